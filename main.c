@@ -1,13 +1,31 @@
+#define _GNU_SOURCE
 #include <gtk/gtk.h>
 #include <glib.h>
 #include <gio/gio.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/xattr.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sys/file.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#include <fcntl.h>
+#include <dirent.h>
 #include <unistd.h>
 #include <errno.h>
+#include <string.h>
+#include <math.h>
+#include <zlib.h>
 
 // --- Data Structures ---
+typedef struct Archive Archive;
+
 typedef struct {
     GtkWidget *window;
     GtkWidget *listbox;
@@ -16,20 +34,57 @@ typedef struct {
     GtkWidget *entryName;
     GtkWidget *statusLabel; // For metadata/status feedback
     gchar *current_dir;
+    int dir_fd; // O_PATH descriptor for current_dir; operations are relative to it
     gchar *selected_file_path; // Full path of the currently selected file/dir
+    GPtrArray *clipboard; // Names put on the clipboard by Copy/Cut
+    int clipboard_dir_fd; // O_PATH descriptor of the directory they are in, or -1
+    GtkWidget *directIoCheck; // Paste bypasses the page cache for large files
+    GtkWidget *verifyCheck; // Paste re-reads and compares what it wrote
+    GtkWidget *stagedDeleteCheck; // Delete stages items for undo and reclaims them later
+    gboolean clipboard_cut; // Paste moves instead of copying
+    Archive *archive; // Being browsed in place of current_dir, or NULL
+    gchar *archive_name; // Its name in current_dir
+    gchar *archive_dir; // Member directory shown; "" for the archive's top
+    GPtrArray *dir_actions; // Buttons that need a real directory, disabled inside an archive
 } AppWidgets;
 
 // --- Function Prototypes ---
 static void refresh_file_list(AppWidgets *w);
 static void on_row_activated(GtkListBox *box, GtkListBoxRow *row, gpointer user_data);
 static void on_new_clicked(GtkButton *btn, gpointer user_data);
+static void on_batch_new_clicked(GtkButton *btn, gpointer user_data);
 static void on_save_clicked(GtkButton *btn, gpointer user_data);
 static void on_delete_clicked(GtkButton *btn, gpointer user_data);
+static void on_undo_delete_clicked(GtkButton *btn, gpointer user_data);
+static void on_trash_clicked(GtkButton *btn, gpointer user_data);
+static void on_view_trash_clicked(GtkButton *btn, gpointer user_data);
+static void on_select_pattern_clicked(GtkButton *btn, gpointer user_data);
+static void on_chmod_clicked(GtkButton *btn, gpointer user_data);
+static void on_bulk_rename_clicked(GtkButton *btn, gpointer user_data);
+static void on_checksums_clicked(GtkButton *btn, gpointer user_data);
+static void on_find_duplicates_clicked(GtkButton *btn, gpointer user_data);
+static void on_compare_clicked(GtkButton *btn, gpointer user_data);
+static void on_snapshots_clicked(GtkButton *btn, gpointer user_data);
+static void on_scrub_clicked(GtkButton *btn, gpointer user_data);
+static void on_extract_clicked(GtkButton *btn, gpointer user_data);
+static void on_compress_clicked(GtkButton *btn, gpointer user_data);
 static void on_rename_clicked(GtkButton *btn, gpointer user_data);
 static void on_up_clicked(GtkButton *btn, gpointer user_data);
+static void on_history_clicked(GtkButton *btn, gpointer user_data);
+static void on_copy_clicked(GtkButton *btn, gpointer user_data);
+static void on_cut_clicked(GtkButton *btn, gpointer user_data);
+static void on_paste_clicked(GtkButton *btn, gpointer user_data);
 static void show_error_dialog(GtkWindow *parent, const gchar *title, const gchar *message);
 static void show_info_dialog(GtkWindow *parent, const gchar *title, const gchar *message);
 static const gchar* get_row_name(GtkListBoxRow *row);
+static GPtrArray* get_selected_names(AppWidgets *w);
+static GtkListBoxRow* get_single_selected_row(AppWidgets *w);
+static GtkListBoxRow* find_row_by_name(AppWidgets *w, const gchar *name);
+static int dir_handle_openat(int parent_fd, const gchar *name);
+static gchar* dir_handle_path(int fd);
+static gboolean read_file_at(int dirfd, const gchar *name, gchar **contents, gsize *length,
+                             struct stat *st, GError **error);
+static gboolean write_file_at(int dirfd, const gchar *name, const gchar *data, gsize len, GError **error);
 
 // --- Helper Functions ---
 
@@ -44,351 +99,13947 @@ static const gchar* get_row_name(GtkListBoxRow *row)
     return text;
 }
 
+// Gives a row a new entry name, as after a rename.
+static void set_row_name(GtkListBoxRow *row, const gchar *name)
+{
+    GtkWidget *hbox = gtk_bin_get_child(GTK_BIN(row));
+    GList *hchildren = gtk_container_get_children(GTK_CONTAINER(hbox));
+    if (hchildren && hchildren->next) gtk_label_set_text(GTK_LABEL(hchildren->next->data), name);
+    g_list_free(hchildren);
+    g_object_set_data_full(G_OBJECT(row), "entry-name", g_strdup(name), g_free);
+}
+
+// Keeps the listing sorted by name, so renamed rows can be moved into
+// place without rebuilding it.
+static gint compare_rows(GtkListBoxRow *a, GtkListBoxRow *b, gpointer user_data)
+{
+    return g_ascii_strcasecmp(g_object_get_data(G_OBJECT(a), "entry-name"),
+                              g_object_get_data(G_OBJECT(b), "entry-name"));
+}
+
+// The same order for g_ptr_array_sort() over an array of names, whose
+// comparator is handed pointers to the elements.
+static gint compare_entry_names(gconstpointer a, gconstpointer b)
+{
+    return g_ascii_strcasecmp(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+// Names of the selected entries in listing order; the strings belong to
+// the rows.
+static GPtrArray* get_selected_names(AppWidgets *w)
+{
+    GPtrArray *names = g_ptr_array_new();
+    GList *rows = gtk_list_box_get_selected_rows(GTK_LIST_BOX(w->listbox));
+    for (GList *r = rows; r; r = r->next)
+        g_ptr_array_add(names, g_object_get_data(G_OBJECT(r->data), "entry-name"));
+    g_list_free(rows);
+    return names;
+}
+
+// Copies of the selected names, for callers that keep them across a dialog,
+// during which the list may be refreshed and its rows destroyed.
+static GPtrArray* get_selected_names_copy(AppWidgets *w)
+{
+    GPtrArray *names = get_selected_names(w);
+    GPtrArray *copy = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < names->len; ++i)
+        g_ptr_array_add(copy, g_strdup(g_ptr_array_index(names, i)));
+    g_ptr_array_free(names, TRUE);
+    return copy;
+}
+
+// The selected row for operations on a single item, or NULL unless exactly
+// one row is selected.
+static GtkListBoxRow* get_single_selected_row(AppWidgets *w)
+{
+    GList *rows = gtk_list_box_get_selected_rows(GTK_LIST_BOX(w->listbox));
+    GtkListBoxRow *row = rows && !rows->next ? rows->data : NULL;
+    g_list_free(rows);
+    return row;
+}
+
+// The row currently listing name, e.g. to find an entry again after a
+// dialog during which the list may have been rebuilt.
+static GtkListBoxRow* find_row_by_name(AppWidgets *w, const gchar *name)
+{
+    GList *rows = gtk_container_get_children(GTK_CONTAINER(w->listbox));
+    GtkListBoxRow *found = NULL;
+    for (GList *r = rows; r && !found; r = r->next)
+        if (g_strcmp0(g_object_get_data(G_OBJECT(r->data), "entry-name"), name) == 0) found = r->data;
+    g_list_free(rows);
+    return found;
+}
+
+// Message dialogs never block: jobs finishing in the background report
+// through them, and a nested main loop would stall the others.
 static void show_error_dialog(GtkWindow *parent, const gchar *title, const gchar *message)
 {
     GtkWidget *d = gtk_message_dialog_new(parent,
-        GTK_DIALOG_MODAL,
+        GTK_DIALOG_DESTROY_WITH_PARENT,
         GTK_MESSAGE_ERROR,
         GTK_BUTTONS_OK,
         "%s", message);
     gtk_window_set_title(GTK_WINDOW(d), title);
-    gtk_dialog_run(GTK_DIALOG(d));
-    gtk_widget_destroy(d);
+    g_signal_connect(d, "response", G_CALLBACK(gtk_widget_destroy), NULL);
+    gtk_widget_show(d);
+}
+
+static void show_info_dialog(GtkWindow *parent, const gchar *title, const gchar *message)
+{
+    GtkWidget *d = gtk_message_dialog_new(parent,
+        GTK_DIALOG_DESTROY_WITH_PARENT,
+        GTK_MESSAGE_INFO,
+        GTK_BUTTONS_OK,
+        "%s", message);
+    gtk_window_set_title(GTK_WINDOW(d), title);
+    g_signal_connect(d, "response", G_CALLBACK(gtk_widget_destroy), NULL);
+    gtk_widget_show(d);
+}
+
+// --- Version History ---
+// Every save keeps the previous contents under <dir>/.fm-versions/files/<name>/.
+// Versions are named by their capture time in microseconds so that a plain
+// string sort orders them. A version is either a reflinked copy of the file
+// or, where reflinks are unavailable, a ".cdc" recipe listing chunks held in
+// the content-addressed store at <dir>/.fm-versions/chunks/. Histories are
+// reached from the descriptor of the directory holding the file and worked
+// on with the *at() calls, like the browser's other operations.
+
+#define VERSIONS_DIR_NAME ".fm-versions"
+#define VERSIONS_FILES_DIR "files"
+#define VERSIONS_CHUNKS_DIR "chunks"
+#define VERSION_RECIPE_SUFFIX ".cdc"
+#define VERSIONS_MAX_COUNT 50
+#define VERSIONS_MAX_AGE_DAYS 30
+
+// Opens the subdirectory name of dirfd as an O_PATH descriptor, creating
+// it first when create is set. -1 with errno set on failure.
+static int versions_subdir_at(int dirfd, const gchar *name, gboolean create)
+{
+    if (create && mkdirat(dirfd, name, 0700) != 0 && errno != EEXIST) return -1;
+    return openat(dirfd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+// The entries of directory name beneath dirfd, "." being dirfd itself.
+// Empty if it cannot be read.
+static GPtrArray* versions_read_dir(int dirfd, const gchar *name)
+{
+    GPtrArray *entries = g_ptr_array_new_with_free_func(g_free);
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return entries;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (g_strcmp0(de->d_name, ".") != 0 && g_strcmp0(de->d_name, "..") != 0)
+            g_ptr_array_add(entries, g_strdup(de->d_name));
+    }
+    closedir(dir);
+    return entries;
+}
+
+// Whether directory name in root_fd holds version files itself, as a
+// history directory of the first layout did, rather than only
+// subdirectories.
+static gboolean versions_is_legacy_history(int root_fd, const gchar *name)
+{
+    GPtrArray *entries = versions_read_dir(root_fd, name);
+    gboolean legacy = FALSE;
+    for (guint i = 0; !legacy && i < entries->len; ++i) {
+        const gchar *entry = g_ptr_array_index(entries, i);
+        gchar *rel = g_build_filename(name, entry, NULL);
+        struct stat st;
+        legacy = g_ascii_isdigit(entry[0]) && fstatat(root_fd, rel, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                 S_ISREG(st.st_mode);
+        g_free(rel);
+    }
+    g_ptr_array_free(entries, TRUE);
+    return legacy;
+}
+
+// Moves history kept in the first layout, <root>/<name>/<version>, to
+// <root>/files/<name>/<version>. Histories of files that were themselves
+// named "files" or "chunks" are recognised by holding version files
+// directly. Versions from both layouts are plain or reflinked copies, so
+// moving them is all it takes.
+static void versions_migrate(int root_fd)
+{
+    GPtrArray *entries = versions_read_dir(root_fd, ".");
+    GPtrArray *legacy = g_ptr_array_new();
+    for (guint i = 0; i < entries->len; ++i) {
+        const gchar *name = g_ptr_array_index(entries, i);
+        gboolean reserved = g_strcmp0(name, VERSIONS_FILES_DIR) == 0 || g_strcmp0(name, VERSIONS_CHUNKS_DIR) == 0;
+        struct stat st;
+        // A legacy "files" history moves first, before others are moved into it
+        if (reserved && versions_is_legacy_history(root_fd, name))
+            g_ptr_array_insert(legacy, 0, (gpointer)name);
+        else if (!reserved && fstatat(root_fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode))
+            g_ptr_array_add(legacy, (gpointer)name);
+    }
+
+    for (guint i = 0; i < legacy->len; ++i) {
+        const gchar *name = g_ptr_array_index(legacy, i);
+        // Step aside first so a history named "files" frees up that name
+        gchar *moving = g_strdup_printf(".migrate-%d-%u", (int)getpid(), i);
+        int files = -1;
+        if (renameat(root_fd, name, root_fd, moving) == 0 &&
+            (files = versions_subdir_at(root_fd, VERSIONS_FILES_DIR, TRUE)) >= 0 &&
+            renameat(root_fd, moving, files, name) != 0) {
+            // Versions exist under both layouts: merge them
+            int from = openat(root_fd, moving, O_PATH | O_DIRECTORY | O_CLOEXEC);
+            int target = versions_subdir_at(files, name, TRUE);
+            GPtrArray *versions = versions_read_dir(root_fd, moving);
+            for (guint v = 0; from >= 0 && target >= 0 && v < versions->len; ++v) {
+                const gchar *version = g_ptr_array_index(versions, v);
+                if (faccessat(target, version, F_OK, AT_SYMLINK_NOFOLLOW) != 0)
+                    renameat(from, version, target, version);
+            }
+            g_ptr_array_free(versions, TRUE);
+            if (target >= 0) close(target);
+            if (from >= 0) close(from);
+            unlinkat(root_fd, moving, AT_REMOVEDIR);
+        }
+        if (files >= 0) close(files);
+        g_free(moving);
+    }
+    g_ptr_array_free(legacy, TRUE);
+    g_ptr_array_free(entries, TRUE);
+}
+
+// Opens the history of the entry name in dirfd, creating it when create
+// is set. Returns the descriptor of its version directory and stores the
+// one of the versions root in *root_fd; both are the caller's to close.
+// A missing history is reported as G_IO_ERROR_NOT_FOUND.
+static int versions_open(int dirfd, const gchar *name, gboolean create, int *root_fd, GError **error)
+{
+    int root = -1, vdir = -1;
+    if (!create || mkdirat(dirfd, VERSIONS_DIR_NAME, 0700) == 0 || errno == EEXIST)
+        root = dir_handle_openat(dirfd, VERSIONS_DIR_NAME);
+    if (root >= 0) {
+        versions_migrate(root);
+        int files = versions_subdir_at(root, VERSIONS_FILES_DIR, create);
+        if (files >= 0) {
+            vdir = versions_subdir_at(files, name, create);
+            int saved = errno;
+            close(files);
+            errno = saved;
+        }
+    }
+    if (vdir < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Cannot open version directory: %s", g_strerror(errno));
+        if (root >= 0) close(root);
+        return -1;
+    }
+    *root_fd = root;
+    return vdir;
+}
+
+static gboolean copy_fd_contents(int in_fd, int out_fd, GError **error)
+{
+    gsize bufsize = 1 << 20;
+    gchar *buf = g_malloc(bufsize);
+    gboolean ok = TRUE;
+
+    for (;;) {
+        ssize_t n = read(in_fd, buf, bufsize);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Read failed: %s", g_strerror(errno));
+            ok = FALSE;
+            break;
+        }
+        if (n == 0) break;
+        for (ssize_t off = 0; off < n; ) {
+            ssize_t m = write(out_fd, buf + off, n - off);
+            if (m < 0 && errno == EINTR) continue;
+            if (m < 0) {
+                g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Write failed: %s", g_strerror(errno));
+                ok = FALSE;
+                goto out;
+            }
+            off += m;
+        }
+    }
+out:
+    g_free(buf);
+    return ok;
+}
+
+static gboolean write_all(int fd, const void *data, gsize len, GError **error)
+{
+    const gchar *p = data;
+    while (len > 0) {
+        ssize_t m = write(fd, p, len);
+        if (m < 0 && errno == EINTR) continue;
+        if (m < 0) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Write failed: %s", g_strerror(errno));
+            return FALSE;
+        }
+        p += m;
+        len -= m;
+    }
+    return TRUE;
+}
+
+// Flushes directory name beneath dirfd, making the entries created or
+// renamed in it durable.
+static gboolean fsync_dir_at(int dirfd, const gchar *name, GError **error)
+{
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    gboolean ok = fd >= 0 && fsync(fd) == 0;
+    if (!ok)
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot flush directory: %s", g_strerror(errno));
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+// --- Content-Defined Chunk Store ---
+// FastCDC-style chunking: a gear rolling hash picks boundaries from the
+// content itself, so an edit only changes the chunks around it. Normalized
+// chunking uses a stricter mask before the average size and a looser one
+// after it, which keeps chunk sizes close to CDC_AVG_SIZE.
+
+#define CDC_MIN_SIZE (16 * 1024)
+#define CDC_AVG_SIZE (64 * 1024)
+#define CDC_MAX_SIZE (256 * 1024)
+#define CDC_MASK_S (((1ULL << 18) - 1) << 46)
+#define CDC_MASK_L (((1ULL << 14) - 1) << 50)
+#define CHUNK_ID_LEN 64 // hex SHA-256
+
+
+static guint64 cdc_gear[256];
+
+static void cdc_init_gear(void)
+{
+    static gsize initialized = 0;
+    if (g_once_init_enter(&initialized)) {
+        // splitmix64 with a fixed seed: the table must be identical on every
+        // run or previously stored chunks would never be matched again
+        guint64 x = 0x3502f5c0ffee1234ULL;
+        for (int i = 0; i < 256; ++i) {
+            guint64 z = (x += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            cdc_gear[i] = z ^ (z >> 31);
+        }
+        g_once_init_leave(&initialized, 1);
+    }
+}
+
+static gsize cdc_next_boundary(const guint8 *p, gsize n)
+{
+    if (n <= CDC_MIN_SIZE) return n;
+
+    gsize normal = MIN(n, (gsize)CDC_AVG_SIZE);
+    gsize limit = MIN(n, (gsize)CDC_MAX_SIZE);
+    guint64 fp = 0;
+    gsize i = CDC_MIN_SIZE;
+
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + cdc_gear[p[i]];
+        if (!(fp & CDC_MASK_S)) return i + 1;
+    }
+    for (; i < limit; ++i) {
+        fp = (fp << 1) + cdc_gear[p[i]];
+        if (!(fp & CDC_MASK_L)) return i + 1;
+    }
+    return limit;
+}
+
+// A chunk lives at <prefix>/<id> in the store, the prefix being the first
+// two hex digits of its ID.
+static gchar* chunk_name(const gchar *id)
+{
+    return g_strdup_printf("%.2s/%s", id, id);
+}
+
+// Stores one chunk unless it is already present. Only new chunks are
+// compressed; a chunk that does not shrink is kept raw. On-disk format is a
+// one byte tag ('Z' zlib, 'R' raw), the raw length as 32-bit little endian,
+// then the payload. New chunks are flushed before they get their name; the
+// directories they were named in are added to dirty, relative to store_fd,
+// for the caller to flush once before anything refers to the chunks.
+static gboolean chunk_store_put(int store_fd, const guint8 *data, gsize len,
+                                gchar *id_out, GHashTable *dirty, GError **error)
+{
+    gchar *id = g_compute_checksum_for_data(G_CHECKSUM_SHA256, data, len);
+    memcpy(id_out, id, CHUNK_ID_LEN + 1);
+    gchar *name = chunk_name(id);
+    g_free(id);
+    gboolean present = faccessat(store_fd, name, F_OK, AT_SYMLINK_NOFOLLOW) == 0;
+    g_free(name);
+    if (present) return TRUE;
+
+    gchar prefix[3] = { id_out[0], id_out[1], '\0' };
+    if (mkdirat(store_fd, prefix, 0700) == 0) g_hash_table_add(dirty, g_strdup("."));
+    int dir_fd = openat(store_fd, prefix, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                    "Cannot create chunk directory: %s", g_strerror(errno));
+        return FALSE;
+    }
+
+    uLongf clen = compressBound(len);
+    guint8 *out = g_malloc(5 + clen);
+    guint32 raw_len = GUINT32_TO_LE((guint32)len);
+    memcpy(out + 1, &raw_len, 4);
+    if (compress2(out + 5, &clen, data, len, Z_BEST_SPEED) == Z_OK && clen < len) {
+        out[0] = 'Z';
+    } else {
+        out[0] = 'R';
+        memcpy(out + 5, data, len);
+        clen = len;
+    }
+
+    // Write to a temporary name and rename, so a crash never leaves a
+    // truncated chunk under its final ID
+    gchar *tmp = g_strdup_printf(".tmp-%d-%08x", (int)getpid(), g_random_int());
+    int fd = openat(dir_fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    gboolean ok = FALSE;
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot write chunk: %s", g_strerror(errno));
+    } else {
+        ok = write_all(fd, out, 5 + clen, error);
+        if (ok && fsync(fd) != 0) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot flush chunk: %s", g_strerror(errno));
+            ok = FALSE;
+        }
+        close(fd);
+        if (ok && renameat(dir_fd, tmp, dir_fd, id_out) != 0) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot store chunk: %s", g_strerror(errno));
+            ok = FALSE;
+        }
+        if (ok) g_hash_table_add(dirty, g_strdup(prefix));
+        else unlinkat(dir_fd, tmp, 0);
+    }
+
+    g_free(tmp);
+    g_free(out);
+    close(dir_fd);
+    return ok;
+}
+
+// Reads chunk id of raw length len into out, verifying its content hash.
+static gboolean chunk_store_get(int store_fd, const gchar *id, gsize len,
+                                guint8 *out, GError **error)
+{
+    gchar *name = chunk_name(id);
+    gchar *contents = NULL;
+    gsize clen = 0;
+    struct stat st;
+    gboolean ok = read_file_at(store_fd, name, &contents, &clen, &st, error);
+    g_free(name);
+    if (!ok) return FALSE;
+
+    guint32 raw_len = 0;
+    if (clen >= 5) memcpy(&raw_len, contents + 1, 4);
+    raw_len = GUINT32_FROM_LE(raw_len);
+
+    ok = FALSE;
+    if (clen < 5 || raw_len != len) {
+        // fall through to the corruption error
+    } else if (contents[0] == 'R' && clen - 5 == len) {
+        memcpy(out, contents + 5, len);
+        ok = TRUE;
+    } else if (contents[0] == 'Z') {
+        uLongf dlen = len;
+        ok = uncompress(out, &dlen, (const Bytef *)contents + 5, clen - 5) == Z_OK && dlen == len;
+    }
+    g_free(contents);
+
+    if (ok) {
+        gchar *actual = g_compute_checksum_for_data(G_CHECKSUM_SHA256, out, len);
+        ok = g_strcmp0(actual, id) == 0;
+        g_free(actual);
+    }
+    if (!ok)
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Chunk %s is corrupt", id);
+    return ok;
+}
+
+// Splits the file behind src_fd into chunks, stores the new ones and writes
+// a recipe named recipe in vdir_fd: a header line "FMCDC1 <size>" followed
+// by "<id> <length>" per chunk. Repeated saves of a mostly unchanged file
+// only add the chunks that actually differ. The recipe is only written once
+// every chunk it names is on disk, so a crash cannot leave it pointing at
+// missing chunks.
+static gboolean cdc_store_file(int src_fd, int store_fd, int vdir_fd, const gchar *recipe_name, GError **error)
+{
+    cdc_init_gear();
+
+    // Size the mapping from the open file itself; a size looked up before
+    // the open may already be stale, and mapping past the end faults
+    struct stat st;
+    if (fstat(src_fd, &st) != 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot stat file: %s", g_strerror(errno));
+        return FALSE;
+    }
+    gsize size = st.st_size;
+    const guint8 *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, src_fd, 0);
+        if (data == MAP_FAILED) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot map file: %s", g_strerror(errno));
+            return FALSE;
+        }
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+
+    GString *recipe = g_string_new(NULL);
+    g_string_append_printf(recipe, "FMCDC1 %" G_GSIZE_FORMAT "\n", size);
+
+    gboolean ok = TRUE;
+    gchar id[CHUNK_ID_LEN + 1];
+    GHashTable *dirty = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    for (gsize off = 0; off < size && ok; ) {
+        gsize len = cdc_next_boundary(data + off, size - off);
+        ok = chunk_store_put(store_fd, data + off, len, id, dirty, error);
+        g_string_append_printf(recipe, "%s %" G_GSIZE_FORMAT "\n", id, len);
+        off += len;
+    }
+
+    if (data) munmap((void *)data, size);
+    GHashTableIter iter;
+    gpointer dir;
+    g_hash_table_iter_init(&iter, dirty);
+    while (ok && g_hash_table_iter_next(&iter, &dir, NULL))
+        ok = fsync_dir_at(store_fd, dir, error);
+    g_hash_table_destroy(dirty);
+    // write_file_at flushes the recipe before renaming it into place
+    if (ok) ok = write_file_at(vdir_fd, recipe_name, recipe->str, recipe->len, error) &&
+                 fsync_dir_at(vdir_fd, ".", error);
+    g_string_free(recipe, TRUE);
+    return ok;
+}
+
+// Streams a recipe back out one chunk at a time, so restoring never needs
+// more than a single chunk in memory.
+static gboolean cdc_restore_to_fd(int store_fd, int vdir_fd, const gchar *recipe_name, int out_fd, GError **error)
+{
+    gchar *contents = NULL;
+    gsize length = 0;
+    struct stat st;
+    if (!read_file_at(vdir_fd, recipe_name, &contents, &length, &st, error)) return FALSE;
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+
+    gboolean ok = g_str_has_prefix(lines[0], "FMCDC1 ");
+    if (!ok)
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Unrecognised version recipe");
+
+    guint8 *buf = g_malloc(CDC_MAX_SIZE);
+    for (guint i = 1; ok && lines[i] && *lines[i]; ++i) {
+        gchar **parts = g_strsplit(lines[i], " ", 2);
+        gsize len = parts[1] ? g_ascii_strtoull(parts[1], NULL, 10) : 0;
+        if (strlen(parts[0]) != CHUNK_ID_LEN || len == 0 || len > CDC_MAX_SIZE) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Malformed version recipe");
+            ok = FALSE;
+        } else {
+            ok = chunk_store_get(store_fd, parts[0], len, buf, error) && write_all(out_fd, buf, len, error);
+        }
+        g_strfreev(parts);
+    }
+
+    g_free(buf);
+    g_strfreev(lines);
+    return ok;
+}
+
+// Mark and sweep: drops every chunk no remaining recipe under the versions
+// root refers to. Temporary files of chunks still being written are left
+// alone.
+static void cdc_collect_garbage(int root_fd)
+{
+    GHashTable *live = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    int files_fd = openat(root_fd, VERSIONS_FILES_DIR, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    GPtrArray *histories = versions_read_dir(root_fd, VERSIONS_FILES_DIR);
+
+    for (guint h = 0; files_fd >= 0 && h < histories->len; ++h) {
+        int vd = openat(files_fd, g_ptr_array_index(histories, h), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        GPtrArray *versions = versions_read_dir(vd, ".");
+        for (guint v = 0; vd >= 0 && v < versions->len; ++v) {
+            const gchar *vname = g_ptr_array_index(versions, v);
+            if (!g_str_has_suffix(vname, VERSION_RECIPE_SUFFIX)) continue;
+            gchar *contents = NULL;
+            gsize length = 0;
+            struct stat st;
+            if (read_file_at(vd, vname, &contents, &length, &st, NULL)) {
+                gchar **lines = g_strsplit(contents, "\n", -1);
+                for (guint i = 1; lines[i]; ++i) {
+                    if (strlen(lines[i]) > CHUNK_ID_LEN)
+                        g_hash_table_add(live, g_strndup(lines[i], CHUNK_ID_LEN));
+                }
+                g_strfreev(lines);
+                g_free(contents);
+            }
+        }
+        g_ptr_array_free(versions, TRUE);
+        if (vd >= 0) close(vd);
+    }
+    g_ptr_array_free(histories, TRUE);
+    if (files_fd >= 0) close(files_fd);
+
+    int store_fd = openat(root_fd, VERSIONS_CHUNKS_DIR, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    GPtrArray *prefixes = versions_read_dir(root_fd, VERSIONS_CHUNKS_DIR);
+    for (guint p = 0; store_fd >= 0 && p < prefixes->len; ++p) {
+        int pd = openat(store_fd, g_ptr_array_index(prefixes, p), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        GPtrArray *ids = versions_read_dir(pd, ".");
+        for (guint i = 0; pd >= 0 && i < ids->len; ++i) {
+            const gchar *id = g_ptr_array_index(ids, i);
+            if (id[0] != '.' && !g_hash_table_contains(live, id)) unlinkat(pd, id, 0);
+        }
+        g_ptr_array_free(ids, TRUE);
+        if (pd >= 0) close(pd);
+    }
+    g_ptr_array_free(prefixes, TRUE);
+    if (store_fd >= 0) close(store_fd);
+    g_hash_table_destroy(live);
+}
+
+// Preserves the current contents of the entry name in dirfd as a new
+// version. On btrfs and XFS a FICLONE reflink shares extents with the file,
+// and the save that follows clones it again and rewrites only the changed
+// blocks (see write_file_at), so only those blocks cost space. Elsewhere
+// the contents go into the chunk store, which likewise only grows by the
+// chunks a save actually changed.
+static gboolean versions_snapshot(int dirfd, const gchar *name, GError **error)
+{
+    struct stat st;
+    if (fstatat(dirfd, name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+        return TRUE; // Nothing to preserve yet
+
+    int root_fd;
+    int vdir_fd = versions_open(dirfd, name, TRUE, &root_fd, error);
+    if (vdir_fd < 0) return FALSE;
+
+    gchar *stamp = g_strdup_printf("%016" G_GINT64_FORMAT, g_get_real_time());
+    gboolean ok = FALSE;
+    int src = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (src < 0 || fstat(src, &st) != 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot open file: %s", g_strerror(errno));
+        if (src >= 0) close(src);
+        goto out;
+    }
+
+    int dst = openat(vdir_fd, stamp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (dst >= 0 && ioctl(dst, FICLONE, src) == 0) {
+        // Keep the original modification time so the history shows when the
+        // content was written, not when it was preserved
+        struct timespec times[2] = { st.st_atim, st.st_mtim };
+        futimens(dst, times);
+        ok = TRUE;
+    } else {
+        if (dst >= 0) unlinkat(vdir_fd, stamp, 0);
+        int store_fd = versions_subdir_at(root_fd, VERSIONS_CHUNKS_DIR, TRUE);
+        gchar *recipe = g_strconcat(stamp, VERSION_RECIPE_SUFFIX, NULL);
+        if (store_fd < 0)
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno),
+                        "Cannot create chunk store: %s", g_strerror(errno));
+        else
+            ok = cdc_store_file(src, store_fd, vdir_fd, recipe, error);
+        g_free(recipe);
+        if (store_fd >= 0) close(store_fd);
+    }
+
+    if (dst >= 0) close(dst);
+    close(src);
+out:
+    g_free(stamp);
+    close(vdir_fd);
+    close(root_fd);
+    return ok;
+}
+
+// Writes the contents of version in vdir_fd to out_fd.
+static gboolean versions_restore_to_fd(int root_fd, int vdir_fd, const gchar *version, int out_fd, GError **error)
+{
+    if (g_str_has_suffix(version, VERSION_RECIPE_SUFFIX)) {
+        int store_fd = openat(root_fd, VERSIONS_CHUNKS_DIR, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (store_fd < 0) {
+            g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot open chunk store: %s", g_strerror(errno));
+            return FALSE;
+        }
+        gboolean ok = cdc_restore_to_fd(store_fd, vdir_fd, version, out_fd, error);
+        close(store_fd);
+        return ok;
+    }
+
+    int fd = openat(vdir_fd, version, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot open version: %s", g_strerror(errno));
+        return FALSE;
+    }
+    gboolean ok = copy_fd_contents(fd, out_fd, error);
+    close(fd);
+    return ok;
+}
+
+// Returns a plain file holding the version's contents, for tools that
+// want a path. Reflinked versions already are one; chunked versions are
+// streamed into a temporary file that the caller must unlink when *is_temp
+// is set.
+static gchar* versions_materialize(int root_fd, int vdir_fd, const gchar *version, gboolean *is_temp, GError **error)
+{
+    *is_temp = FALSE;
+    gchar *vdir = g_str_has_suffix(version, VERSION_RECIPE_SUFFIX) ? NULL : dir_handle_path(vdir_fd);
+    if (vdir) {
+        gchar *vpath = g_build_filename(vdir, version, NULL);
+        g_free(vdir);
+        return vpath;
+    }
+
+    gchar *tmp = NULL;
+    int fd = g_file_open_tmp("fm-version-XXXXXX", &tmp, error);
+    if (fd < 0) return NULL;
+
+    gboolean ok = versions_restore_to_fd(root_fd, vdir_fd, version, fd, error);
+    close(fd);
+    if (!ok) {
+        unlink(tmp);
+        g_free(tmp);
+        return NULL;
+    }
+    *is_temp = TRUE;
+    return tmp;
+}
+
+// Replaces the entry name in dirfd with the version's contents. The current
+// contents are preserved first, so a restore can itself be undone from the
+// history.
+static gboolean versions_restore_file(int root_fd, int vdir_fd, const gchar *version,
+                                      int dirfd, const gchar *name, GError **error)
+{
+    if (!versions_snapshot(dirfd, name, error)) return FALSE;
+
+    gchar *tmp = g_strdup_printf(".%s.fm-restore-%d", name, (int)getpid());
+    int fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot create file: %s", g_strerror(errno));
+        g_free(tmp);
+        return FALSE;
+    }
+
+    struct stat st;
+    if (fstatat(dirfd, name, &st, 0) == 0) fchmod(fd, st.st_mode & 07777);
+
+    gboolean ok = versions_restore_to_fd(root_fd, vdir_fd, version, fd, error);
+    if (ok && fsync(fd) != 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot flush file: %s", g_strerror(errno));
+        ok = FALSE;
+    }
+    close(fd);
+    if (ok && renameat(dirfd, tmp, dirfd, name) != 0) {
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(errno), "Cannot replace file: %s", g_strerror(errno));
+        ok = FALSE;
+    }
+    if (!ok) unlinkat(dirfd, tmp, 0);
+    g_free(tmp);
+    return ok;
+}
+
+static gint versions_compare_newest_first(gconstpointer a, gconstpointer b)
+{
+    return g_strcmp0(*(const gchar **)b, *(const gchar **)a);
+}
+
+// Returns the version names in vdir_fd, newest first.
+static GPtrArray* versions_list(int vdir_fd)
+{
+    GPtrArray *entries = versions_read_dir(vdir_fd, ".");
+    GPtrArray *versions = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < entries->len; ++i) {
+        const gchar *name = g_ptr_array_index(entries, i);
+        if (name[0] != '.') // Skips recipes still being written
+            g_ptr_array_add(versions, g_strdup(name));
+    }
+    g_ptr_array_free(entries, TRUE);
+
+    g_ptr_array_sort(versions, versions_compare_newest_first);
+    return versions;
+}
+
+// Applies the retention policy: at most VERSIONS_MAX_COUNT versions, none
+// older than VERSIONS_MAX_AGE_DAYS. Chunks only referenced by dropped
+// recipes are reclaimed afterwards.
+static void versions_prune(int root_fd, int vdir_fd)
+{
+    GPtrArray *versions = versions_list(vdir_fd);
+    gint64 cutoff = g_get_real_time() - VERSIONS_MAX_AGE_DAYS * G_TIME_SPAN_DAY;
+    gboolean dropped_recipe = FALSE;
+
+    for (guint i = 0; i < versions->len; ++i) {
+        const gchar *name = g_ptr_array_index(versions, i);
+        gint64 stamp = g_ascii_strtoll(name, NULL, 10);
+        if (i < VERSIONS_MAX_COUNT && stamp >= cutoff) continue;
+
+        if (unlinkat(vdir_fd, name, 0) == 0 && g_str_has_suffix(name, VERSION_RECIPE_SUFFIX))
+            dropped_recipe = TRUE;
+    }
+    g_ptr_array_free(versions, TRUE);
+
+    if (dropped_recipe) cdc_collect_garbage(root_fd);
+}
+
+static gchar* versions_describe(int vdir_fd, const gchar *version)
+{
+    gint64 stamp = g_ascii_strtoll(version, NULL, 10);
+    GDateTime *dt = g_date_time_new_from_unix_local(stamp / G_USEC_PER_SEC);
+    gchar *when = dt ? g_date_time_format(dt, "%Y-%m-%d %H:%M:%S") : g_strdup(version);
+    if (dt) g_date_time_unref(dt);
+
+    gint64 size = -1;
+    if (g_str_has_suffix(version, VERSION_RECIPE_SUFFIX)) {
+        // The recipe header records the original size
+        int fd = openat(vdir_fd, version, O_RDONLY | O_CLOEXEC);
+        gchar header[64] = "";
+        ssize_t n = fd >= 0 ? read(fd, header, sizeof header - 1) : -1;
+        if (n > 0 && g_str_has_prefix(header, "FMCDC1 "))
+            size = g_ascii_strtoll(header + 7, NULL, 10);
+        if (fd >= 0) close(fd);
+    } else {
+        struct stat st;
+        if (fstatat(vdir_fd, version, &st, 0) == 0) size = st.st_size;
+    }
+
+    gchar *label;
+    if (size >= 0) {
+        gchar *size_str = g_format_size(size);
+        label = g_strdup_printf("%s  (%s)", when, size_str);
+        g_free(size_str);
+    } else {
+        label = g_strdup(when);
+    }
+    g_free(when);
+    return label;
+}
+
+typedef struct {
+    gchar *current_path; // For diff(1), derived from the held directory
+    GtkWidget *diffview;
+    int root_fd;
+    int vdir_fd;
+} HistoryView;
+
+static void on_version_selected(GtkListBox *box, GtkListBoxRow *row, gpointer user_data)
+{
+    HistoryView *hv = (HistoryView *)user_data;
+    GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(hv->diffview));
+    if (!row) {
+        gtk_text_buffer_set_text(buf, "", -1);
+        return;
+    }
+
+    const gchar *label = g_object_get_data(G_OBJECT(row), "version-label");
+    gboolean is_temp = FALSE;
+    GError *err = NULL;
+    gchar *vfile = versions_materialize(hv->root_fd, hv->vdir_fd, g_object_get_data(G_OBJECT(row), "version-name"),
+                                        &is_temp, &err);
+    if (!vfile) {
+        gtk_text_buffer_set_text(buf, err->message, -1);
+        g_error_free(err);
+        return;
+    }
+
+    gchar *argv[] = { "diff", "-u", "--label", (gchar *)label, "--label", "current",
+                      vfile, hv->current_path, NULL };
+    gchar *out = NULL;
+    gint status = 0;
+
+    if (!g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_STDERR_TO_DEV_NULL,
+                      NULL, NULL, &out, NULL, &status, &err)) {
+        gchar *msg = g_strdup_printf("Cannot run diff: %s", err->message);
+        gtk_text_buffer_set_text(buf, msg, -1);
+        g_free(msg);
+        g_error_free(err);
+    } else if (out && *out) {
+        gtk_text_buffer_set_text(buf, out, -1);
+    } else {
+        gtk_text_buffer_set_text(buf, "No differences from the current file.", -1);
+    }
+
+    g_free(out);
+    if (is_temp) unlink(vfile);
+    g_free(vfile);
+}
+
+// --- Storage Devices ---
+// Maps a st_dev to the block device behind it through sysfs, so I/O can be
+// shaped to the hardware: spinning disks want one sequential stream, flash
+// wants many requests in flight. Results are cached per device.
+
+typedef struct {
+    gboolean known;      // Backed by a block device we could inspect
+    gboolean rotational;
+    guint queue_depth;   // queue/nr_requests
+    guint64 optimal_io;  // queue/optimal_io_size in bytes, 0 if unreported
+    gchar *name;         // e.g. "sda" or "nvme0n1"
+} DeviceInfo;
+
+#define DEVICE_MAX_SLOTS 16
+
+G_LOCK_DEFINE_STATIC(device_cache);
+static GHashTable *device_cache = NULL;
+
+static guint64 read_sysfs_u64(const gchar *dir, const gchar *attr, guint64 fallback)
+{
+    gchar *path = g_build_filename(dir, attr, NULL);
+    gchar *contents = NULL;
+    guint64 value = fallback;
+    if (g_file_get_contents(path, &contents, NULL, NULL))
+        value = g_ascii_strtoull(contents, NULL, 10);
+    g_free(contents);
+    g_free(path);
+    return value;
+}
+
+static const DeviceInfo* device_probe(dev_t dev)
+{
+    guint64 key = dev;
+    G_LOCK(device_cache);
+    if (!device_cache)
+        device_cache = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+    DeviceInfo *info = g_hash_table_lookup(device_cache, &key);
+    G_UNLOCK(device_cache);
+    if (info) return info;
+
+    info = g_new0(DeviceInfo, 1);
+    info->queue_depth = 32;
+
+    // Partitions have no queue of their own; it lives on the parent disk
+    gchar *link = g_strdup_printf("/sys/dev/block/%u:%u", major(dev), minor(dev));
+    gchar *real = realpath(link, NULL);
+    if (real) {
+        gchar *queue = g_build_filename(real, "queue", NULL);
+        gchar *disk = g_strdup(real);
+        if (!g_file_test(queue, G_FILE_TEST_IS_DIR)) {
+            g_free(disk);
+            disk = g_path_get_dirname(real);
+            g_free(queue);
+            queue = g_build_filename(disk, "queue", NULL);
+        }
+        if (g_file_test(queue, G_FILE_TEST_IS_DIR)) {
+            info->known = TRUE;
+            info->rotational = read_sysfs_u64(queue, "rotational", 0) != 0;
+            info->queue_depth = MAX(1, read_sysfs_u64(queue, "nr_requests", 32));
+            info->optimal_io = read_sysfs_u64(queue, "optimal_io_size", 0);
+            info->name = g_path_get_basename(disk);
+        }
+        g_free(disk);
+        g_free(queue);
+        free(real);
+    }
+    g_free(link);
+
+    G_LOCK(device_cache);
+    DeviceInfo *existing = g_hash_table_lookup(device_cache, &key);
+    if (existing) {
+        g_free(info->name);
+        g_free(info);
+        info = existing;
+    } else {
+        g_hash_table_insert(device_cache, g_memdup2(&key, sizeof key), info);
+    }
+    G_UNLOCK(device_cache);
+    return info;
+}
+
+// How many requests are worth keeping in flight on a device: one for a
+// spinning disk, whose head would seek between them, and a share of the
+// request queue for flash, bounded by the CPUs that have to issue them.
+static guint device_io_slots(const DeviceInfo *info)
+{
+    if (info->rotational) return 1;
+    guint cap = MAX(4, MIN(g_get_num_processors() * 2, DEVICE_MAX_SLOTS));
+    // Without a block queue (tmpfs, network) only the CPUs limit it
+    if (!info->known) return cap;
+    return CLAMP(info->queue_depth / 8, 4, cap);
+}
+
+// Physical byte offset of the first extent of fd's data, for reading files
+// from a spinning disk in on-disk order. 0 when the filesystem cannot tell
+// (no FIEMAP, data inline in the inode, or an empty file).
+static guint64 device_physical_offset(int fd)
+{
+    guint64 buf[(sizeof(struct fiemap) + sizeof(struct fiemap_extent)) / sizeof(guint64) + 1];
+    memset(buf, 0, sizeof buf);
+    struct fiemap *map = (struct fiemap *)buf;
+    map->fm_length = FIEMAP_MAX_OFFSET;
+    map->fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) != 0 || map->fm_mapped_extents == 0) return 0;
+    return map->fm_extents[0].fe_physical;
+}
+
+// --- I/O QoS ---
+// Work runs in one of three classes. Interactive work, which the user is
+// waiting on, gets the highest best-effort I/O priority; normal work keeps
+// the defaults; background work gets the idle I/O class and a raised nice
+// value, so the kernel only serves it when nothing else wants the disk or
+// the CPU. Each class can also be capped to a bandwidth by a token bucket,
+// for when even idle-class I/O hurts: a spinning disk in the middle of a
+// long read still makes a listing wait for the seek back. A raised nice
+// value cannot be lowered again without privileges, so background work
+// runs on threads of its own, never on shared pools.
+
+#define IOPRIO_WHO_PROCESS_ 1
+#define IOPRIO_CLASS_SHIFT_ 13
+#define IOPRIO_CLASS_BE_ 2
+#define IOPRIO_CLASS_IDLE_ 3
+#define QOS_BACKGROUND_NICE 19
+#define QOS_BURST_SECONDS 0.5 // A bucket holds this much of its rate
+
+typedef enum {
+    QOS_INTERACTIVE, // Quick work the user is waiting on
+    QOS_NORMAL,
+    QOS_BACKGROUND,  // Bulk work that can wait
+    QOS_CLASSES
+} QosClass;
+
+typedef struct {
+    GMutex lock;
+    guint64 rate;    // Bytes per second; 0 for no cap
+    gdouble tokens;  // Goes negative on overdraft, which is slept off
+    gint64 refilled; // Monotonic time tokens were last added
+} QosBucket;
+
+static QosBucket qos_buckets[QOS_CLASSES];
+
+static const gchar* qos_class_name(QosClass c)
+{
+    return c == QOS_INTERACTIVE ? "interactive" : c == QOS_NORMAL ? "normal" : "background";
+}
+
+// Gives the calling thread the I/O priority of class c, and for background
+// work its CPU niceness too.
+static void qos_apply_thread(QosClass c)
+{
+    int prio = 0; // IOPRIO_CLASS_NONE: follows the nice value
+    if (c == QOS_INTERACTIVE) prio = IOPRIO_CLASS_BE_ << IOPRIO_CLASS_SHIFT_; // Level 0, the highest
+    else if (c == QOS_BACKGROUND) prio = IOPRIO_CLASS_IDLE_ << IOPRIO_CLASS_SHIFT_;
+    syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS_, 0, prio);
+    if (c == QOS_BACKGROUND) setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), QOS_BACKGROUND_NICE);
+}
+
+// Caps bucket b at bytes_per_second; 0 lifts the cap.
+static void qos_bucket_set_rate(QosBucket *b, guint64 bytes_per_second)
+{
+    g_mutex_lock(&b->lock);
+    b->rate = bytes_per_second;
+    b->tokens = 0;
+    b->refilled = g_get_monotonic_time();
+    g_mutex_unlock(&b->lock);
+}
+
+// Charges bytes just transferred to bucket b and sleeps off any overdraft,
+// so everything drawing on it stays within its rate. Sleeps are cut short
+// by cancellation.
+static void qos_bucket_throttle(QosBucket *b, guint64 bytes, GCancellable *cancellable)
+{
+    g_mutex_lock(&b->lock);
+    if (b->rate == 0) {
+        g_mutex_unlock(&b->lock);
+        return;
+    }
+    gint64 now = g_get_monotonic_time();
+    gdouble refill = (now - b->refilled) * (gdouble)b->rate / G_USEC_PER_SEC;
+    b->tokens = MIN(b->rate * QOS_BURST_SECONDS, b->tokens + refill) - bytes;
+    b->refilled = now;
+    gint64 until = b->tokens < 0 ? now + (gint64)(-b->tokens * G_USEC_PER_SEC / b->rate) : now;
+    g_mutex_unlock(&b->lock);
+
+    for (gint64 left = until - now; left > 0 && !g_cancellable_is_cancelled(cancellable);
+         left = until - g_get_monotonic_time())
+        g_usleep(MIN(left, 100 * 1000));
+}
+
+static void qos_set_rate(QosClass c, guint64 bytes_per_second)
+{
+    qos_bucket_set_rate(&qos_buckets[c], bytes_per_second);
+}
+
+static void qos_throttle(QosClass c, guint64 bytes, GCancellable *cancellable)
+{
+    qos_bucket_throttle(&qos_buckets[c], bytes, cancellable);
+}
+
+// --- Copy Journal ---
+// Long copies record their progress in a small append-only journal under
+// $XDG_STATE_HOME/owltech-fm/jobs/, so an interrupted job can continue
+// where it stopped instead of starting over. Records are one per line, with
+// tab-separated fields and escaped paths:
+//   FMJOURNAL1 <mode>       header
+//   D <dest dir>            where the job pastes into
+//   S <source>              one per source item
+//   T <source> <target>     target chosen for a source item
+//   C <target> <dev:ino>    a file this job created, so a resumed run can
+//                           tell it from one that appeared at the path since
+//   F <target>              a file that has been copied completely
+//   P <target> <offset>     bytes of a file known to be on disk
+//   R <source>              a moved item is in place; only its source
+//                           remains to be deleted
+// A checkpoint is only written after the target has been flushed up to the
+// recorded offset. F records are flushed too, so a finished file is never
+// copied again nor a partial one taken for finished; a C record reaches the
+// disk with the first P or F record after it.
+
+#define JOURNAL_MAGIC "FMJOURNAL1"
+#define JOURNAL_TAIL_CHECK (1024 * 1024)
+#define COPY_CHECKPOINT_INTERVAL (64LL * 1024 * 1024)
+
+typedef struct {
+    gchar *path;
+    FILE *f;
+    GMutex lock;
+    gchar *mode;          // "copy" or "move"
+    gchar *dest_dir;
+    GPtrArray *sources;
+    GHashTable *targets;   // source -> target
+    GHashTable *completed; // Set of finished target paths
+    GHashTable *partial;   // target -> guint64 last checkpoint offset
+    GHashTable *moved;     // Set of sources whose move reached its target
+    GHashTable *created;   // target -> "dev:ino" of the file this job made
+    gboolean resuming;     // Loaded from an earlier run; targets may exist
+} CopyJournal;
+
+static gchar* copy_journal_dir(void)
+{
+    return g_build_filename(g_get_user_state_dir(), "owltech-fm", "jobs", NULL);
+}
+
+static void copy_journal_write(CopyJournal *j, gboolean durable, const gchar *tag,
+                               const gchar *a, const gchar *b)
+{
+    gchar *ea = g_strescape(a, NULL);
+    gchar *eb = b ? g_strescape(b, NULL) : NULL;
+    g_mutex_lock(&j->lock);
+    if (eb) fprintf(j->f, "%s\t%s\t%s\n", tag, ea, eb);
+    else fprintf(j->f, "%s\t%s\n", tag, ea);
+    fflush(j->f);
+    if (durable) fdatasync(fileno(j->f));
+    g_mutex_unlock(&j->lock);
+    g_free(eb);
+    g_free(ea);
+}
+
+static CopyJournal* copy_journal_alloc(void)
+{
+    CopyJournal *j = g_new0(CopyJournal, 1);
+    g_mutex_init(&j->lock);
+    j->sources = g_ptr_array_new_with_free_func(g_free);
+    j->targets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    j->completed = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    j->partial = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    j->moved = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    j->created = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    return j;
+}
+
+static void copy_journal_free(CopyJournal *j)
+{
+    if (j->f) fclose(j->f);
+    g_mutex_clear(&j->lock);
+    g_ptr_array_free(j->sources, TRUE);
+    g_hash_table_destroy(j->targets);
+    g_hash_table_destroy(j->completed);
+    g_hash_table_destroy(j->partial);
+    g_hash_table_destroy(j->moved);
+    g_hash_table_destroy(j->created);
+    g_free(j->mode);
+    g_free(j->dest_dir);
+    g_free(j->path);
+    g_free(j);
+}
+
+static CopyJournal* copy_journal_create(const gchar *mode, const gchar *dest_dir, GPtrArray *sources, GError **error)
+{
+    gchar *dir = copy_journal_dir();
+    if (g_mkdir_with_parents(dir, 0700) != 0) {
+        int saved = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved), "Cannot create journal directory: %s", g_strerror(saved));
+        g_free(dir);
+        return NULL;
+    }
+
+    CopyJournal *j = copy_journal_alloc();
+    j->path = g_build_filename(dir, "XXXXXX.journal", NULL);
+    g_free(dir);
+
+    int fd = mkstemps(j->path, strlen(".journal"));
+    if (fd < 0 || !(j->f = fdopen(fd, "a"))) {
+        int saved = errno;
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved), "Cannot create journal: %s", g_strerror(saved));
+        if (fd >= 0) close(fd);
+        copy_journal_free(j);
+        return NULL;
+    }
+
+    j->mode = g_strdup(mode);
+    j->dest_dir = g_strdup(dest_dir);
+    copy_journal_write(j, FALSE, JOURNAL_MAGIC, mode, NULL);
+    copy_journal_write(j, FALSE, "D", dest_dir, NULL);
+    for (guint i = 0; i < sources->len; ++i) {
+        g_ptr_array_add(j->sources, g_strdup(g_ptr_array_index(sources, i)));
+        copy_journal_write(j, FALSE, "S", g_ptr_array_index(sources, i), NULL);
+    }
+    fdatasync(fd);
+    return j;
+}
+
+// Reads a journal left behind by an interrupted job and reopens it for
+// appending, so the resumed run keeps extending the same record.
+static CopyJournal* copy_journal_load(const gchar *path, GError **error)
+{
+    gchar *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, error)) return NULL;
+
+    CopyJournal *j = copy_journal_alloc();
+    j->path = g_strdup(path);
+    j->resuming = TRUE;
+
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    for (guint i = 0; lines[i]; ++i) {
+        gchar **f = g_strsplit(lines[i], "\t", 3);
+        guint n = g_strv_length(f);
+        gchar *a = n > 1 ? g_strcompress(f[1]) : NULL;
+        gchar *b = n > 2 ? g_strcompress(f[2]) : NULL;
+
+        if (n < 2) {
+            // Blank or torn final line
+        } else if (i == 0 && g_strcmp0(f[0], JOURNAL_MAGIC) == 0) {
+            j->mode = g_strdup(a);
+        } else if (g_strcmp0(f[0], "D") == 0) {
+            j->dest_dir = g_strdup(a);
+        } else if (g_strcmp0(f[0], "S") == 0) {
+            g_ptr_array_add(j->sources, g_strdup(a));
+        } else if (g_strcmp0(f[0], "T") == 0 && b) {
+            g_hash_table_replace(j->targets, g_strdup(a), g_strdup(b));
+        } else if (g_strcmp0(f[0], "F") == 0) {
+            g_hash_table_add(j->completed, g_strdup(a));
+            g_hash_table_remove(j->partial, a);
+        } else if (g_strcmp0(f[0], "C") == 0 && b) {
+            g_hash_table_replace(j->created, g_strdup(a), g_strdup(b));
+        } else if (g_strcmp0(f[0], "R") == 0) {
+            g_hash_table_add(j->moved, g_strdup(a));
+        } else if (g_strcmp0(f[0], "P") == 0 && b) {
+            guint64 off = g_ascii_strtoull(b, NULL, 10);
+            g_hash_table_replace(j->partial, g_strdup(a), g_memdup2(&off, sizeof off));
+        }
+        g_free(b);
+        g_free(a);
+        g_strfreev(f);
+    }
+    g_strfreev(lines);
+
+    if (!j->mode || !j->dest_dir || !(j->f = fopen(path, "a"))) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Unreadable copy journal");
+        copy_journal_free(j);
+        return NULL;
+    }
+    return j;
+}
+
+// Closes the journal; removes it when the job has nothing left to resume.
+static void copy_journal_close(CopyJournal *j, gboolean finished)
+{
+    if (finished) unlink(j->path);
+    copy_journal_free(j);
+}
+
+// Returns the paths of journals left behind by interrupted jobs.
+static GPtrArray* copy_journal_find_pending(void)
+{
+    GPtrArray *found = g_ptr_array_new_with_free_func(g_free);
+    gchar *dir = copy_journal_dir();
+    GDir *d = g_dir_open(dir, 0, NULL);
+    const gchar *name;
+    while (d && (name = g_dir_read_name(d)) != NULL) {
+        if (g_str_has_suffix(name, ".journal"))
+            g_ptr_array_add(found, g_build_filename(dir, name, NULL));
+    }
+    if (d) g_dir_close(d);
+    g_free(dir);
+    return found;
+}
+
+// Returns the target an earlier run chose for src, or NULL.
+static gchar* copy_journal_lookup_target(CopyJournal *j, const gchar *src)
+{
+    return j ? g_strdup(g_hash_table_lookup(j->targets, src)) : NULL;
+}
+
+static void copy_journal_set_target(CopyJournal *j, const gchar *src, const gchar *target)
+{
+    if (!j) return;
+    g_hash_table_replace(j->targets, g_strdup(src), g_strdup(target));
+    copy_journal_write(j, TRUE, "T", src, target);
+}
+
+static gboolean copy_journal_is_done(CopyJournal *j, const gchar *target)
+{
+    if (!j) return FALSE;
+    g_mutex_lock(&j->lock);
+    gboolean done = g_hash_table_contains(j->completed, target);
+    g_mutex_unlock(&j->lock);
+    return done;
+}
+
+static guint64 copy_journal_offset(CopyJournal *j, const gchar *target)
+{
+    if (!j) return 0;
+    g_mutex_lock(&j->lock);
+    const guint64 *off = g_hash_table_lookup(j->partial, target);
+    guint64 result = off ? *off : 0;
+    g_mutex_unlock(&j->lock);
+    return result;
+}
+
+static void copy_journal_file_done(CopyJournal *j, const gchar *target)
+{
+    if (!j) return;
+    g_mutex_lock(&j->lock);
+    g_hash_table_add(j->completed, g_strdup(target));
+    g_hash_table_remove(j->partial, target);
+    g_mutex_unlock(&j->lock);
+    copy_journal_write(j, TRUE, "F", target, NULL);
+}
+
+static gchar* copy_journal_identity(const struct stat *st)
+{
+    return g_strdup_printf("%" G_GUINT64_FORMAT ":%" G_GUINT64_FORMAT, (guint64)st->st_dev, (guint64)st->st_ino);
+}
+
+// Records that this job created target as the file st describes.
+static void copy_journal_set_created(CopyJournal *j, const gchar *target, const struct stat *st)
+{
+    if (!j) return;
+    gchar *id = copy_journal_identity(st);
+    g_mutex_lock(&j->lock);
+    g_hash_table_replace(j->created, g_strdup(target), g_strdup(id));
+    g_mutex_unlock(&j->lock);
+    copy_journal_write(j, FALSE, "C", target, id);
+    g_free(id);
+}
+
+// Whether the file st describes at target is the one this job created.
+static gboolean copy_journal_owns(CopyJournal *j, const gchar *target, const struct stat *st)
+{
+    if (!j) return FALSE;
+    gchar *id = copy_journal_identity(st);
+    g_mutex_lock(&j->lock);
+    gboolean owns = g_strcmp0(g_hash_table_lookup(j->created, target), id) == 0;
+    g_mutex_unlock(&j->lock);
+    g_free(id);
+    return owns;
+}
+
+static gboolean copy_journal_is_moved(CopyJournal *j, const gchar *src)
+{
+    if (!j) return FALSE;
+    g_mutex_lock(&j->lock);
+    gboolean moved = g_hash_table_contains(j->moved, src);
+    g_mutex_unlock(&j->lock);
+    return moved;
+}
+
+static void copy_journal_set_moved(CopyJournal *j, const gchar *src)
+{
+    if (!j) return;
+    g_mutex_lock(&j->lock);
+    g_hash_table_add(j->moved, g_strdup(src));
+    g_mutex_unlock(&j->lock);
+    copy_journal_write(j, TRUE, "R", src, NULL);
+}
+
+// Flushes out_fd and records that target holds valid data up to offset.
+static void copy_journal_checkpoint(CopyJournal *j, int out_fd, const gchar *target, guint64 offset)
+{
+    if (!j || offset == 0 || fdatasync(out_fd) != 0) return;
+    g_mutex_lock(&j->lock);
+    g_hash_table_replace(j->partial, g_strdup(target), g_memdup2(&offset, sizeof offset));
+    g_mutex_unlock(&j->lock);
+
+    gchar *off = g_strdup_printf("%" G_GUINT64_FORMAT, offset);
+    copy_journal_write(j, TRUE, "P", target, off);
+    g_free(off);
+}
+
+// Gives up on an interrupted job: every file it created but did not
+// finish is removed, whether or not it reached a checkpoint; completed
+// ones are left where they are. A file that has since replaced one of
+// them is not the job's to remove.
+static void copy_journal_discard(CopyJournal *j)
+{
+    GHashTableIter iter;
+    gpointer target;
+    g_hash_table_iter_init(&iter, j->created);
+    while (g_hash_table_iter_next(&iter, &target, NULL)) {
+        struct stat st;
+        if (g_hash_table_contains(j->completed, target)) continue;
+        if (lstat(target, &st) == 0 && S_ISREG(st.st_mode) && copy_journal_owns(j, target, &st))
+            unlink(target);
+    }
+    copy_journal_close(j, TRUE);
+}
+
+// A partial target is only trusted if it is at least as long as the
+// checkpoint and the data just before the checkpoint matches the source.
+static gboolean copy_journal_verify_tail(int in_fd, int out_fd, guint64 offset)
+{
+    struct stat st;
+    if (fstat(out_fd, &st) != 0 || (guint64)st.st_size < offset) return FALSE;
+
+    gsize len = MIN(offset, (guint64)JOURNAL_TAIL_CHECK);
+    if (len == 0) return TRUE;
+    guint8 *a = g_malloc(len), *b = g_malloc(len);
+    gboolean ok = pread(in_fd, a, len, offset - len) == (ssize_t)len &&
+                  pread(out_fd, b, len, offset - len) == (ssize_t)len;
+    ok = ok && memcmp(a, b, len) == 0;
+    g_free(a);
+    g_free(b);
+    return ok;
+}
+
+// --- Copy Engine ---
+// Copies files and trees with the cheapest mechanism the filesystems allow:
+// a FICLONE reflink, then in-kernel copy_file_range, then sendfile, and only
+// then a plain read/write loop through a large user-space buffer. Regular
+// files of a tree are copied by a pool of workers so that many small files
+// are in flight at once; directories are created by the walker up front and
+// get their final metadata once everything beneath them has been written.
+
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024)
+#define COPY_BUFFER_SIZE (4 * 1024 * 1024)
+#define COPY_TREE_WORKERS 16
+#define COPY_RANGED_MIN_SIZE (1024LL * 1024 * 1024)
+#define COPY_RANGE_MIN_CHUNK (64LL * 1024 * 1024)
+#define COPY_RANGE_MAX_CHUNK (1024LL * 1024 * 1024)
+#define COPY_RANGE_MAX_STREAMS 16
+#define DIRECT_IO_ALIGN 4096
+
+typedef enum {
+    COPY_ORDER_AUTO,       // Chosen from the source and target devices
+    COPY_ORDER_SEQUENTIAL, // One file at a time, in the source's on-disk order
+    COPY_ORDER_PARALLEL,   // Many files in flight, in walk order
+} CopyOrder;
+
+typedef struct {
+    GCancellable *cancellable;
+    GMutex lock;
+    guint64 bytes_done;
+    guint64 bytes_total;
+    guint files_done;
+    guint files_total;
+    GPtrArray *errors; // Human readable per-item failures
+    gboolean direct_io; // Bypass the page cache for large files
+    gboolean verify;    // Re-read and compare every copied extent
+    guint64 bytes_verified;
+    guint files_verified;
+    guint files_cloned;   // Reflinked; they share the source's blocks
+    CopyJournal *journal; // Progress record for resuming, or NULL
+    CopyOrder order;      // How the files of a tree are scheduled
+    QosClass qos;
+} CopyJob;
+
+typedef struct {
+    gchar *src;
+    gchar *dst;
+    struct stat st;
+    guint64 offset; // Physical offset of the data, when copied in disk order
+} CopyTask;
+
+static CopyJob* copy_job_new(GCancellable *cancellable)
+{
+    CopyJob *job = g_new0(CopyJob, 1);
+    job->cancellable = cancellable ? g_object_ref(cancellable) : g_cancellable_new();
+    job->qos = QOS_NORMAL;
+    g_mutex_init(&job->lock);
+    job->errors = g_ptr_array_new_with_free_func(g_free);
+    return job;
+}
+
+static void copy_job_free(CopyJob *job)
+{
+    g_object_unref(job->cancellable);
+    g_mutex_clear(&job->lock);
+    g_ptr_array_free(job->errors, TRUE);
+    g_free(job);
+}
+
+static void copy_job_add_bytes(CopyJob *job, guint64 bytes)
+{
+    g_mutex_lock(&job->lock);
+    job->bytes_done += bytes;
+    g_mutex_unlock(&job->lock);
+}
+
+static void copy_job_add_file(CopyJob *job, guint64 size)
+{
+    g_mutex_lock(&job->lock);
+    job->files_total++;
+    job->bytes_total += size;
+    g_mutex_unlock(&job->lock);
+}
+
+static void copy_job_file_done(CopyJob *job)
+{
+    g_mutex_lock(&job->lock);
+    job->files_done++;
+    g_mutex_unlock(&job->lock);
+}
+
+static void copy_job_add_verified(CopyJob *job, guint64 bytes)
+{
+    g_mutex_lock(&job->lock);
+    job->bytes_verified += bytes;
+    g_mutex_unlock(&job->lock);
+}
+
+static void copy_job_add_error(CopyJob *job, const gchar *path, const GError *err)
+{
+    g_mutex_lock(&job->lock);
+    g_ptr_array_add(job->errors, g_strdup_printf("%s: %s", path, err->message));
+    g_mutex_unlock(&job->lock);
+}
+
+// A resumed job finds the directories, links and files it created before,
+// which is not an error.
+static gboolean copy_job_resuming(CopyJob *job)
+{
+    return job->journal && job->journal->resuming;
+}
+
+static void copy_task_free(CopyTask *t)
+{
+    g_free(t->src);
+    g_free(t->dst);
+    g_free(t);
+}
+
+static gboolean set_errno_error(GError **error, const gchar *what)
+{
+    int saved = errno;
+    g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved), "%s: %s", what, g_strerror(saved));
+    return FALSE;
+}
+
+// Copies the contents of in_fd to out_fd from offset start onwards, in the
+// kernel where possible. Every fallback continues from the current file
+// offsets, so a method that gives up part way leaves no gap for the next
+// one. The journal gets a checkpoint for dst every COPY_CHECKPOINT_INTERVAL
+// bytes.
+static gboolean copy_file_data(const gchar *dst, int in_fd, int out_fd, off_t start, CopyJob *job, GError **error)
+{
+    if (lseek(in_fd, start, SEEK_SET) < 0 || lseek(out_fd, start, SEEK_SET) < 0)
+        return set_errno_error(error, "Cannot seek");
+
+    off_t pos = start, checkpoint = start;
+    gboolean use_cfr = TRUE, use_sendfile = TRUE;
+    for (;;) {
+        if (pos - checkpoint >= COPY_CHECKPOINT_INTERVAL) {
+            copy_journal_checkpoint(job->journal, out_fd, dst, pos);
+            checkpoint = pos;
+        }
+        if (g_cancellable_set_error_if_cancelled(job->cancellable, error)) return FALSE;
+
+        ssize_t n = -1;
+        if (use_cfr) {
+            n = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS ||
+                          errno == EOPNOTSUPP || errno == EBADF)) {
+                use_cfr = FALSE;
+                continue;
+            }
+        } else if (use_sendfile) {
+            n = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+            if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+                use_sendfile = FALSE;
+                continue;
+            }
+        } else {
+            break;
+        }
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return set_errno_error(error, "Copy failed");
+        if (n == 0) return TRUE;
+        pos += n;
+        copy_job_add_bytes(job, n);
+        qos_throttle(job->qos, n, job->cancellable);
+    }
+
+    gchar *buf = g_malloc(COPY_BUFFER_SIZE);
+    gboolean ok = TRUE;
+    for (;;) {
+        if (g_cancellable_set_error_if_cancelled(job->cancellable, error)) {
+            ok = FALSE;
+            break;
+        }
+        ssize_t n = read(in_fd, buf, COPY_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ok = set_errno_error(error, "Read failed");
+            break;
+        }
+        if (n == 0) break;
+        if (!(ok = write_all(out_fd, buf, n, error))) break;
+        pos += n;
+        copy_job_add_bytes(job, n);
+        qos_throttle(job->qos, n, job->cancellable);
+        if (pos - checkpoint >= COPY_CHECKPOINT_INTERVAL) {
+            copy_journal_checkpoint(job->journal, out_fd, dst, pos);
+            checkpoint = pos;
+        }
+    }
+    g_free(buf);
+    return ok;
+}
+
+// Copies extended attributes. Filesystems without xattr support are not an
+// error; the data has still been copied faithfully.
+static void copy_xattrs(int in_fd, int out_fd)
+{
+    ssize_t len = flistxattr(in_fd, NULL, 0);
+    if (len <= 0) return;
+
+    gchar *names = g_malloc(len);
+    len = flistxattr(in_fd, names, len);
+    gchar *value = NULL;
+    gsize value_cap = 0;
+
+    for (gchar *name = names; len > 0 && name < names + len; name += strlen(name) + 1) {
+        ssize_t vlen = fgetxattr(in_fd, name, NULL, 0);
+        if (vlen < 0) continue;
+        if ((gsize)vlen > value_cap) {
+            value_cap = vlen;
+            value = g_realloc(value, value_cap);
+        }
+        vlen = fgetxattr(in_fd, name, value, vlen);
+        if (vlen >= 0) fsetxattr(out_fd, name, value, vlen, 0);
+    }
+    g_free(value);
+    g_free(names);
+}
+
+// Applies ownership (when permitted), mode, xattrs and timestamps. Times go
+// last because every other change would bump them.
+static void copy_metadata(int in_fd, int out_fd, const struct stat *st)
+{
+    if (fchown(out_fd, st->st_uid, st->st_gid) != 0 && errno == EPERM) {
+        // Unprivileged copies keep the copier's ownership, as cp -a does
+    }
+    fchmod(out_fd, st->st_mode & 07777);
+    copy_xattrs(in_fd, out_fd);
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    futimens(out_fd, times);
+}
+
+static gboolean pwrite_all(int fd, const void *data, gsize len, off_t off, GError **error)
+{
+    const gchar *p = data;
+    while (len > 0) {
+        ssize_t m = pwrite(fd, p, len, off);
+        if (m < 0 && errno == EINTR) continue;
+        if (m < 0) return set_errno_error(error, "Write failed");
+        p += m;
+        off += m;
+        len -= m;
+    }
+    return TRUE;
+}
+
+// Chooses how a single large file is split. Spinning disks get one
+// sequential stream; otherwise the stream count follows the device queue
+// depth and the CPU count, and chunks are sized so every stream gets several
+// of them, rounded to the device's preferred I/O size.
+static void copy_plan_ranges(const struct stat *src_st, dev_t dst_dev, guint *streams, guint64 *chunk)
+{
+    const DeviceInfo *in = device_probe(src_st->st_dev);
+    const DeviceInfo *out = device_probe(dst_dev);
+
+    if (in->rotational || out->rotational) {
+        *streams = 1;
+    } else {
+        guint depth = MIN(in->queue_depth, out->queue_depth);
+        *streams = CLAMP(depth / 16, 2, MIN(g_get_num_processors(), COPY_RANGE_MAX_STREAMS));
+    }
+
+    guint64 align = MAX(MAX(in->optimal_io, out->optimal_io), 1024 * 1024);
+    guint64 c = src_st->st_size / (*streams * 4);
+    c = CLAMP(c, COPY_RANGE_MIN_CHUNK, COPY_RANGE_MAX_CHUNK);
+    *chunk = (c + align - 1) / align * align;
+}
+
+typedef struct {
+    int in_fd, out_fd;         // Buffered descriptors
+    int in_direct, out_direct; // O_DIRECT descriptors, or -1
+    guint64 size;
+    guint64 base;              // Offset the chunks start from
+    guint64 chunk;
+    gint nchunks;
+    gint next;                 // Next chunk index to claim
+    gint failed;
+    const gchar *dst;          // Target path, for journal checkpoints
+    guint8 *finished;          // Per chunk completion flags
+    gint watermark;            // Chunks below this are all complete
+    gboolean sparse;           // Only data extents are copied
+    CopyJob *job;
+    GMutex lock;
+    GError *error;             // First failure
+} RangedCopy;
+
+// A file whose allocated blocks cover less than its size has holes worth
+// preserving; small files are not worth the extra lseek calls.
+static gboolean copy_is_sparse(const struct stat *st)
+{
+    return st->st_size >= 64 * 1024 && (guint64)st->st_blocks * 512 < (guint64)st->st_size;
+}
+
+// XXH64, used to fingerprint copied data on the fly. It runs at memory
+// speed, so hashing every buffer costs next to nothing next to the I/O.
+#define XXH_P1 11400714785074694791ULL
+#define XXH_P2 14029467366897019727ULL
+#define XXH_P3 1609587929392839161ULL
+#define XXH_P4 9650029242287828579ULL
+#define XXH_P5 2870177450012600261ULL
+
+static inline guint64 xxh_read64(const guint8 *p)
+{
+    guint64 v;
+    memcpy(&v, p, sizeof v);
+    return GUINT64_FROM_LE(v);
+}
+
+static inline guint64 xxh_round(guint64 acc, guint64 input)
+{
+    acc += input * XXH_P2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * XXH_P1;
+}
+
+static inline guint64 xxh_merge(guint64 h, guint64 v)
+{
+    h ^= xxh_round(0, v);
+    return h * XXH_P1 + XXH_P4;
+}
+
+static inline guint64 xxh_rotl(guint64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+// Mixes in the tail after the last full stripe and avalanches the result.
+static guint64 xxh_finish(guint64 h, const guint8 *p, const guint8 *end)
+{
+    for (; p + 8 <= end; p += 8)
+        h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_P1 + XXH_P4;
+    if (p + 4 <= end) {
+        guint32 v;
+        memcpy(&v, p, sizeof v);
+        h = xxh_rotl(h ^ (GUINT32_FROM_LE(v) * XXH_P1), 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = xxh_rotl(h ^ (*p * XXH_P5), 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static guint64 xxh64(const void *data, gsize len, guint64 seed)
+{
+    const guint8 *p = data, *end = p + len;
+    guint64 h;
+
+    if (len >= 32) {
+        guint64 v1 = seed + XXH_P1 + XXH_P2, v2 = seed + XXH_P2, v3 = seed, v4 = seed - XXH_P1;
+        do {
+            v1 = xxh_round(v1, xxh_read64(p));
+            v2 = xxh_round(v2, xxh_read64(p + 8));
+            v3 = xxh_round(v3, xxh_read64(p + 16));
+            v4 = xxh_round(v4, xxh_read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+        h = xxh_merge(xxh_merge(xxh_merge(xxh_merge(h, v1), v2), v3), v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    return xxh_finish(h + len, p, end);
+}
+
+typedef struct {
+    guint64 v[4];
+    guint64 total;
+    guint8 mem[32]; // Input short of a full stripe
+    guint mem_len;
+    guint64 seed;
+} Xxh64State;
+
+// Streaming form of xxh64(), for data that arrives in pieces.
+static void xxh64_init(Xxh64State *s, guint64 seed)
+{
+    memset(s, 0, sizeof *s);
+    s->seed = seed;
+    s->v[0] = seed + XXH_P1 + XXH_P2;
+    s->v[1] = seed + XXH_P2;
+    s->v[2] = seed;
+    s->v[3] = seed - XXH_P1;
+}
+
+static void xxh64_stripe(Xxh64State *s, const guint8 *p)
+{
+    for (int i = 0; i < 4; ++i)
+        s->v[i] = xxh_round(s->v[i], xxh_read64(p + 8 * i));
+}
+
+static void xxh64_update(Xxh64State *s, const void *data, gsize len)
+{
+    const guint8 *p = data, *end = p + len;
+    s->total += len;
+    if (s->mem_len + len < 32) {
+        memcpy(s->mem + s->mem_len, p, len);
+        s->mem_len += len;
+        return;
+    }
+    if (s->mem_len > 0) {
+        memcpy(s->mem + s->mem_len, p, 32 - s->mem_len);
+        p += 32 - s->mem_len;
+        xxh64_stripe(s, s->mem);
+        s->mem_len = 0;
+    }
+    for (; p + 32 <= end; p += 32)
+        xxh64_stripe(s, p);
+    memcpy(s->mem, p, end - p);
+    s->mem_len = end - p;
+}
+
+static guint64 xxh64_digest(const Xxh64State *s)
+{
+    guint64 h;
+    if (s->total >= 32) {
+        h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) + xxh_rotl(s->v[2], 12) + xxh_rotl(s->v[3], 18);
+        for (int i = 0; i < 4; ++i)
+            h = xxh_merge(h, s->v[i]);
+    } else {
+        h = s->seed + XXH_P5;
+    }
+    return xxh_finish(h + s->total, s->mem, s->mem + s->mem_len);
+}
+
+typedef struct {
+    guint64 len;
+    guint64 hash;
+} VerifyPiece;
+
+// Checks the extent just written at off against the digests taken from the
+// source while it streamed through. The extent is written back and dropped
+// from the page cache first, so the re-read comes from the device and not
+// from the very pages that were just written.
+static gboolean copy_verify_extent(RangedCopy *rc, off_t off, GArray *pieces, guint8 *buf, GError **error)
+{
+    guint64 len = 0;
+    for (guint i = 0; i < pieces->len; ++i)
+        len += g_array_index(pieces, VerifyPiece, i).len;
+
+    if (sync_file_range(rc->out_fd, off, len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER) != 0 && fdatasync(rc->out_fd) != 0)
+        return set_errno_error(error, "Cannot flush target");
+    posix_fadvise(rc->out_fd, off, len, POSIX_FADV_DONTNEED);
+
+    for (guint i = 0; i < pieces->len; ++i) {
+        const VerifyPiece *p = &g_array_index(pieces, VerifyPiece, i);
+        gboolean direct = rc->out_direct >= 0 && p->len % DIRECT_IO_ALIGN == 0 && off % DIRECT_IO_ALIGN == 0;
+        ssize_t n;
+        do n = pread(direct ? rc->out_direct : rc->out_fd, buf, p->len, off);
+        while (n < 0 && errno == EINTR);
+        if (n < 0) return set_errno_error(error, "Cannot re-read target");
+        if ((guint64)n != p->len || xxh64(buf, n, 0) != p->hash) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                        "Verification failed: target differs from source at offset %" G_GUINT64_FORMAT,
+                        (guint64)off);
+            return FALSE;
+        }
+        off += n;
+    }
+    copy_job_add_verified(rc->job, len);
+    qos_throttle(rc->job->qos, len, rc->job->cancellable);
+    return TRUE;
+}
+
+static gboolean copy_extent(RangedCopy *rc, off_t off, guint64 len, guint8 *buf, GError **error)
+{
+    // In-kernel copy with explicit offsets; falls through to pread/pwrite
+    // for whatever it could not do (other filesystem, direct I/O mode).
+    // Verified copies always go through the buffer so they can be hashed.
+    if (rc->in_direct < 0 && !rc->job->verify) {
+        loff_t in_off = off, out_off = off;
+        while (len > 0) {
+            if (g_cancellable_set_error_if_cancelled(rc->job->cancellable, error)) return FALSE;
+            ssize_t n = copy_file_range(rc->in_fd, &in_off, rc->out_fd, &out_off, MIN(len, COPY_BUFFER_SIZE * 4), 0);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            len -= n;
+            copy_job_add_bytes(rc->job, n);
+            qos_throttle(rc->job->qos, n, rc->job->cancellable);
+        }
+        off = in_off;
+    }
+
+    GArray *pieces = rc->job->verify ? g_array_new(FALSE, FALSE, sizeof(VerifyPiece)) : NULL;
+    off_t first = off;
+    gboolean ok = TRUE;
+    while (len > 0) {
+        if (g_cancellable_set_error_if_cancelled(rc->job->cancellable, error)) {
+            ok = FALSE;
+            break;
+        }
+        if (g_atomic_int_get(&rc->failed)) {
+            // Another stream already reported; this range is not complete
+            // and must be neither marked finished nor checkpointed
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_CANCELLED, "Aborted after another stream failed");
+            ok = FALSE;
+            break;
+        }
+
+        gsize want = MIN(len, (guint64)COPY_BUFFER_SIZE);
+        gboolean direct = rc->in_direct >= 0 && want % DIRECT_IO_ALIGN == 0 && off % DIRECT_IO_ALIGN == 0;
+        ssize_t n = pread(direct ? rc->in_direct : rc->in_fd, buf, want, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ok = set_errno_error(error, "Read failed");
+            break;
+        }
+        if (n == 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Source file shrank during copy");
+            ok = FALSE;
+            break;
+        }
+        if (pieces) {
+            VerifyPiece piece = { n, xxh64(buf, n, 0) };
+            g_array_append_val(pieces, piece);
+        }
+        if (!(ok = pwrite_all(direct && n % DIRECT_IO_ALIGN == 0 ? rc->out_direct : rc->out_fd, buf, n, off, error)))
+            break;
+        off += n;
+        len -= n;
+        copy_job_add_bytes(rc->job, n);
+        qos_throttle(rc->job->qos, n, rc->job->cancellable);
+    }
+
+    if (ok && pieces && len == 0) ok = copy_verify_extent(rc, first, pieces, buf, error);
+    if (pieces) g_array_free(pieces, TRUE);
+    return ok;
+}
+
+// Copies [off, off + len). For sparse sources only the data extents found
+// with SEEK_DATA/SEEK_HOLE are copied; the target never had blocks there,
+// so skipping a hole reproduces it.
+static gboolean copy_range(RangedCopy *rc, off_t off, guint64 len, guint8 *buf, GError **error)
+{
+    if (!rc->sparse) return copy_extent(rc, off, len, buf, error);
+
+    off_t end = off + len;
+    while (off < end) {
+        off_t data = lseek(rc->in_fd, off, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            data = end; // Only a hole remains
+        else if (data < 0)
+            return copy_extent(rc, off, end - off, buf, error); // No hole support
+        data = MIN(data, end);
+
+        off_t hole = data < end ? lseek(rc->in_fd, data, SEEK_HOLE) : end;
+        hole = hole < 0 ? end : MIN(hole, end);
+
+        copy_job_add_bytes(rc->job, data - off);
+        if (hole > data && !copy_extent(rc, data, hole - data, buf, error)) return FALSE;
+        off = hole;
+    }
+    return TRUE;
+}
+
+// Copies a file on a single stream from offset start through a user-space
+// buffer, leaving the holes of a sparse source unallocated. Works through
+// checkpoint-sized pieces so the journal can record how far it got.
+static gboolean copy_file_stream(const gchar *dst, int in_fd, int out_fd, const struct stat *st, off_t start,
+                                 CopyJob *job, GError **error)
+{
+    if (ftruncate(out_fd, st->st_size) != 0) return set_errno_error(error, "Cannot size target");
+
+    RangedCopy rc = { in_fd, out_fd, -1, -1 };
+    rc.size = st->st_size;
+    rc.sparse = copy_is_sparse(st);
+    rc.job = job;
+
+    guint8 *buf = NULL;
+    if (posix_memalign((void **)&buf, DIRECT_IO_ALIGN, COPY_BUFFER_SIZE) != 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Out of memory");
+        return FALSE;
+    }
+    gboolean ok = TRUE;
+    for (off_t off = start; ok && off < st->st_size; off += COPY_CHECKPOINT_INTERVAL) {
+        ok = copy_range(&rc, off, MIN(COPY_CHECKPOINT_INTERVAL, st->st_size - off), buf, error);
+        if (ok && off + COPY_CHECKPOINT_INTERVAL < st->st_size)
+            copy_journal_checkpoint(job->journal, out_fd, dst, off + COPY_CHECKPOINT_INTERVAL);
+    }
+    free(buf);
+    return ok;
+}
+
+// Chunks finish out of order, so only the contiguous prefix of finished
+// chunks can be recorded as a checkpoint.
+static void ranged_copy_chunk_done(RangedCopy *rc, gint i)
+{
+    g_mutex_lock(&rc->lock);
+    rc->finished[i] = 1;
+    gint mark = rc->watermark;
+    while (mark < rc->nchunks && rc->finished[mark]) mark++;
+    if (mark > rc->watermark) {
+        rc->watermark = mark;
+        if (mark < rc->nchunks)
+            copy_journal_checkpoint(rc->job->journal, rc->out_fd, rc->dst, rc->base + (guint64)mark * rc->chunk);
+    }
+    g_mutex_unlock(&rc->lock);
+}
+
+static gpointer ranged_copy_worker(gpointer data)
+{
+    RangedCopy *rc = (RangedCopy *)data;
+    guint8 *buf = NULL;
+    if (posix_memalign((void **)&buf, DIRECT_IO_ALIGN, COPY_BUFFER_SIZE) != 0) buf = NULL;
+
+    for (;;) {
+        gint i = g_atomic_int_add(&rc->next, 1);
+        if (i >= rc->nchunks || g_atomic_int_get(&rc->failed)) break;
+
+        off_t off = rc->base + (off_t)i * rc->chunk;
+        guint64 len = MIN(rc->chunk, rc->size - off);
+        GError *err = NULL;
+        if (!buf) {
+            g_set_error(&err, G_IO_ERROR, G_IO_ERROR_FAILED, "Out of memory");
+        } else if (copy_range(rc, off, len, buf, &err)) {
+            ranged_copy_chunk_done(rc, i);
+            continue;
+        }
+
+        g_mutex_lock(&rc->lock);
+        if (!rc->error) rc->error = err;
+        else g_error_free(err);
+        g_mutex_unlock(&rc->lock);
+        g_atomic_int_set(&rc->failed, 1);
+        break;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Copies one large file as independent ranges on several streams. The
+// target is preallocated first so ranges land in place without extending
+// the file from many threads at once, and a full disk fails up front.
+// Sparse sources are only sized, not preallocated, so their holes survive.
+// A resumed copy only splits the part after start.
+static gboolean copy_file_ranged(const gchar *src, const gchar *dst, int in_fd, int out_fd,
+                                 const struct stat *st, off_t start, CopyJob *job, GError **error)
+{
+    gboolean sparse = copy_is_sparse(st);
+    if (sparse || fallocate(out_fd, 0, 0, st->st_size) != 0) {
+        if (!sparse && errno != EOPNOTSUPP && errno != ENOSYS) return set_errno_error(error, "Cannot preallocate target");
+        if (ftruncate(out_fd, st->st_size) != 0) return set_errno_error(error, "Cannot size target");
+    }
+
+    struct stat dst_st;
+    if (fstat(out_fd, &dst_st) != 0) return set_errno_error(error, "Cannot stat target");
+
+    RangedCopy rc = { in_fd, out_fd, -1, -1 };
+    guint streams = 1;
+    copy_plan_ranges(st, dst_st.st_dev, &streams, &rc.chunk);
+    rc.size = st->st_size;
+    rc.base = start;
+    rc.nchunks = (st->st_size - start + rc.chunk - 1) / rc.chunk;
+    rc.sparse = sparse;
+    rc.job = job;
+    rc.dst = dst;
+    rc.finished = g_new0(guint8, rc.nchunks);
+    g_mutex_init(&rc.lock);
+
+    if (job->direct_io) {
+        // Falls back to buffered I/O silently where O_DIRECT is refused
+        rc.in_direct = open(src, O_RDONLY | O_DIRECT | O_CLOEXEC);
+        rc.out_direct = open(dst, O_RDWR | O_DIRECT | O_CLOEXEC);
+        if (rc.in_direct < 0 || rc.out_direct < 0) {
+            if (rc.in_direct >= 0) close(rc.in_direct);
+            if (rc.out_direct >= 0) close(rc.out_direct);
+            rc.in_direct = rc.out_direct = -1;
+        }
+    }
+
+    streams = MIN(streams, (guint)rc.nchunks);
+    GThread **threads = g_new0(GThread *, streams);
+    for (guint i = 0; i < streams; ++i)
+        threads[i] = g_thread_new("copy-range", ranged_copy_worker, &rc);
+    for (guint i = 0; i < streams; ++i)
+        g_thread_join(threads[i]);
+    g_free(threads);
+
+    if (rc.in_direct >= 0) close(rc.in_direct);
+    if (rc.out_direct >= 0) close(rc.out_direct);
+    g_mutex_clear(&rc.lock);
+    g_free(rc.finished);
+
+    if (rc.error) {
+        g_propagate_error(error, rc.error);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Copies one regular file. When a resumed job finds a partial target whose
+// checkpoint still checks out, the copy continues from there; otherwise the
+// target is started again from the beginning. Only a target the journal
+// shows this job created is reused; anything else found at the path is
+// refused rather than overwritten. A failed target is kept if the journal
+// has a checkpoint for it, so a retry can pick it up.
+static gboolean copy_regular_file(const gchar *src, const gchar *dst, const struct stat *st,
+                                  CopyJob *job, GError **error)
+{
+    CopyJournal *journal = job->journal;
+    if (copy_journal_is_done(journal, dst)) {
+        copy_job_add_bytes(job, st->st_size);
+        return TRUE;
+    }
+
+    int in_fd = open(src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (in_fd < 0) return set_errno_error(error, "Cannot open source");
+
+    gboolean resuming = copy_job_resuming(job);
+    int out_fd = open(dst, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    gboolean created = out_fd >= 0;
+    if (out_fd < 0 && resuming && errno == EEXIST) {
+        struct stat dst_st;
+        out_fd = open(dst, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+        if (out_fd < 0 && errno == EACCES && lstat(dst, &dst_st) == 0 &&
+            copy_journal_owns(journal, dst, &dst_st) && unlink(dst) == 0) {
+            // Finished but read-only, interrupted before it was journaled
+            out_fd = open(dst, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            created = out_fd >= 0;
+        } else if (out_fd >= 0 && (fstat(out_fd, &dst_st) != 0 || !copy_journal_owns(journal, dst, &dst_st))) {
+            close(out_fd);
+            close(in_fd);
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS,
+                        "Target was created by someone else since the copy was interrupted");
+            return FALSE;
+        }
+    }
+    if (out_fd < 0) {
+        close(in_fd);
+        return set_errno_error(error, "Cannot create target");
+    }
+    struct stat out_st;
+    if (created && journal && fstat(out_fd, &out_st) == 0)
+        copy_journal_set_created(journal, dst, &out_st);
+
+    off_t start = copy_journal_offset(journal, dst);
+    if (start > st->st_size || (start > 0 && !copy_journal_verify_tail(in_fd, out_fd, start)))
+        start = 0;
+    if (resuming && ftruncate(out_fd, start) != 0) {
+        close(out_fd);
+        close(in_fd);
+        return set_errno_error(error, "Cannot truncate target");
+    }
+    copy_job_add_bytes(job, start);
+
+    // A reflink shares the source's blocks, so there is nothing to verify.
+    // Direct I/O copies of large files skip it to really move the data.
+    gboolean ok, cloned = FALSE;
+    if (st->st_size > 0 && (!job->direct_io || st->st_size < COPY_RANGED_MIN_SIZE) &&
+        ioctl(out_fd, FICLONE, in_fd) == 0) {
+        copy_job_add_bytes(job, st->st_size - start);
+        ok = cloned = TRUE;
+    } else if (st->st_size >= COPY_RANGED_MIN_SIZE) {
+        ok = copy_file_ranged(src, dst, in_fd, out_fd, st, start, job, error);
+    } else if (copy_is_sparse(st) || job->verify) {
+        ok = copy_file_stream(dst, in_fd, out_fd, st, start, job, error);
+    } else {
+        posix_fadvise(in_fd, start, 0, POSIX_FADV_SEQUENTIAL);
+        ok = copy_file_data(dst, in_fd, out_fd, start, job, error);
+    }
+    if (ok) copy_metadata(in_fd, out_fd, st);
+    if (ok && job->verify) {
+        g_mutex_lock(&job->lock);
+        if (cloned) job->files_cloned++;
+        else job->files_verified++;
+        g_mutex_unlock(&job->lock);
+    }
+
+    if (close(out_fd) != 0 && ok)
+        ok = set_errno_error(error, "Cannot finish target");
+    close(in_fd);
+    if (ok) copy_journal_file_done(journal, dst);
+    else if (copy_journal_offset(journal, dst) == 0) unlink(dst);
+    return ok;
+}
+
+static void copy_pool_worker(gpointer data, gpointer user_data)
+{
+    CopyTask *t = (CopyTask *)data;
+    CopyJob *job = (CopyJob *)user_data;
+    GError *err = NULL;
+
+    qos_apply_thread(job->qos);
+    if (!g_cancellable_is_cancelled(job->cancellable)) {
+        if (!copy_regular_file(t->src, t->dst, &t->st, job, &err)) {
+            if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+                copy_job_add_error(job, t->src, err);
+            g_error_free(err);
+        }
+        copy_job_file_done(job);
+    }
+    copy_task_free(t);
+}
+
+static gboolean copy_symlink(const gchar *src, const gchar *dst, const struct stat *st, gboolean resuming,
+                             GError **error)
+{
+    gchar *target = g_malloc(st->st_size + 1);
+    ssize_t n = readlink(src, target, st->st_size + 1);
+    if (n < 0 || n > st->st_size) {
+        g_free(target);
+        return set_errno_error(error, "Cannot read link");
+    }
+    target[n] = '\0';
+
+    gboolean ok = symlink(target, dst) == 0 || (resuming && errno == EEXIST) ||
+                  set_errno_error(error, "Cannot create link");
+    g_free(target);
+    if (ok) {
+        if (lchown(dst, st->st_uid, st->st_gid) != 0) {
+            // Not permitted for unprivileged users; keep the copier's ownership
+        }
+        struct timespec times[2] = { st->st_atim, st->st_mtim };
+        utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW);
+    }
+    return ok;
+}
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+} InodeKey;
+
+static guint inode_key_hash(gconstpointer p)
+{
+    const InodeKey *k = p;
+    return (guint)(k->ino ^ (k->ino >> 32) ^ (k->dev * 2654435761u));
+}
+
+static gboolean inode_key_equal(gconstpointer a, gconstpointer b)
+{
+    const InodeKey *x = a, *y = b;
+    return x->dev == y->dev && x->ino == y->ino;
+}
+
+typedef struct {
+    CopyJob *job;
+    GThreadPool *pool;
+    GPtrArray *files;    // CopyTask held back to be sorted, or NULL to push directly
+    GPtrArray *dirs;     // CopyTask per created directory, in creation order
+    GHashTable *inodes;  // InodeKey -> first target path of a hard-link set
+    GPtrArray *links;    // CopyTask: src is the first target, dst the new link
+} CopyWalk;
+
+// Walks src depth first, creating directories and links as it goes and
+// handing regular files to the worker pool. Created directories are
+// recorded so their metadata can be applied after the pool drains. Files
+// with several links are copied once; later members of the same (dev, ino)
+// set are queued as links to that first copy.
+static void copy_walk(CopyWalk *cw, const gchar *src, const gchar *dst, const struct stat *st)
+{
+    CopyJob *job = cw->job;
+    GError *err = NULL;
+    if (g_cancellable_is_cancelled(job->cancellable)) return;
+
+    if (S_ISREG(st->st_mode)) {
+        CopyTask *t = g_new0(CopyTask, 1);
+        t->src = g_strdup(src);
+        t->dst = g_strdup(dst);
+        t->st = *st;
+
+        if (st->st_nlink > 1) {
+            InodeKey key = { st->st_dev, st->st_ino };
+            const gchar *first = g_hash_table_lookup(cw->inodes, &key);
+            if (first) {
+                g_free(t->src);
+                t->src = g_strdup(first);
+                g_ptr_array_add(cw->links, t);
+                return;
+            }
+            g_hash_table_insert(cw->inodes, g_memdup2(&key, sizeof key), g_strdup(dst));
+        }
+
+        copy_job_add_file(job, st->st_size);
+        if (cw->files) g_ptr_array_add(cw->files, t);
+        else g_thread_pool_push(cw->pool, t, NULL);
+        return;
+    }
+
+    if (S_ISLNK(st->st_mode)) {
+        if (!copy_symlink(src, dst, st, copy_job_resuming(job), &err)) {
+            copy_job_add_error(job, src, err);
+            g_error_free(err);
+        }
+        return;
+    }
+
+    if (!S_ISDIR(st->st_mode)) {
+        if (mknod(dst, st->st_mode, st->st_rdev) != 0 && !(copy_job_resuming(job) && errno == EEXIST)) {
+            set_errno_error(&err, "Cannot create special file");
+            copy_job_add_error(job, src, err);
+            g_error_free(err);
+        }
+        return;
+    }
+
+    // Owner-writable until the final mode is applied at the end
+    if (mkdir(dst, 0700) != 0 && !(copy_job_resuming(job) && errno == EEXIST)) {
+        set_errno_error(&err, "Cannot create directory");
+        copy_job_add_error(job, src, err);
+        g_error_free(err);
+        return;
+    }
+    CopyTask *d = g_new0(CopyTask, 1);
+    d->src = g_strdup(src);
+    d->dst = g_strdup(dst);
+    d->st = *st;
+    g_ptr_array_add(cw->dirs, d);
+
+    DIR *dir = opendir(src);
+    if (!dir) {
+        set_errno_error(&err, "Cannot open directory");
+        copy_job_add_error(job, src, err);
+        g_error_free(err);
+        return;
+    }
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (g_strcmp0(de->d_name, ".") == 0 || g_strcmp0(de->d_name, "..") == 0) continue;
+
+        gchar *child_src = g_build_filename(src, de->d_name, NULL);
+        gchar *child_dst = g_build_filename(dst, de->d_name, NULL);
+        struct stat cst;
+        if (fstatat(dirfd(dir), de->d_name, &cst, AT_SYMLINK_NOFOLLOW) == 0) {
+            copy_walk(cw, child_src, child_dst, &cst);
+        } else {
+            set_errno_error(&err, "Cannot stat");
+            copy_job_add_error(job, child_src, err);
+            g_clear_error(&err);
+        }
+        g_free(child_src);
+        g_free(child_dst);
+    }
+    closedir(dir);
+}
+
+// Chooses how the files of a tree are scheduled and returns how many are
+// copied at once. A spinning disk at either end gets them one at a time in
+// the source's on-disk order, so the head sweeps instead of seeking; flash
+// gets as many in flight as the slower device's queue takes.
+static guint copy_plan_tree(const struct stat *src_st, const gchar *dst, CopyOrder *order)
+{
+    if (*order != COPY_ORDER_AUTO) return *order == COPY_ORDER_SEQUENTIAL ? 1 : COPY_TREE_WORKERS;
+
+    const DeviceInfo *in = device_probe(src_st->st_dev);
+    const DeviceInfo *out = in;
+    gchar *dst_dir = g_path_get_dirname(dst);
+    struct stat dst_st;
+    if (stat(dst_dir, &dst_st) == 0) out = device_probe(dst_st.st_dev);
+    g_free(dst_dir);
+
+    if (in->rotational || out->rotational) {
+        *order = COPY_ORDER_SEQUENTIAL;
+        return 1;
+    }
+    *order = COPY_ORDER_PARALLEL;
+    return MIN(MIN(device_io_slots(in), device_io_slots(out)), COPY_TREE_WORKERS);
+}
+
+static gint copy_task_compare_inode(gconstpointer a, gconstpointer b)
+{
+    const CopyTask *x = *(CopyTask * const *)a, *y = *(CopyTask * const *)b;
+    return x->st.st_ino < y->st.st_ino ? -1 : x->st.st_ino > y->st.st_ino;
+}
+
+static gint copy_task_compare_offset(gconstpointer a, gconstpointer b)
+{
+    const CopyTask *x = *(CopyTask * const *)a, *y = *(CopyTask * const *)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// Sorts files by where their data starts on disk. Extents are looked up in
+// inode order, which keeps the inode table reads sequential too; files
+// whose offset is unknown keep that inode order, ahead of the rest.
+static void copy_sort_by_offset(GPtrArray *files, GCancellable *cancellable)
+{
+    g_ptr_array_sort(files, copy_task_compare_inode);
+    for (guint i = 0; i < files->len && !g_cancellable_is_cancelled(cancellable); ++i) {
+        CopyTask *t = g_ptr_array_index(files, i);
+        int fd = open(t->src, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) continue;
+        t->offset = device_physical_offset(fd);
+        close(fd);
+    }
+    g_ptr_array_sort(files, copy_task_compare_offset);
+}
+
+// Copies src (file, link or whole tree) to dst, which must not exist unless
+// the job is resuming into it.
+// Failures of individual entries inside a tree are collected in
+// job->errors; FALSE is only returned when nothing could be copied.
+static gboolean copy_engine_copy(const gchar *src, const gchar *dst, CopyJob *job, GError **error)
+{
+    struct stat st;
+    if (lstat(src, &st) != 0) return set_errno_error(error, "Cannot stat source");
+
+    if (S_ISREG(st.st_mode)) {
+        copy_job_add_file(job, st.st_size);
+        gboolean ok = copy_regular_file(src, dst, &st, job, error);
+        if (ok) copy_job_file_done(job);
+        return ok;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        if (S_ISLNK(st.st_mode)) return copy_symlink(src, dst, &st, copy_job_resuming(job), error);
+        if (mknod(dst, st.st_mode, st.st_rdev) != 0 && !(copy_job_resuming(job) && errno == EEXIST))
+            return set_errno_error(error, "Cannot create special file");
+        return TRUE;
+    }
+
+    if (!copy_job_resuming(job) && access(dst, F_OK) == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "Target already exists");
+        return FALSE;
+    }
+
+    CopyOrder order = job->order;
+    guint workers = copy_plan_tree(&st, dst, &order);
+    CopyWalk cw = { job };
+    // Background work gets threads of its own (see I/O QoS)
+    cw.pool = g_thread_pool_new(copy_pool_worker, job, workers, job->qos == QOS_BACKGROUND, NULL);
+    if (order == COPY_ORDER_SEQUENTIAL) cw.files = g_ptr_array_new();
+    cw.dirs = g_ptr_array_new_with_free_func((GDestroyNotify)copy_task_free);
+    cw.inodes = g_hash_table_new_full(inode_key_hash, inode_key_equal, g_free, g_free);
+    cw.links = g_ptr_array_new_with_free_func((GDestroyNotify)copy_task_free);
+
+    copy_walk(&cw, src, dst, &st);
+    if (cw.files) {
+        // The pool has a single thread, so files are copied in push order
+        copy_sort_by_offset(cw.files, job->cancellable);
+        for (guint i = 0; i < cw.files->len; ++i)
+            g_thread_pool_push(cw.pool, g_ptr_array_index(cw.files, i), NULL);
+        g_ptr_array_free(cw.files, TRUE);
+    }
+    g_thread_pool_free(cw.pool, FALSE, TRUE);
+
+    // Recreate hard-link sets now that every first member has been copied
+    for (guint i = 0; i < cw.links->len; ++i) {
+        CopyTask *l = g_ptr_array_index(cw.links, i);
+        if (linkat(AT_FDCWD, l->src, AT_FDCWD, l->dst, 0) != 0 && !(copy_job_resuming(job) && errno == EEXIST)) {
+            GError *err = NULL;
+            set_errno_error(&err, "Cannot recreate hard link");
+            copy_job_add_error(job, l->dst, err);
+            g_error_free(err);
+        }
+    }
+
+    // Deepest directories first, so setting a parent's times is final
+    for (guint i = cw.dirs->len; i-- > 0; ) {
+        CopyTask *d = g_ptr_array_index(cw.dirs, i);
+        int in_fd = open(d->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        int out_fd = open(d->dst, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (in_fd >= 0 && out_fd >= 0) copy_metadata(in_fd, out_fd, &d->st);
+        if (in_fd >= 0) close(in_fd);
+        if (out_fd >= 0) close(out_fd);
+    }
+
+    g_ptr_array_free(cw.links, TRUE);
+    g_hash_table_destroy(cw.inodes);
+    g_ptr_array_free(cw.dirs, TRUE);
+
+    return !g_cancellable_set_error_if_cancelled(job->cancellable, error);
+}
+
+// Returns a path in dir for name that does not exist yet, adding a
+// " (copy)" / " (copy N)" suffix before the extension when needed.
+static gchar* copy_unique_dest(const gchar *dir, const gchar *name)
+{
+    gchar *dst = g_build_filename(dir, name, NULL);
+    struct stat st;
+    if (lstat(dst, &st) != 0 && errno == ENOENT) return dst;
+    g_free(dst);
+
+    const gchar *dot = strrchr(name, '.');
+    if (dot == name) dot = NULL; // Hidden file, not an extension
+    gchar *stem = dot ? g_strndup(name, dot - name) : g_strdup(name);
+    const gchar *ext = dot ? dot : "";
+
+    for (guint n = 1; ; ++n) {
+        gchar *candidate = n == 1 ? g_strdup_printf("%s (copy)%s", stem, ext)
+                                  : g_strdup_printf("%s (copy %u)%s", stem, n, ext);
+        dst = g_build_filename(dir, candidate, NULL);
+        g_free(candidate);
+        if (lstat(dst, &st) != 0 && errno == ENOENT) break;
+        g_free(dst);
+    }
+    g_free(stem);
+    return dst;
+}
+
+// Whether the directory dest_fd is the entry name of src_dirfd or lies
+// beneath it. Walks up from dest_fd through ".." comparing device and
+// inode, so symlinks and bind mounts cannot hide the relation.
+static gboolean copy_dest_inside(int src_dirfd, const gchar *name, int dest_fd)
+{
+    struct stat src_st, st;
+    if (fstatat(src_dirfd, name, &src_st, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISDIR(src_st.st_mode)) return FALSE;
+
+    int fd = fcntl(dest_fd, F_DUPFD_CLOEXEC, 0);
+    gboolean inside = FALSE;
+    while (fd >= 0 && fstat(fd, &st) == 0) {
+        if (st.st_dev == src_st.st_dev && st.st_ino == src_st.st_ino) {
+            inside = TRUE;
+            break;
+        }
+        struct stat parent_st;
+        int parent = openat(fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+        gboolean at_root = parent < 0 || fstat(parent, &parent_st) != 0 ||
+                           (parent_st.st_dev == st.st_dev && parent_st.st_ino == st.st_ino);
+        close(fd);
+        fd = at_root ? -1 : parent;
+        if (at_root && parent >= 0) close(parent);
+    }
+    if (fd >= 0) close(fd);
+    return inside;
+}
+
+// Refuses a paste of the entries names of src_dirfd into dest_fd that
+// would put a directory inside itself, which would otherwise copy the
+// growing tree until a path or descriptor limit stops it.
+static gboolean copy_check_sources(int src_dirfd, GPtrArray *names, int dest_fd, gboolean move, GError **error)
+{
+    for (guint i = 0; i < names->len; ++i) {
+        const gchar *name = g_ptr_array_index(names, i);
+        if (!copy_dest_inside(src_dirfd, name, dest_fd)) continue;
+        if (move)
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "Cannot move '%s' to a subdirectory of itself.", name);
+        else
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT,
+                        "Cannot copy a directory, '%s', into itself.", name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static gchar* copy_job_describe(CopyJob *job, const gchar *verb)
+{
+    g_mutex_lock(&job->lock);
+    gchar *done = g_format_size(job->bytes_done);
+    gchar *total = g_format_size(job->bytes_total);
+    gchar *text = g_strdup_printf("%s: %u of %u files | %s of %s", verb,
+                                  job->files_done, job->files_total, done, total);
+    g_mutex_unlock(&job->lock);
+    g_free(done);
+    g_free(total);
+    return text;
+}
+
+// Summary of a verified copy; mismatches are reported as job errors.
+static gchar* copy_job_verify_report(CopyJob *job)
+{
+    g_mutex_lock(&job->lock);
+    gchar *bytes = g_format_size(job->bytes_verified);
+    gchar *text = g_strdup_printf("Verification: %u file(s) re-read from disk and matched the source (%s).\n"
+                                  "%u reflinked file(s) share the source's blocks.\n"
+                                  "%u problem(s) found.",
+                                  job->files_verified, bytes, job->files_cloned, job->errors->len);
+    g_mutex_unlock(&job->lock);
+    g_free(bytes);
+    return text;
+}
+
+// Evicts the cached pages of every file under path, so each benchmark run
+// reads from the device rather than from memory.
+static void copy_bench_drop_cache(const gchar *path)
+{
+    struct stat st;
+    if (lstat(path, &st) != 0) return;
+    if (S_ISREG(st.st_mode)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd >= 0) {
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) return;
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (g_strcmp0(de->d_name, ".") == 0 || g_strcmp0(de->d_name, "..") == 0) continue;
+        gchar *child = g_build_filename(path, de->d_name, NULL);
+        copy_bench_drop_cache(child);
+        g_free(child);
+    }
+    closedir(dir);
+}
+
+// Command line benchmark: copies src to dst with the engine and then with
+// "cp -a" to dst.cp-a, and reports both. Each tool starts from a cold page
+// cache so neither reads what the other left in memory.
+static int run_copy_benchmark(const gchar *src, const gchar *dst, gboolean direct_io, gboolean verify)
+{
+    CopyJob *job = copy_job_new(NULL);
+    GError *err = NULL;
+    job->direct_io = direct_io;
+    job->verify = verify;
+
+    struct stat st;
+    gchar *dst_dir = g_path_get_dirname(dst);
+    struct stat dst_st;
+    if (lstat(src, &st) == 0 && S_ISREG(st.st_mode) && st.st_size >= COPY_RANGED_MIN_SIZE &&
+        stat(dst_dir, &dst_st) == 0) {
+        guint streams;
+        guint64 chunk;
+        copy_plan_ranges(&st, dst_st.st_dev, &streams, &chunk);
+        const DeviceInfo *info = device_probe(st.st_dev);
+        g_print("ranged copy: %u stream(s), %" G_GUINT64_FORMAT " MiB chunks, source %s (%s)%s\n",
+                streams, chunk >> 20, info->name ? info->name : "unknown",
+                info->rotational ? "rotational" : "solid-state", direct_io ? ", O_DIRECT" : "");
+    }
+    g_free(dst_dir);
+
+    sync();
+    copy_bench_drop_cache(src);
+    gint64 start = g_get_monotonic_time();
+    gboolean ok = copy_engine_copy(src, dst, job, &err);
+    sync();
+    gdouble engine_s = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+    if (!ok) {
+        g_printerr("copy engine failed: %s\n", err->message);
+        g_error_free(err);
+        copy_job_free(job);
+        return 1;
+    }
+    for (guint i = 0; i < job->errors->len; ++i)
+        g_printerr("%s\n", (const gchar *)g_ptr_array_index(job->errors, i));
+
+    g_print("engine: %u files, %" G_GUINT64_FORMAT " bytes in %.3f s (%.1f MB/s, %.0f files/s)\n",
+            job->files_done, job->bytes_done, engine_s,
+            job->bytes_done / 1e6 / engine_s, job->files_done / engine_s);
+    if (verify) {
+        gchar *report = copy_job_verify_report(job);
+        g_print("%s\n", report);
+        g_free(report);
+    }
+
+    gchar *cp_dst = g_strconcat(dst, ".cp-a", NULL);
+    gchar *argv[] = { "cp", "-a", (gchar *)src, cp_dst, NULL };
+    gint status = 0;
+    copy_bench_drop_cache(src);
+    start = g_get_monotonic_time();
+    ok = g_spawn_sync(NULL, argv, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, &status, &err);
+    sync();
+    gdouble cp_s = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+    if (ok && g_spawn_check_wait_status(status, &err)) {
+        g_print("cp -a:  %.3f s (engine is %.2fx)\n", cp_s, cp_s / engine_s);
+    } else {
+        g_printerr("cp -a failed: %s\n", err->message);
+        g_error_free(err);
+    }
+
+    g_free(cp_dst);
+    copy_job_free(job);
+    return 0;
+}
+
+// Copies the tree src to dst.sequential and dst.parallel, reading from a
+// cold cache each time, and reports what the device-based plan would pick.
+// Run it once against a spinning disk and once against flash.
+static int run_copy_order_benchmark(const gchar *src, const gchar *dst)
+{
+    struct stat st;
+    if (lstat(src, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        g_printerr("%s is not a directory\n", src);
+        return 1;
+    }
+    const DeviceInfo *info = device_probe(st.st_dev);
+    CopyOrder planned = COPY_ORDER_AUTO;
+    guint workers = copy_plan_tree(&st, dst, &planned);
+    g_print("source %s (%s, queue depth %u): plan is %s with %u worker(s)\n",
+            info->name ? info->name : "unknown", info->rotational ? "rotational" : "solid-state",
+            info->queue_depth, planned == COPY_ORDER_SEQUENTIAL ? "sequential" : "parallel", workers);
+
+    static const struct { CopyOrder order; const gchar *name; } runs[] = {
+        { COPY_ORDER_SEQUENTIAL, "sequential" },
+        { COPY_ORDER_PARALLEL, "parallel" },
+    };
+    for (guint i = 0; i < G_N_ELEMENTS(runs); ++i) {
+        gchar *target = g_strdup_printf("%s.%s", dst, runs[i].name);
+        CopyJob *job = copy_job_new(NULL);
+        job->order = runs[i].order;
+        GError *err = NULL;
+
+        sync();
+        copy_bench_drop_cache(src);
+        gint64 start = g_get_monotonic_time();
+        gboolean ok = copy_engine_copy(src, target, job, &err);
+        sync();
+        gdouble s = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+        if (ok) {
+            g_print("%-10s %u files, %" G_GUINT64_FORMAT " bytes in %.3f s (%.1f MB/s, %.0f files/s)\n",
+                    runs[i].name, job->files_done, job->bytes_done, s, job->bytes_done / 1e6 / s, job->files_done / s);
+        } else {
+            g_printerr("%s copy failed: %s\n", runs[i].name, err->message);
+            g_error_free(err);
+        }
+        copy_job_free(job);
+        g_free(target);
+    }
+    return 0;
+}
+
+// --- Directory Handles ---
+// The browser holds an O_PATH descriptor for the directory it shows and
+// works relative to it with the *at() calls, so names are resolved one
+// component at a time and a rename of an ancestor does not pull the
+// directory out from under an operation. Recently visited directories are
+// kept open in a small cache, so going back up or into a sibling reuses
+// the descriptor instead of looking the name up again.
+
+#define DIR_CACHE_SIZE 8
+
+// A cached lookup of name in the directory parent_dev/parent_ino. It holds
+// while the parent's stamp is unchanged: its mtime, which any entry added,
+// removed or renamed in it moves, or for ".." its ctime, which moving the
+// directory itself moves.
+typedef struct {
+    int fd;
+    dev_t parent_dev;
+    ino_t parent_ino;
+    gchar *name;
+    struct timespec stamp;
+    gint64 cached_at; // Wall clock, to spot stamps too recent to trust
+    gint64 used;
+} DirHandle;
+
+static DirHandle dir_cache[DIR_CACHE_SIZE] = { [0 ... DIR_CACHE_SIZE - 1] = { .fd = -1 } };
+
+// Returns a new O_PATH descriptor for the directory name beneath
+// parent_fd, or -1 with errno set. A cached lookup is reused after a
+// single fstat() of the parent, without resolving name again. A stamp
+// from within a second of caching is not trusted, since a change in the
+// same clock tick would leave it as it was.
+static int dir_handle_openat(int parent_fd, const gchar *name)
+{
+    struct stat pst;
+    gboolean dotdot = g_strcmp0(name, "..") == 0;
+    gboolean have_parent = fstat(parent_fd, &pst) == 0;
+    struct timespec stamp = dotdot ? pst.st_ctim : pst.st_mtim;
+
+    DirHandle *slot = &dir_cache[0];
+    for (guint i = 0; have_parent && i < DIR_CACHE_SIZE; ++i) {
+        DirHandle *h = &dir_cache[i];
+        if (h->fd >= 0 && h->parent_dev == pst.st_dev && h->parent_ino == pst.st_ino &&
+            g_strcmp0(h->name, name) == 0) {
+            gint64 stamp_us = (gint64)stamp.tv_sec * G_USEC_PER_SEC + stamp.tv_nsec / 1000;
+            if (h->stamp.tv_sec == stamp.tv_sec && h->stamp.tv_nsec == stamp.tv_nsec &&
+                stamp_us < h->cached_at - G_USEC_PER_SEC) {
+                h->used = g_get_monotonic_time();
+                return fcntl(h->fd, F_DUPFD_CLOEXEC, 0);
+            }
+            slot = h; // Stale: refresh this entry in place
+            break;
+        }
+        if (h->used < slot->used) slot = h;
+    }
+
+    int fd = openat(parent_fd, name, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || !have_parent) return fd;
+
+    // Replace the stale or least recently used entry
+    if (slot->fd >= 0) close(slot->fd);
+    g_free(slot->name);
+    slot->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    slot->parent_dev = pst.st_dev;
+    slot->parent_ino = pst.st_ino;
+    slot->name = g_strdup(name);
+    slot->stamp = stamp;
+    slot->cached_at = g_get_real_time();
+    slot->used = g_get_monotonic_time();
+    return fd;
+}
+
+// The current path of an open directory, which follows renames of any of
+// its ancestors. NULL if the kernel cannot tell or the directory has been
+// removed.
+static gchar* dir_handle_path(int fd)
+{
+    gchar *link = g_strdup_printf("/proc/self/fd/%d", fd);
+    gchar *path = g_file_read_link(link, NULL);
+    g_free(link);
+    struct stat st, path_st;
+    if (path && (!g_path_is_absolute(path) || fstat(fd, &st) != 0 || stat(path, &path_st) != 0 ||
+                 st.st_dev != path_st.st_dev || st.st_ino != path_st.st_ino))
+        g_clear_pointer(&path, g_free);
+    return path;
+}
+
+// Reads a whole regular file relative to dirfd. The stat of the opened
+// file is returned too, so no second lookup is needed for its metadata.
+static gboolean read_file_at(int dirfd, const gchar *name, gchar **contents, gsize *length,
+                             struct stat *st, GError **error)
+{
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return set_errno_error(error, "Cannot open file");
+    if (fstat(fd, st) != 0) {
+        close(fd);
+        return set_errno_error(error, "Cannot stat file");
+    }
+
+    GString *buf = g_string_sized_new(st->st_size + 1);
+    gchar chunk[65536];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof chunk)) != 0) {
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            set_errno_error(error, "Read failed");
+            g_string_free(buf, TRUE);
+            close(fd);
+            return FALSE;
+        }
+        g_string_append_len(buf, chunk, n);
+    }
+    close(fd);
+    *length = buf->len;
+    *contents = g_string_free(buf, FALSE);
+    return TRUE;
+}
+
+// Makes fd a reflink of name and then rewrites only the blocks where data
+// differs, so the result shares every unchanged extent with name. Sets
+// *cloned to FALSE, leaving fd untouched, when no reflink could be made.
+static gboolean write_over_clone(int dirfd, const gchar *name, int fd, const gchar *data, gsize len,
+                                 gboolean *cloned, GError **error)
+{
+    int src = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    *cloned = src >= 0 && ioctl(fd, FICLONE, src) == 0;
+    if (src >= 0) close(src);
+    if (!*cloned) return TRUE;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) return set_errno_error(error, "Cannot stat file");
+    gsize block = MAX(st.st_blksize, 4096);
+    gsize window = MAX(block, (1 << 20) / block * block);
+    guint8 *buf = g_malloc(window);
+    gboolean ok = TRUE;
+
+    for (gsize off = 0; ok && off < len; off += window) {
+        gsize n = MIN(window, len - off);
+        gsize have = 0;
+        while (have < n && off + have < (gsize)st.st_size) {
+            ssize_t r = pread(fd, buf + have, n - have, off + have);
+            if (r < 0 && errno == EINTR) continue;
+            if (r < 0) {
+                ok = set_errno_error(error, "Read failed");
+                break;
+            }
+            if (r == 0) break;
+            have += r;
+        }
+
+        // Adjacent changed blocks go out as one write
+        gsize run = n;
+        for (gsize b = 0; ok && b < n; b += block) {
+            gsize m = MIN(block, n - b);
+            gboolean same = b + m <= have && memcmp(buf + b, data + off + b, m) == 0;
+            if (!same && run == n) run = b;
+            if (run < n && (same || b + m == n)) {
+                gsize end = same ? b : b + m;
+                ok = pwrite_all(fd, data + off + run, end - run, off + run, error);
+                run = n;
+            }
+        }
+    }
+    g_free(buf);
+    if (ok && ftruncate(fd, len) != 0) ok = set_errno_error(error, "Cannot set file size");
+    return ok;
+}
+
+// Replaces name in dirfd atomically: the data goes to a temporary file in
+// the same directory, is flushed, and is renamed over the old file. The
+// old file's permissions are kept. Where the filesystem has reflinks the
+// temporary file starts as a clone of the old one and only changed blocks
+// are written, so the new file keeps sharing unchanged extents with the
+// old contents and with versions reflinked from them.
+static gboolean write_file_at(int dirfd, const gchar *name, const gchar *data, gsize len, GError **error)
+{
+    struct stat st;
+    gboolean exists = fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode);
+    mode_t mode = exists ? (st.st_mode & 07777) : 0644;
+    gchar *tmp = g_strdup_printf(".%s.fm-save-%d", name, (int)getpid());
+
+    int fd = openat(dirfd, tmp, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    gboolean ok = fd >= 0 || set_errno_error(error, "Cannot create temporary file");
+    gboolean cloned = FALSE;
+    if (ok && exists) ok = write_over_clone(dirfd, name, fd, data, len, &cloned, error);
+    if (ok && !cloned) ok = write_all(fd, data, len, error);
+    if (ok && fchmod(fd, mode) != 0) ok = set_errno_error(error, "Cannot set permissions");
+    if (ok && fsync(fd) != 0) ok = set_errno_error(error, "Cannot flush file");
+    if (fd >= 0 && close(fd) != 0 && ok) ok = set_errno_error(error, "Cannot finish file");
+    if (ok && renameat(dirfd, tmp, dirfd, name) != 0) ok = set_errno_error(error, "Cannot replace file");
+    if (!ok && fd >= 0) unlinkat(dirfd, tmp, 0);
+    g_free(tmp);
+    return ok;
+}
+
+// --- Create ---
+// Items are created relative to a directory descriptor with O_EXCL and
+// mkdirat(), so an existing item is reported by the creating call itself
+// instead of a separate check that another writer could race.
+
+static void set_create_error(GError **error)
+{
+    int saved = errno;
+    if (saved == EEXIST)
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "File or directory already exists.");
+    else
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(saved), "%s", g_strerror(saved));
+}
+
+// Returns an O_PATH descriptor for rel beneath dirfd, creating missing
+// directories on the way, or -1 on failure.
+static int open_parents_at(int dirfd, const gchar *rel, GError **error)
+{
+    int fd = openat(dirfd, ".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    gchar **parts = g_strsplit(rel, "/", -1);
+    for (guint i = 0; fd >= 0 && parts[i]; ++i) {
+        if (!*parts[i]) continue;
+        if (mkdirat(fd, parts[i], 0755) != 0 && errno != EEXIST) {
+            set_create_error(error);
+            close(fd);
+            fd = -1;
+            break;
+        }
+        int next = openat(fd, parts[i], O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (next < 0) set_create_error(error);
+        close(fd);
+        fd = next;
+    }
+    g_strfreev(parts);
+    if (fd < 0 && error && !*error) set_errno_error(error, "Cannot open directory");
+    return fd;
+}
+
+// Creates one empty file or directory named leaf in dirfd; never replaces.
+static gboolean create_at(int dirfd, const gchar *leaf, gboolean is_dir, GError **error)
+{
+    if (is_dir) {
+        if (mkdirat(dirfd, leaf, 0755) == 0) return TRUE;
+    } else {
+        int fd = openat(dirfd, leaf, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            close(fd);
+            return TRUE;
+        }
+    }
+    set_create_error(error);
+    return FALSE;
+}
+
+// Splits a name typed by the user into its parent part, its last
+// component and whether it asks for a directory (trailing "/" or "\").
+static gchar* create_split_name(const gchar *name, gchar **parent, gboolean *is_dir)
+{
+    gchar *trimmed = g_strdup(name);
+    gsize len = strlen(trimmed);
+    *is_dir = len > 0 && (trimmed[len - 1] == '/' || trimmed[len - 1] == '\\');
+    while (len > 0 && (trimmed[len - 1] == '/' || trimmed[len - 1] == '\\'))
+        trimmed[--len] = '\0';
+
+    gchar *slash = strrchr(trimmed, '/');
+    gchar *leaf = g_strdup(slash ? slash + 1 : trimmed);
+    *parent = slash ? g_strndup(trimmed, slash - trimmed) : g_strdup("");
+    g_free(trimmed);
+    return leaf;
+}
+
+// Creates name (which may contain directories) beneath dirfd.
+static gboolean create_path_at(int dirfd, const gchar *name, GError **error)
+{
+    gchar *parent;
+    gboolean is_dir;
+    gchar *leaf = create_split_name(name, &parent, &is_dir);
+    gboolean ok = FALSE;
+
+    if (!*leaf) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_FILENAME, "Invalid name");
+    } else {
+        int pfd = *parent ? open_parents_at(dirfd, parent, error) : dirfd;
+        if (pfd >= 0) ok = create_at(pfd, leaf, is_dir, error);
+        if (pfd >= 0 && pfd != dirfd) close(pfd);
+    }
+    g_free(parent);
+    g_free(leaf);
+    return ok;
+}
+
+// Creates every name of a list beneath dirfd in one pass. Parent
+// directories are resolved once and their descriptors reused, so each new
+// item costs a single openat() or mkdirat(). Failures are collected in
+// errors; returns the number of items created.
+static guint create_batch_at(int dirfd, gchar **names, GPtrArray *errors)
+{
+    GHashTable *parents = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    guint created = 0;
+
+    for (guint i = 0; names[i]; ++i) {
+        gchar *name = g_strstrip(g_strdup(names[i]));
+        gchar *parent;
+        gboolean is_dir;
+        gchar *leaf = create_split_name(name, &parent, &is_dir);
+        GError *err = NULL;
+
+        if (*leaf) {
+            int pfd = dirfd;
+            if (*parent) {
+                gpointer cached;
+                if (g_hash_table_lookup_extended(parents, parent, NULL, &cached)) {
+                    pfd = GPOINTER_TO_INT(cached);
+                } else {
+                    pfd = open_parents_at(dirfd, parent, &err);
+                    g_hash_table_insert(parents, g_strdup(parent), GINT_TO_POINTER(pfd));
+                }
+            }
+            if (pfd >= 0 && create_at(pfd, leaf, is_dir, &err)) created++;
+            if (err) {
+                g_ptr_array_add(errors, g_strdup_printf("%s: %s", name, err->message));
+                g_error_free(err);
+            } else if (pfd < 0) {
+                g_ptr_array_add(errors, g_strdup_printf("%s: Parent directory could not be created", name));
+            }
+        }
+        g_free(parent);
+        g_free(leaf);
+        g_free(name);
+    }
+
+    GHashTableIter iter;
+    gpointer fd;
+    g_hash_table_iter_init(&iter, parents);
+    while (g_hash_table_iter_next(&iter, NULL, &fd))
+        if (GPOINTER_TO_INT(fd) >= 0) close(GPOINTER_TO_INT(fd));
+    g_hash_table_destroy(parents);
+    return created;
+}
+
+// --- Delete Engine ---
+// Deletes trees bottom-up with unlinkat() relative to open directory
+// descriptors, reading entries in large getdents64() batches. Directories
+// are spread over a pool of workers; each directory counts the children it
+// still has outstanding, and whichever thread removes the last one removes
+// the directory itself and then reports to its parent in turn.
+
+#define DELETE_WORKERS 8
+#define DELETE_DENTS_BUFFER (64 * 1024)
+
+typedef struct {
+    ino64_t d_ino;
+    off64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+} DeleteDirent;
+
+typedef struct {
+    GCancellable *cancellable;
+    GMutex lock;
+    GCond cond;
+    guint64 removed;
+    GPtrArray *errors; // Human readable per-item failures
+    GThreadPool *pool;
+    gboolean finished;
+    QosClass qos;
+} DeleteJob;
+
+typedef struct DeleteDir DeleteDir;
+struct DeleteDir {
+    DeleteDir *parent; // NULL for the sentinel standing for the caller's dirfd
+    gchar *name;       // Relative to parent->fd
+    gchar *path;       // For messages only
+    int fd;
+    gint pending;      // Children not yet removed, plus one while scanning
+    gint failed;       // Something beneath could not be removed
+    gboolean rescanned;
+};
+
+static DeleteJob* delete_job_new(GCancellable *cancellable)
+{
+    DeleteJob *job = g_new0(DeleteJob, 1);
+    job->cancellable = cancellable ? g_object_ref(cancellable) : g_cancellable_new();
+    job->qos = QOS_NORMAL;
+    g_mutex_init(&job->lock);
+    g_cond_init(&job->cond);
+    job->errors = g_ptr_array_new_with_free_func(g_free);
+    return job;
+}
+
+static void delete_job_free(DeleteJob *job)
+{
+    g_object_unref(job->cancellable);
+    g_mutex_clear(&job->lock);
+    g_cond_clear(&job->cond);
+    g_ptr_array_free(job->errors, TRUE);
+    g_free(job);
+}
+
+static void delete_job_add_removed(DeleteJob *job, guint64 n)
+{
+    g_mutex_lock(&job->lock);
+    job->removed += n;
+    g_mutex_unlock(&job->lock);
+}
+
+static void delete_job_add_error(DeleteJob *job, const gchar *dir, const gchar *name, const gchar *what)
+{
+    int e = errno;
+    gchar *path = name ? g_build_filename(dir, name, NULL) : g_strdup(dir);
+    g_mutex_lock(&job->lock);
+    g_ptr_array_add(job->errors, g_strdup_printf("%s: %s: %s", path, what, g_strerror(e)));
+    g_mutex_unlock(&job->lock);
+    g_free(path);
+}
+
+static guint64 delete_job_removed(DeleteJob *job)
+{
+    g_mutex_lock(&job->lock);
+    guint64 n = job->removed;
+    g_mutex_unlock(&job->lock);
+    return n;
+}
+
+static DeleteDir* delete_dir_new(DeleteDir *parent, const gchar *name)
+{
+    DeleteDir *d = g_new0(DeleteDir, 1);
+    d->parent = parent;
+    d->name = g_strdup(name);
+    d->path = parent->path ? g_build_filename(parent->path, name, NULL) : g_strdup(name);
+    d->fd = -1;
+    d->pending = 1;
+    return d;
+}
+
+static void delete_dir_release(DeleteJob *job, DeleteDir *d);
+
+// Unlinks everything in d that is not a directory. Subdirectories go to
+// the pool while a worker is idle; otherwise this thread takes them depth
+// first itself, which keeps the number of open descriptors bounded by
+// roughly workers times depth however wide the tree is.
+static void delete_dir_scan(DeleteJob *job, DeleteDir *d)
+{
+    gchar *buf = g_malloc(DELETE_DENTS_BUFFER);
+    GPtrArray *local = g_ptr_array_new();
+    long n;
+
+    while ((n = syscall(SYS_getdents64, d->fd, buf, DELETE_DENTS_BUFFER)) > 0) {
+        guint64 removed = 0;
+        for (long off = 0; off < n; ) {
+            DeleteDirent *de = (DeleteDirent *)(buf + off);
+            off += de->d_reclen;
+            if (g_strcmp0(de->d_name, ".") == 0 || g_strcmp0(de->d_name, "..") == 0) continue;
+
+            gboolean is_dir = de->d_type == DT_DIR;
+            if (!is_dir) {
+                if (unlinkat(d->fd, de->d_name, 0) == 0) {
+                    ++removed;
+                    continue;
+                }
+                struct stat st;
+                is_dir = errno == EISDIR ||
+                         (errno == EPERM && de->d_type == DT_UNKNOWN &&
+                          fstatat(d->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode));
+                if (!is_dir) {
+                    if (errno == ENOENT) continue;
+                    delete_job_add_error(job, d->path, de->d_name, "Cannot delete");
+                    g_atomic_int_set(&d->failed, TRUE);
+                    continue;
+                }
+            }
+            g_atomic_int_inc(&d->pending);
+            DeleteDir *child = delete_dir_new(d, de->d_name);
+            if (g_thread_pool_unprocessed(job->pool) < DELETE_WORKERS)
+                g_thread_pool_push(job->pool, child, NULL);
+            else
+                g_ptr_array_add(local, child);
+        }
+        delete_job_add_removed(job, removed);
+        if (g_cancellable_is_cancelled(job->cancellable)) break;
+    }
+    if (n < 0) {
+        delete_job_add_error(job, d->path, NULL, "Cannot read directory");
+        g_atomic_int_set(&d->failed, TRUE);
+    }
+    g_free(buf);
+
+    for (guint i = 0; i < local->len; ++i) {
+        DeleteDir *child = g_ptr_array_index(local, i);
+        if (!g_cancellable_is_cancelled(job->cancellable)) {
+            child->fd = openat(d->fd, child->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (child->fd >= 0) delete_dir_scan(job, child);
+            else delete_job_add_error(job, child->path, NULL, "Cannot open directory");
+        }
+        delete_dir_release(job, child);
+    }
+    g_ptr_array_free(local, TRUE);
+}
+
+// Drops one outstanding reference of d. The last one removes d itself and
+// passes on to its parent; reaching the sentinel wakes the caller.
+static void delete_dir_release(DeleteJob *job, DeleteDir *d)
+{
+    while (g_atomic_int_dec_and_test(&d->pending)) {
+        if (!d->parent) {
+            g_mutex_lock(&job->lock);
+            job->finished = TRUE;
+            g_cond_signal(&job->cond);
+            g_mutex_unlock(&job->lock);
+            return;
+        }
+
+        gboolean cancelled = g_cancellable_is_cancelled(job->cancellable);
+        if (d->fd < 0 && !cancelled) {
+            g_atomic_int_set(&d->failed, TRUE);
+        } else if (d->fd >= 0 && unlinkat(d->parent->fd, d->name, AT_REMOVEDIR) == 0) {
+            delete_job_add_removed(job, 1);
+        } else if (d->fd >= 0 && errno == ENOTEMPTY && !cancelled && !d->failed && !d->rescanned) {
+            // Entries can be skipped when a directory changes while it is
+            // read; look once more before giving up
+            d->rescanned = TRUE;
+            d->pending = 1;
+            lseek(d->fd, 0, SEEK_SET);
+            delete_dir_scan(job, d);
+            continue;
+        } else if (d->fd >= 0 && !(errno == ENOTEMPTY && (cancelled || d->failed))) {
+            delete_job_add_error(job, d->path, NULL, "Cannot delete directory");
+            g_atomic_int_set(&d->failed, TRUE);
+        }
+
+        DeleteDir *parent = d->parent;
+        if (g_atomic_int_get(&d->failed)) g_atomic_int_set(&parent->failed, TRUE);
+        if (d->fd >= 0) close(d->fd);
+        g_free(d->name);
+        g_free(d->path);
+        g_free(d);
+        d = parent;
+    }
+}
+
+static void delete_pool_worker(gpointer data, gpointer user_data)
+{
+    DeleteJob *job = user_data;
+    DeleteDir *d = data;
+    qos_apply_thread(job->qos);
+    if (!g_cancellable_is_cancelled(job->cancellable)) {
+        d->fd = openat(d->parent->fd, d->name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (d->fd >= 0) delete_dir_scan(job, d);
+        else delete_job_add_error(job, d->path, NULL, "Cannot open directory");
+    }
+    delete_dir_release(job, d);
+}
+
+// Removes name beneath dirfd and everything below it, without following
+// symlinks, on a pool of workers. Failures of individual entries are
+// collected in job->errors; FALSE is returned when name itself is still
+// there afterwards, or when the job was cancelled.
+static gboolean delete_tree_at(int dirfd, const gchar *name, DeleteJob *job, GError **error)
+{
+    if (unlinkat(dirfd, name, 0) == 0) {
+        delete_job_add_removed(job, 1);
+        return TRUE;
+    }
+    if (errno == ENOENT) return TRUE;
+    if (errno != EISDIR && errno != EPERM) return set_errno_error(error, "Cannot delete");
+
+    DeleteDir top = { NULL, NULL, NULL, dirfd, 1, FALSE, FALSE };
+    DeleteDir *root = delete_dir_new(&top, name);
+    job->finished = FALSE;
+    job->pool = g_thread_pool_new(delete_pool_worker, job, DELETE_WORKERS, job->qos == QOS_BACKGROUND, NULL);
+    g_thread_pool_push(job->pool, root, NULL);
+
+    g_mutex_lock(&job->lock);
+    while (!job->finished)
+        g_cond_wait(&job->cond, &job->lock);
+    g_mutex_unlock(&job->lock);
+    g_thread_pool_free(job->pool, FALSE, TRUE);
+    job->pool = NULL;
+
+    if (g_cancellable_set_error_if_cancelled(job->cancellable, error)) return FALSE;
+    if (top.failed) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Not everything in \"%s\" could be deleted", name);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Removes name beneath dirfd and everything below it, without following
+// symlinks. Each level is opened relative to its parent, so no path is
+// ever resolved from the root.
+static gboolean remove_tree_at(int dirfd, const gchar *name, GError **error)
+{
+    if (unlinkat(dirfd, name, 0) == 0 || errno == ENOENT) return TRUE;
+    if (errno != EISDIR && errno != EPERM) return set_errno_error(error, "Cannot delete");
+
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return set_errno_error(error, "Cannot open directory");
+    }
+    gboolean ok = TRUE;
+    struct dirent *de;
+    while (ok && (de = readdir(dir)) != NULL) {
+        if (g_strcmp0(de->d_name, ".") == 0 || g_strcmp0(de->d_name, "..") == 0) continue;
+        ok = remove_tree_at(fd, de->d_name, error);
+    }
+    closedir(dir);
+    return ok && (unlinkat(dirfd, name, AT_REMOVEDIR) == 0 || set_errno_error(error, "Cannot delete directory"));
+}
+
+static gboolean remove_tree(const gchar *path, GError **error)
+{
+    return remove_tree_at(AT_FDCWD, path, error);
+}
+
+// --- Move ---
+// Moves are a single renameat2() when source and target share a
+// filesystem. Across filesystems the item is copied by the copy engine to a
+// hidden partial name next to the target, renamed into place in one step
+// once complete, and only then deleted at the source.
+
+#define MOVE_PARTIAL_SUFFIX ".fm-partial"
+
+// Renames without ever replacing an existing target. Returns 0 or an errno
+// value; EXDEV means the caller has to copy instead.
+static int move_renameat(int src_dirfd, const gchar *src, int dst_dirfd, const gchar *dst)
+{
+    if (renameat2(src_dirfd, src, dst_dirfd, dst, RENAME_NOREPLACE) == 0) return 0;
+    if (errno != EINVAL && errno != ENOSYS) return errno;
+
+    // Filesystem without RENAME_NOREPLACE; check and rename instead
+    struct stat st;
+    if (fstatat(dst_dirfd, dst, &st, AT_SYMLINK_NOFOLLOW) == 0) return EEXIST;
+    return renameat(src_dirfd, src, dst_dirfd, dst) == 0 ? 0 : errno;
+}
+
+static int move_rename(const gchar *src, const gchar *dst)
+{
+    return move_renameat(AT_FDCWD, src, AT_FDCWD, dst);
+}
+
+static gchar* move_partial_path(const gchar *dst)
+{
+    gchar *dir = g_path_get_dirname(dst);
+    gchar *name = g_path_get_basename(dst);
+    gchar *partial_name = g_strconcat(".", name, MOVE_PARTIAL_SUFFIX, NULL);
+    gchar *partial = g_build_filename(dir, partial_name, NULL);
+    g_free(partial_name);
+    g_free(name);
+    g_free(dir);
+    return partial;
+}
+
+// Moves src to dst: a rename when possible, otherwise copy, rename the
+// finished copy into place and delete the source. The source is kept if
+// anything inside it failed to copy. A journaled move that already reached
+// its target only finishes deleting the source.
+static gboolean move_path(const gchar *src, const gchar *dst, CopyJob *job, GError **error)
+{
+    if (!copy_journal_is_moved(job->journal, src)) {
+        struct stat st;
+        int e = move_rename(src, dst);
+        if (e == 0) return TRUE;
+        if (e == ENOENT && copy_job_resuming(job) && lstat(dst, &st) == 0)
+            return TRUE; // Renamed before the interruption
+        if (e != EXDEV) {
+            errno = e;
+            return set_errno_error(error, "Cannot move");
+        }
+
+        // A journaled move keeps its partial copy to resume into later
+        gchar *partial = move_partial_path(dst);
+        guint errors_before = job->errors->len;
+        gboolean copied = copy_engine_copy(src, partial, job, error);
+        if (copied && job->errors->len != errors_before) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_PARTIAL_INPUT,
+                        "Not everything could be copied; the source was kept");
+            copied = FALSE;
+        }
+        if (!copied) {
+            if (!job->journal) remove_tree(partial, NULL);
+            g_free(partial);
+            return FALSE;
+        }
+        e = move_rename(partial, dst);
+        g_free(partial);
+        if (e != 0) {
+            errno = e;
+            return set_errno_error(error, "Cannot move into place");
+        }
+        copy_journal_set_moved(job->journal, src);
+    }
+    return remove_tree(src, error);
+}
+
+// --- Staged Delete ---
+// A staged delete renames the item into a hidden staging directory on the
+// same filesystem, a single metadata update however large the tree, and
+// leaves the removal itself to a reclaimer thread running at idle I/O and
+// CPU priority. Until the reclaimer takes an item it can be put back. Every
+// staged item has a record beside it naming where it came from, written
+// before the rename, so staged items are picked up again after a restart.
+// The instance that owns an item holds an flock on its record, so a second
+// running instance leaves it alone.
+
+#define STAGING_DIR_PREFIX ".owltech-fm-staging-"
+#define STAGING_RECORD_MAGIC "FMSTAGED1"
+#define STAGING_GRACE_SECONDS 120
+typedef struct {
+    gchar *staging;    // Staging directory holding the item
+    gchar *id;         // Name of the item inside it; the record is id.staged
+    gchar *origin;     // Full path the item was deleted from
+    gint64 staged_at;  // Unix time; reclaimed STAGING_GRACE_SECONDS later
+    gint64 batch;      // Items deleted together are undone together
+    gboolean undoable; // FALSE once a reclaim was started, even before a restart
+    int lock_fd;       // Record, flocked while this instance owns the item
+} StagedItem;
+
+static GMutex staging_lock;
+static GCond staging_cond;
+static GQueue staging_items = G_QUEUE_INIT; // StagedItem, oldest first
+static GThread *staging_thread = NULL;
+
+static void staged_item_free(StagedItem *item)
+{
+    g_free(item->staging);
+    g_free(item->id);
+    g_free(item->origin);
+    if (item->lock_fd >= 0) close(item->lock_fd);
+    g_free(item);
+}
+
+static gint staged_item_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const StagedItem *x = a, *y = b;
+    return x->staged_at < y->staged_at ? -1 : x->staged_at > y->staged_at;
+}
+
+static gchar* staging_record_path(const StagedItem *item, const gchar *suffix)
+{
+    gchar *name = g_strconcat(item->id, suffix, NULL);
+    gchar *path = g_build_filename(item->staging, name, NULL);
+    g_free(name);
+    return path;
+}
+
+static gchar* staging_home_dir(void)
+{
+    return g_build_filename(g_get_user_state_dir(), "owltech-fm", "staging", NULL);
+}
+
+// Staging directories outside the home filesystem are listed here so they
+// are found again at startup.
+static gchar* staging_list_path(void)
+{
+    return g_build_filename(g_get_user_state_dir(), "owltech-fm", "staging-dirs", NULL);
+}
+
+static GPtrArray* staging_known_dirs(void)
+{
+    GPtrArray *dirs = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(dirs, staging_home_dir());
+
+    gchar *list = staging_list_path();
+    gchar *contents = NULL;
+    if (g_file_get_contents(list, &contents, NULL, NULL)) {
+        gchar **lines = g_strsplit(contents, "\n", -1);
+        for (gchar **l = lines; *l; ++l)
+            if (**l) g_ptr_array_add(dirs, g_strdup(*l));
+        g_strfreev(lines);
+    }
+    g_free(contents);
+    g_free(list);
+    return dirs;
+}
+
+static void staging_register_dir(const gchar *dir)
+{
+    GPtrArray *known = staging_known_dirs();
+    gboolean found = FALSE;
+    for (guint i = 0; i < known->len && !found; ++i)
+        found = g_strcmp0(g_ptr_array_index(known, i), dir) == 0;
+    g_ptr_array_free(known, TRUE);
+    if (found) return;
+
+    gchar *list = staging_list_path();
+    FILE *f = fopen(list, "a");
+    if (f) {
+        fprintf(f, "%s\n", dir);
+        fclose(f);
+    }
+    g_free(list);
+}
+
+// Returns the topmost ancestor of path that is still on device dev, i.e.
+// where that filesystem is mounted (as seen through path).
+static gchar* filesystem_top(const gchar *path, dev_t dev)
+{
+    struct stat st;
+    gchar *top = g_strdup(path);
+    for (;;) {
+        gchar *parent = g_path_get_dirname(top);
+        if (g_strcmp0(parent, top) == 0 || stat(parent, &st) != 0 || st.st_dev != dev) {
+            g_free(parent);
+            return top;
+        }
+        g_free(top);
+        top = parent;
+    }
+}
+
+// Finds or creates a staging directory on device dev: the one under the
+// state directory when that is on the same filesystem, otherwise a hidden
+// per-user one at the top of the filesystem holding origin_dir.
+static gchar* staging_dir_for(dev_t dev, const gchar *origin_dir, GError **error)
+{
+    struct stat st;
+    gchar *home = staging_home_dir();
+    if (g_mkdir_with_parents(home, 0700) == 0 && stat(home, &st) == 0 && st.st_dev == dev)
+        return home;
+    g_free(home);
+
+    if (stat(origin_dir, &st) != 0 || st.st_dev != dev) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "The item is a mount point");
+        return NULL;
+    }
+    gchar *top = filesystem_top(origin_dir, dev);
+    gchar *name = g_strdup_printf(STAGING_DIR_PREFIX "%u", (guint)getuid());
+    gchar *dir = g_build_filename(top, name, NULL);
+    g_free(name);
+    g_free(top);
+
+    // Never trust an existing directory someone else could have planted
+    if ((mkdir(dir, 0700) != 0 && errno != EEXIST) || lstat(dir, &st) != 0) {
+        set_errno_error(error, "Cannot create staging directory");
+        g_free(dir);
+        return NULL;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || st.st_dev != dev) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED, "Unsafe staging directory %s", dir);
+        g_free(dir);
+        return NULL;
+    }
+    staging_register_dir(dir);
+    return dir;
+}
+
+// Takes the oldest item once its grace period is over, marks it as no
+// longer undoable on disk and removes it at idle priority.
+static gpointer staging_reclaim_thread(gpointer data)
+{
+    qos_apply_thread(QOS_BACKGROUND);
+
+    for (;;) {
+        g_mutex_lock(&staging_lock);
+        StagedItem *item;
+        for (;;) {
+            item = g_queue_peek_head(&staging_items);
+            if (!item) {
+                g_cond_wait(&staging_cond, &staging_lock);
+                continue;
+            }
+            gint64 wait = item->staged_at + STAGING_GRACE_SECONDS - g_get_real_time() / G_USEC_PER_SEC;
+            if (wait <= 0) break;
+            g_cond_wait_until(&staging_cond, &staging_lock, g_get_monotonic_time() + wait * G_TIME_SPAN_SECOND);
+        }
+        g_queue_pop_head(&staging_items);
+        g_mutex_unlock(&staging_lock);
+
+        gchar *staged = staging_record_path(item, ".staged");
+        gchar *reclaim = staging_record_path(item, ".reclaim");
+        if (item->undoable) rename(staged, reclaim);
+
+        GError *err = NULL;
+        int fd = open(item->staging, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0 || !remove_tree_at(fd, item->id, &err)) {
+            g_warning("Cannot reclaim %s from %s: %s", item->origin, item->staging,
+                      err ? err->message : g_strerror(errno));
+            g_clear_error(&err);
+        } else {
+            unlink(reclaim);
+        }
+        if (fd >= 0) close(fd);
+        g_free(staged);
+        g_free(reclaim);
+        staged_item_free(item);
+    }
+    return NULL;
+}
+
+static void staging_enqueue(StagedItem *item)
+{
+    g_mutex_lock(&staging_lock);
+    g_queue_insert_sorted(&staging_items, item, staged_item_compare, NULL);
+    if (!staging_thread)
+        staging_thread = g_thread_new("fm-reclaim", staging_reclaim_thread, NULL);
+    g_cond_signal(&staging_cond);
+    g_mutex_unlock(&staging_lock);
+}
+
+// Moves name beneath dirfd, whose full path is origin_dir, into staging as
+// part of batch. Fails without touching the item when no staging directory
+// on its filesystem can be used; the caller then deletes it for real.
+static gboolean staging_stage(int dirfd, const gchar *name, const gchar *origin_dir, gint64 batch, GError **error)
+{
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return set_errno_error(error, "Cannot stat");
+    gchar *staging = staging_dir_for(st.st_dev, origin_dir, error);
+    if (!staging) return FALSE;
+
+    gchar *record = g_build_filename(staging, "XXXXXX.staged", NULL);
+    int fd = mkstemps(record, strlen(".staged"));
+    int lock_fd = fd >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, 0) : -1;
+    FILE *f = lock_fd >= 0 && flock(lock_fd, LOCK_EX) == 0 ? fdopen(fd, "w") : NULL;
+    if (!f) {
+        set_errno_error(error, "Cannot create staging record");
+        if (fd >= 0) {
+            unlink(record);
+            close(fd);
+        }
+        if (lock_fd >= 0) close(lock_fd);
+        g_free(record);
+        g_free(staging);
+        return FALSE;
+    }
+
+    StagedItem *item = g_new0(StagedItem, 1);
+    item->lock_fd = lock_fd;
+    item->staging = staging;
+    gchar *base = g_path_get_basename(record);
+    item->id = g_strndup(base, strlen(base) - strlen(".staged"));
+    g_free(base);
+    item->origin = g_build_filename(origin_dir, name, NULL);
+    item->staged_at = g_get_real_time() / G_USEC_PER_SEC;
+    item->batch = batch;
+    item->undoable = TRUE;
+
+    gchar *escaped = g_strescape(item->origin, NULL);
+    fprintf(f, STAGING_RECORD_MAGIC "\t%s\t%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT "\n",
+            escaped, item->staged_at, item->batch);
+    g_free(escaped);
+    gboolean written = fflush(f) == 0 && fdatasync(fd) == 0;
+    fclose(f);
+
+    int sfd = open(staging, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int e = !written ? EIO : sfd < 0 ? errno : move_renameat(dirfd, name, sfd, item->id);
+    if (sfd >= 0) close(sfd);
+    if (e != 0) {
+        errno = e;
+        set_errno_error(error, "Cannot move into staging");
+        unlink(record);
+        g_free(record);
+        staged_item_free(item);
+        return FALSE;
+    }
+    g_free(record);
+    staging_enqueue(item);
+    return TRUE;
+}
+
+static gboolean staging_restore_item(StagedItem *item, GError **error)
+{
+    gchar *dir = g_path_get_dirname(item->origin);
+    gchar *name = g_path_get_basename(item->origin);
+    int dfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int sfd = open(item->staging, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int e = dfd < 0 || sfd < 0 ? errno : move_renameat(sfd, item->id, dfd, name);
+    if (dfd >= 0) close(dfd);
+    if (sfd >= 0) close(sfd);
+    g_free(dir);
+    g_free(name);
+
+    if (e != 0) {
+        errno = e;
+        return set_errno_error(error, e == EEXIST ? "Something else now exists at the original location" : "Cannot restore");
+    }
+    gchar *record = staging_record_path(item, ".staged");
+    unlink(record);
+    g_free(record);
+    return TRUE;
+}
+
+// Puts the most recently deleted batch back where it came from, as far as
+// the reclaimer has not taken it yet, never replacing anything created
+// there since. Returns the number of items restored; items that could not
+// be restored stay staged and are listed in error.
+static guint staging_undo_last(GError **error)
+{
+    GPtrArray *items = g_ptr_array_new();
+    g_mutex_lock(&staging_lock);
+    gint64 batch = 0;
+    for (GList *l = g_queue_peek_tail_link(&staging_items); l; l = l->prev) {
+        StagedItem *item = l->data;
+        if (item->undoable && item->batch > batch) batch = item->batch;
+    }
+    for (GList *l = g_queue_peek_head_link(&staging_items), *next; l; l = next) {
+        next = l->next;
+        StagedItem *item = l->data;
+        if (!item->undoable || item->batch != batch) continue;
+        g_ptr_array_add(items, item);
+        g_queue_delete_link(&staging_items, l);
+    }
+    g_mutex_unlock(&staging_lock);
+
+    if (items->len == 0) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "Nothing to undo; deleted items may already have been reclaimed.");
+        g_ptr_array_free(items, TRUE);
+        return 0;
+    }
+
+    guint restored = 0;
+    GString *failures = g_string_new(NULL);
+    for (guint i = 0; i < items->len; ++i) {
+        StagedItem *item = g_ptr_array_index(items, i);
+        GError *err = NULL;
+        if (staging_restore_item(item, &err)) {
+            ++restored;
+            staged_item_free(item);
+        } else {
+            g_string_append_printf(failures, "%s: %s\n", item->origin, err->message);
+            g_error_free(err);
+            staging_enqueue(item);
+        }
+    }
+    if (failures->len > 0)
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "%u item(s) could not be restored:\n%s",
+                    items->len - restored, failures->str);
+    g_string_free(failures, TRUE);
+    g_ptr_array_free(items, TRUE);
+    return restored;
+}
+
+// Requeues what earlier sessions left staged. Items whose reclaim had
+// already started are finished first and can no longer be undone. Records
+// locked by another running instance are skipped, as are records that were
+// restored or reclaimed between listing and locking them.
+static void staging_restore_pending(void)
+{
+    GPtrArray *dirs = staging_known_dirs();
+    for (guint i = 0; i < dirs->len; ++i) {
+        const gchar *staging = g_ptr_array_index(dirs, i);
+        GDir *d = g_dir_open(staging, 0, NULL);
+        const gchar *name;
+        while (d && (name = g_dir_read_name(d)) != NULL) {
+            gboolean reclaiming = g_str_has_suffix(name, ".reclaim");
+            if (!reclaiming && !g_str_has_suffix(name, ".staged")) continue;
+
+            gchar *record = g_build_filename(staging, name, NULL);
+            int lock_fd = open(record, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            struct stat st, lst;
+            if (lock_fd < 0 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0 || fstat(lock_fd, &st) != 0 ||
+                lstat(record, &lst) != 0 || st.st_dev != lst.st_dev || st.st_ino != lst.st_ino) {
+                if (lock_fd >= 0) close(lock_fd);
+                g_free(record);
+                continue;
+            }
+
+            StagedItem *item = g_new0(StagedItem, 1);
+            item->lock_fd = lock_fd;
+            item->staging = g_strdup(staging);
+            item->id = g_strndup(name, strrchr(name, '.') - name);
+            item->undoable = !reclaiming;
+
+            gchar *item_path = g_build_filename(staging, item->id, NULL);
+            gchar *contents = NULL;
+            gchar **fields = NULL;
+            if (g_file_get_contents(record, &contents, NULL, NULL))
+                fields = g_strsplit(g_strchomp(contents), "\t", 4);
+            if (fields && g_strv_length(fields) >= 3 && g_strcmp0(fields[0], STAGING_RECORD_MAGIC) == 0 &&
+                lstat(item_path, &st) == 0) {
+                item->origin = g_strcompress(fields[1]);
+                item->staged_at = reclaiming ? 0 : g_ascii_strtoll(fields[2], NULL, 10);
+                item->batch = fields[3] ? g_ascii_strtoll(fields[3], NULL, 10) : item->staged_at;
+                staging_enqueue(item);
+                item = NULL;
+            } else if (lstat(item_path, &st) != 0) {
+                // The rename into staging never happened
+                unlink(record);
+            }
+            if (item) staged_item_free(item);
+            g_strfreev(fields);
+            g_free(contents);
+            g_free(item_path);
+            g_free(record);
+        }
+        if (d) g_dir_close(d);
+    }
+    g_ptr_array_free(dirs, TRUE);
+}
+
+// --- Trash ---
+// Implements the freedesktop.org Trash specification. An item is trashed
+// into the trash of its own filesystem, so trashing is a rename: the home
+// trash under $XDG_DATA_HOME when the item lives there, otherwise
+// $topdir/.Trash/$uid or, when that cannot be used, $topdir/.Trash-$uid.
+// The .trashinfo file is created exclusively first, which reserves the
+// name, and the item is then renamed into files/ without replacing
+// anything. Sizes of trashed directories are cached in directorysizes.
+
+#define TRASH_INFO_SUFFIX ".trashinfo"
+#define TRASH_DIRSIZES "directorysizes"
+
+typedef struct {
+    gchar *path;   // Holds files/ and info/
+    gchar *topdir; // Path= values are relative to it; NULL for the home trash
+    int files_fd;
+    int info_fd;
+} TrashDir;
+
+typedef struct {
+    TrashDir *dir;  // Owned by the TrashScan
+    gchar *name;    // Inside files/; the record is info/name.trashinfo
+    gchar *origin;  // Absolute original path
+    gint64 deleted; // Unix time
+    guint64 size;   // Bytes allocated on disk
+} TrashEntry;
+
+typedef struct {
+    GPtrArray *dirs;    // TrashDir
+    GPtrArray *entries; // TrashEntry, newest first
+} TrashScan;
+
+static void trash_dir_free(TrashDir *t)
+{
+    if (t->files_fd >= 0) close(t->files_fd);
+    if (t->info_fd >= 0) close(t->info_fd);
+    g_free(t->path);
+    g_free(t->topdir);
+    g_free(t);
+}
+
+static void trash_entry_free(TrashEntry *e)
+{
+    g_free(e->name);
+    g_free(e->origin);
+    g_free(e);
+}
+
+static void trash_scan_free(TrashScan *scan)
+{
+    g_ptr_array_free(scan->entries, TRUE);
+    g_ptr_array_free(scan->dirs, TRUE);
+    g_free(scan);
+}
+
+// Opens (creating if asked) a trash directory. Trash directories that are
+// not ours, or are symlinks, are refused as the specification requires.
+static TrashDir* trash_dir_open(const gchar *path, const gchar *topdir, gboolean create, GError **error)
+{
+    gchar *files = g_build_filename(path, "files", NULL);
+    gchar *info = g_build_filename(path, "info", NULL);
+    struct stat st;
+    if (create && (g_mkdir_with_parents(files, 0700) != 0 || g_mkdir_with_parents(info, 0700) != 0)) {
+        set_errno_error(error, "Cannot create trash directory");
+    } else if (lstat(path, &st) != 0) {
+        set_errno_error(error, "Cannot open trash directory");
+    } else if (!S_ISDIR(st.st_mode) || st.st_uid != getuid()) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_PERMISSION_DENIED, "Unsafe trash directory %s", path);
+    } else {
+        TrashDir *t = g_new0(TrashDir, 1);
+        t->path = g_strdup(path);
+        t->topdir = g_strdup(topdir);
+        t->files_fd = open(files, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        t->info_fd = open(info, O_PATH | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        g_free(files);
+        g_free(info);
+        if (t->files_fd >= 0 && t->info_fd >= 0) return t;
+        set_errno_error(error, "Cannot open trash directory");
+        trash_dir_free(t);
+        return NULL;
+    }
+    g_free(files);
+    g_free(info);
+    return NULL;
+}
+
+static gchar* trash_home_path(void)
+{
+    return g_build_filename(g_get_user_data_dir(), "Trash", NULL);
+}
+
+// The per-user trashes under topdir, preferred first: $topdir/.Trash/$uid
+// when the administrator provided a sticky, non-symlink .Trash, then the
+// $topdir/.Trash-$uid fallback.
+static GPtrArray* trash_topdir_paths(const gchar *topdir)
+{
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    struct stat st;
+    gchar *shared = g_build_filename(topdir, ".Trash", NULL);
+    gchar *uid = g_strdup_printf("%u", (guint)getuid());
+    if (lstat(shared, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & S_ISVTX))
+        g_ptr_array_add(paths, g_build_filename(shared, uid, NULL));
+    gchar *name = g_strconcat(".Trash-", uid, NULL);
+    g_ptr_array_add(paths, g_build_filename(topdir, name, NULL));
+    g_free(name);
+    g_free(uid);
+    g_free(shared);
+    return paths;
+}
+
+// Finds the trash for an item on device dev inside origin_dir.
+static TrashDir* trash_dir_for(dev_t dev, const gchar *origin_dir, GError **error)
+{
+    struct stat st;
+    gchar *home = trash_home_path();
+    gchar *parent = g_path_get_dirname(home);
+    if (g_mkdir_with_parents(parent, 0700) == 0 && stat(parent, &st) == 0 && st.st_dev == dev) {
+        TrashDir *t = trash_dir_open(home, NULL, TRUE, error);
+        g_free(parent);
+        g_free(home);
+        return t;
+    }
+    g_free(parent);
+    g_free(home);
+
+    if (stat(origin_dir, &st) != 0 || st.st_dev != dev) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Mount points cannot be trashed");
+        return NULL;
+    }
+    gchar *top = filesystem_top(origin_dir, dev);
+    GPtrArray *paths = trash_topdir_paths(top);
+    TrashDir *t = NULL;
+    GError *err = NULL;
+    for (guint i = 0; i < paths->len && !t; ++i) {
+        g_clear_error(&err);
+        t = trash_dir_open(g_ptr_array_index(paths, i), top, TRUE, &err);
+    }
+    if (!t) g_propagate_error(error, err);
+    g_ptr_array_free(paths, TRUE);
+    g_free(top);
+    return t;
+}
+
+// Trashes name beneath dirfd, whose full path is origin_dir, into t.
+static gboolean trash_put(TrashDir *t, int dirfd, const gchar *name, const gchar *origin_dir, GError **error)
+{
+    gchar *origin = g_build_filename(origin_dir, name, NULL);
+    const gchar *stored = origin;
+    if (t->topdir && g_str_has_prefix(origin, t->topdir))
+        for (stored = origin + strlen(t->topdir); *stored == '/'; ++stored);
+    gchar *escaped = g_uri_escape_string(stored, "/", FALSE);
+    GDateTime *now = g_date_time_new_now_local();
+    gchar *date = g_date_time_format(now, "%Y-%m-%dT%H:%M:%S");
+    gchar *contents = g_strdup_printf("[Trash Info]\nPath=%s\nDeletionDate=%s\n", escaped, date);
+    g_date_time_unref(now);
+    g_free(date);
+    g_free(escaped);
+    g_free(origin);
+
+    gboolean ok = FALSE;
+    for (guint n = 1; !ok; ++n) {
+        gchar *trash_name = n == 1 ? g_strdup(name) : g_strdup_printf("%s.%u", name, n);
+        gchar *info_name = g_strconcat(trash_name, TRASH_INFO_SUFFIX, NULL);
+        int fd = openat(t->info_fd, info_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            g_free(info_name);
+            g_free(trash_name);
+            continue;
+        }
+        if (fd < 0 || write(fd, contents, strlen(contents)) != (ssize_t)strlen(contents)) {
+            set_errno_error(error, "Cannot write trash info");
+            if (fd >= 0) {
+                close(fd);
+                unlinkat(t->info_fd, info_name, 0);
+            }
+            g_free(info_name);
+            g_free(trash_name);
+            break;
+        }
+        close(fd);
+
+        int e = move_renameat(dirfd, name, t->files_fd, trash_name);
+        if (e == 0) {
+            ok = TRUE;
+        } else {
+            unlinkat(t->info_fd, info_name, 0);
+            if (e != EEXIST) { // A stray file without info holds the name
+                errno = e;
+                set_errno_error(error, "Cannot move to trash");
+                g_free(info_name);
+                g_free(trash_name);
+                break;
+            }
+        }
+        g_free(info_name);
+        g_free(trash_name);
+    }
+    g_free(contents);
+    return ok;
+}
+
+// Bytes allocated by name beneath dirfd and everything below it.
+static guint64 disk_usage_at(int dirfd, const gchar *name)
+{
+    struct stat st;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) return 0;
+    guint64 total = (guint64)st.st_blocks * 512;
+    if (!S_ISDIR(st.st_mode)) return total;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return total;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (g_strcmp0(de->d_name, ".") == 0 || g_strcmp0(de->d_name, "..") == 0) continue;
+        total += disk_usage_at(fd, de->d_name);
+    }
+    closedir(dir);
+    return total;
+}
+
+static gint trash_entry_newest_first(gconstpointer a, gconstpointer b)
+{
+    const TrashEntry *x = *(TrashEntry **)a, *y = *(TrashEntry **)b;
+    return x->deleted > y->deleted ? -1 : x->deleted < y->deleted;
+}
+
+typedef struct {
+    guint64 size;
+    gint64 mtime; // Of the .trashinfo file the size was computed for
+} TrashDirSize;
+
+// Reads the directorysizes cache of t: one "size mtime name" line for
+// each directory in files/, name percent-encoded.
+static GHashTable* trash_dir_sizes_load(TrashDir *t)
+{
+    GHashTable *sizes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    gchar *path = g_build_filename(t->path, TRASH_DIRSIZES, NULL);
+    gchar *contents = NULL;
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        gchar **lines = g_strsplit(contents, "\n", -1);
+        for (gchar **l = lines; *l; ++l) {
+            gchar **fields = g_strsplit(*l, " ", 3);
+            gchar *name = g_strv_length(fields) == 3 ? g_uri_unescape_string(fields[2], NULL) : NULL;
+            if (name) {
+                TrashDirSize *ds = g_new(TrashDirSize, 1);
+                ds->size = g_ascii_strtoull(fields[0], NULL, 10);
+                ds->mtime = g_ascii_strtoll(fields[1], NULL, 10);
+                g_hash_table_replace(sizes, name, ds);
+            }
+            g_strfreev(fields);
+        }
+        g_strfreev(lines);
+    }
+    g_free(contents);
+    g_free(path);
+    return sizes;
+}
+
+static void trash_dir_sizes_save(TrashDir *t, GHashTable *sizes)
+{
+    GString *out = g_string_new(NULL);
+    GHashTableIter iter;
+    gpointer key, value;
+    g_hash_table_iter_init(&iter, sizes);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        const TrashDirSize *ds = value;
+        gchar *escaped = g_uri_escape_string(key, NULL, FALSE);
+        g_string_append_printf(out, "%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT " %s\n", ds->size, ds->mtime, escaped);
+        g_free(escaped);
+    }
+    gchar *path = g_build_filename(t->path, TRASH_DIRSIZES, NULL);
+    g_file_set_contents(path, out->str, out->len, NULL); // Only a cache
+    g_free(path);
+    g_string_free(out, TRUE);
+}
+
+// Lists t. Directory sizes come from directorysizes while the .trashinfo
+// they were computed for is unchanged, so a listing only walks directories
+// trashed since the last one; the cache is rewritten when it changed.
+static void trash_scan_dir(TrashScan *scan, TrashDir *t)
+{
+    GHashTable *cached = trash_dir_sizes_load(t);
+    GHashTable *sizes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+    gboolean sizes_changed = FALSE;
+    gchar *info_dir = g_build_filename(t->path, "info", NULL);
+    GDir *d = g_dir_open(info_dir, 0, NULL);
+    const gchar *info_name;
+    while (d && (info_name = g_dir_read_name(d)) != NULL) {
+        if (!g_str_has_suffix(info_name, TRASH_INFO_SUFFIX)) continue;
+        gchar *name = g_strndup(info_name, strlen(info_name) - strlen(TRASH_INFO_SUFFIX));
+        struct stat st;
+        if (fstatat(t->files_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            g_free(name); // Info left behind by an interrupted trash or purge
+            continue;
+        }
+
+        gchar *info_path = g_build_filename(info_dir, info_name, NULL);
+        GKeyFile *kf = g_key_file_new();
+        gchar *path = NULL, *date = NULL;
+        if (g_key_file_load_from_file(kf, info_path, G_KEY_FILE_NONE, NULL)) {
+            path = g_key_file_get_string(kf, "Trash Info", "Path", NULL);
+            date = g_key_file_get_string(kf, "Trash Info", "DeletionDate", NULL);
+        }
+        g_key_file_free(kf);
+        g_free(info_path);
+
+        TrashEntry *e = g_new0(TrashEntry, 1);
+        e->dir = t;
+        e->name = name;
+        gchar *unescaped = path ? g_uri_unescape_string(path, NULL) : NULL;
+        if (!unescaped)
+            e->origin = g_strdup(name);
+        else if (g_path_is_absolute(unescaped) || !t->topdir)
+            e->origin = g_strdup(unescaped);
+        else
+            e->origin = g_build_filename(t->topdir, unescaped, NULL);
+        GTimeZone *tz = g_time_zone_new_local();
+        GDateTime *dt = date ? g_date_time_new_from_iso8601(date, tz) : NULL;
+        e->deleted = dt ? g_date_time_to_unix(dt) : st.st_ctime;
+        if (dt) g_date_time_unref(dt);
+        g_time_zone_unref(tz);
+        struct stat info_st;
+        if (!S_ISDIR(st.st_mode)) {
+            e->size = (guint64)st.st_blocks * 512;
+        } else if (fstatat(t->info_fd, info_name, &info_st, 0) == 0) {
+            TrashDirSize *known = g_hash_table_lookup(cached, name);
+            TrashDirSize *ds = g_new(TrashDirSize, 1);
+            if (known && known->mtime == info_st.st_mtime) {
+                *ds = *known;
+                g_hash_table_remove(cached, name);
+            } else {
+                ds->size = disk_usage_at(t->files_fd, name);
+                ds->mtime = info_st.st_mtime;
+                sizes_changed = TRUE;
+            }
+            g_hash_table_replace(sizes, g_strdup(name), ds);
+            e->size = ds->size;
+        } else {
+            e->size = disk_usage_at(t->files_fd, name);
+        }
+        g_ptr_array_add(scan->entries, e);
+
+        g_free(unescaped);
+        g_free(path);
+        g_free(date);
+    }
+    if (d) g_dir_close(d);
+    g_free(info_dir);
+
+    // Entries left in cached are gone or stale
+    if (sizes_changed || g_hash_table_size(cached) > 0) trash_dir_sizes_save(t, sizes);
+    g_hash_table_destroy(sizes);
+    g_hash_table_destroy(cached);
+}
+
+// Lists everything in the home trash and the trashes at the top of every
+// mounted filesystem.
+static TrashScan* trash_scan(void)
+{
+    TrashScan *scan = g_new0(TrashScan, 1);
+    scan->dirs = g_ptr_array_new_with_free_func((GDestroyNotify)trash_dir_free);
+    scan->entries = g_ptr_array_new_with_free_func((GDestroyNotify)trash_entry_free);
+
+    GPtrArray *paths = g_ptr_array_new_with_free_func(g_free);
+    GPtrArray *tops = g_ptr_array_new_with_free_func(g_free);
+    g_ptr_array_add(paths, trash_home_path());
+    g_ptr_array_add(tops, NULL);
+
+    gchar *mounts = NULL;
+    if (g_file_get_contents("/proc/self/mounts", &mounts, NULL, NULL)) {
+        gchar **lines = g_strsplit(mounts, "\n", -1);
+        for (gchar **l = lines; *l; ++l) {
+            gchar **fields = g_strsplit(*l, " ", 3);
+            if (g_strv_length(fields) >= 2) {
+                gchar *top = g_strcompress(fields[1]); // Spaces come as \040
+                GPtrArray *candidates = trash_topdir_paths(top);
+                for (guint i = 0; i < candidates->len; ++i) {
+                    g_ptr_array_add(paths, g_strdup(g_ptr_array_index(candidates, i)));
+                    g_ptr_array_add(tops, g_strdup(top));
+                }
+                g_ptr_array_free(candidates, TRUE);
+                g_free(top);
+            }
+            g_strfreev(fields);
+        }
+        g_strfreev(lines);
+    }
+    g_free(mounts);
+
+    GHashTable *seen = g_hash_table_new(g_str_hash, g_str_equal);
+    for (guint i = 0; i < paths->len; ++i) {
+        const gchar *path = g_ptr_array_index(paths, i);
+        if (!g_hash_table_add(seen, (gpointer)path)) continue;
+        TrashDir *t = trash_dir_open(path, g_ptr_array_index(tops, i), FALSE, NULL);
+        if (!t) continue;
+        g_ptr_array_add(scan->dirs, t);
+        trash_scan_dir(scan, t);
+    }
+    g_hash_table_destroy(seen);
+    g_ptr_array_free(tops, TRUE);
+    g_ptr_array_free(paths, TRUE);
+
+    g_ptr_array_sort(scan->entries, trash_entry_newest_first);
+    return scan;
+}
+
+// Puts a trashed entry back at its original location, never replacing
+// anything that has appeared there since.
+static gboolean trash_restore(TrashEntry *e, GError **error)
+{
+    gchar *dir = g_path_get_dirname(e->origin);
+    gchar *name = g_path_get_basename(e->origin);
+    if (g_mkdir_with_parents(dir, 0755) != 0) {
+        set_errno_error(error, "Cannot recreate the original folder");
+        g_free(dir);
+        g_free(name);
+        return FALSE;
+    }
+    int dfd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int err = dfd < 0 ? errno : move_renameat(e->dir->files_fd, e->name, dfd, name);
+    if (dfd >= 0) close(dfd);
+    g_free(dir);
+    g_free(name);
+    if (err != 0) {
+        errno = err;
+        return set_errno_error(error, err == EEXIST ? "Something else now exists at the original location" : "Cannot restore");
+    }
+    gchar *info_name = g_strconcat(e->name, TRASH_INFO_SUFFIX, NULL);
+    unlinkat(e->dir->info_fd, info_name, 0);
+    g_free(info_name);
+    return TRUE;
+}
+
+// Deletes a trashed entry for good with the parallel delete engine. The
+// info file goes last, so an interruption never leaves an entry that is
+// listed nowhere.
+static gboolean trash_purge(TrashEntry *e, DeleteJob *job, GError **error)
+{
+    if (!delete_tree_at(e->dir->files_fd, e->name, job, error)) return FALSE;
+    gchar *info_name = g_strconcat(e->name, TRASH_INFO_SUFFIX, NULL);
+    unlinkat(e->dir->info_fd, info_name, 0);
+    g_free(info_name);
+    return TRUE;
+}
+
+// --- Bulk Rename ---
+// New names come from a regular expression replacement or a template, with
+// an optional case transform, and are turned into a plan before anything
+// is touched. The plan is checked as a whole: every new name must be valid,
+// no two entries may end up with the same name, and none may land on an
+// entry that stays. It is then ordered so that every rename targets a free
+// name: a chain (a -> b, b -> c) runs from its end, and a cycle (a -> b,
+// b -> a) is broken by parking one member under a temporary name. Renames
+// never replace anything, and a failure part way undoes what was done.
+
+#define RENAME_TEMP_PREFIX ".owltech-fm-rename-"
+
+typedef enum {
+    RENAME_CASE_KEEP,
+    RENAME_CASE_LOWER,
+    RENAME_CASE_UPPER,
+    RENAME_CASE_TITLE,
+} RenameCase;
+
+typedef struct {
+    GRegex *regex;       // Matches are replaced; NULL for a template
+    gchar *replacement;  // Regex replacement (\0, \1, \g<name>) or template
+    RenameCase case_mode;
+} RenameSpec;
+
+typedef struct {
+    gchar *from;
+    gchar *to;
+} RenameStep;
+
+typedef struct {
+    GPtrArray *steps;    // RenameStep in execution order, temporary moves included
+    GHashTable *renamed; // Old name -> final name; strings owned by steps
+} RenamePlan;
+
+static void rename_spec_free(RenameSpec *spec)
+{
+    if (spec->regex) g_regex_unref(spec->regex);
+    g_free(spec->replacement);
+    g_free(spec);
+}
+
+// find is a regular expression, or empty to use replacement as a template.
+static RenameSpec* rename_spec_new(const gchar *find, const gchar *replacement, RenameCase case_mode,
+                                   GError **error)
+{
+    RenameSpec *spec = g_new0(RenameSpec, 1);
+    spec->replacement = g_strdup(replacement);
+    spec->case_mode = case_mode;
+    if (find && *find) {
+        spec->regex = g_regex_new(find, G_REGEX_OPTIMIZE, 0, error);
+        if (!spec->regex || !g_regex_check_replacement(replacement, NULL, error)) {
+            rename_spec_free(spec);
+            return NULL;
+        }
+    }
+    return spec;
+}
+
+// Expands a template for one entry: {name} is the name without its
+// extension, {ext} the extension with its dot (or nothing), {n} a counter, {n:W} the
+// counter zero-padded to W digits and {n:W:S} one that starts at S rather
+// than 1, {date} the modification date and {date:FORMAT} the modification
+// time in strftime FORMAT. {{ and }} are literal braces.
+static gboolean rename_expand_template(const gchar *tmpl, int dirfd, const gchar *name, guint index,
+                                       GString *out, GError **error)
+{
+    const gchar *dot = strrchr(name, '.');
+    if (dot == name) dot = NULL; // A leading dot marks a hidden file, not an extension
+
+    for (const gchar *p = tmpl; *p; ) {
+        if ((p[0] == '{' && p[1] == '{') || (p[0] == '}' && p[1] == '}')) {
+            g_string_append_c(out, *p);
+            p += 2;
+            continue;
+        }
+        if (*p != '{') {
+            g_string_append_c(out, *p++);
+            continue;
+        }
+        const gchar *end = strchr(p, '}');
+        if (!end) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Unclosed \"{\" in the template");
+            return FALSE;
+        }
+        gchar *field = g_strndup(p + 1, end - p - 1);
+        gchar **parts = g_strsplit(field, ":", 3);
+        gboolean ok = TRUE;
+        if (g_strcmp0(parts[0], "name") == 0 && !parts[1]) {
+            g_string_append_len(out, name, dot ? dot - name : -1);
+        } else if (g_strcmp0(parts[0], "ext") == 0 && !parts[1]) {
+            if (dot) g_string_append(out, dot);
+        } else if (g_strcmp0(parts[0], "n") == 0) {
+            guint width = parts[1] ? (guint)g_ascii_strtoull(parts[1], NULL, 10) : 1;
+            guint64 start = parts[1] && parts[2] ? g_ascii_strtoull(parts[2], NULL, 10) : 1;
+            g_string_append_printf(out, "%0*" G_GUINT64_FORMAT, (int)MIN(width, 20), start + index);
+        } else if (g_strcmp0(parts[0], "date") == 0) {
+            // A format may itself contain colons
+            const gchar *format = strchr(field, ':') ? strchr(field, ':') + 1 : "%Y-%m-%d";
+            struct stat st;
+            if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+                ok = set_errno_error(error, "Cannot stat");
+            } else {
+                GDateTime *dt = g_date_time_new_from_unix_local(st.st_mtime);
+                gchar *text = g_date_time_format(dt, format);
+                g_date_time_unref(dt);
+                if (text) g_string_append(out, text);
+                else g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Bad date format \"%s\"", format);
+                ok = text != NULL;
+                g_free(text);
+            }
+        } else {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "Unknown field {%s}", field);
+            ok = FALSE;
+        }
+        g_strfreev(parts);
+        g_free(field);
+        if (!ok) return FALSE;
+        p = end + 1;
+    }
+    return TRUE;
+}
+
+static gchar* rename_apply_case(const gchar *s, RenameCase mode)
+{
+    if (mode == RENAME_CASE_LOWER) return g_utf8_strdown(s, -1);
+    if (mode == RENAME_CASE_UPPER) return g_utf8_strup(s, -1);
+    if (mode == RENAME_CASE_KEEP) return g_strdup(s);
+
+    // Title case: each run of letters and digits starts upper case
+    GString *out = g_string_new(NULL);
+    gboolean word_start = TRUE;
+    for (const gchar *p = s; *p; p = g_utf8_next_char(p)) {
+        gunichar c = g_utf8_get_char(p);
+        if (g_unichar_isalnum(c)) {
+            g_string_append_unichar(out, word_start ? g_unichar_totitle(c) : g_unichar_tolower(c));
+            word_start = FALSE;
+        } else {
+            g_string_append_unichar(out, c);
+            word_start = TRUE;
+        }
+    }
+    return g_string_free(out, FALSE);
+}
+
+// The new name for the index-th entry of a selection.
+static gchar* rename_spec_apply(const RenameSpec *spec, int dirfd, const gchar *name, guint index, GError **error)
+{
+    gchar *raw;
+    if (spec->regex) {
+        raw = g_regex_replace(spec->regex, name, -1, 0, spec->replacement, 0, error);
+        if (!raw) return NULL;
+    } else {
+        GString *out = g_string_new(NULL);
+        if (!rename_expand_template(spec->replacement, dirfd, name, index, out, error)) {
+            g_string_free(out, TRUE);
+            return NULL;
+        }
+        raw = g_string_free(out, FALSE);
+    }
+    gchar *result = rename_apply_case(raw, spec->case_mode);
+    g_free(raw);
+    return result;
+}
+
+static void rename_step_free(RenameStep *s)
+{
+    g_free(s->from);
+    g_free(s->to);
+    g_free(s);
+}
+
+static void rename_plan_free(RenamePlan *plan)
+{
+    g_hash_table_destroy(plan->renamed);
+    g_ptr_array_free(plan->steps, TRUE);
+    g_free(plan);
+}
+
+// Names in the directory, hidden ones included, for checking a plan
+// against.
+static GHashTable* rename_read_dir(int dirfd)
+{
+    GHashTable *names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        return names;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+        g_hash_table_add(names, g_strdup(de->d_name));
+    closedir(dir);
+    return names;
+}
+
+static gboolean rename_check_name(const gchar *name, GError **error)
+{
+    const gchar *problem = NULL;
+    if (!*name || g_strcmp0(name, ".") == 0 || g_strcmp0(name, "..") == 0) problem = "is not a valid name";
+    else if (strchr(name, '/')) problem = "contains \"/\"";
+    else if (strlen(name) > NAME_MAX) problem = "is too long";
+    else if (g_str_has_prefix(name, STAGING_DIR_PREFIX) || g_str_has_prefix(name, RENAME_TEMP_PREFIX) ||
+             g_strcmp0(name, VERSIONS_DIR_NAME) == 0)
+        problem = "is reserved";
+    if (!problem) return TRUE;
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_FILENAME, "\"%s\" %s", name, problem);
+    return FALSE;
+}
+
+// Checks and orders renaming names[i] to targets[i] within a directory
+// holding existing (see rename_read_dir). Entries whose name does not
+// change are left out.
+static RenamePlan* rename_plan_new(GHashTable *existing, GPtrArray *names, GPtrArray *targets, GError **error)
+{
+    GPtrArray *changed = g_ptr_array_new_with_free_func((GDestroyNotify)rename_step_free);
+    GHashTable *by_from = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable *by_to = g_hash_table_new(g_str_hash, g_str_equal);
+    gboolean ok = TRUE;
+
+    for (guint i = 0; ok && i < names->len; ++i) {
+        const gchar *from = g_ptr_array_index(names, i), *to = g_ptr_array_index(targets, i);
+        if (g_strcmp0(from, to) == 0) continue;
+        if (!(ok = rename_check_name(to, error))) break;
+        RenameStep *s = g_new0(RenameStep, 1);
+        s->from = g_strdup(from);
+        s->to = g_strdup(to);
+        g_ptr_array_add(changed, s);
+        g_hash_table_insert(by_from, s->from, s);
+    }
+    for (guint i = 0; ok && i < changed->len; ++i) {
+        RenameStep *s = g_ptr_array_index(changed, i);
+        RenameStep *other = g_hash_table_lookup(by_to, s->to);
+        if (other) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "\"%s\" and \"%s\" would both be named \"%s\"",
+                        other->from, s->from, s->to);
+            ok = FALSE;
+        } else if (g_hash_table_contains(existing, s->to) && !g_hash_table_contains(by_from, s->to)) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "\"%s\" would be renamed onto \"%s\", which stays",
+                        s->from, s->to);
+            ok = FALSE;
+        }
+        g_hash_table_insert(by_to, s->to, s);
+    }
+    if (!ok) {
+        g_hash_table_destroy(by_to);
+        g_hash_table_destroy(by_from);
+        g_ptr_array_free(changed, TRUE);
+        return NULL;
+    }
+
+    RenamePlan *plan = g_new0(RenamePlan, 1);
+    plan->steps = g_ptr_array_new_full(changed->len, (GDestroyNotify)rename_step_free);
+    plan->renamed = g_hash_table_new(g_str_hash, g_str_equal);
+    GHashTable *placed = g_hash_table_new(NULL, NULL);
+
+    // Chains: a step whose target no selected entry holds can go first,
+    // which frees its source name for the step renaming onto it, and so on
+    for (guint i = 0; i < changed->len; ++i) {
+        RenameStep *s = g_ptr_array_index(changed, i);
+        if (g_hash_table_contains(by_from, s->to)) continue;
+        for (RenameStep *cur = s; cur; cur = g_hash_table_lookup(by_to, cur->from)) {
+            g_ptr_array_add(plan->steps, cur);
+            g_hash_table_add(placed, cur);
+        }
+    }
+
+    // What is left forms cycles: park one member, run the cycle backwards
+    // from its name, then move the parked entry into place
+    guint temp_seq = 0;
+    for (guint i = 0; i < changed->len; ++i) {
+        RenameStep *s = g_ptr_array_index(changed, i);
+        if (g_hash_table_contains(placed, s)) continue;
+        gchar *temp = NULL;
+        do {
+            g_free(temp);
+            temp = g_strdup_printf(RENAME_TEMP_PREFIX "%d-%u", (int)getpid(), temp_seq++);
+        } while (g_hash_table_contains(existing, temp));
+
+        RenameStep *park = g_new0(RenameStep, 1);
+        park->from = g_strdup(s->from);
+        park->to = temp;
+        g_ptr_array_add(plan->steps, park);
+        g_hash_table_add(placed, s);
+        for (RenameStep *cur = g_hash_table_lookup(by_to, s->from); cur != s; cur = g_hash_table_lookup(by_to, cur->from)) {
+            g_ptr_array_add(plan->steps, cur);
+            g_hash_table_add(placed, cur);
+        }
+        g_free(s->from);
+        s->from = g_strdup(temp);
+        g_ptr_array_add(plan->steps, s);
+        g_hash_table_insert(plan->renamed, park->from, s->to);
+    }
+    for (guint i = 0; i < plan->steps->len; ++i) {
+        RenameStep *s = g_ptr_array_index(plan->steps, i);
+        if (!g_str_has_prefix(s->from, RENAME_TEMP_PREFIX) && !g_str_has_prefix(s->to, RENAME_TEMP_PREFIX))
+            g_hash_table_insert(plan->renamed, s->from, s->to);
+    }
+
+    // Every step now belongs to the plan
+    g_ptr_array_set_free_func(changed, NULL);
+    g_ptr_array_free(changed, TRUE);
+    g_hash_table_destroy(placed);
+    g_hash_table_destroy(by_to);
+    g_hash_table_destroy(by_from);
+    return plan;
+}
+
+// Runs the plan in dirfd. On failure or cancellation the renames already
+// done are undone in reverse, so the directory ends up as it started.
+// done counts finished steps for progress.
+static gboolean rename_plan_execute(RenamePlan *plan, int dirfd, GCancellable *cancellable, gint *done,
+                                    GError **error)
+{
+    guint i;
+    int e = 0;
+    for (i = 0; i < plan->steps->len && !g_cancellable_is_cancelled(cancellable); ++i) {
+        RenameStep *s = g_ptr_array_index(plan->steps, i);
+        if ((e = move_renameat(dirfd, s->from, dirfd, s->to)) != 0) break;
+        g_atomic_int_inc(done);
+    }
+    if (i == plan->steps->len) return TRUE;
+
+    if (e) {
+        RenameStep *s = g_ptr_array_index(plan->steps, i);
+        g_set_error(error, G_IO_ERROR, g_io_error_from_errno(e), "Cannot rename \"%s\" to \"%s\": %s",
+                    s->from, s->to, g_strerror(e));
+    } else {
+        g_cancellable_set_error_if_cancelled(cancellable, error);
+    }
+    guint stuck = 0;
+    while (i-- > 0) {
+        RenameStep *s = g_ptr_array_index(plan->steps, i);
+        if (move_renameat(dirfd, s->to, dirfd, s->from) != 0) stuck++;
+        g_atomic_int_add(done, -1);
+    }
+    if (stuck > 0)
+        g_prefix_error(error, "%u rename(s) could not be undone. ", stuck);
+    return FALSE;
+}
+
+// --- Checksums ---
+// Content digests of files and whole trees: SHA-256, BLAKE3 or XXH64.
+// Files are read in large sequential blocks and hashed by a pool with as
+// many workers as the device has I/O slots, one file each; a spinning disk
+// gets a single worker fed in on-disk order. BLAKE3 is a tree hash, so a
+// large file is also cut into subtrees that are hashed in parallel and
+// joined at the end. A digest is cached in a user.checksum.<algorithm>
+// xattr together with the size and mtime it was taken at, and is reused
+// only while both still match. Manifests use the sha256sum line format.
+
+#define BLAKE3_BLOCK_LEN 64
+#define BLAKE3_CHUNK_LEN 1024
+#define BLAKE3_MAX_DEPTH 54
+#define CHECKSUM_PIECE_SIZE (16 * 1024 * 1024)   // A complete BLAKE3 subtree: a power of two chunks
+#define CHECKSUM_TREE_MIN (64LL * 1024 * 1024)  // Smaller files are hashed in one piece
+#define CHECKSUM_XATTR_MAX 128
+
+typedef enum {
+    CHECKSUM_SHA256,
+    CHECKSUM_BLAKE3,
+    CHECKSUM_XXH64,
+    CHECKSUM_ALGORITHMS
+} ChecksumAlgorithm;
+
+static const struct {
+    const gchar *name;
+    const gchar *xattr;    // Cache attribute
+    const gchar *manifest; // Customary manifest name
+    guint hex_len;
+} checksum_info[CHECKSUM_ALGORITHMS] = {
+    { "SHA-256", "user.checksum.sha256", "SHA256SUMS", 64 },
+    { "BLAKE3", "user.checksum.blake3", "B3SUMS", 64 },
+    { "XXH64", "user.checksum.xxh64", "XXH64SUMS", 16 },
+};
+
+enum {
+    BLAKE3_CHUNK_START = 1 << 0,
+    BLAKE3_CHUNK_END = 1 << 1,
+    BLAKE3_PARENT = 1 << 2,
+    BLAKE3_ROOT = 1 << 3,
+};
+
+static const guint32 blake3_iv[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+
+static const guint8 blake3_permutation[16] = { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 };
+
+// A compression that has not been run yet: the last block of a chunk, or
+// a parent, which becomes a chaining value or the root output depending
+// on whether anything follows it.
+typedef struct {
+    guint32 cv[8];
+    guint32 block[16];
+    guint64 counter;
+    guint32 len;
+    guint32 flags;
+} Blake3Node;
+
+typedef struct {
+    guint32 cv[8];       // Of the chunk being hashed
+    guint64 chunk;       // Its index in the whole input
+    guint8 block[BLAKE3_BLOCK_LEN];
+    guint block_len;
+    guint blocks_done;   // Blocks of the chunk compressed so far
+    guint32 stack[BLAKE3_MAX_DEPTH][8]; // Complete subtrees to the left, largest first
+    guint stack_len;
+} Blake3;
+
+static inline guint32 blake3_rotr(guint32 x, int n)
+{
+    return (x >> n) | (x << (32 - n));
+}
+
+static inline void blake3_g(guint32 *s, int a, int b, int c, int d, guint32 x, guint32 y)
+{
+    s[a] += s[b] + x;
+    s[d] = blake3_rotr(s[d] ^ s[a], 16);
+    s[c] += s[d];
+    s[b] = blake3_rotr(s[b] ^ s[c], 12);
+    s[a] += s[b] + y;
+    s[d] = blake3_rotr(s[d] ^ s[a], 8);
+    s[c] += s[d];
+    s[b] = blake3_rotr(s[b] ^ s[c], 7);
+}
+
+static void blake3_compress(const guint32 cv[8], const guint32 block[16], guint64 counter, guint32 len,
+                            guint32 flags, guint32 out[16])
+{
+    guint32 s[16], m[16], t[16];
+    memcpy(s, cv, 8 * sizeof *s);
+    memcpy(s + 8, blake3_iv, 4 * sizeof *s);
+    s[12] = (guint32)counter;
+    s[13] = (guint32)(counter >> 32);
+    s[14] = len;
+    s[15] = flags;
+    memcpy(m, block, sizeof m);
+
+    for (int round = 0; round < 7; ++round) {
+        blake3_g(s, 0, 4, 8, 12, m[0], m[1]);
+        blake3_g(s, 1, 5, 9, 13, m[2], m[3]);
+        blake3_g(s, 2, 6, 10, 14, m[4], m[5]);
+        blake3_g(s, 3, 7, 11, 15, m[6], m[7]);
+        blake3_g(s, 0, 5, 10, 15, m[8], m[9]);
+        blake3_g(s, 1, 6, 11, 12, m[10], m[11]);
+        blake3_g(s, 2, 7, 8, 13, m[12], m[13]);
+        blake3_g(s, 3, 4, 9, 14, m[14], m[15]);
+        for (int i = 0; i < 16; ++i)
+            t[i] = m[blake3_permutation[i]];
+        memcpy(m, t, sizeof m);
+    }
+    for (int i = 0; i < 8; ++i) {
+        out[i] = s[i] ^ s[i + 8];
+        out[i + 8] = s[i + 8] ^ cv[i];
+    }
+}
+
+static void blake3_load_block(const guint8 *p, guint32 block[16])
+{
+    for (int i = 0; i < 16; ++i) {
+        guint32 v;
+        memcpy(&v, p + 4 * i, sizeof v);
+        block[i] = GUINT32_FROM_LE(v);
+    }
+}
+
+static void blake3_node_cv(const Blake3Node *n, guint32 cv[8])
+{
+    guint32 out[16];
+    blake3_compress(n->cv, n->block, n->counter, n->len, n->flags, out);
+    memcpy(cv, out, 8 * sizeof *cv);
+}
+
+static void blake3_parent_node(const guint32 left[8], const guint32 right[8], Blake3Node *n)
+{
+    memcpy(n->cv, blake3_iv, sizeof n->cv);
+    memcpy(n->block, left, 8 * sizeof *left);
+    memcpy(n->block + 8, right, 8 * sizeof *right);
+    n->counter = 0;
+    n->len = BLAKE3_BLOCK_LEN;
+    n->flags = BLAKE3_PARENT;
+}
+
+static void blake3_chunk_node(const Blake3 *h, Blake3Node *n)
+{
+    guint8 block[BLAKE3_BLOCK_LEN] = { 0 };
+    memcpy(block, h->block, h->block_len);
+    memcpy(n->cv, h->cv, sizeof n->cv);
+    blake3_load_block(block, n->block);
+    n->counter = h->chunk;
+    n->len = h->block_len;
+    n->flags = BLAKE3_CHUNK_END | (h->blocks_done == 0 ? BLAKE3_CHUNK_START : 0);
+}
+
+// Starts at chunk index first_chunk, which is 0 unless only a piece of a
+// larger input is hashed.
+static void blake3_init(Blake3 *h, guint64 first_chunk)
+{
+    memcpy(h->cv, blake3_iv, sizeof h->cv);
+    h->chunk = first_chunk;
+    h->block_len = 0;
+    h->blocks_done = 0;
+    h->stack_len = 0;
+}
+
+// Adds the chaining value of a complete subtree, the total'th of its size.
+// While that count is even, the subtree completes one twice its size with
+// its neighbour on the left, and the two are merged.
+static void blake3_push_cv(Blake3 *h, const guint32 cv[8], guint64 total)
+{
+    guint32 merged[8];
+    memcpy(merged, cv, sizeof merged);
+    for (; (total & 1) == 0; total >>= 1) {
+        Blake3Node n;
+        blake3_parent_node(h->stack[--h->stack_len], merged, &n);
+        blake3_node_cv(&n, merged);
+    }
+    memcpy(h->stack[h->stack_len++], merged, sizeof merged);
+}
+
+static void blake3_update(Blake3 *h, const void *data, gsize len)
+{
+    const guint8 *p = data;
+    while (len > 0) {
+        if (h->block_len == BLAKE3_BLOCK_LEN) {
+            if (h->blocks_done == BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN - 1) {
+                // The chunk is full and more input follows, so it is not the root
+                Blake3Node n;
+                guint32 cv[8];
+                blake3_chunk_node(h, &n);
+                blake3_node_cv(&n, cv);
+                blake3_push_cv(h, cv, ++h->chunk);
+                memcpy(h->cv, blake3_iv, sizeof h->cv);
+                h->blocks_done = 0;
+            } else {
+                guint32 block[16], out[16];
+                blake3_load_block(h->block, block);
+                blake3_compress(h->cv, block, h->chunk, BLAKE3_BLOCK_LEN,
+                                h->blocks_done == 0 ? BLAKE3_CHUNK_START : 0, out);
+                memcpy(h->cv, out, sizeof h->cv);
+                h->blocks_done++;
+            }
+            h->block_len = 0;
+        }
+        gsize take = MIN(len, BLAKE3_BLOCK_LEN - h->block_len);
+        memcpy(h->block + h->block_len, p, take);
+        h->block_len += take;
+        p += take;
+        len -= take;
+    }
+}
+
+// The node all input so far reduces to: the current chunk merged with the
+// subtrees to its left, nearest first.
+static void blake3_top_node(const Blake3 *h, Blake3Node *n)
+{
+    blake3_chunk_node(h, n);
+    for (guint i = h->stack_len; i-- > 0;) {
+        guint32 cv[8];
+        blake3_node_cv(n, cv);
+        blake3_parent_node(h->stack[i], cv, n);
+    }
+}
+
+static void blake3_finish(const Blake3 *h, guint8 digest[32])
+{
+    Blake3Node n;
+    guint32 out[16];
+    blake3_top_node(h, &n);
+    blake3_compress(n.cv, n.block, 0, n.len, n.flags | BLAKE3_ROOT, out);
+    for (int i = 0; i < 8; ++i) {
+        guint32 v = GUINT32_TO_LE(out[i]);
+        memcpy(digest + 4 * i, &v, sizeof v);
+    }
+}
+
+// Puts the chaining values of the leading pieces of an input, complete
+// subtrees of equal size, underneath the hasher that took the rest.
+static void blake3_join(Blake3 *rest, guint32 (*pieces)[8], guint npieces)
+{
+    Blake3 left;
+    blake3_init(&left, 0);
+    for (guint i = 0; i < npieces; ++i)
+        blake3_push_cv(&left, pieces[i], i + 1);
+    memmove(rest->stack + left.stack_len, rest->stack, rest->stack_len * sizeof rest->stack[0]);
+    memcpy(rest->stack, left.stack, left.stack_len * sizeof left.stack[0]);
+    rest->stack_len += left.stack_len;
+}
+
+static gchar* checksum_hex(const guint8 *digest, gsize len)
+{
+    static const gchar digits[] = "0123456789abcdef";
+    gchar *hex = g_malloc(2 * len + 1);
+    for (gsize i = 0; i < len; ++i) {
+        hex[2 * i] = digits[digest[i] >> 4];
+        hex[2 * i + 1] = digits[digest[i] & 15];
+    }
+    hex[2 * len] = '\0';
+    return hex;
+}
+
+typedef struct {
+    ChecksumAlgorithm algorithm;
+    GChecksum *sha256;
+    Blake3 blake3;
+    Xxh64State xxh64;
+} ChecksumState;
+
+static void checksum_state_init(ChecksumState *s, ChecksumAlgorithm algorithm, guint64 first_chunk)
+{
+    s->algorithm = algorithm;
+    s->sha256 = algorithm == CHECKSUM_SHA256 ? g_checksum_new(G_CHECKSUM_SHA256) : NULL;
+    if (algorithm == CHECKSUM_BLAKE3) blake3_init(&s->blake3, first_chunk);
+    if (algorithm == CHECKSUM_XXH64) xxh64_init(&s->xxh64, 0);
+}
+
+static void checksum_state_update(ChecksumState *s, const guint8 *data, gsize len)
+{
+    if (s->algorithm == CHECKSUM_SHA256) g_checksum_update(s->sha256, data, len);
+    else if (s->algorithm == CHECKSUM_BLAKE3) blake3_update(&s->blake3, data, len);
+    else xxh64_update(&s->xxh64, data, len);
+}
+
+// The digest in lowercase hex; s is used up.
+static gchar* checksum_state_finish(ChecksumState *s)
+{
+    if (s->algorithm == CHECKSUM_SHA256) {
+        gchar *hex = g_strdup(g_checksum_get_string(s->sha256));
+        g_checksum_free(s->sha256);
+        return hex;
+    }
+    if (s->algorithm == CHECKSUM_BLAKE3) {
+        guint8 digest[32];
+        blake3_finish(&s->blake3, digest);
+        return checksum_hex(digest, sizeof digest);
+    }
+    return g_strdup_printf("%016" G_GINT64_MODIFIER "x", xxh64_digest(&s->xxh64));
+}
+
+// The cached digest of fd, or NULL when there is none or the file's size
+// or mtime moved on since it was taken.
+static gchar* checksum_cache_get(int fd, const struct stat *st, ChecksumAlgorithm algorithm)
+{
+    gchar value[CHECKSUM_XATTR_MAX + 1], hex[CHECKSUM_XATTR_MAX + 1];
+    ssize_t n = fgetxattr(fd, checksum_info[algorithm].xattr, value, CHECKSUM_XATTR_MAX);
+    if (n <= 0) return NULL;
+    value[n] = '\0';
+
+    guint64 size;
+    gint64 sec;
+    long nsec;
+    if (sscanf(value, "%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT ".%ld %s", &size, &sec, &nsec, hex) != 4 ||
+        size != (guint64)st->st_size || sec != st->st_mtim.tv_sec || nsec != st->st_mtim.tv_nsec ||
+        strlen(hex) != checksum_info[algorithm].hex_len)
+        return NULL;
+    return g_strdup(hex);
+}
+
+// Best effort: without xattr support or write permission there is simply
+// no cache, which FALSE reports.
+static gboolean checksum_cache_set(int fd, const struct stat *st, ChecksumAlgorithm algorithm, const gchar *hex)
+{
+    gchar *value = g_strdup_printf("%" G_GUINT64_FORMAT " %" G_GINT64_FORMAT ".%09ld %s", (guint64)st->st_size,
+                                   (gint64)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec, hex);
+    gboolean ok = fsetxattr(fd, checksum_info[algorithm].xattr, value, strlen(value), 0) == 0;
+    g_free(value);
+    return ok;
+}
+
+typedef struct {
+    gchar *path;      // Relative to the job's directory
+    struct stat st;   // As found by the walk
+    guint64 offset;   // Physical, for reading a spinning disk in order
+    gchar *expected;  // From the manifest being verified, or NULL
+    gchar *digest;    // Hex, once hashed
+    gchar *error;     // Why there is no digest
+    // BLAKE3 only: leading pieces hashed apart from the rest of the file
+    guint npieces;
+    guint32 (*cvs)[8];
+    Blake3 *rest;
+    gint pending;     // Pieces plus the rest still to hash
+} ChecksumFile;
+
+typedef struct {
+    ChecksumAlgorithm algorithm;
+    int dir_fd;
+    gboolean use_cache;    // Trust cached digests; verification re-reads everything
+    QosClass qos;
+    GCancellable *cancellable;
+    GPtrArray *files;      // ChecksumFile
+    GPtrArray *errors;     // Entries the walk could not read
+    GMutex lock;
+    GCond cond;
+    guint64 bytes_done;
+    guint64 bytes_total;
+    guint outstanding;     // Tasks queued or running
+} ChecksumJob;
+
+typedef struct {
+    ChecksumFile *file;
+    guint piece; // file->npieces stands for the rest of the file
+} ChecksumTask;
+
+static GPrivate checksum_buffer = G_PRIVATE_INIT(g_free);
+
+static void checksum_file_free(ChecksumFile *f)
+{
+    g_free(f->path);
+    g_free(f->expected);
+    g_free(f->digest);
+    g_free(f->error);
+    g_free(f->cvs);
+    g_free(f->rest);
+    g_free(f);
+}
+
+static ChecksumJob* checksum_job_new(int dir_fd, ChecksumAlgorithm algorithm, GCancellable *cancellable)
+{
+    ChecksumJob *job = g_new0(ChecksumJob, 1);
+    job->algorithm = algorithm;
+    job->dir_fd = dir_fd;
+    job->use_cache = TRUE;
+    job->qos = QOS_NORMAL;
+    job->cancellable = cancellable ? g_object_ref(cancellable) : g_cancellable_new();
+    job->files = g_ptr_array_new_with_free_func((GDestroyNotify)checksum_file_free);
+    job->errors = g_ptr_array_new_with_free_func(g_free);
+    g_mutex_init(&job->lock);
+    g_cond_init(&job->cond);
+    return job;
+}
+
+static void checksum_job_free(ChecksumJob *job)
+{
+    g_object_unref(job->cancellable);
+    g_ptr_array_free(job->files, TRUE);
+    g_ptr_array_free(job->errors, TRUE);
+    g_mutex_clear(&job->lock);
+    g_cond_clear(&job->cond);
+    g_free(job);
+}
+
+static ChecksumFile* checksum_job_add_file(ChecksumJob *job, const gchar *path, const struct stat *st)
+{
+    ChecksumFile *f = g_new0(ChecksumFile, 1);
+    f->path = g_strdup(path);
+    if (st) f->st = *st;
+    g_ptr_array_add(job->files, f);
+    job->bytes_total += f->st.st_size;
+    return f;
+}
+
+static void checksum_job_add_bytes(ChecksumJob *job, guint64 bytes)
+{
+    g_mutex_lock(&job->lock);
+    job->bytes_done += bytes;
+    g_mutex_unlock(&job->lock);
+}
+
+// Adds the regular files at and beneath name, found relative to dirfd
+// and reported as rel. Symlinks are not followed; like special files they
+// have no content of their own.
+static void checksum_walk(ChecksumJob *job, int dirfd, const gchar *name, const gchar *rel)
+{
+    struct stat st;
+    if (g_cancellable_is_cancelled(job->cancellable)) return;
+    if (fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        g_ptr_array_add(job->errors, g_strdup_printf("%s: %s", rel, g_strerror(errno)));
+        return;
+    }
+    if (S_ISREG(st.st_mode)) {
+        checksum_job_add_file(job, rel, &st);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) return;
+
+    int fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        g_ptr_array_add(job->errors, g_strdup_printf("%s: %s", rel, g_strerror(errno)));
+        if (fd >= 0) close(fd);
+        return;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        gchar *child = g_build_filename(rel, de->d_name, NULL);
+        checksum_walk(job, fd, de->d_name, child);
+        g_free(child);
+    }
+    closedir(dir);
+}
+
+// Hashes len bytes of fd from off, or up to the end for G_MAXUINT64. A
+// file that ends before off + len has changed since it was measured.
+static gboolean checksum_read(ChecksumJob *job, int fd, guint64 off, guint64 len, ChecksumState *s,
+                              GError **error)
+{
+    guint8 *buf = g_private_get(&checksum_buffer);
+    if (!buf) {
+        buf = g_malloc(COPY_BUFFER_SIZE);
+        g_private_set(&checksum_buffer, buf);
+    }
+    gboolean to_end = len == G_MAXUINT64;
+    while (len > 0) {
+        if (g_cancellable_set_error_if_cancelled(job->cancellable, error)) return FALSE;
+        ssize_t n = pread(fd, buf, MIN(len, (guint64)COPY_BUFFER_SIZE), off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return set_errno_error(error, "Read failed");
+        if (n == 0 && !to_end) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Changed while it was read");
+            return FALSE;
+        }
+        if (n == 0) break;
+        checksum_state_update(s, buf, n);
+        off += n;
+        len -= n;
+        checksum_job_add_bytes(job, n);
+        qos_throttle(job->qos, n, job->cancellable);
+    }
+    return TRUE;
+}
+
+// Takes hex as f's digest if the file still has the size and mtime it had
+// before it was read, and caches it.
+static gboolean checksum_store(ChecksumJob *job, ChecksumFile *f, int fd, gchar *hex, GError **error)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != f->st.st_size || st.st_mtim.tv_sec != f->st.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != f->st.st_mtim.tv_nsec) {
+        g_free(hex);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Changed while it was read");
+        return FALSE;
+    }
+    checksum_cache_set(fd, &st, job->algorithm, hex);
+    f->digest = hex;
+    return TRUE;
+}
+
+static gboolean checksum_whole_file(ChecksumJob *job, ChecksumFile *f, int fd, GError **error)
+{
+    // The walk's stat may be stale by now; what counts is the file as read
+    if (fstat(fd, &f->st) != 0) return set_errno_error(error, "Cannot stat");
+    if (job->use_cache && (f->digest = checksum_cache_get(fd, &f->st, job->algorithm))) {
+        checksum_job_add_bytes(job, f->st.st_size);
+        return TRUE;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ChecksumState s;
+    checksum_state_init(&s, job->algorithm, 0);
+    gboolean ok = checksum_read(job, fd, 0, G_MAXUINT64, &s, error);
+    gchar *hex = checksum_state_finish(&s);
+    if (!ok) {
+        g_free(hex);
+        return FALSE;
+    }
+    return checksum_store(job, f, fd, hex, error);
+}
+
+// Hashes one piece of a file split for BLAKE3, or the rest after them.
+// Whichever task finishes last joins the pieces into the digest. Every
+// piece is bounded by the size the file had when it was split: a rest
+// that kept growing would hold more chunks than its tree has room for.
+static void checksum_piece(ChecksumJob *job, ChecksumFile *f, guint piece, int fd, GError **error)
+{
+    guint64 off = (guint64)piece * CHECKSUM_PIECE_SIZE;
+    guint64 len = piece < f->npieces ? CHECKSUM_PIECE_SIZE : (guint64)f->st.st_size - off;
+    ChecksumState s;
+    guint8 extra;
+    checksum_state_init(&s, CHECKSUM_BLAKE3, off / BLAKE3_CHUNK_LEN);
+    posix_fadvise(fd, off, len, POSIX_FADV_SEQUENTIAL);
+    if (checksum_read(job, fd, off, len, &s, error) && piece == f->npieces &&
+        pread(fd, &extra, 1, off + len) != 0)
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Changed while it was read");
+    if (!*error) {
+        if (piece < f->npieces) {
+            Blake3Node n;
+            blake3_top_node(&s.blake3, &n);
+            blake3_node_cv(&n, f->cvs[piece]);
+        } else {
+            *f->rest = s.blake3;
+        }
+    }
+
+    g_mutex_lock(&job->lock);
+    if (*error && !f->error) f->error = g_strdup((*error)->message);
+    gboolean last = --f->pending == 0;
+    g_mutex_unlock(&job->lock);
+    g_clear_error(error);
+    if (!last || f->error) return;
+
+    guint8 digest[32];
+    blake3_join(f->rest, f->cvs, f->npieces);
+    blake3_finish(f->rest, digest);
+    checksum_store(job, f, fd, checksum_hex(digest, sizeof digest), error);
+}
+
+static void checksum_pool_worker(gpointer data, gpointer user_data)
+{
+    ChecksumJob *job = user_data;
+    ChecksumTask *t = data;
+    ChecksumFile *f = t->file;
+    GError *err = NULL;
+    qos_apply_thread(job->qos);
+    if (!g_cancellable_is_cancelled(job->cancellable)) {
+        int fd = openat(job->dir_fd, f->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) set_errno_error(&err, "Cannot open");
+        else if (f->npieces == 0) checksum_whole_file(job, f, fd, &err);
+        else checksum_piece(job, f, t->piece, fd, &err);
+        if (fd >= 0) close(fd);
+        // A failed piece has already been recorded with the others
+        if (err && !f->error) f->error = g_strdup(err->message);
+        g_clear_error(&err);
+    }
+    g_free(t);
+
+    g_mutex_lock(&job->lock);
+    if (--job->outstanding == 0) g_cond_signal(&job->cond);
+    g_mutex_unlock(&job->lock);
+}
+
+static gint checksum_file_compare_inode(gconstpointer a, gconstpointer b)
+{
+    const ChecksumFile *x = *(ChecksumFile * const *)a, *y = *(ChecksumFile * const *)b;
+    return x->st.st_ino < y->st.st_ino ? -1 : x->st.st_ino > y->st.st_ino;
+}
+
+static gint checksum_file_compare_offset(gconstpointer a, gconstpointer b)
+{
+    const ChecksumFile *x = *(ChecksumFile * const *)a, *y = *(ChecksumFile * const *)b;
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+static gint checksum_file_compare_path(gconstpointer a, gconstpointer b)
+{
+    const ChecksumFile *x = *(ChecksumFile * const *)a, *y = *(ChecksumFile * const *)b;
+    return strcmp(x->path, y->path);
+}
+
+static void checksum_push(ChecksumJob *job, GThreadPool *pool, ChecksumFile *f, guint piece)
+{
+    ChecksumTask *t = g_new(ChecksumTask, 1);
+    t->file = f;
+    t->piece = piece;
+    g_mutex_lock(&job->lock);
+    job->outstanding++;
+    g_mutex_unlock(&job->lock);
+    g_thread_pool_push(pool, t, NULL);
+}
+
+// Hashes every file of the job that has neither a digest nor an error
+// yet. Failures of single files end up in their error; FALSE is only
+// returned when the job was cancelled.
+static gboolean checksum_job_run(ChecksumJob *job, GError **error)
+{
+    struct stat dir_st;
+    const DeviceInfo *info = device_probe(fstat(job->dir_fd, &dir_st) == 0 ? dir_st.st_dev : 0);
+    guint workers = device_io_slots(info);
+
+    // A spinning disk reads the files one by one in the order their data
+    // lies on it, inode order where that is unknown
+    if (info->rotational) {
+        g_ptr_array_sort(job->files, checksum_file_compare_inode);
+        for (guint i = 0; i < job->files->len && !g_cancellable_is_cancelled(job->cancellable); ++i) {
+            ChecksumFile *f = g_ptr_array_index(job->files, i);
+            int fd = openat(job->dir_fd, f->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) continue;
+            f->offset = device_physical_offset(fd);
+            close(fd);
+        }
+        g_ptr_array_sort(job->files, checksum_file_compare_offset);
+    }
+
+    GThreadPool *pool = g_thread_pool_new(checksum_pool_worker, job, workers, job->qos == QOS_BACKGROUND, NULL);
+    for (guint i = 0; i < job->files->len; ++i) {
+        ChecksumFile *f = g_ptr_array_index(job->files, i);
+        if (f->digest || f->error) continue;
+        if (job->algorithm != CHECKSUM_BLAKE3 || f->st.st_size < CHECKSUM_TREE_MIN) {
+            checksum_push(job, pool, f, 0);
+            continue;
+        }
+
+        // Split, unless the cache already has it. The rest after the
+        // pieces is never empty, so it always holds the final chunk.
+        int fd = openat(job->dir_fd, f->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &f->st) != 0) {
+            f->error = g_strdup(g_strerror(errno));
+        } else if (job->use_cache && (f->digest = checksum_cache_get(fd, &f->st, job->algorithm))) {
+            checksum_job_add_bytes(job, f->st.st_size);
+        } else {
+            f->npieces = (f->st.st_size - 1) / CHECKSUM_PIECE_SIZE;
+            f->cvs = g_malloc_n(f->npieces, sizeof *f->cvs);
+            f->rest = g_new(Blake3, 1);
+            f->pending = f->npieces + 1;
+            for (guint p = 0; p <= f->npieces; ++p)
+                checksum_push(job, pool, f, p);
+        }
+        if (fd >= 0) close(fd);
+    }
+
+    g_mutex_lock(&job->lock);
+    while (job->outstanding > 0)
+        g_cond_wait(&job->cond, &job->lock);
+    g_mutex_unlock(&job->lock);
+    g_thread_pool_free(pool, FALSE, TRUE);
+
+    g_ptr_array_sort(job->files, checksum_file_compare_path);
+    return !g_cancellable_set_error_if_cancelled(job->cancellable, error);
+}
+
+// Appends one manifest line as sha256sum writes it: digest, two spaces,
+// path. A path with a backslash or newline is escaped, which a backslash
+// at the start of the line announces.
+static void checksum_manifest_append(GString *out, const gchar *digest, const gchar *path)
+{
+    gboolean escape = strpbrk(path, "\\\n") != NULL;
+    if (escape) g_string_append_c(out, '\\');
+    g_string_append(out, digest);
+    g_string_append(out, "  ");
+    for (const gchar *p = path; *p; ++p) {
+        if (escape && *p == '\\') g_string_append(out, "\\\\");
+        else if (*p == '\n') g_string_append(out, "\\n");
+        else g_string_append_c(out, *p);
+    }
+    g_string_append_c(out, '\n');
+}
+
+// Adds the files listed in a manifest to job, each with the digest it is
+// expected to have. Blank lines and # comments are skipped; files hashed
+// in binary mode ("*path") are the same to us.
+static gboolean checksum_manifest_parse(ChecksumJob *job, const gchar *contents, GError **error)
+{
+    guint hex_len = checksum_info[job->algorithm].hex_len;
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    gboolean ok = TRUE;
+    for (guint i = 0; ok && lines[i]; ++i) {
+        gchar *line = lines[i];
+        gsize n = strlen(line);
+        if (n > 0 && line[n - 1] == '\r') line[--n] = '\0';
+        if (n == 0 || line[0] == '#') continue;
+
+        gboolean escaped = line[0] == '\\';
+        const gchar *p = line + escaped;
+        guint digits = 0;
+        while (g_ascii_isxdigit(p[digits])) digits++;
+        if (digits != hex_len || p[digits] != ' ' || (p[digits + 1] != ' ' && p[digits + 1] != '*') ||
+            p[digits + 2] == '\0') {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "Line %u is not a %s checksum line", i + 1,
+                        checksum_info[job->algorithm].name);
+            ok = FALSE;
+            break;
+        }
+
+        GString *path = g_string_new(NULL);
+        for (const gchar *q = p + digits + 2; *q; ++q) {
+            if (escaped && q[0] == '\\' && (q[1] == '\\' || q[1] == 'n')) {
+                g_string_append_c(path, q[1] == 'n' ? '\n' : '\\');
+                ++q;
+            } else {
+                g_string_append_c(path, *q);
+            }
+        }
+        struct stat st;
+        gboolean found = fstatat(job->dir_fd, path->str, &st, 0) == 0;
+        ChecksumFile *f = checksum_job_add_file(job, path->str, found ? &st : NULL);
+        f->expected = g_ascii_strdown(p, digits);
+        if (!found) f->error = g_strdup(g_strerror(errno));
+        else if (!S_ISREG(st.st_mode)) f->error = g_strdup("Not a regular file");
+        g_string_free(path, TRUE);
+    }
+    g_strfreev(lines);
+    return ok;
+}
+
+// The algorithm a manifest was most likely written with, going by its
+// name: B3SUMS, files.sha256, XXH64SUMS and the like. FALSE when the name
+// does not look like a manifest at all.
+static gboolean checksum_manifest_algorithm(const gchar *name, ChecksumAlgorithm *algorithm)
+{
+    gchar *lower = g_ascii_strdown(name, -1);
+    gboolean manifest = strstr(lower, "sums") || g_str_has_suffix(lower, ".sha256") ||
+                        g_str_has_suffix(lower, ".b3") || g_str_has_suffix(lower, ".xxh64");
+    *algorithm = strstr(lower, "b3") || strstr(lower, "blake3") ? CHECKSUM_BLAKE3 :
+                 strstr(lower, "xxh") ? CHECKSUM_XXH64 : CHECKSUM_SHA256;
+    g_free(lower);
+    return manifest;
+}
+
+// Hashes a tree and prints it as a manifest, with the throughput on
+// stderr. The page cache is dropped first, and the xattr cache is not
+// used, so the number is for reading the data from the device.
+static int run_checksum_benchmark(const gchar *dir, const gchar *algorithm_name)
+{
+    ChecksumAlgorithm algorithm = CHECKSUM_SHA256;
+    for (ChecksumAlgorithm a = 0; a < CHECKSUM_ALGORITHMS; ++a)
+        if (g_ascii_strcasecmp(algorithm_name, checksum_info[a].name) == 0 ||
+            (a == CHECKSUM_SHA256 && g_ascii_strcasecmp(algorithm_name, "sha256") == 0))
+            algorithm = a;
+    int dir_fd = open(dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd < 0) {
+        g_printerr("Cannot open %s: %s\n", dir, g_strerror(errno));
+        return 1;
+    }
+
+    ChecksumJob *job = checksum_job_new(dir_fd, algorithm, NULL);
+    job->use_cache = FALSE;
+    sync();
+    copy_bench_drop_cache(dir);
+    gint64 start = g_get_monotonic_time();
+    DIR *d = fdopendir(openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL)
+        if (strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0)
+            checksum_walk(job, dir_fd, de->d_name, de->d_name);
+    if (d) closedir(d);
+    checksum_job_run(job, NULL);
+    gdouble s = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+    GString *out = g_string_new(NULL);
+    guint failed = 0;
+    for (guint i = 0; i < job->files->len; ++i) {
+        ChecksumFile *f = g_ptr_array_index(job->files, i);
+        if (f->digest) {
+            checksum_manifest_append(out, f->digest, f->path);
+        } else {
+            g_printerr("%s: %s\n", f->path, f->error);
+            failed++;
+        }
+    }
+    fwrite(out->str, 1, out->len, stdout);
+    g_printerr("%s: %u files, %" G_GUINT64_FORMAT " bytes in %.3f s (%.1f MB/s)\n", checksum_info[algorithm].name,
+               job->files->len - failed, job->bytes_done, s, job->bytes_done / 1e6 / s);
+    g_string_free(out, TRUE);
+    checksum_job_free(job);
+    close(dir_fd);
+    return failed > 0;
+}
+
+// --- Duplicate Finder ---
+// Finds files with the same contents beneath a directory, in three stages
+// that each run on a pool of workers. The walk groups files by size, and
+// the great majority, whose size no other file has, drop out without a
+// single read. The rest are narrowed down by a digest of their first and
+// last 4 KiB, and only files still alike after that are hashed in full,
+// with BLAKE3 through the checksum engine and so with its xattr cache.
+// Links to one inode count as one file, and the walk stays on one
+// filesystem, since space can only be reclaimed within one. A set is
+// collapsed either by sharing extents with FIDEDUPERANGE, which the kernel
+// only does after comparing the data itself and which keeps the files
+// independent, or by replacing the copies with hard links.
+
+#define DUP_EDGE_SIZE 4096
+#define DUP_DEDUPE_CHUNK (16 * 1024 * 1024) // Per FIDEDUPERANGE call; btrfs does no more at once
+#define DUP_LINK_PREFIX ".owltech-fm-link-"
+
+typedef struct {
+    gchar *path;    // Relative to the scan's directory
+    struct stat st;
+    guint64 edges;  // Digest of the first and last DUP_EDGE_SIZE bytes
+    gchar *digest;  // BLAKE3 of the whole file
+    gboolean failed;
+} DupFile;
+
+typedef struct {
+    guint64 size;
+    GPtrArray *files; // DupFile, by path; the first one is kept
+} DupSet;
+
+typedef enum {
+    DUP_STAGE_WALK,
+    DUP_STAGE_EDGES,
+    DUP_STAGE_HASH,
+} DupStage;
+
+typedef enum {
+    DUP_SHARE_EXTENTS,
+    DUP_HARD_LINK,
+} DupMethod;
+
+typedef struct {
+    int dir_fd;
+    dev_t dev;
+    GCancellable *cancellable;
+    GThreadPool *pool;
+    GMutex lock;
+    GCond cond;
+    guint outstanding;    // Tasks queued or running
+    GPtrArray *files;     // DupFile: every regular file found
+    GPtrArray *errors;
+    GPtrArray *sets;      // DupSet, most space to reclaim first
+    DupStage stage;
+    guint done;           // Files through the current stage
+    guint total;
+    ChecksumJob *hash;    // While the full hashes are taken
+    guint size_matches;   // Files that share their size with another
+    guint edge_matches;   // Of those, files that also share their edges
+} DupScan;
+
+static void dup_file_free(DupFile *f)
+{
+    g_free(f->path);
+    g_free(f->digest);
+    g_free(f);
+}
+
+static void dup_set_free(DupSet *set)
+{
+    g_ptr_array_free(set->files, TRUE);
+    g_free(set);
+}
+
+static DupScan* dup_scan_new(int dir_fd, GCancellable *cancellable)
+{
+    DupScan *scan = g_new0(DupScan, 1);
+    scan->dir_fd = dir_fd;
+    scan->cancellable = cancellable ? g_object_ref(cancellable) : g_cancellable_new();
+    g_mutex_init(&scan->lock);
+    g_cond_init(&scan->cond);
+    scan->files = g_ptr_array_new_with_free_func((GDestroyNotify)dup_file_free);
+    scan->errors = g_ptr_array_new_with_free_func(g_free);
+    scan->sets = g_ptr_array_new_with_free_func((GDestroyNotify)dup_set_free);
+    return scan;
+}
+
+static void dup_scan_free(DupScan *scan)
+{
+    close(scan->dir_fd);
+    g_object_unref(scan->cancellable);
+    g_mutex_clear(&scan->lock);
+    g_cond_clear(&scan->cond);
+    g_ptr_array_free(scan->sets, TRUE);
+    g_ptr_array_free(scan->files, TRUE);
+    g_ptr_array_free(scan->errors, TRUE);
+    g_free(scan);
+}
+
+static guint64 dup_set_reclaimable(const DupSet *set)
+{
+    return set->size * (set->files->len - 1);
+}
+
+static void dup_scan_add_error(DupScan *scan, const gchar *path, const gchar *what)
+{
+    g_mutex_lock(&scan->lock);
+    g_ptr_array_add(scan->errors, g_strdup_printf("%s: %s", path, what));
+    g_mutex_unlock(&scan->lock);
+}
+
+static void dup_scan_push(DupScan *scan, gpointer task)
+{
+    g_mutex_lock(&scan->lock);
+    scan->outstanding++;
+    g_mutex_unlock(&scan->lock);
+    g_thread_pool_push(scan->pool, task, NULL);
+}
+
+// Called by a worker when it is through with a task.
+static void dup_scan_task_done(DupScan *scan, GPtrArray *found)
+{
+    g_mutex_lock(&scan->lock);
+    if (found) {
+        for (guint i = 0; i < found->len; ++i)
+            g_ptr_array_add(scan->files, g_ptr_array_index(found, i));
+        scan->done += found->len;
+    } else {
+        scan->done++;
+    }
+    if (--scan->outstanding == 0) g_cond_signal(&scan->cond);
+    g_mutex_unlock(&scan->lock);
+}
+
+static void dup_scan_wait(DupScan *scan)
+{
+    g_mutex_lock(&scan->lock);
+    while (scan->outstanding > 0)
+        g_cond_wait(&scan->cond, &scan->lock);
+    g_mutex_unlock(&scan->lock);
+}
+
+// Reads one directory: subdirectories become tasks of their own, regular
+// files are collected. Version stores and staging areas are skipped.
+static void dup_walk_worker(gpointer data, gpointer user_data)
+{
+    DupScan *scan = user_data;
+    gchar *rel = data;
+    GPtrArray *found = g_ptr_array_new();
+    DIR *dir = NULL;
+    if (!g_cancellable_is_cancelled(scan->cancellable)) {
+        int fd = openat(scan->dir_fd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        dir = fd >= 0 ? fdopendir(fd) : NULL;
+        if (!dir) dup_scan_add_error(scan, rel, g_strerror(errno));
+        if (!dir && fd >= 0) close(fd);
+    }
+
+    struct dirent *de;
+    while (dir && (de = readdir(dir)) != NULL) {
+        const gchar *name = de->d_name;
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, VERSIONS_DIR_NAME) == 0 ||
+            g_str_has_prefix(name, STAGING_DIR_PREFIX))
+            continue;
+        if (de->d_type != DT_UNKNOWN && de->d_type != DT_REG && de->d_type != DT_DIR) continue;
+        struct stat st;
+        if (fstatat(dirfd(dir), name, &st, AT_SYMLINK_NOFOLLOW) != 0 || st.st_dev != scan->dev) continue;
+        gchar *child = strcmp(rel, ".") == 0 ? g_strdup(name) : g_build_filename(rel, name, NULL);
+        if (S_ISDIR(st.st_mode)) {
+            dup_scan_push(scan, child);
+            continue;
+        }
+        if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            DupFile *f = g_new0(DupFile, 1);
+            f->path = child;
+            f->st = st;
+            g_ptr_array_add(found, f);
+        } else {
+            g_free(child);
+        }
+    }
+    if (dir) closedir(dir);
+    g_free(rel);
+    dup_scan_task_done(scan, found);
+    g_ptr_array_free(found, TRUE);
+}
+
+// Digests the first and last DUP_EDGE_SIZE bytes of a file, which is all
+// of it up to twice that size.
+static void dup_edges_worker(gpointer data, gpointer user_data)
+{
+    DupScan *scan = user_data;
+    DupFile *f = data;
+    if (!g_cancellable_is_cancelled(scan->cancellable)) {
+        guint8 buf[2 * DUP_EDGE_SIZE];
+        guint64 size = f->st.st_size;
+        gsize head = MIN(size, DUP_EDGE_SIZE);
+        gsize tail = size > DUP_EDGE_SIZE ? MIN(size - DUP_EDGE_SIZE, DUP_EDGE_SIZE) : 0;
+        ssize_t n = 0, m = 0;
+        const gchar *problem = NULL;
+        int fd = openat(scan->dir_fd, f->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0 || (n = pread(fd, buf, head, 0)) < 0 || (tail > 0 && (m = pread(fd, buf + head, tail, size - tail)) < 0))
+            problem = g_strerror(errno);
+        else if (n != (ssize_t)head || m != (ssize_t)tail)
+            problem = "Changed during the scan";
+        if (fd >= 0) close(fd);
+        f->failed = problem != NULL;
+        if (problem) dup_scan_add_error(scan, f->path, problem);
+        else f->edges = xxh64(buf, head + tail, 0);
+    }
+    dup_scan_task_done(scan, NULL);
+}
+
+static gint dup_file_compare_size(gconstpointer a, gconstpointer b)
+{
+    const DupFile *x = *(DupFile * const *)a, *y = *(DupFile * const *)b;
+    return x->st.st_size < y->st.st_size ? -1 : x->st.st_size > y->st.st_size;
+}
+
+static gint dup_file_compare_inode(gconstpointer a, gconstpointer b)
+{
+    const DupFile *x = *(DupFile * const *)a, *y = *(DupFile * const *)b;
+    gint c = dup_file_compare_size(a, b);
+    return c ? c : x->st.st_ino < y->st.st_ino ? -1 : x->st.st_ino > y->st.st_ino;
+}
+
+static gint dup_file_compare_edges(gconstpointer a, gconstpointer b)
+{
+    const DupFile *x = *(DupFile * const *)a, *y = *(DupFile * const *)b;
+    gint c = dup_file_compare_size(a, b);
+    return c ? c : x->edges < y->edges ? -1 : x->edges > y->edges;
+}
+
+static gint dup_file_compare_digest(gconstpointer a, gconstpointer b)
+{
+    const DupFile *x = *(DupFile * const *)a, *y = *(DupFile * const *)b;
+    gint c = dup_file_compare_size(a, b);
+    if (!c) c = strcmp(x->digest, y->digest);
+    return c ? c : strcmp(x->path, y->path);
+}
+
+static gint dup_set_compare_reclaimable(gconstpointer a, gconstpointer b)
+{
+    guint64 x = dup_set_reclaimable(*(DupSet * const *)a), y = dup_set_reclaimable(*(DupSet * const *)b);
+    return x > y ? -1 : x < y;
+}
+
+// Keeps the files of in (sorted by compare) that have at least one equal
+// neighbour by that comparison.
+static GPtrArray* dup_keep_runs(GPtrArray *in, GCompareFunc compare)
+{
+    GPtrArray *out = g_ptr_array_new();
+    g_ptr_array_sort(in, compare);
+    for (guint i = 0, j; i < in->len; i = j) {
+        for (j = i + 1; j < in->len && compare(&in->pdata[i], &in->pdata[j]) == 0; ++j)
+            ;
+        for (guint k = i; j - i > 1 && k < j; ++k)
+            g_ptr_array_add(out, g_ptr_array_index(in, k));
+    }
+    return out;
+}
+
+// Runs the scan over names in the scan's directory ("." for all of it).
+// Files that cannot be read are left out and listed in scan->errors;
+// FALSE is only returned when the scan was cancelled.
+static gboolean dup_scan_run(DupScan *scan, GPtrArray *names, GError **error)
+{
+    struct stat dir_st;
+    if (fstat(scan->dir_fd, &dir_st) != 0) return set_errno_error(error, "Cannot stat folder");
+    scan->dev = dir_st.st_dev;
+    guint workers = device_io_slots(device_probe(scan->dev));
+
+    scan->pool = g_thread_pool_new(dup_walk_worker, scan, workers, FALSE, NULL);
+    for (guint i = 0; i < names->len; ++i) {
+        const gchar *name = g_ptr_array_index(names, i);
+        struct stat st;
+        if (fstatat(scan->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            dup_scan_add_error(scan, name, g_strerror(errno));
+        } else if (S_ISDIR(st.st_mode)) {
+            dup_scan_push(scan, g_strdup(name));
+        } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+            DupFile *f = g_new0(DupFile, 1);
+            f->path = g_strdup(name);
+            f->st = st;
+            g_ptr_array_add(scan->files, f);
+        }
+    }
+    dup_scan_wait(scan);
+    g_thread_pool_free(scan->pool, FALSE, TRUE);
+    if (g_cancellable_set_error_if_cancelled(scan->cancellable, error)) return FALSE;
+
+    // Sizes: every link to an inode after the first is dropped, so a file
+    // is never a duplicate of itself
+    GPtrArray *unique = g_ptr_array_new();
+    g_ptr_array_sort(scan->files, dup_file_compare_inode);
+    for (guint i = 0; i < scan->files->len; ++i) {
+        DupFile *f = g_ptr_array_index(scan->files, i);
+        if (unique->len == 0 || dup_file_compare_inode(&unique->pdata[unique->len - 1], &f) != 0)
+            g_ptr_array_add(unique, f);
+    }
+    GPtrArray *same_size = dup_keep_runs(unique, dup_file_compare_size);
+    g_ptr_array_free(unique, TRUE);
+    scan->size_matches = same_size->len;
+
+    // Edges
+    g_mutex_lock(&scan->lock);
+    scan->stage = DUP_STAGE_EDGES;
+    scan->done = 0;
+    scan->total = same_size->len;
+    g_mutex_unlock(&scan->lock);
+    scan->pool = g_thread_pool_new(dup_edges_worker, scan, workers, FALSE, NULL);
+    for (guint i = 0; i < same_size->len; ++i)
+        dup_scan_push(scan, g_ptr_array_index(same_size, i));
+    dup_scan_wait(scan);
+    g_thread_pool_free(scan->pool, FALSE, TRUE);
+    for (guint i = 0; i < same_size->len; ++i)
+        if (((DupFile *)g_ptr_array_index(same_size, i))->failed) g_ptr_array_remove_index_fast(same_size, i--);
+    GPtrArray *same_edges = dup_keep_runs(same_size, dup_file_compare_edges);
+    g_ptr_array_free(same_size, TRUE);
+    scan->edge_matches = same_edges->len;
+    if (g_cancellable_set_error_if_cancelled(scan->cancellable, error)) {
+        g_ptr_array_free(same_edges, TRUE);
+        return FALSE;
+    }
+
+    // Full hashes
+    ChecksumJob *hash = checksum_job_new(scan->dir_fd, CHECKSUM_BLAKE3, scan->cancellable);
+    GPtrArray *hashed = g_ptr_array_new();
+    for (guint i = 0; i < same_edges->len; ++i) {
+        DupFile *f = g_ptr_array_index(same_edges, i);
+        g_ptr_array_add(hashed, checksum_job_add_file(hash, f->path, &f->st));
+    }
+    g_mutex_lock(&scan->lock);
+    scan->stage = DUP_STAGE_HASH;
+    scan->hash = hash;
+    g_mutex_unlock(&scan->lock);
+    gboolean ok = checksum_job_run(hash, error);
+    GPtrArray *confirmed = g_ptr_array_new();
+    for (guint i = 0; ok && i < same_edges->len; ++i) {
+        DupFile *f = g_ptr_array_index(same_edges, i);
+        ChecksumFile *cf = g_ptr_array_index(hashed, i);
+        if (cf->digest) {
+            f->digest = g_strdup(cf->digest);
+            g_ptr_array_add(confirmed, f);
+        } else {
+            dup_scan_add_error(scan, f->path, cf->error);
+        }
+    }
+    g_mutex_lock(&scan->lock);
+    scan->hash = NULL;
+    g_mutex_unlock(&scan->lock);
+    checksum_job_free(hash);
+    g_ptr_array_free(hashed, TRUE);
+    g_ptr_array_free(same_edges, TRUE);
+
+    g_ptr_array_sort(confirmed, dup_file_compare_digest);
+    for (guint i = 0, j; i < confirmed->len; i = j) {
+        DupFile *f = g_ptr_array_index(confirmed, i);
+        for (j = i + 1; j < confirmed->len; ++j) {
+            DupFile *g = g_ptr_array_index(confirmed, j);
+            if (g->st.st_size != f->st.st_size || strcmp(g->digest, f->digest) != 0) break;
+        }
+        if (j - i < 2) continue;
+        DupSet *set = g_new0(DupSet, 1);
+        set->size = f->st.st_size;
+        set->files = g_ptr_array_new();
+        for (guint k = i; k < j; ++k)
+            g_ptr_array_add(set->files, g_ptr_array_index(confirmed, k));
+        g_ptr_array_add(scan->sets, set);
+    }
+    g_ptr_array_free(confirmed, TRUE);
+    g_ptr_array_sort(scan->sets, dup_set_compare_reclaimable);
+    return ok;
+}
+
+// Makes copy share keep's extents. The kernel compares the data range by
+// range and refuses ranges that differ, so a file changed since the scan
+// is never lost.
+static gboolean dup_share_extents(int dir_fd, const DupFile *keep, const DupFile *copy, GError **error)
+{
+    int src = openat(dir_fd, keep->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src < 0) return set_errno_error(error, "Cannot open the kept copy");
+    // Read-only is enough for the owner on recent kernels
+    int dst = openat(dir_fd, copy->path, O_RDWR | O_NOFOLLOW | O_CLOEXEC);
+    if (dst < 0 && (errno == EACCES || errno == ETXTBSY)) dst = openat(dir_fd, copy->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (dst < 0) {
+        close(src);
+        return set_errno_error(error, "Cannot open");
+    }
+
+    struct file_dedupe_range *range = g_malloc0(sizeof *range + sizeof range->info[0]);
+    gboolean ok = TRUE;
+    for (guint64 off = 0; ok && off < copy->st.st_size;) {
+        range->src_offset = off;
+        range->src_length = MIN(copy->st.st_size - off, DUP_DEDUPE_CHUNK);
+        range->dest_count = 1;
+        range->info[0].dest_fd = dst;
+        range->info[0].dest_offset = off;
+        range->info[0].bytes_deduped = 0;
+        if (ioctl(src, FIDEDUPERANGE, range) != 0) {
+            if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL || errno == EXDEV)
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "The filesystem cannot share blocks between files");
+            else
+                set_errno_error(error, "Cannot share blocks");
+            ok = FALSE;
+        } else if (range->info[0].status == FILE_DEDUPE_RANGE_DIFFERS) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Changed since the scan");
+            ok = FALSE;
+        } else if (range->info[0].status < 0 || range->info[0].bytes_deduped == 0) {
+            errno = range->info[0].status < 0 ? -range->info[0].status : EIO;
+            ok = set_errno_error(error, "Cannot share blocks");
+        } else {
+            off += range->info[0].bytes_deduped;
+        }
+    }
+    g_free(range);
+    close(dst);
+    close(src);
+    return ok;
+}
+
+// FALSE unless path is still the file that was scanned as seen, going by
+// its inode, size and mtime.
+static gboolean file_unchanged_at(int dir_fd, const gchar *path, const struct stat *seen, GError **error)
+{
+    struct stat st;
+    if (fstatat(dir_fd, path, &st, AT_SYMLINK_NOFOLLOW) != 0) return set_errno_error(error, "Cannot stat");
+    if (st.st_ino != seen->st_ino || st.st_size != seen->st_size || st.st_mtim.tv_sec != seen->st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != seen->st_mtim.tv_nsec) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Changed since the scan");
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// FALSE unless keep and copy, still as scanned, hold the same bytes.
+// Their digests may come from the checksum cache, which only goes by size
+// and mtime, so anything that cannot be undone compares the data itself.
+static gboolean dup_same_contents(int dir_fd, const DupFile *keep, const DupFile *copy, GError **error)
+{
+    int a = openat(dir_fd, keep->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    int b = openat(dir_fd, copy->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    guint8 *x = g_malloc(COPY_BUFFER_SIZE), *y = g_malloc(COPY_BUFFER_SIZE);
+    gboolean ok = a >= 0 && b >= 0 ? TRUE : set_errno_error(error, "Cannot open");
+    if (ok) {
+        posix_fadvise(a, 0, 0, POSIX_FADV_SEQUENTIAL);
+        posix_fadvise(b, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    for (guint64 off = 0; ok && off < (guint64)keep->st.st_size;) {
+        gsize want = MIN((guint64)keep->st.st_size - off, (guint64)COPY_BUFFER_SIZE);
+        ssize_t n = pread(a, x, want, off), m = pread(b, y, want, off);
+        if ((n < 0 || m < 0) && errno == EINTR) continue;
+        if (n < 0 || m < 0) {
+            ok = set_errno_error(error, "Read failed");
+        } else if (n != (ssize_t)want || m != (ssize_t)want || memcmp(x, y, want) != 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Contents differ from %s", keep->path);
+            ok = FALSE;
+        }
+        off += want;
+    }
+    g_free(x);
+    g_free(y);
+    if (a >= 0) close(a);
+    if (b >= 0) close(b);
+    return ok;
+}
+
+// Replaces copy with a hard link to keep once their bytes are confirmed
+// equal. The link is made under a temporary name next to copy and renamed
+// over it, so copy is never missing.
+static gboolean dup_hard_link(int dir_fd, const DupFile *keep, const DupFile *copy, GError **error)
+{
+    if (!file_unchanged_at(dir_fd, keep->path, &keep->st, error) ||
+        !file_unchanged_at(dir_fd, copy->path, &copy->st, error) ||
+        copy->st.st_size != keep->st.st_size || !dup_same_contents(dir_fd, keep, copy, error) ||
+        !file_unchanged_at(dir_fd, keep->path, &keep->st, error) ||
+        !file_unchanged_at(dir_fd, copy->path, &copy->st, error))
+        return FALSE;
+    gchar *parent = g_path_get_dirname(copy->path);
+    gchar *leaf = g_strdup_printf("%s%d", DUP_LINK_PREFIX, (int)getpid());
+    gchar *tmp = g_build_filename(parent, leaf, NULL);
+    gboolean ok = TRUE;
+    if (linkat(dir_fd, keep->path, dir_fd, tmp, 0) != 0) {
+        ok = set_errno_error(error, "Cannot link");
+    } else if (renameat(dir_fd, tmp, dir_fd, copy->path) != 0) {
+        ok = set_errno_error(error, "Cannot replace");
+        unlinkat(dir_fd, tmp, 0);
+    }
+    g_free(tmp);
+    g_free(leaf);
+    g_free(parent);
+    return ok;
+}
+
+// --- Directory Compare ---
+// Compares two directory trees and brings the second up to date with the
+// first. Both trees are walked together, one pair of directories per task
+// on a pool of workers, and entries are classified from their metadata:
+// a regular file with the same size and mtime on both sides is taken to be
+// unchanged, so comparing trees that are alike costs one stat per entry
+// and side and not a single read. Only files whose sizes match but whose
+// times do not are hashed, with BLAKE3 through the checksum engine and its
+// xattr cache. A sync copies what is missing and replaces what changed.
+// Large files are rebuilt the way rsync does it: the target's blocks are
+// indexed by a rolling weak checksum and a strong one, the source is
+// scanned for them at every byte offset, and the new version is written
+// from reused target blocks plus the data that matched none, then renamed
+// over the old one. Every match is confirmed against the target's bytes,
+// so a checksum collision cannot corrupt the result.
+
+#define SYNC_DELTA_MIN (1024 * 1024) // Smaller changed files are copied whole
+#define SYNC_BLOCK_MIN 2048
+#define SYNC_BLOCK_MAX (128 * 1024)
+#define SYNC_NO_BLOCK G_MAXUINT32
+#define SYNC_TEMP_PREFIX ".owltech-fm-sync-"
+
+typedef enum {
+    CMP_SAME,
+    CMP_NEWER,     // Changed, and newer in the source
+    CMP_OLDER,     // Changed, and newer in the target
+    CMP_DIFFERENT, // Changed with the same mtime, or a different kind of entry
+    CMP_MISSING,   // Only in the source
+    CMP_EXTRA,     // Only in the target
+    CMP_STATES,
+} CmpState;
+
+static const gchar *const cmp_state_names[CMP_STATES] = {
+    "Same", "Newer", "Older", "Different", "Missing", "Only in target",
+};
+
+typedef struct {
+    gchar *path;        // Relative to both roots
+    CmpState state;
+    struct stat src_st; // Unless CMP_EXTRA
+    struct stat dst_st; // Unless CMP_MISSING
+    gboolean ambiguous; // Same size, other mtime: the contents decide
+    gboolean retime;    // Same contents; the target only needs the mtime
+} CmpEntry;
+
+typedef struct {
+    gchar *src_root;
+    gchar *dst_root;
+    int src_fd;
+    int dst_fd;
+    GCancellable *cancellable;
+    GThreadPool *pool;
+    GMutex lock;
+    GCond cond;
+    guint outstanding;      // Directory pairs queued or being read
+    GPtrArray *entries;     // CmpEntry, by path: all but the unchanged ones
+    GPtrArray *errors;
+    guint counts[CMP_STATES];
+    guint scanned;          // Entries compared
+    guint hashed;           // Files whose contents had to be compared
+    ChecksumJob *hash[2];   // Source and target, while hashing
+} CmpScan;
+
+typedef struct {
+    CopyJob *copy;    // For whole copies; its errors are the sync's
+    gint done;        // Entries dealt with
+    guint total;
+    guint copied;     // Missing items copied
+    guint updated;    // Changed items replaced
+    guint retimed;    // Unchanged files given the source's mtime
+    guint skipped;    // Newer in the target, left alone
+    guint64 literal;  // Delta transfers: bytes written from the source
+    guint64 reused;   // Delta transfers: bytes taken from the target
+} CmpSync;
+
+typedef struct {
+    guint32 weak;
+    guint32 next;     // Next block with the same weak checksum
+    guint64 strong;
+} SyncBlock;
+
+// One delta transfer: the target's old version is the basis from which
+// the new one is written.
+typedef struct {
+    int basis;
+    int out;
+    guint32 block_size;
+    guint32 nblocks;
+    SyncBlock *blocks;
+    GHashTable *heads;        // Weak checksum -> first block with it
+    guint8 tags[65536 / 8];   // Bit per folded weak checksum in heads
+    guint8 *scratch;          // SYNC_BLOCK_MAX bytes
+    guint64 out_off;
+    guint64 run_off;          // Basis blocks waiting to be copied
+    guint64 run_len;
+    CmpSync *sync;
+} SyncDelta;
+
+static void cmp_entry_free(CmpEntry *e)
+{
+    g_free(e->path);
+    g_free(e);
+}
+
+static gint cmp_compare_names(gconstpointer a, gconstpointer b)
+{
+    return strcmp(*(const gchar * const *)a, *(const gchar * const *)b);
+}
+
+static gint cmp_entry_compare_path(gconstpointer a, gconstpointer b)
+{
+    return strcmp((*(CmpEntry * const *)a)->path, (*(CmpEntry * const *)b)->path);
+}
+
+static gint cmp_timespec(const struct timespec *a, const struct timespec *b)
+{
+    if (a->tv_sec != b->tv_sec) return a->tv_sec < b->tv_sec ? -1 : 1;
+    return a->tv_nsec < b->tv_nsec ? -1 : a->tv_nsec > b->tv_nsec;
+}
+
+// TRUE when one of two resolved paths is the other or lies inside it.
+static gboolean cmp_paths_nested(const gchar *a, const gchar *b)
+{
+    gsize al = strlen(a), bl = strlen(b), n = MIN(al, bl);
+    if (strncmp(a, b, n) != 0) return FALSE;
+    return al == bl || n == 1 || (al > bl ? a : b)[n] == '/';
+}
+
+// Opens both roots, which must not be one inside the other.
+static CmpScan* cmp_scan_new(const gchar *src, const gchar *dst, GError **error)
+{
+    gchar *src_real = realpath(src, NULL);
+    gchar *dst_real = src_real ? realpath(dst, NULL) : NULL;
+    int src_fd = -1, dst_fd = -1;
+    if (!dst_real) {
+        set_errno_error(error, "Cannot resolve folder");
+    } else if (cmp_paths_nested(src_real, dst_real)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_ARGUMENT, "%s",
+                    strcmp(src_real, dst_real) == 0 ? "Both sides are the same folder"
+                                                    : "One folder is inside the other");
+    } else if ((src_fd = open(src_real, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0 ||
+               (dst_fd = open(dst_real, O_PATH | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        set_errno_error(error, "Cannot open folder");
+        if (src_fd >= 0) close(src_fd);
+        src_fd = -1;
+    }
+
+    CmpScan *scan = NULL;
+    if (src_fd >= 0) {
+        scan = g_new0(CmpScan, 1);
+        scan->src_root = g_strdup(src_real);
+        scan->dst_root = g_strdup(dst_real);
+        scan->src_fd = src_fd;
+        scan->dst_fd = dst_fd;
+        scan->cancellable = g_cancellable_new();
+        g_mutex_init(&scan->lock);
+        g_cond_init(&scan->cond);
+        scan->entries = g_ptr_array_new_with_free_func((GDestroyNotify)cmp_entry_free);
+        scan->errors = g_ptr_array_new_with_free_func(g_free);
+    }
+    free(src_real);
+    free(dst_real);
+    return scan;
+}
+
+static void cmp_scan_free(CmpScan *scan)
+{
+    close(scan->src_fd);
+    close(scan->dst_fd);
+    g_free(scan->src_root);
+    g_free(scan->dst_root);
+    g_object_unref(scan->cancellable);
+    g_mutex_clear(&scan->lock);
+    g_cond_clear(&scan->cond);
+    g_ptr_array_free(scan->entries, TRUE);
+    g_ptr_array_free(scan->errors, TRUE);
+    g_free(scan);
+}
+
+static void cmp_scan_add_error(CmpScan *scan, const gchar *path, const gchar *what)
+{
+    g_mutex_lock(&scan->lock);
+    g_ptr_array_add(scan->errors, g_strdup_printf("%s: %s", path, what));
+    g_mutex_unlock(&scan->lock);
+}
+
+static void cmp_scan_push(CmpScan *scan, gchar *rel)
+{
+    g_mutex_lock(&scan->lock);
+    scan->outstanding++;
+    g_mutex_unlock(&scan->lock);
+    g_thread_pool_push(scan->pool, rel, NULL);
+}
+
+// Entries the comparison ignores: the app's own version stores, staging
+// areas and temporary files.
+static gboolean cmp_skip_name(const gchar *name)
+{
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || strcmp(name, VERSIONS_DIR_NAME) == 0 ||
+           g_str_has_prefix(name, STAGING_DIR_PREFIX) || g_str_has_prefix(name, SYNC_TEMP_PREFIX) ||
+           g_str_has_prefix(name, DUP_LINK_PREFIX);
+}
+
+// Sorted names in rel beneath root_fd, with *dir left open for stat
+// calls. NULL with errno set when the directory cannot be read.
+static GPtrArray* cmp_read_dir(int root_fd, const gchar *rel, DIR **dir)
+{
+    int fd = openat(root_fd, rel, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!*dir) {
+        int saved = errno;
+        if (fd >= 0) close(fd);
+        errno = saved;
+        return NULL;
+    }
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    struct dirent *de;
+    while ((de = readdir(*dir)) != NULL)
+        if (!cmp_skip_name(de->d_name)) g_ptr_array_add(names, g_strdup(de->d_name));
+    g_ptr_array_sort(names, cmp_compare_names);
+    return names;
+}
+
+// Classifies an entry present on both sides from its metadata. Regular
+// files of the same size and another mtime are only tentatively changed.
+static CmpState cmp_classify(int src_dir, int dst_dir, const gchar *name, const struct stat *s,
+                             const struct stat *d, gboolean *ambiguous)
+{
+    *ambiguous = FALSE;
+    if ((s->st_mode & S_IFMT) != (d->st_mode & S_IFMT)) return CMP_DIFFERENT;
+    gint newer = cmp_timespec(&s->st_mtim, &d->st_mtim);
+    CmpState changed = newer > 0 ? CMP_NEWER : newer < 0 ? CMP_OLDER : CMP_DIFFERENT;
+    if (S_ISREG(s->st_mode)) {
+        if (s->st_size != d->st_size) return changed;
+        if (newer == 0) return CMP_SAME;
+        *ambiguous = TRUE;
+        return changed;
+    }
+    if (S_ISLNK(s->st_mode)) {
+        gchar a[PATH_MAX], b[PATH_MAX];
+        ssize_t n = readlinkat(src_dir, name, a, sizeof a);
+        ssize_t m = readlinkat(dst_dir, name, b, sizeof b);
+        return n >= 0 && n == m && memcmp(a, b, n) == 0 ? CMP_SAME : changed;
+    }
+    return s->st_rdev == d->st_rdev ? CMP_SAME : changed;
+}
+
+// Compares one directory on both sides. Directories on both sides become
+// tasks of their own; a directory on one side only is a single entry.
+static void cmp_walk_worker(gpointer data, gpointer user_data)
+{
+    CmpScan *scan = user_data;
+    gchar *rel = data;
+    GPtrArray *found = g_ptr_array_new();
+    guint counts[CMP_STATES] = { 0 }, scanned = 0;
+    DIR *src_dir = NULL, *dst_dir = NULL;
+    GPtrArray *src = NULL, *dst = NULL;
+    if (!g_cancellable_is_cancelled(scan->cancellable)) {
+        if (!(src = cmp_read_dir(scan->src_fd, rel, &src_dir))) cmp_scan_add_error(scan, rel, g_strerror(errno));
+        else if (!(dst = cmp_read_dir(scan->dst_fd, rel, &dst_dir))) cmp_scan_add_error(scan, rel, g_strerror(errno));
+    }
+
+    for (guint i = 0, j = 0; dst && (i < src->len || j < dst->len);) {
+        const gchar *a = i < src->len ? g_ptr_array_index(src, i) : NULL;
+        const gchar *b = j < dst->len ? g_ptr_array_index(dst, j) : NULL;
+        gint c = !a ? 1 : !b ? -1 : strcmp(a, b);
+        const gchar *name = c <= 0 ? a : b;
+        if (c <= 0) i++;
+        if (c >= 0) j++;
+
+        // Entries that vanish under the walk are simply not there
+        struct stat s, d;
+        gboolean in_src = c <= 0 && fstatat(dirfd(src_dir), name, &s, AT_SYMLINK_NOFOLLOW) == 0;
+        gboolean in_dst = c >= 0 && fstatat(dirfd(dst_dir), name, &d, AT_SYMLINK_NOFOLLOW) == 0;
+        if (!in_src && !in_dst) continue;
+        gchar *child = strcmp(rel, ".") == 0 ? g_strdup(name) : g_build_filename(rel, name, NULL);
+        scanned++;
+        if (in_src && in_dst && S_ISDIR(s.st_mode) && S_ISDIR(d.st_mode)) {
+            cmp_scan_push(scan, child);
+            continue;
+        }
+
+        CmpEntry *e = g_new0(CmpEntry, 1);
+        e->path = child;
+        if (in_src) e->src_st = s;
+        if (in_dst) e->dst_st = d;
+        e->state = !in_dst ? CMP_MISSING : !in_src ? CMP_EXTRA
+                 : cmp_classify(dirfd(src_dir), dirfd(dst_dir), name, &s, &d, &e->ambiguous);
+        // Ambiguous entries are counted once their contents are compared
+        if (!e->ambiguous) counts[e->state]++;
+        if (e->state == CMP_SAME && !e->ambiguous) cmp_entry_free(e);
+        else g_ptr_array_add(found, e);
+    }
+    if (src_dir) closedir(src_dir);
+    if (dst_dir) closedir(dst_dir);
+    if (src) g_ptr_array_free(src, TRUE);
+    if (dst) g_ptr_array_free(dst, TRUE);
+    g_free(rel);
+
+    g_mutex_lock(&scan->lock);
+    for (guint i = 0; i < found->len; ++i)
+        g_ptr_array_add(scan->entries, g_ptr_array_index(found, i));
+    for (CmpState st = 0; st < CMP_STATES; ++st)
+        scan->counts[st] += counts[st];
+    scan->scanned += scanned;
+    if (--scan->outstanding == 0) g_cond_signal(&scan->cond);
+    g_mutex_unlock(&scan->lock);
+    g_ptr_array_free(found, TRUE);
+}
+
+// Compares the two trees. Entries that cannot be read are listed in
+// scan->errors; FALSE is only returned when the scan was cancelled.
+static gboolean cmp_scan_run(CmpScan *scan, GError **error)
+{
+    struct stat src_st, dst_st;
+    if (fstat(scan->src_fd, &src_st) != 0 || fstat(scan->dst_fd, &dst_st) != 0)
+        return set_errno_error(error, "Cannot stat folder");
+    // The slower side sets the pace
+    guint workers = MIN(device_io_slots(device_probe(src_st.st_dev)), device_io_slots(device_probe(dst_st.st_dev)));
+
+    scan->pool = g_thread_pool_new(cmp_walk_worker, scan, workers, FALSE, NULL);
+    cmp_scan_push(scan, g_strdup("."));
+    g_mutex_lock(&scan->lock);
+    while (scan->outstanding > 0)
+        g_cond_wait(&scan->cond, &scan->lock);
+    g_mutex_unlock(&scan->lock);
+    g_thread_pool_free(scan->pool, FALSE, TRUE);
+    scan->pool = NULL;
+    if (g_cancellable_set_error_if_cancelled(scan->cancellable, error)) return FALSE;
+    g_ptr_array_sort(scan->entries, cmp_entry_compare_path);
+
+    // Same size, other mtime: hash both sides
+    ChecksumJob *hash[2] = {
+        checksum_job_new(scan->src_fd, CHECKSUM_BLAKE3, scan->cancellable),
+        checksum_job_new(scan->dst_fd, CHECKSUM_BLAKE3, scan->cancellable),
+    };
+    GPtrArray *pending = g_ptr_array_new();
+    GPtrArray *sums[2] = { g_ptr_array_new(), g_ptr_array_new() };
+    for (guint i = 0; i < scan->entries->len; ++i) {
+        CmpEntry *e = g_ptr_array_index(scan->entries, i);
+        if (!e->ambiguous) continue;
+        g_ptr_array_add(pending, e);
+        g_ptr_array_add(sums[0], checksum_job_add_file(hash[0], e->path, &e->src_st));
+        g_ptr_array_add(sums[1], checksum_job_add_file(hash[1], e->path, &e->dst_st));
+    }
+    g_mutex_lock(&scan->lock);
+    scan->hash[0] = hash[0];
+    scan->hash[1] = hash[1];
+    g_mutex_unlock(&scan->lock);
+    gboolean ok = pending->len == 0 || (checksum_job_run(hash[0], error) && checksum_job_run(hash[1], error));
+    for (guint i = 0; ok && i < pending->len; ++i) {
+        CmpEntry *e = g_ptr_array_index(pending, i);
+        const ChecksumFile *a = g_ptr_array_index(sums[0], i), *b = g_ptr_array_index(sums[1], i);
+        if (a->digest && b->digest && strcmp(a->digest, b->digest) == 0) {
+            e->state = CMP_SAME;
+            e->retime = TRUE;
+        } else if (!a->digest || !b->digest) {
+            cmp_scan_add_error(scan, e->path, a->digest ? b->error : a->error);
+        }
+        e->ambiguous = FALSE;
+        scan->counts[e->state]++;
+    }
+    scan->hashed = pending->len;
+    g_mutex_lock(&scan->lock);
+    scan->hash[0] = scan->hash[1] = NULL;
+    g_mutex_unlock(&scan->lock);
+    checksum_job_free(hash[0]);
+    checksum_job_free(hash[1]);
+    g_ptr_array_free(sums[0], TRUE);
+    g_ptr_array_free(sums[1], TRUE);
+    g_ptr_array_free(pending, TRUE);
+    return ok;
+}
+
+// Whether a sync does anything with e.
+static gboolean cmp_entry_syncs(const CmpEntry *e)
+{
+    return e->state == CMP_MISSING || e->state == CMP_NEWER || e->state == CMP_DIFFERENT || e->retime;
+}
+
+// Blocks about the square root of the file size, as in rsync: larger
+// blocks mean a smaller index, smaller ones finer-grained matches.
+static guint32 sync_block_size(guint64 size)
+{
+    guint32 bs = SYNC_BLOCK_MIN;
+    while (bs < SYNC_BLOCK_MAX && (guint64)bs * bs < size)
+        bs *= 2;
+    return bs;
+}
+
+// rsync's weak checksum: a is the sum of the bytes, b the sum of the
+// running sums, both modulo 2^16. It rolls one byte at a time.
+static guint32 sync_weak(const guint8 *p, guint32 len, guint32 *a, guint32 *b)
+{
+    guint32 s1 = 0, s2 = 0;
+    for (guint32 i = 0; i < len; ++i) {
+        s1 += p[i];
+        s2 += s1;
+    }
+    *a = s1 & 0xffff;
+    *b = s2 & 0xffff;
+    return *a | (*b << 16);
+}
+
+static guint sync_tag(guint32 weak)
+{
+    return (weak ^ (weak >> 16)) & 0xffff;
+}
+
+// Reads len bytes at off, failing if the file is shorter.
+static gboolean sync_pread_full(int fd, guint8 *buf, gsize len, guint64 off, GError **error)
+{
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return set_errno_error(error, "Read failed");
+        if (n == 0) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Changed during the sync");
+            return FALSE;
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+// Checksums every whole block of the basis. A short last block is left
+// out; at most that much is written again.
+static gboolean sync_index_basis(SyncDelta *sd, guint64 size, GCancellable *cancellable, GError **error)
+{
+    sd->nblocks = size / sd->block_size;
+    sd->blocks = g_new(SyncBlock, MAX(sd->nblocks, 1));
+    guint8 *buf = g_malloc(COPY_BUFFER_SIZE);
+    gboolean ok = TRUE;
+    for (guint32 i = 0; ok && i < sd->nblocks;) {
+        gsize len = MIN((guint64)(sd->nblocks - i) * sd->block_size, COPY_BUFFER_SIZE / sd->block_size * sd->block_size);
+        ok = !g_cancellable_set_error_if_cancelled(cancellable, error) &&
+             sync_pread_full(sd->basis, buf, len, (guint64)i * sd->block_size, error);
+        for (gsize k = 0; ok && k < len; k += sd->block_size, ++i) {
+            guint32 a, b, weak = sync_weak(buf + k, sd->block_size, &a, &b);
+            gpointer head;
+            sd->blocks[i].weak = weak;
+            sd->blocks[i].strong = xxh64(buf + k, sd->block_size, 0);
+            sd->blocks[i].next = g_hash_table_lookup_extended(sd->heads, GUINT_TO_POINTER(weak), NULL, &head)
+                               ? GPOINTER_TO_UINT(head) : SYNC_NO_BLOCK;
+            g_hash_table_insert(sd->heads, GUINT_TO_POINTER(weak), GUINT_TO_POINTER(i));
+            sd->tags[sync_tag(weak) / 8] |= 1 << (sync_tag(weak) % 8);
+        }
+        if (ok) qos_throttle(QOS_NORMAL, len, cancellable);
+    }
+    g_free(buf);
+    return ok;
+}
+
+static gboolean sync_block_matches(SyncDelta *sd, guint32 i, guint32 weak, guint64 strong, const guint8 *data)
+{
+    const SyncBlock *blk = &sd->blocks[i];
+    return blk->weak == weak && blk->strong == strong &&
+           pread(sd->basis, sd->scratch, sd->block_size, (off_t)i * sd->block_size) == (ssize_t)sd->block_size &&
+           memcmp(sd->scratch, data, sd->block_size) == 0;
+}
+
+// The basis block holding exactly data, or SYNC_NO_BLOCK. The block after
+// the last match is tried first, so unchanged runs stay contiguous.
+static guint32 sync_find_block(SyncDelta *sd, guint32 weak, const guint8 *data, guint32 last)
+{
+    guint tag = sync_tag(weak);
+    gpointer head;
+    if (!(sd->tags[tag / 8] & (1 << (tag % 8))) ||
+        !g_hash_table_lookup_extended(sd->heads, GUINT_TO_POINTER(weak), NULL, &head))
+        return SYNC_NO_BLOCK;
+
+    guint64 strong = xxh64(data, sd->block_size, 0);
+    guint32 next = last != SYNC_NO_BLOCK && last + 1 < sd->nblocks ? last + 1 : SYNC_NO_BLOCK;
+    if (next != SYNC_NO_BLOCK && sync_block_matches(sd, next, weak, strong, data)) return next;
+    for (guint32 i = GPOINTER_TO_UINT(head); i != SYNC_NO_BLOCK; i = sd->blocks[i].next)
+        if (i != next && sync_block_matches(sd, i, weak, strong, data)) return i;
+    return SYNC_NO_BLOCK;
+}
+
+// Copies the pending run of basis blocks to the output, in the kernel
+// where the filesystem allows.
+static gboolean sync_flush_run(SyncDelta *sd, GError **error)
+{
+    loff_t in = sd->run_off, out = sd->out_off;
+    guint64 left = sd->run_len;
+    while (left > 0) {
+        ssize_t n = copy_file_range(sd->basis, &in, sd->out, &out, left, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        left -= n;
+    }
+    while (left > 0) {
+        gsize len = MIN(left, SYNC_BLOCK_MAX);
+        if (!sync_pread_full(sd->basis, sd->scratch, len, in, error) ||
+            !pwrite_all(sd->out, sd->scratch, len, out, error))
+            return FALSE;
+        in += len;
+        out += len;
+        left -= len;
+    }
+    sd->sync->reused += sd->run_len;
+    sd->out_off += sd->run_len;
+    sd->run_len = 0;
+    return TRUE;
+}
+
+static gboolean sync_write_literal(SyncDelta *sd, const guint8 *data, gsize len, GError **error)
+{
+    if (len == 0) return TRUE;
+    if (sd->run_len > 0 && !sync_flush_run(sd, error)) return FALSE;
+    if (!pwrite_all(sd->out, data, len, sd->out_off, error)) return FALSE;
+    sd->out_off += len;
+    sd->sync->literal += len;
+    return TRUE;
+}
+
+// Queues basis block i for the output, extending the pending run when it
+// follows on.
+static gboolean sync_reuse_block(SyncDelta *sd, guint32 i, GError **error)
+{
+    guint64 off = (guint64)i * sd->block_size;
+    if (sd->run_len > 0 && sd->run_off + sd->run_len != off && !sync_flush_run(sd, error)) return FALSE;
+    if (sd->run_len == 0) sd->run_off = off;
+    sd->run_len += sd->block_size;
+    return TRUE;
+}
+
+// Streams the source past the basis index and writes the new version: at
+// every offset the rolling checksum is looked up, a confirmed match is
+// taken from the basis and the window jumps a block, otherwise it moves
+// on by one byte and that byte is literal data.
+static gboolean sync_delta_stream(SyncDelta *sd, int src, GCancellable *cancellable, GError **error)
+{
+    guint32 bs = sd->block_size;
+    guint8 *buf = g_malloc(COPY_BUFFER_SIZE);
+    gsize len = 0, p = 0, lit = 0;
+    guint32 a = 0, b = 0, weak = 0, last = SYNC_NO_BLOCK;
+    gboolean eof = FALSE, fresh = TRUE, ok = TRUE;
+    while (ok) {
+        // Rolling needs the byte after the window
+        if (len - p <= bs && !eof) {
+            ok = !g_cancellable_set_error_if_cancelled(cancellable, error) &&
+                 sync_write_literal(sd, buf + lit, p - lit, error);
+            memmove(buf, buf + p, len - p);
+            len -= p;
+            p = lit = 0;
+            ssize_t n = ok ? read(src, buf + len, COPY_BUFFER_SIZE - len) : 0;
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) ok = set_errno_error(error, "Read failed");
+            if (n > 0) qos_throttle(QOS_NORMAL, n, cancellable);
+            eof = n == 0;
+            len += MAX(n, 0);
+            continue;
+        }
+        if (len - p < bs) break;
+        if (fresh) {
+            weak = sync_weak(buf + p, bs, &a, &b);
+            fresh = FALSE;
+        }
+        guint32 i = sync_find_block(sd, weak, buf + p, last);
+        if (i != SYNC_NO_BLOCK) {
+            ok = sync_write_literal(sd, buf + lit, p - lit, error) && sync_reuse_block(sd, i, error);
+            p += bs;
+            lit = p;
+            last = i;
+            fresh = TRUE;
+        } else if (p + bs < len) {
+            a = (a - buf[p] + buf[p + bs]) & 0xffff;
+            b = (b - bs * buf[p] + a) & 0xffff;
+            weak = a | (b << 16);
+            p++;
+        } else {
+            break;
+        }
+    }
+    if (ok) ok = sync_write_literal(sd, buf + lit, len - lit, error);
+    if (ok && sd->run_len > 0) ok = sync_flush_run(sd, error);
+    g_free(buf);
+    return ok;
+}
+
+// A temporary name next to path in the target tree.
+static gchar* sync_temp_path(const gchar *path)
+{
+    gchar *parent = g_path_get_dirname(path);
+    gchar *leaf = g_strdup_printf("%s%d", SYNC_TEMP_PREFIX, (int)getpid());
+    gchar *tmp = g_build_filename(parent, leaf, NULL);
+    g_free(leaf);
+    g_free(parent);
+    return tmp;
+}
+
+// Replaces the target's version of a large changed file by one built from
+// its own blocks and the source's new data.
+static gboolean sync_delta_file(CmpScan *scan, CmpSync *sync, const CmpEntry *e, GError **error)
+{
+    int src = openat(scan->src_fd, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (src < 0) return set_errno_error(error, "Cannot open source");
+    SyncDelta sd = { .sync = sync, .out = -1 };
+    sd.basis = openat(scan->dst_fd, e->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (sd.basis < 0) {
+        close(src);
+        return set_errno_error(error, "Cannot open target");
+    }
+    gchar *tmp = sync_temp_path(e->path);
+    unlinkat(scan->dst_fd, tmp, 0);
+    sd.out = openat(scan->dst_fd, tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    gboolean ok = sd.out >= 0 || set_errno_error(error, "Cannot create temporary file");
+
+    sd.block_size = sync_block_size(e->dst_st.st_size);
+    sd.heads = g_hash_table_new(g_direct_hash, g_direct_equal);
+    sd.scratch = g_malloc(SYNC_BLOCK_MAX);
+    posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+    struct stat st;
+    if (ok) ok = sync_index_basis(&sd, e->dst_st.st_size, sync->copy->cancellable, error);
+    if (ok) ok = sync_delta_stream(&sd, src, sync->copy->cancellable, error);
+    if (ok && fstat(src, &st) != 0) ok = set_errno_error(error, "Cannot stat source");
+    if (ok) copy_metadata(src, sd.out, &st);
+    if (sd.out >= 0 && close(sd.out) != 0 && ok) ok = set_errno_error(error, "Cannot finish file");
+    if (ok && renameat(scan->dst_fd, tmp, scan->dst_fd, e->path) != 0) ok = set_errno_error(error, "Cannot replace");
+    if (!ok && sd.out >= 0) unlinkat(scan->dst_fd, tmp, 0);
+
+    g_free(sd.scratch);
+    g_hash_table_destroy(sd.heads);
+    g_free(sd.blocks);
+    g_free(tmp);
+    close(sd.basis);
+    close(src);
+    return ok;
+}
+
+// Brings a changed target entry up to date: large files by delta, the
+// rest by a whole copy renamed over it.
+static gboolean sync_replace(CmpScan *scan, CmpSync *sync, const CmpEntry *e, GError **error)
+{
+    if (S_ISDIR(e->src_st.st_mode) || S_ISDIR(e->dst_st.st_mode)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_IS_DIRECTORY, "A folder on one side only; left as it is");
+        return FALSE;
+    }
+    if (!file_unchanged_at(scan->dst_fd, e->path, &e->dst_st, error)) return FALSE;
+    if (S_ISREG(e->src_st.st_mode) && S_ISREG(e->dst_st.st_mode) && e->src_st.st_size >= SYNC_DELTA_MIN &&
+        e->dst_st.st_size >= SYNC_DELTA_MIN)
+        return sync_delta_file(scan, sync, e, error);
+
+    gchar *tmp = sync_temp_path(e->path);
+    gchar *src = g_build_filename(scan->src_root, e->path, NULL);
+    gchar *dst = g_build_filename(scan->dst_root, tmp, NULL);
+    unlinkat(scan->dst_fd, tmp, 0);
+    gboolean ok = copy_engine_copy(src, dst, sync->copy, error);
+    if (ok && renameat(scan->dst_fd, tmp, scan->dst_fd, e->path) != 0) ok = set_errno_error(error, "Cannot replace");
+    if (!ok) unlinkat(scan->dst_fd, tmp, 0);
+    g_free(dst);
+    g_free(src);
+    g_free(tmp);
+    return ok;
+}
+
+// One-way sync of everything the scan found changed: missing items are
+// copied, changed ones replaced, files with the same contents get the
+// source's mtime so the next comparison needs no hashing. Entries newer in
+// the target and those only there are left alone. Failures are listed in
+// sync->copy->errors; FALSE is only returned when cancelled.
+static gboolean cmp_sync_run(CmpScan *scan, CmpSync *sync, GError **error)
+{
+    for (guint i = 0; i < scan->entries->len; ++i) {
+        CmpEntry *e = g_ptr_array_index(scan->entries, i);
+        if (e->state == CMP_OLDER) sync->skipped++;
+        if (!cmp_entry_syncs(e)) continue;
+        if (g_cancellable_set_error_if_cancelled(sync->copy->cancellable, error)) return FALSE;
+
+        GError *err = NULL;
+        gboolean ok;
+        if (e->state == CMP_MISSING) {
+            gchar *src = g_build_filename(scan->src_root, e->path, NULL);
+            gchar *dst = g_build_filename(scan->dst_root, e->path, NULL);
+            ok = copy_engine_copy(src, dst, sync->copy, &err);
+            g_free(dst);
+            g_free(src);
+            if (ok) sync->copied++;
+        } else if (e->state == CMP_SAME) {
+            struct timespec times[2] = { { .tv_nsec = UTIME_OMIT }, e->src_st.st_mtim };
+            ok = file_unchanged_at(scan->dst_fd, e->path, &e->dst_st, &err) &&
+                 (utimensat(scan->dst_fd, e->path, times, AT_SYMLINK_NOFOLLOW) == 0 ||
+                  set_errno_error(&err, "Cannot set the time"));
+            if (ok) sync->retimed++;
+        } else {
+            ok = sync_replace(scan, sync, e, &err);
+            if (ok) sync->updated++;
+        }
+        if (!ok && g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            g_propagate_error(error, err);
+            return FALSE;
+        }
+        if (!ok) {
+            copy_job_add_error(sync->copy, e->path, err);
+            g_error_free(err);
+        }
+        g_atomic_int_inc(&sync->done);
+    }
+    return TRUE;
+}
+
+// Compares two trees from the command line and, with sync, brings the
+// second up to date; reports where the time and the bytes went.
+static int run_compare_benchmark(const gchar *src, const gchar *dst, gboolean sync)
+{
+    GError *err = NULL;
+    CmpScan *scan = cmp_scan_new(src, dst, &err);
+    if (!scan) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        return 1;
+    }
+    gint64 start = g_get_monotonic_time();
+    gboolean ok = cmp_scan_run(scan, &err);
+    gdouble s = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+    if (!ok) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+        cmp_scan_free(scan);
+        return 1;
+    }
+    for (guint i = 0; i < scan->entries->len; ++i) {
+        CmpEntry *e = g_ptr_array_index(scan->entries, i);
+        if (e->state != CMP_SAME) printf("%-14s %s\n", cmp_state_names[e->state], e->path);
+    }
+    for (guint i = 0; i < scan->errors->len; ++i)
+        g_printerr("%s\n", (gchar *)g_ptr_array_index(scan->errors, i));
+    g_printerr("Compared %u entries in %.3f s, hashed %u file(s):", scan->scanned, s, scan->hashed);
+    for (CmpState st = 0; st < CMP_STATES; ++st)
+        g_printerr(" %s %u%s", cmp_state_names[st], scan->counts[st], st + 1 < CMP_STATES ? "," : "\n");
+
+    guint failed = scan->errors->len;
+    if (sync) {
+        CmpSync cs = { .copy = copy_job_new(NULL) };
+        start = g_get_monotonic_time();
+        cmp_sync_run(scan, &cs, NULL);
+        s = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+        for (guint i = 0; i < cs.copy->errors->len; ++i)
+            g_printerr("%s\n", (gchar *)g_ptr_array_index(cs.copy->errors, i));
+        g_printerr("Synced in %.3f s: %u copied, %u updated, %u retimed, %u newer in the target; "
+                   "delta transfers wrote %" G_GUINT64_FORMAT " bytes and reused %" G_GUINT64_FORMAT "\n",
+                   s, cs.copied, cs.updated, cs.retimed, cs.skipped, cs.literal, cs.reused);
+        failed += cs.copy->errors->len;
+        copy_job_free(cs.copy);
+    }
+    cmp_scan_free(scan);
+    return failed > 0;
+}
+
+// --- Snapshots ---
+// A snapshot records a tree as a Merkle tree in one compact file under
+// $XDG_STATE_HOME/owltech-fm/snapshots/<tree>/. Every directory is a
+// record of its entries, sorted by name: type, mode, size, mtime and, if
+// asked for, a BLAKE3 content hash per file. Each subdirectory entry
+// carries the offset of its own record and a hash over that record's
+// contents, so two snapshots whose directory hashes match are the same
+// tree below it. A diff starts at the roots and only descends where the
+// hashes differ, and so reads records in proportion to what changed.
+//
+// A new snapshot is taken against the last one. A directory whose mtime
+// is unchanged still has the same names, so its listing is taken from the
+// old record instead of being read again, and files whose size and mtime
+// are unchanged keep their old content hash. Every entry is still stat'ed,
+// since a file edited in place changes no directory's mtime.
+//
+// File layout, integers as LEB128 varints unless noted:
+//   header     "FMSNAP1\n", then little-endian u32 flags, i64 creation time
+//              (µs), u64 root record offset, u64 entry count, the root
+//              hash, and the root's path as a varint length and bytes
+//   record     entry count, then per entry: name NUL-terminated, type byte
+//              ('f', 'd', 'l' or 'o'), mode, size, mtime seconds zigzag
+//              encoded, mtime nanoseconds, a hash for directories (and for
+//              files and links with SNAPSHOT_HASHES), and for directories
+//              the offset of their record. A file or link whose contents
+//              could not be hashed has SNAPSHOT_NO_HASH in its mode and
+//              zeros for the hash.
+// Records are written children first, so the root comes last.
+
+#define SNAPSHOT_MAGIC "FMSNAP1\n"
+#define SNAPSHOT_HASH_LEN 16
+#define SNAPSHOT_HEADER_LEN (8 + 4 + 8 + 8 + 8 + SNAPSHOT_HASH_LEN)
+#define SNAPSHOT_HASHES 1 // Files carry content hashes
+#define SNAPSHOT_KEEP 30  // Newest snapshots kept per tree
+#define SNAPSHOT_SUFFIX ".fmsnap"
+#define SNAPSHOT_NONE G_MAXUINT64
+#define SNAPSHOT_NO_HASH 0x10000 // In an entry's mode: the hash is missing
+
+typedef struct {
+    GMappedFile *map;
+    const guint8 *data;
+    gsize len;
+    gchar *file;
+    gchar *root;     // The tree it records
+    guint32 flags;
+    gint64 created;  // µs since the epoch
+    guint64 root_offset;
+    guint64 entries;
+    guint8 root_hash[SNAPSHOT_HASH_LEN];
+} Snapshot;
+
+typedef struct {
+    const gchar *name;    // In the mapping
+    gchar type;
+    guint32 mode;
+    guint64 size;
+    gint64 mtime_sec;
+    guint32 mtime_nsec;
+    const guint8 *hash;   // NULL for files without a content hash, never reused
+    guint64 child;        // Directories: offset of their record
+} SnapEntry;
+
+typedef enum {
+    SNAPSHOT_ADDED,
+    SNAPSHOT_REMOVED,
+    SNAPSHOT_MODIFIED,
+} SnapshotChangeKind;
+
+typedef struct {
+    gchar *path;
+    SnapshotChangeKind kind;
+    gboolean dir;
+} SnapshotChange;
+
+typedef struct {
+    FILE *out;
+    guint64 offset;      // Bytes written so far
+    guint32 flags;
+    dev_t dev;           // Mount points below the root are not entered
+    Snapshot *base;      // The previous snapshot of the tree, or NULL
+    ChecksumJob *hash;   // Hashes file contents with SNAPSHOT_HASHES
+    GCancellable *cancellable;
+    GPtrArray *errors;
+    gint entries;         // Updated atomically, for progress
+    guint dirs_read;      // Directories whose listing had to be read
+    guint dirs_reused;    // Listings taken from the previous snapshot
+    guint files_hashed;
+    guint hashes_reused;
+} SnapshotScan;
+
+static const gchar *const snapshot_change_names[] = { "Added", "Removed", "Modified" };
+
+static void snapshot_change_free(SnapshotChange *c)
+{
+    g_free(c->path);
+    g_free(c);
+}
+
+static void snapshot_close(Snapshot *snap)
+{
+    if (snap->map) g_mapped_file_unref(snap->map);
+    g_free(snap->file);
+    g_free(snap->root);
+    g_free(snap);
+}
+
+static void snap_put_varint(GByteArray *b, guint64 v)
+{
+    guint8 byte;
+    do {
+        byte = (v & 0x7f) | (v >= 0x80 ? 0x80 : 0);
+        g_byte_array_append(b, &byte, 1);
+        v >>= 7;
+    } while (byte & 0x80);
+}
+
+static void snap_put_le(GByteArray *b, guint64 v, guint bytes)
+{
+    for (guint i = 0; i < bytes; ++i) {
+        guint8 byte = v >> (8 * i);
+        g_byte_array_append(b, &byte, 1);
+    }
+}
+
+static guint64 snap_get_le(const guint8 *p, guint bytes)
+{
+    guint64 v = 0;
+    for (guint i = 0; i < bytes; ++i)
+        v |= (guint64)p[i] << (8 * i);
+    return v;
+}
+
+// Decodes a varint at *p, which must stay before end; FALSE when it does
+// not.
+static gboolean snap_get_varint(const guint8 **p, const guint8 *end, guint64 *v)
+{
+    *v = 0;
+    for (guint shift = 0; *p < end && shift < 64; shift += 7) {
+        guint8 byte = *(*p)++;
+        *v |= (guint64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return TRUE;
+    }
+    return FALSE;
+}
+
+static gboolean snap_corrupt(const Snapshot *snap, GError **error)
+{
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is damaged", snap->file);
+    return FALSE;
+}
+
+static Snapshot* snapshot_open(const gchar *file, GError **error)
+{
+    GMappedFile *map = g_mapped_file_new(file, FALSE, error);
+    if (!map) return NULL;
+    Snapshot *snap = g_new0(Snapshot, 1);
+    snap->map = map;
+    snap->data = (const guint8 *)g_mapped_file_get_contents(map);
+    snap->len = g_mapped_file_get_length(map);
+    snap->file = g_strdup(file);
+    const guint8 *p = snap->data + SNAPSHOT_HEADER_LEN, *end = snap->data + snap->len;
+    guint64 path_len;
+    if (snap->len < SNAPSHOT_HEADER_LEN || memcmp(snap->data, SNAPSHOT_MAGIC, 8) != 0 ||
+        !snap_get_varint(&p, end, &path_len) || path_len > (guint64)(end - p)) {
+        snap_corrupt(snap, error);
+        snapshot_close(snap);
+        return NULL;
+    }
+    snap->flags = snap_get_le(snap->data + 8, 4);
+    snap->created = snap_get_le(snap->data + 12, 8);
+    snap->root_offset = snap_get_le(snap->data + 20, 8);
+    snap->entries = snap_get_le(snap->data + 28, 8);
+    memcpy(snap->root_hash, snap->data + 36, SNAPSHOT_HASH_LEN);
+    snap->root = g_strndup((const gchar *)p, path_len);
+    return snap;
+}
+
+// Decodes the directory record at offset into entries.
+static gboolean snapshot_read_dir(const Snapshot *snap, guint64 offset, GArray *entries, GError **error)
+{
+    g_array_set_size(entries, 0);
+    if (offset >= snap->len) return snap_corrupt(snap, error);
+    const guint8 *p = snap->data + offset, *end = snap->data + snap->len;
+    guint64 count;
+    if (!snap_get_varint(&p, end, &count)) return snap_corrupt(snap, error);
+    for (guint64 i = 0; i < count; ++i) {
+        SnapEntry e = { .name = (const gchar *)p };
+        const guint8 *nul = memchr(p, '\0', end - p);
+        guint64 mode, sec, nsec;
+        if (!nul || nul + 2 > end) return snap_corrupt(snap, error);
+        p = nul + 1;
+        e.type = *p++;
+        if (!snap_get_varint(&p, end, &mode) || !snap_get_varint(&p, end, &e.size) ||
+            !snap_get_varint(&p, end, &sec) || !snap_get_varint(&p, end, &nsec))
+            return snap_corrupt(snap, error);
+        e.mode = mode & 07777;
+        e.mtime_sec = (gint64)(sec >> 1) ^ -(gint64)(sec & 1);
+        e.mtime_nsec = nsec;
+        if (e.type == 'd' || (snap->flags & SNAPSHOT_HASHES)) {
+            static const guint8 none[SNAPSHOT_HASH_LEN];
+            if (end - p < SNAPSHOT_HASH_LEN) return snap_corrupt(snap, error);
+            // Snapshots from before SNAPSHOT_NO_HASH left only the zeros
+            if (e.type == 'd' || !((mode & SNAPSHOT_NO_HASH) || memcmp(p, none, SNAPSHOT_HASH_LEN) == 0))
+                e.hash = p;
+            p += SNAPSHOT_HASH_LEN;
+        }
+        if (e.type == 'd' && (!snap_get_varint(&p, end, &e.child) || e.child >= offset))
+            return snap_corrupt(snap, error);
+        g_array_append_val(entries, e);
+    }
+    return TRUE;
+}
+
+// Where the snapshots of the tree at root (a resolved path) are kept.
+static gchar* snapshot_dir(const gchar *root)
+{
+    gchar *key = g_compute_checksum_for_string(G_CHECKSUM_SHA256, root, -1);
+    key[16] = '\0';
+    gchar *dir = g_build_filename(g_get_user_state_dir(), "owltech-fm", "snapshots", key, NULL);
+    g_free(key);
+    return dir;
+}
+
+static gint snapshot_compare_files(gconstpointer a, gconstpointer b)
+{
+    // Named by creation time, newest first
+    gint64 x = g_ascii_strtoll(*(const gchar * const *)a, NULL, 10);
+    gint64 y = g_ascii_strtoll(*(const gchar * const *)b, NULL, 10);
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Snapshot files of the tree at root, newest first.
+static GPtrArray* snapshot_list(const gchar *root)
+{
+    GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+    gchar *dir = snapshot_dir(root);
+    GDir *d = g_dir_open(dir, 0, NULL);
+    const gchar *name;
+    while (d && (name = g_dir_read_name(d)) != NULL)
+        if (g_str_has_suffix(name, SNAPSHOT_SUFFIX)) g_ptr_array_add(files, g_strdup(name));
+    if (d) g_dir_close(d);
+    g_ptr_array_sort(files, snapshot_compare_files);
+    for (guint i = 0; i < files->len; ++i) {
+        gchar *path = g_build_filename(dir, g_ptr_array_index(files, i), NULL);
+        g_free(files->pdata[i]);
+        files->pdata[i] = path;
+    }
+    g_free(dir);
+    return files;
+}
+
+static gchar snapshot_type(mode_t mode)
+{
+    return S_ISREG(mode) ? 'f' : S_ISDIR(mode) ? 'd' : S_ISLNK(mode) ? 'l' : 'o';
+}
+
+// Appends one entry to a directory record and its hashed form to h. A
+// directory's own size and mtime are recorded but left out of the hash:
+// they change with every create and delete inside, and what the hash
+// covers is the contents.
+static void snapshot_put_entry(SnapshotScan *s, GByteArray *rec, Blake3 *h, const gchar *name,
+                               const struct stat *st, const guint8 *hash, guint64 child)
+{
+    gchar type = snapshot_type(st->st_mode);
+    gboolean missing = !hash && (s->flags & SNAPSHOT_HASHES) && (type == 'f' || type == 'l');
+    guint start = rec->len;
+    g_byte_array_append(rec, (const guint8 *)name, strlen(name) + 1);
+    g_byte_array_append(rec, (const guint8 *)&type, 1);
+    snap_put_varint(rec, (st->st_mode & 07777) | (missing ? SNAPSHOT_NO_HASH : 0));
+    guint hashed_end = rec->len;
+    snap_put_varint(rec, type == 'd' ? 0 : st->st_size);
+    snap_put_varint(rec, ((guint64)st->st_mtim.tv_sec << 1) ^ (guint64)(st->st_mtim.tv_sec >> 63));
+    snap_put_varint(rec, st->st_mtim.tv_nsec);
+    if (type != 'd') hashed_end = rec->len;
+    if (type == 'd' || (s->flags & SNAPSHOT_HASHES)) {
+        static const guint8 none[SNAPSHOT_HASH_LEN];
+        g_byte_array_append(rec, hash ? hash : none, SNAPSHOT_HASH_LEN);
+        blake3_update(h, rec->data + start, hashed_end - start);
+        blake3_update(h, hash ? hash : none, SNAPSHOT_HASH_LEN);
+    } else {
+        blake3_update(h, rec->data + start, hashed_end - start);
+    }
+    if (type == 'd') snap_put_varint(rec, child);
+}
+
+// The entry called name in a decoded record, or NULL. Both sides are
+// sorted, so callers walk them together through *cursor.
+static const SnapEntry* snapshot_find(GArray *entries, guint *cursor, const gchar *name)
+{
+    while (*cursor < entries->len) {
+        const SnapEntry *e = &g_array_index(entries, SnapEntry, *cursor);
+        gint c = strcmp(e->name, name);
+        if (c > 0) return NULL;
+        ++*cursor;
+        if (c == 0) return e;
+    }
+    return NULL;
+}
+
+static gboolean snapshot_hash_file(SnapshotScan *s, int dir_fd, const gchar *name, struct stat *st,
+                                   guint8 hash[SNAPSHOT_HASH_LEN], GError **error)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) return set_errno_error(error, "Cannot open");
+    ChecksumFile f = { .path = (gchar *)name };
+    gboolean ok = checksum_whole_file(s->hash, &f, fd, error);
+    close(fd);
+    if (!ok) return FALSE;
+    // The metadata recorded is that of the contents hashed
+    *st = f.st;
+    for (guint i = 0; i < SNAPSHOT_HASH_LEN; ++i)
+        hash[i] = g_ascii_xdigit_value(f.digest[2 * i]) << 4 | g_ascii_xdigit_value(f.digest[2 * i + 1]);
+    g_free(f.digest);
+    return TRUE;
+}
+
+static void snapshot_scan_add_error(SnapshotScan *s, const gchar *rel, const gchar *name, const gchar *what)
+{
+    gchar *path = strcmp(rel, ".") == 0 ? g_strdup(name) : g_build_filename(rel, name, NULL);
+    g_ptr_array_add(s->errors, g_strdup_printf("%s: %s", path, what));
+    g_free(path);
+}
+
+// Writes a directory record and finishes its hash.
+static gboolean snapshot_write_record(SnapshotScan *s, guint count, GByteArray *rec, Blake3 *h, guint64 *offset,
+                                      guint8 hash[SNAPSHOT_HASH_LEN], GError **error)
+{
+    GByteArray *head = g_byte_array_new();
+    snap_put_varint(head, count);
+    gboolean ok = fwrite(head->data, 1, head->len, s->out) == head->len &&
+                  fwrite(rec->data, 1, rec->len, s->out) == rec->len;
+    *offset = s->offset;
+    s->offset += head->len + rec->len;
+    g_byte_array_free(head, TRUE);
+    guint8 digest[32];
+    blake3_finish(h, digest);
+    memcpy(hash, digest, SNAPSHOT_HASH_LEN);
+    return ok || set_errno_error(error, "Cannot write snapshot");
+}
+
+// Names in the directory open as dir_fd, sorted; NULL with errno set when
+// it cannot be read.
+static GPtrArray* snapshot_read_names(int dir_fd)
+{
+    int fd = openat(dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        int saved = errno;
+        if (fd >= 0) close(fd);
+        errno = saved;
+        return NULL;
+    }
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL)
+        if (!cmp_skip_name(de->d_name)) g_ptr_array_add(names, g_strdup(de->d_name));
+    closedir(dir);
+    g_ptr_array_sort(names, cmp_compare_names);
+    return names;
+}
+
+// FALSE when a timestamp recorded in the base snapshot is too close to the
+// moment that snapshot started: a change within the same clock tick leaves
+// the mtime as it was, so only older stamps prove nothing changed since.
+static gboolean snapshot_stamp_trusted(const SnapshotScan *s, gint64 sec)
+{
+    return sec < s->base->created / G_USEC_PER_SEC - 1;
+}
+
+// Records the directory open as dir_fd, its subdirectories first, and
+// returns the offset and hash of its record. prev is its entry in the
+// previous snapshot, or NULL. Unreadable entries are listed in s->errors;
+// FALSE means the snapshot cannot be completed.
+static gboolean snapshot_scan_dir(SnapshotScan *s, int dir_fd, const gchar *rel, const struct stat *dir_st,
+                                  const SnapEntry *prev, guint64 *offset, guint8 hash[SNAPSHOT_HASH_LEN],
+                                  GError **error)
+{
+    if (g_cancellable_set_error_if_cancelled(s->cancellable, error)) return FALSE;
+    GArray *old = prev ? g_array_new(FALSE, FALSE, sizeof(SnapEntry)) : NULL;
+    if (old && !snapshot_read_dir(s->base, prev->child, old, NULL)) {
+        // Scanned afresh, like a new directory
+        g_array_free(old, TRUE);
+        old = NULL;
+    }
+
+    // The names in a directory only change along with its mtime
+    GPtrArray *names;
+    if (old && prev->mtime_sec == dir_st->st_mtim.tv_sec && prev->mtime_nsec == dir_st->st_mtim.tv_nsec &&
+        snapshot_stamp_trusted(s, prev->mtime_sec)) {
+        names = g_ptr_array_new_with_free_func(g_free);
+        for (guint i = 0; i < old->len; ++i)
+            g_ptr_array_add(names, g_strdup(g_array_index(old, SnapEntry, i).name));
+        s->dirs_reused++;
+    } else if ((names = snapshot_read_names(dir_fd)) != NULL) {
+        s->dirs_read++;
+    } else {
+        g_ptr_array_add(s->errors, g_strdup_printf("%s: %s", rel, g_strerror(errno)));
+        names = g_ptr_array_new();
+    }
+
+    GByteArray *rec = g_byte_array_new();
+    Blake3 h;
+    blake3_init(&h, 0);
+    guint count = 0, cursor = 0;
+    gboolean ok = TRUE;
+    for (guint i = 0; ok && i < names->len; ++i) {
+        const gchar *name = g_ptr_array_index(names, i);
+        const SnapEntry *was = old ? snapshot_find(old, &cursor, name) : NULL;
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            if (errno != ENOENT) snapshot_scan_add_error(s, rel, name, g_strerror(errno));
+            continue;
+        }
+        guint8 entry_hash[SNAPSHOT_HASH_LEN];
+        const guint8 *eh = NULL;
+        guint64 child = 0;
+        gchar type = snapshot_type(st.st_mode);
+        gboolean same = was && was->type == type && was->size == (guint64)st.st_size &&
+                        was->mtime_sec == st.st_mtim.tv_sec && was->mtime_nsec == (guint32)st.st_mtim.tv_nsec &&
+                        snapshot_stamp_trusted(s, was->mtime_sec);
+        if (S_ISDIR(st.st_mode)) {
+            // Mount points and unreadable directories are recorded empty
+            int fd = st.st_dev == s->dev ? openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+            if (fd < 0 && st.st_dev == s->dev) snapshot_scan_add_error(s, rel, name, g_strerror(errno));
+            gchar *child_rel = strcmp(rel, ".") == 0 ? g_strdup(name) : g_build_filename(rel, name, NULL);
+            if (fd >= 0) {
+                ok = snapshot_scan_dir(s, fd, child_rel, &st, was && was->type == 'd' ? was : NULL, &child,
+                                       entry_hash, error);
+                close(fd);
+            } else {
+                GByteArray *empty = g_byte_array_new();
+                Blake3 eh3;
+                blake3_init(&eh3, 0);
+                ok = snapshot_write_record(s, 0, empty, &eh3, &child, entry_hash, error);
+                g_byte_array_free(empty, TRUE);
+            }
+            g_free(child_rel);
+            eh = entry_hash;
+        } else if ((s->flags & SNAPSHOT_HASHES) && same && was->hash && type != 'o') {
+            eh = was->hash;
+            s->hashes_reused++;
+        } else if ((s->flags & SNAPSHOT_HASHES) && type == 'f') {
+            GError *err = NULL;
+            if (snapshot_hash_file(s, dir_fd, name, &st, entry_hash, &err)) {
+                eh = entry_hash;
+                s->files_hashed++;
+            } else if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_propagate_error(error, err);
+                ok = FALSE;
+            } else {
+                snapshot_scan_add_error(s, rel, name, err->message);
+                g_error_free(err);
+            }
+        } else if ((s->flags & SNAPSHOT_HASHES) && type == 'l') {
+            gchar target[PATH_MAX];
+            ssize_t n = readlinkat(dir_fd, name, target, sizeof target);
+            if (n >= 0) {
+                Blake3 lh;
+                guint8 digest[32];
+                blake3_init(&lh, 0);
+                blake3_update(&lh, target, n);
+                blake3_finish(&lh, digest);
+                memcpy(entry_hash, digest, SNAPSHOT_HASH_LEN);
+                eh = entry_hash;
+            } else {
+                snapshot_scan_add_error(s, rel, name, g_strerror(errno));
+            }
+        }
+        if (!ok) break;
+        snapshot_put_entry(s, rec, &h, name, &st, eh, child);
+        count++;
+        g_atomic_int_inc(&s->entries);
+    }
+    if (ok) ok = snapshot_write_record(s, count, rec, &h, offset, hash, error);
+    g_byte_array_free(rec, TRUE);
+    g_ptr_array_free(names, TRUE);
+    if (old) g_array_free(old, TRUE);
+    return ok;
+}
+
+static SnapshotScan* snapshot_scan_new(guint32 flags, Snapshot *base)
+{
+    SnapshotScan *s = g_new0(SnapshotScan, 1);
+    s->flags = flags;
+    s->base = base;
+    s->cancellable = g_cancellable_new();
+    s->errors = g_ptr_array_new_with_free_func(g_free);
+    return s;
+}
+
+static void snapshot_scan_free(SnapshotScan *s)
+{
+    if (s->base) snapshot_close(s->base);
+    g_object_unref(s->cancellable);
+    g_ptr_array_free(s->errors, TRUE);
+    g_free(s);
+}
+
+// Removes all but the SNAPSHOT_KEEP newest snapshots of a tree.
+static void snapshot_prune(const gchar *root)
+{
+    GPtrArray *files = snapshot_list(root);
+    for (guint i = SNAPSHOT_KEEP; i < files->len; ++i)
+        unlink(g_ptr_array_index(files, i));
+    g_ptr_array_free(files, TRUE);
+}
+
+// Takes a snapshot of the tree at root, a resolved path, and returns the
+// file it was stored in. The file only appears once it is complete.
+static gchar* snapshot_take(SnapshotScan *s, const gchar *root, GError **error)
+{
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat root_st;
+    if (root_fd < 0 || fstat(root_fd, &root_st) != 0) {
+        set_errno_error(error, "Cannot open folder");
+        if (root_fd >= 0) close(root_fd);
+        return NULL;
+    }
+    gchar *dir = snapshot_dir(root);
+    gchar *tmp = g_build_filename(dir, "XXXXXX.tmp", NULL);
+    int fd = g_mkdir_with_parents(dir, 0700) == 0 ? mkstemps(tmp, strlen(".tmp")) : -1;
+    if (fd < 0 || !(s->out = fdopen(fd, "w"))) {
+        set_errno_error(error, "Cannot create snapshot");
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp);
+        }
+        g_free(tmp);
+        g_free(dir);
+        close(root_fd);
+        return NULL;
+    }
+
+    // The header is written again once the root record is known
+    gint64 created = g_get_real_time();
+    GByteArray *header = g_byte_array_new();
+    g_byte_array_append(header, (const guint8 *)SNAPSHOT_MAGIC, 8);
+    snap_put_le(header, s->flags, 4);
+    snap_put_le(header, created, 8);
+    g_byte_array_set_size(header, SNAPSHOT_HEADER_LEN);
+    memset(header->data + 20, 0, SNAPSHOT_HEADER_LEN - 20);
+    snap_put_varint(header, strlen(root));
+    g_byte_array_append(header, (const guint8 *)root, strlen(root));
+    gboolean ok = fwrite(header->data, 1, header->len, s->out) == header->len || set_errno_error(error, "Cannot write snapshot");
+    s->offset = header->len;
+    s->dev = root_st.st_dev;
+    if (s->flags & SNAPSHOT_HASHES) s->hash = checksum_job_new(root_fd, CHECKSUM_BLAKE3, s->cancellable);
+
+    // The root's listing is always read; its entries can still be reused
+    SnapEntry prev = { .type = 'd', .mtime_sec = G_MININT64 };
+    if (s->base) prev.child = s->base->root_offset;
+    guint64 root_offset = 0;
+    guint8 root_hash[SNAPSHOT_HASH_LEN];
+    if (ok) ok = snapshot_scan_dir(s, root_fd, ".", &root_st, s->base ? &prev : NULL, &root_offset, root_hash, error);
+
+    g_byte_array_set_size(header, 20);
+    snap_put_le(header, root_offset, 8);
+    snap_put_le(header, g_atomic_int_get(&s->entries), 8);
+    g_byte_array_append(header, root_hash, SNAPSHOT_HASH_LEN);
+    if (ok && (fflush(s->out) != 0 || pwrite(fileno(s->out), header->data, header->len, 0) != (ssize_t)header->len ||
+               fdatasync(fileno(s->out)) != 0))
+        ok = set_errno_error(error, "Cannot write snapshot");
+    if (fclose(s->out) != 0 && ok) ok = set_errno_error(error, "Cannot write snapshot");
+    s->out = NULL;
+    g_byte_array_free(header, TRUE);
+
+    gchar *file = NULL;
+    if (ok) {
+        gchar *name = g_strdup_printf("%" G_GINT64_FORMAT SNAPSHOT_SUFFIX, created);
+        file = g_build_filename(dir, name, NULL);
+        g_free(name);
+        if (rename(tmp, file) != 0) {
+            set_errno_error(error, "Cannot store snapshot");
+            g_clear_pointer(&file, g_free);
+        }
+    }
+    if (!file) unlink(tmp);
+    else snapshot_prune(root);
+    if (s->hash) {
+        checksum_job_free(s->hash);
+        s->hash = NULL;
+    }
+    g_free(tmp);
+    g_free(dir);
+    close(root_fd);
+    return file;
+}
+
+static gboolean snapshot_entry_changed(const SnapEntry *a, const SnapEntry *b)
+{
+    if (a->type != b->type || a->mode != b->mode || a->size != b->size) return TRUE;
+    // Contents decide where both sides have them; a touch is no change
+    if (a->hash && b->hash) return memcmp(a->hash, b->hash, SNAPSHOT_HASH_LEN) != 0;
+    return a->mtime_sec != b->mtime_sec || a->mtime_nsec != b->mtime_nsec;
+}
+
+static void snapshot_add_change(GPtrArray *changes, const gchar *prefix, const SnapEntry *e, SnapshotChangeKind kind)
+{
+    SnapshotChange *c = g_new0(SnapshotChange, 1);
+    c->path = prefix ? g_build_filename(prefix, e->name, NULL) : g_strdup(e->name);
+    c->kind = kind;
+    c->dir = e->type == 'd';
+    g_ptr_array_add(changes, c);
+}
+
+// Diffs two directory records, descending only into subdirectories whose
+// hashes differ. A directory added or removed is one change.
+static gboolean snapshot_diff_dir(const Snapshot *a, guint64 a_off, const Snapshot *b, guint64 b_off,
+                                  const gchar *prefix, GPtrArray *changes, GError **error)
+{
+    GArray *x = g_array_new(FALSE, FALSE, sizeof(SnapEntry));
+    GArray *y = g_array_new(FALSE, FALSE, sizeof(SnapEntry));
+    gboolean ok = snapshot_read_dir(a, a_off, x, error) && snapshot_read_dir(b, b_off, y, error);
+    for (guint i = 0, j = 0; ok && (i < x->len || j < y->len);) {
+        const SnapEntry *ea = i < x->len ? &g_array_index(x, SnapEntry, i) : NULL;
+        const SnapEntry *eb = j < y->len ? &g_array_index(y, SnapEntry, j) : NULL;
+        gint c = !ea ? 1 : !eb ? -1 : strcmp(ea->name, eb->name);
+        if (c < 0) {
+            snapshot_add_change(changes, prefix, ea, SNAPSHOT_REMOVED);
+        } else if (c > 0) {
+            snapshot_add_change(changes, prefix, eb, SNAPSHOT_ADDED);
+        } else if (ea->type == 'd' && eb->type == 'd') {
+            if (ea->mode != eb->mode) snapshot_add_change(changes, prefix, eb, SNAPSHOT_MODIFIED);
+            if (memcmp(ea->hash, eb->hash, SNAPSHOT_HASH_LEN) != 0) {
+                gchar *path = prefix ? g_build_filename(prefix, ea->name, NULL) : g_strdup(ea->name);
+                ok = snapshot_diff_dir(a, ea->child, b, eb->child, path, changes, error);
+                g_free(path);
+            }
+        } else if (snapshot_entry_changed(ea, eb)) {
+            snapshot_add_change(changes, prefix, eb, SNAPSHOT_MODIFIED);
+        }
+        if (c <= 0) i++;
+        if (c >= 0) j++;
+    }
+    g_array_free(x, TRUE);
+    g_array_free(y, TRUE);
+    return ok;
+}
+
+// What changed from snapshot a to snapshot b, as SnapshotChange in path
+// order within each directory.
+static GPtrArray* snapshot_diff(const Snapshot *a, const Snapshot *b, GError **error)
+{
+    GPtrArray *changes = g_ptr_array_new_with_free_func((GDestroyNotify)snapshot_change_free);
+    if (memcmp(a->root_hash, b->root_hash, SNAPSHOT_HASH_LEN) != 0 &&
+        !snapshot_diff_dir(a, a->root_offset, b, b->root_offset, NULL, changes, error)) {
+        g_ptr_array_free(changes, TRUE);
+        return NULL;
+    }
+    return changes;
+}
+
+static void snapshot_count_changes(GPtrArray *changes, guint counts[3])
+{
+    counts[0] = counts[1] = counts[2] = 0;
+    for (guint i = 0; i < changes->len; ++i)
+        counts[((SnapshotChange *)g_ptr_array_index(changes, i))->kind]++;
+}
+
+// Snapshots a tree from the command line against its last snapshot and
+// lists what changed since.
+static int run_snapshot_benchmark(const gchar *dir, gboolean hashes)
+{
+    gchar *root = realpath(dir, NULL);
+    if (!root) {
+        g_printerr("Cannot resolve %s: %s\n", dir, g_strerror(errno));
+        return 1;
+    }
+    GPtrArray *files = snapshot_list(root);
+    GError *err = NULL;
+    Snapshot *base = files->len > 0 ? snapshot_open(g_ptr_array_index(files, 0), &err) : NULL;
+    if (err) {
+        g_printerr("%s\n", err->message);
+        g_clear_error(&err);
+    }
+    g_ptr_array_free(files, TRUE);
+
+    SnapshotScan *s = snapshot_scan_new(hashes ? SNAPSHOT_HASHES : 0, base);
+    gint64 start = g_get_monotonic_time();
+    gchar *file = snapshot_take(s, root, &err);
+    gdouble took = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+    for (guint i = 0; i < s->errors->len; ++i)
+        g_printerr("%s\n", (gchar *)g_ptr_array_index(s->errors, i));
+    int status = file ? 0 : 1;
+    if (!file) {
+        g_printerr("%s\n", err->message);
+        g_error_free(err);
+    } else {
+        g_printerr("Snapshot of %d entries in %.3f s: %u listings read, %u reused, %u files hashed, %u hashes reused\n",
+                   g_atomic_int_get(&s->entries), took, s->dirs_read, s->dirs_reused, s->files_hashed,
+                   s->hashes_reused);
+        Snapshot *now = base ? snapshot_open(file, &err) : NULL;
+        start = g_get_monotonic_time();
+        GPtrArray *changes = now ? snapshot_diff(base, now, &err) : NULL;
+        took = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+        if (changes) {
+            guint counts[3];
+            snapshot_count_changes(changes, counts);
+            for (guint i = 0; i < changes->len; ++i) {
+                SnapshotChange *c = g_ptr_array_index(changes, i);
+                printf("%-9s %s%s\n", snapshot_change_names[c->kind], c->path, c->dir ? "/" : "");
+            }
+            g_printerr("Diff in %.6f s: %u added, %u removed, %u modified\n", took, counts[0], counts[1], counts[2]);
+            g_ptr_array_free(changes, TRUE);
+        } else if (err) {
+            g_printerr("%s\n", err->message);
+            g_clear_error(&err);
+            status = 1;
+        }
+        if (now) snapshot_close(now);
+        g_free(file);
+    }
+    snapshot_scan_free(s);
+    free(root);
+    return status;
+}
+
+// --- Scrubber ---
+// Looks for silent corruption: files whose content changed although their
+// size and mtime did not, which no writer leaves behind. A pass re-reads
+// every regular file under a tree and compares it with the digest the
+// checksum xattr cache holds for it. A file with no digest, or only one
+// taken before its last legitimate change, is sealed with a fresh BLAKE3
+// digest for the next pass to check. Cached pages are dropped before and
+// after each file, so it is the disk that gets read, and reads run in the
+// background class under a bandwidth cap of the scrub's own. The walk goes
+// in name order and stays on the tree's filesystem. The last file done is
+// checkpointed to a state file under $XDG_STATE_HOME/owltech-fm/scrub/, so
+// a pass that is cancelled or cut short by a restart continues where it
+// stopped, and trees with a state file are scrubbed again every
+// SCRUB_INTERVAL_DAYS while the file manager runs. Records are one per
+// line, with tab-separated fields and escaped paths:
+//   FMSCRUB1                        header
+//   R <root>                        the tree, a resolved path
+//   L <MiB/s>                       bandwidth cap; 0 for none
+//   P <started> <finished> <bytes>  start of the pass under way and end of
+//                                   the last complete one, in microseconds
+//                                   since the epoch or 0, and what the
+//                                   complete one read
+//   C <path>                        last file done in the pass under way
+//   N <files> <bytes> <sealed>      done in the latest pass
+//   B <path: reason>                a bad file found in the latest pass
+
+#define SCRUB_MAGIC "FMSCRUB1"
+#define SCRUB_SUFFIX ".scrub"
+#define SCRUB_INTERVAL_DAYS 30
+#define SCRUB_DEFAULT_RATE 20 // MiB/s
+#define SCRUB_CHECKPOINT_INTERVAL (10 * G_USEC_PER_SEC)
+#define SCRUB_CHECK_SECONDS 3600 // How often due trees are looked for
+#define SCRUB_BAD_CONTENT "Content changed but size and mtime did not"
+
+typedef struct {
+    gchar *path;          // Of the state file
+    gchar *root;
+    gint rate;            // MiB/s; the UI may change it while a pass runs
+    gint64 started;       // Of the pass under way; 0 when there is none
+    gint64 finished;      // Of the last complete pass; 0 when there is none
+    guint64 last_bytes;   // Read by the last complete pass
+    gchar *cursor;        // Last file done in the pass under way, or NULL
+    guint64 files;        // Done in the latest pass
+    guint64 bytes;
+    guint64 sealed;
+    GPtrArray *bad;       // "path: reason", found in the latest pass
+} ScrubState;
+
+typedef struct {
+    ScrubState *state;
+    int root_fd;
+    dev_t dev;
+    GCancellable *cancellable;
+    QosBucket bucket;
+    GMutex lock;          // Guards the state's counters against progress reads
+    guint64 reading;      // Bytes of the current file read so far
+    guint8 *buf;
+    gint64 saved;         // When the state was last written
+    GPtrArray *found;     // Bad files found by this run
+    GPtrArray *errors;    // Entries that could not be scrubbed
+} Scrub;
+
+// The state file of the tree at root, a resolved path.
+static gchar* scrub_state_path(const gchar *root)
+{
+    gchar *key = g_compute_checksum_for_string(G_CHECKSUM_SHA256, root, -1);
+    key[16] = '\0';
+    gchar *name = g_strconcat(key, SCRUB_SUFFIX, NULL);
+    gchar *path = g_build_filename(g_get_user_state_dir(), "owltech-fm", "scrub", name, NULL);
+    g_free(name);
+    g_free(key);
+    return path;
+}
+
+static ScrubState* scrub_state_alloc(const gchar *path)
+{
+    ScrubState *state = g_new0(ScrubState, 1);
+    state->path = g_strdup(path);
+    state->rate = SCRUB_DEFAULT_RATE;
+    state->bad = g_ptr_array_new_with_free_func(g_free);
+    return state;
+}
+
+static ScrubState* scrub_state_new(const gchar *root)
+{
+    gchar *path = scrub_state_path(root);
+    ScrubState *state = scrub_state_alloc(path);
+    state->root = g_strdup(root);
+    g_free(path);
+    return state;
+}
+
+static void scrub_state_free(ScrubState *state)
+{
+    g_ptr_array_free(state->bad, TRUE);
+    g_free(state->cursor);
+    g_free(state->root);
+    g_free(state->path);
+    g_free(state);
+}
+
+static ScrubState* scrub_state_load(const gchar *path, GError **error)
+{
+    gchar *contents = NULL;
+    if (!g_file_get_contents(path, &contents, NULL, error)) return NULL;
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    ScrubState *state = g_strcmp0(lines[0], SCRUB_MAGIC) == 0 ? scrub_state_alloc(path) : NULL;
+    for (guint i = 1; state && lines[i]; ++i) {
+        gchar **f = g_strsplit(lines[i], "\t", 5);
+        guint n = g_strv_length(f);
+        if (n >= 2 && strcmp(f[0], "R") == 0) {
+            g_free(state->root);
+            state->root = g_strcompress(f[1]);
+        } else if (n >= 2 && strcmp(f[0], "L") == 0) {
+            state->rate = (gint)g_ascii_strtoll(f[1], NULL, 10);
+        } else if (n >= 4 && strcmp(f[0], "P") == 0) {
+            state->started = g_ascii_strtoll(f[1], NULL, 10);
+            state->finished = g_ascii_strtoll(f[2], NULL, 10);
+            state->last_bytes = g_ascii_strtoull(f[3], NULL, 10);
+        } else if (n >= 2 && strcmp(f[0], "C") == 0) {
+            g_free(state->cursor);
+            state->cursor = g_strcompress(f[1]);
+        } else if (n >= 4 && strcmp(f[0], "N") == 0) {
+            state->files = g_ascii_strtoull(f[1], NULL, 10);
+            state->bytes = g_ascii_strtoull(f[2], NULL, 10);
+            state->sealed = g_ascii_strtoull(f[3], NULL, 10);
+        } else if (n >= 2 && strcmp(f[0], "B") == 0) {
+            g_ptr_array_add(state->bad, g_strcompress(f[1]));
+        }
+        g_strfreev(f);
+    }
+    g_strfreev(lines);
+    g_free(contents);
+    if (state && !state->root) g_clear_pointer(&state, scrub_state_free);
+    if (!state) g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "%s is not a scrub state file", path);
+    return state;
+}
+
+// Replaces the state file with the state as it is now, all at once.
+static gboolean scrub_state_save(ScrubState *state, GError **error)
+{
+    GString *out = g_string_new(SCRUB_MAGIC "\n");
+    gchar *escaped = g_strescape(state->root, NULL);
+    g_string_append_printf(out, "R\t%s\n", escaped);
+    g_free(escaped);
+    g_string_append_printf(out, "L\t%d\n", g_atomic_int_get(&state->rate));
+    g_string_append_printf(out, "P\t%" G_GINT64_FORMAT "\t%" G_GINT64_FORMAT "\t%" G_GUINT64_FORMAT "\n",
+                           state->started, state->finished, state->last_bytes);
+    if (state->cursor) {
+        escaped = g_strescape(state->cursor, NULL);
+        g_string_append_printf(out, "C\t%s\n", escaped);
+        g_free(escaped);
+    }
+    g_string_append_printf(out, "N\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\n",
+                           state->files, state->bytes, state->sealed);
+    for (guint i = 0; i < state->bad->len; ++i) {
+        escaped = g_strescape(g_ptr_array_index(state->bad, i), NULL);
+        g_string_append_printf(out, "B\t%s\n", escaped);
+        g_free(escaped);
+    }
+
+    gchar *dir = g_path_get_dirname(state->path);
+    gboolean ok = g_mkdir_with_parents(dir, 0700) == 0 ? g_file_set_contents(state->path, out->str, out->len, error)
+                                                         : set_errno_error(error, "Cannot create scrub state directory");
+    g_free(dir);
+    g_string_free(out, TRUE);
+    return ok;
+}
+
+// The states of all trees that are scrubbed.
+static GPtrArray* scrub_state_list(void)
+{
+    GPtrArray *states = g_ptr_array_new();
+    gchar *dir = g_build_filename(g_get_user_state_dir(), "owltech-fm", "scrub", NULL);
+    GDir *d = g_dir_open(dir, 0, NULL);
+    const gchar *name;
+    while (d && (name = g_dir_read_name(d)) != NULL) {
+        if (!g_str_has_suffix(name, SCRUB_SUFFIX)) continue;
+        gchar *path = g_build_filename(dir, name, NULL);
+        ScrubState *state = scrub_state_load(path, NULL);
+        if (state) g_ptr_array_add(states, state);
+        g_free(path);
+    }
+    if (d) g_dir_close(d);
+    g_free(dir);
+    return states;
+}
+
+static gboolean scrub_due(const ScrubState *state, gint64 now)
+{
+    return state->started != 0 || now - state->finished >= (gint64)SCRUB_INTERVAL_DAYS * 24 * 3600 * G_USEC_PER_SEC;
+}
+
+// Prepares a run over state's tree, which it takes over.
+static Scrub* scrub_new(ScrubState *state, GError **error)
+{
+    int fd = open(state->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        set_errno_error(error, "Cannot open folder");
+        if (fd >= 0) close(fd);
+        scrub_state_free(state);
+        return NULL;
+    }
+    Scrub *s = g_new0(Scrub, 1);
+    s->state = state;
+    s->root_fd = fd;
+    s->dev = st.st_dev;
+    s->cancellable = g_cancellable_new();
+    g_mutex_init(&s->bucket.lock);
+    qos_bucket_set_rate(&s->bucket, (guint64)state->rate * 1024 * 1024);
+    g_mutex_init(&s->lock);
+    s->buf = g_malloc(COPY_BUFFER_SIZE);
+    s->saved = g_get_monotonic_time();
+    s->found = g_ptr_array_new_with_free_func(g_free);
+    s->errors = g_ptr_array_new_with_free_func(g_free);
+    return s;
+}
+
+static void scrub_free(Scrub *s)
+{
+    scrub_state_free(s->state);
+    close(s->root_fd);
+    g_object_unref(s->cancellable);
+    g_mutex_clear(&s->bucket.lock);
+    g_mutex_clear(&s->lock);
+    g_free(s->buf);
+    g_ptr_array_free(s->found, TRUE);
+    g_ptr_array_free(s->errors, TRUE);
+    g_free(s);
+}
+
+static void scrub_set_rate(Scrub *s, gint mib_per_second)
+{
+    g_atomic_int_set(&s->state->rate, mib_per_second);
+    qos_bucket_set_rate(&s->bucket, (guint64)mib_per_second * 1024 * 1024);
+}
+
+static void scrub_add_bad(Scrub *s, const gchar *rel, const gchar *reason)
+{
+    g_ptr_array_add(s->state->bad, g_strdup_printf("%s: %s", rel, reason));
+    g_ptr_array_add(s->found, g_strdup_printf("%s: %s", rel, reason));
+}
+
+// Writes the state out if the last checkpoint is old enough. Failing to
+// only costs a resumed pass some work, so it is not an error.
+static void scrub_checkpoint(Scrub *s)
+{
+    gint64 now = g_get_monotonic_time();
+    if (now - s->saved < SCRUB_CHECKPOINT_INTERVAL) return;
+    GError *err = NULL;
+    if (!scrub_state_save(s->state, &err)) {
+        g_warning("Cannot checkpoint scrub of %s: %s", s->state->root, err->message);
+        g_error_free(err);
+    }
+    s->saved = now;
+}
+
+// The digest of fd as it is on the disk rather than in the page cache.
+// Pages that are dirty cannot be dropped, but then the file is being
+// written and will be skipped anyway.
+static gchar* scrub_hash(Scrub *s, int fd, ChecksumAlgorithm algorithm, GError **error)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    ChecksumState cs;
+    checksum_state_init(&cs, algorithm, 0);
+    guint64 off = 0;
+    gboolean ok = TRUE;
+    for (;;) {
+        if (g_cancellable_set_error_if_cancelled(s->cancellable, error)) {
+            ok = FALSE;
+            break;
+        }
+        ssize_t n = pread(fd, s->buf, COPY_BUFFER_SIZE, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ok = set_errno_error(error, "Read failed");
+            break;
+        }
+        if (n == 0) break;
+        checksum_state_update(&cs, s->buf, n);
+        // Leaves the cache to what the user is working on
+        posix_fadvise(fd, off, n, POSIX_FADV_DONTNEED);
+        off += n;
+        g_mutex_lock(&s->lock);
+        s->reading = off;
+        g_mutex_unlock(&s->lock);
+        qos_bucket_throttle(&s->bucket, n, s->cancellable);
+        qos_throttle(QOS_BACKGROUND, n, s->cancellable);
+    }
+    gchar *hex = checksum_state_finish(&cs);
+    if (ok) return hex;
+    g_free(hex);
+    return NULL;
+}
+
+// Checks one regular file against its stored digest, or seals it. FALSE
+// only when the run is cancelled.
+static gboolean scrub_file(Scrub *s, int dir_fd, const gchar *name, const gchar *rel)
+{
+    // Reading an archive should not rewrite its atimes; O_NOATIME needs
+    // owning the file
+    int fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_NOATIME | O_CLOEXEC);
+    if (fd < 0 && errno == EPERM) fd = openat(dir_fd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        g_ptr_array_add(s->errors, g_strdup_printf("%s: %s", rel, g_strerror(errno)));
+        if (fd >= 0) close(fd);
+        return TRUE;
+    }
+
+    // Whichever digest is cheapest to recompute
+    static const ChecksumAlgorithm preference[] = { CHECKSUM_XXH64, CHECKSUM_BLAKE3, CHECKSUM_SHA256 };
+    ChecksumAlgorithm algorithm = CHECKSUM_BLAKE3;
+    gchar *stored = NULL;
+    for (guint i = 0; i < G_N_ELEMENTS(preference) && !stored; ++i)
+        if ((stored = checksum_cache_get(fd, &st, preference[i]))) algorithm = preference[i];
+
+    GError *err = NULL;
+    gchar *hex = scrub_hash(s, fd, algorithm, &err);
+    struct stat after;
+    gboolean unchanged = fstat(fd, &after) == 0 && after.st_size == st.st_size &&
+                         after.st_mtim.tv_sec == st.st_mtim.tv_sec && after.st_mtim.tv_nsec == st.st_mtim.tv_nsec;
+    gboolean cancelled = g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+    gboolean sealed = FALSE;
+    if (cancelled) {
+        // Done over on resuming
+    } else if (err) {
+        // On an archive an I/O error is the usual face of bit rot
+        scrub_add_bad(s, rel, err->message);
+    } else if (!unchanged) {
+        // Written while it was read; the next pass seals it
+    } else if (stored && strcmp(stored, hex) != 0) {
+        scrub_add_bad(s, rel, SCRUB_BAD_CONTENT);
+    } else if (!stored) {
+        sealed = checksum_cache_set(fd, &st, algorithm, hex);
+    }
+    close(fd);
+
+    g_mutex_lock(&s->lock);
+    if (!cancelled) {
+        s->state->files++;
+        s->state->bytes += s->reading;
+        if (sealed) s->state->sealed++;
+    }
+    s->reading = 0;
+    g_mutex_unlock(&s->lock);
+    if (err) g_error_free(err);
+    g_free(hex);
+    g_free(stored);
+    return !cancelled;
+}
+
+// Scrubs the directory open as dir_fd, reported as rel, in name order.
+// after, a path relative to it, is where an earlier run stopped: it and
+// everything before it are done. FALSE when the run is cancelled.
+static gboolean scrub_dir(Scrub *s, int dir_fd, const gchar *rel, const gchar *after)
+{
+    GPtrArray *names = snapshot_read_names(dir_fd);
+    if (!names) {
+        g_ptr_array_add(s->errors, g_strdup_printf("%s: %s", *rel ? rel : ".", g_strerror(errno)));
+        return TRUE;
+    }
+    const gchar *rest = after ? strchr(after, '/') : NULL;
+    gchar *head = after ? g_strndup(after, rest ? (gsize)(rest - after) : strlen(after)) : NULL;
+    gboolean ok = TRUE;
+    for (guint i = 0; i < names->len && ok; ++i) {
+        const gchar *name = g_ptr_array_index(names, i);
+        gint order = head ? strcmp(name, head) : 1;
+        if (order < 0 || (order == 0 && !rest)) continue;
+
+        gchar *child = *rel ? g_build_filename(rel, name, NULL) : g_strdup(name);
+        struct stat st;
+        if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            g_ptr_array_add(s->errors, g_strdup_printf("%s: %s", child, g_strerror(errno)));
+        } else if (S_ISREG(st.st_mode)) {
+            if ((ok = scrub_file(s, dir_fd, name, child))) {
+                g_free(s->state->cursor);
+                s->state->cursor = g_strdup(child);
+                scrub_checkpoint(s);
+            }
+        } else if (S_ISDIR(st.st_mode) && st.st_dev == s->dev) {
+            int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (fd < 0) {
+                g_ptr_array_add(s->errors, g_strdup_printf("%s: %s", child, g_strerror(errno)));
+            } else {
+                ok = scrub_dir(s, fd, child, order == 0 ? rest + 1 : NULL);
+                close(fd);
+            }
+        }
+        g_free(child);
+    }
+    g_free(head);
+    g_ptr_array_free(names, TRUE);
+    return ok;
+}
+
+// Runs a pass over s's tree, or the rest of one an earlier run left, and
+// records how far it got.
+static gboolean scrub_run(Scrub *s, GError **error)
+{
+    ScrubState *state = s->state;
+    if (state->started == 0) {
+        g_mutex_lock(&s->lock);
+        state->started = g_get_real_time();
+        state->files = state->bytes = state->sealed = 0;
+        g_mutex_unlock(&s->lock);
+        g_ptr_array_set_size(state->bad, 0);
+        g_clear_pointer(&state->cursor, g_free);
+    }
+    if (scrub_dir(s, s->root_fd, "", state->cursor)) {
+        state->finished = g_get_real_time();
+        state->last_bytes = state->bytes;
+        state->started = 0;
+        g_clear_pointer(&state->cursor, g_free);
+    }
+    if (!scrub_state_save(state, error)) return FALSE;
+    return !g_cancellable_set_error_if_cancelled(s->cancellable, error);
+}
+
+// Runs or resumes a scrub pass over dir in the foreground, so passes can
+// also be scheduled from cron, and prints what it found. rate, in MiB/s,
+// replaces the stored cap unless it is negative. Returns 1 when there are
+// bad files.
+static int run_scrub(const gchar *dir, gint rate)
+{
+    gchar *root = realpath(dir, NULL);
+    if (!root) {
+        g_printerr("Cannot resolve %s: %s\n", dir, g_strerror(errno));
+        return 1;
+    }
+    gchar *path = scrub_state_path(root);
+    ScrubState *state = scrub_state_load(path, NULL);
+    if (!state) state = scrub_state_new(root);
+    if (rate >= 0) state->rate = rate;
+    g_free(path);
+    free(root);
+
+    qos_apply_thread(QOS_BACKGROUND);
+    GError *err = NULL;
+    gint64 t0 = g_get_monotonic_time();
+    Scrub *s = scrub_new(state, &err);
+    if (!s || !scrub_run(s, &err)) {
+        g_printerr("Scrub failed: %s\n", err->message);
+        g_error_free(err);
+        if (s) scrub_free(s);
+        return 1;
+    }
+    gdouble secs = (g_get_monotonic_time() - t0) / 1e6;
+    state = s->state;
+    g_print("%s: %" G_GUINT64_FORMAT " files, %.1f MiB checked in this pass, %" G_GUINT64_FORMAT
+            " newly sealed; this run took %.1f s\n",
+            state->root, state->files, state->bytes / 1048576.0, state->sealed, secs);
+    for (guint i = 0; i < s->errors->len; ++i)
+        g_printerr("Cannot scrub %s\n", (gchar *)g_ptr_array_index(s->errors, i));
+    for (guint i = 0; i < state->bad->len; ++i)
+        g_print("BAD %s\n", (gchar *)g_ptr_array_index(state->bad, i));
+    int status = state->bad->len > 0 ? 1 : 0;
+    scrub_free(s);
+    return status;
+}
+
+// --- Archives ---
+// Zip and tar files can be browsed like directories. A zip's central
+// directory and the members actually opened are read with pread into
+// bounded buffers, so nothing else of the file is touched. A tar has no
+// directory: its headers are walked once, seeking over the data between
+// them, and the resulting index is cached, keyed by device and inode,
+// under $XDG_CACHE_HOME/owltech-fm/archive-index/. Like the checksum cache
+// it is trusted only while the tarball keeps the size and mtime it was
+// built for. Either way a member is read by going straight to its data,
+// so previewing or extracting one never touches the rest. Paths are
+// normalised as they are indexed and any that would climb out with ".."
+// are dropped, so an extraction cannot write outside its destination. A
+// compressed tarball has no offsets to seek to and is not browsable, but
+// it can be extracted whole in a single streaming pass. Archives are
+// created as streams too: tar, gzip-compressed tar and zip.
+
+#define ARCHIVE_INDEX_MAGIC "FMTARIDX1"
+#define ARCHIVE_INDEX_KEEP 64               // Cached tar indexes
+#define ARCHIVE_PREVIEW_MAX (1024 * 1024)
+#define ARCHIVE_TEXT_MAX (1024 * 1024)      // Long names, link targets and pax headers
+#define ARCHIVE_BUFFER_SIZE (256 * 1024)
+#define ARCHIVE_READ_AHEAD 16               // Buffers read ahead of the compressor
+#define TAR_BLOCK 512
+#define ARCHIVE_TAR_RECORD (20 * TAR_BLOCK) // What tar(1) pads an archive to
+#define ZIP_LOCAL_SIG 0x04034b50
+#define ZIP_CENTRAL_SIG 0x02014b50
+#define ZIP_END_SIG 0x06054b50
+#define ZIP64_END_SIG 0x06064b50
+#define ZIP64_LOCATOR_SIG 0x07064b50
+#define ZIP_DESCRIPTOR_SIG 0x08074b50
+#define ZIP64_THRESHOLD 0xFF000000ULL       // Sizes that get zip64 fields, with room for deflate to grow
+#define ZIP_ENCRYPTED 0x0001
+#define ZIP_SIZES_FOLLOW 0x0008             // CRC and sizes are in a descriptor after the data
+#define ZIP_UTF8 0x0800
+#define ZIP_STORED 0
+#define ZIP_DEFLATED 8
+
+typedef enum {
+    ARCHIVE_ZIP,
+    ARCHIVE_TAR,
+} ArchiveFormat;
+
+typedef struct ArchiveMember ArchiveMember;
+struct ArchiveMember {
+    gchar *path;          // Without a trailing slash; "" for the top
+    gchar type;           // 'f', 'd', 'l' (symlink) or 'o' (anything else)
+    guint32 mode;         // Permission bits
+    gint64 mtime;
+    guint64 size;
+    guint64 offset;       // Zip: of the local header; tar: of the data
+    guint64 csize;        // Zip: compressed size
+    guint16 method;       // Zip
+    guint16 flags;        // Zip
+    guint32 crc;          // Zip
+    gchar *link;          // Tar: symlink target, or the member a hard link shares data with
+    GPtrArray *children;  // Directories: ArchiveMember, not owned
+};
+
+struct Archive {
+    gint ref;
+    ArchiveFormat format;
+    int fd;
+    guint64 len;          // Size when opened; zips are read with pread, never mapped
+    GPtrArray *members;   // Owns every ArchiveMember
+    GHashTable *by_path;  // Path -> ArchiveMember; a later duplicate wins
+    ArchiveMember *root;
+};
+
+typedef gboolean (*ArchiveWriteFunc)(const guint8 *data, gsize len, gpointer user_data, GError **error);
+
+static gboolean archive_corrupt(GError **error, const gchar *what)
+{
+    g_set_error(error, G_IO_ERROR, G_IO_ERROR_INVALID_DATA, "The archive is damaged: %s", what);
+    return FALSE;
+}
+
+static ArchiveMember* archive_member_new(gchar *path, gchar type)
+{
+    ArchiveMember *m = g_new0(ArchiveMember, 1);
+    m->path = path;
+    m->type = type;
+    return m;
+}
+
+static void archive_member_free(ArchiveMember *m)
+{
+    if (m->children) g_ptr_array_free(m->children, TRUE);
+    g_free(m->link);
+    g_free(m->path);
+    g_free(m);
+}
+
+static const gchar* archive_member_name(const ArchiveMember *m)
+{
+    const gchar *slash = strrchr(m->path, '/');
+    return slash ? slash + 1 : m->path;
+}
+
+// raw without empty and "." components; NULL for the top itself or for a
+// path that climbs out with "..".
+static gchar* archive_clean_path(const gchar *raw)
+{
+    gchar **parts = g_strsplit(raw, "/", -1);
+    GPtrArray *kept = g_ptr_array_new();
+    gboolean ok = TRUE;
+    for (guint i = 0; parts[i] && ok; ++i) {
+        if (strcmp(parts[i], "..") == 0) ok = FALSE;
+        else if (*parts[i] && strcmp(parts[i], ".") != 0) g_ptr_array_add(kept, parts[i]);
+    }
+    g_ptr_array_add(kept, NULL);
+    gchar *path = ok && kept->len > 1 ? g_strjoinv("/", (gchar **)kept->pdata) : NULL;
+    g_ptr_array_free(kept, TRUE);
+    g_strfreev(parts);
+    return path;
+}
+
+static void archive_add(Archive *a, ArchiveMember *m)
+{
+    g_ptr_array_add(a->members, m);
+    g_hash_table_insert(a->by_path, m->path, m);
+}
+
+static ArchiveMember* archive_lookup(Archive *a, const gchar *path)
+{
+    return g_hash_table_lookup(a->by_path, path);
+}
+
+// Makes up the directories members imply without listing them, links
+// every member to its parent and gives hard links their target's size.
+static void archive_finish(Archive *a)
+{
+    guint listed = a->members->len;
+    a->root = archive_member_new(g_strdup(""), 'd');
+    a->root->mode = 0755;
+    archive_add(a, a->root);
+    for (guint i = 0; i < listed; ++i) {
+        ArchiveMember *m = g_ptr_array_index(a->members, i);
+        if (archive_lookup(a, m->path) != m) continue; // Superseded by a later copy
+        if (m->type == 'f' && m->link) {
+            ArchiveMember *target = archive_lookup(a, m->link);
+            if (target) m->size = target->size;
+        }
+        for (ArchiveMember *child = m; child != a->root;) {
+            const gchar *slash = strrchr(child->path, '/');
+            gchar *parent_path = slash ? g_strndup(child->path, slash - child->path) : g_strdup("");
+            ArchiveMember *parent = archive_lookup(a, parent_path);
+            gboolean made = !parent;
+            if (made) {
+                parent = archive_member_new(parent_path, 'd');
+                parent->mode = 0755;
+                archive_add(a, parent);
+            } else {
+                g_free(parent_path);
+            }
+            if (parent->type != 'd') break; // A file in the way; what is beneath it is unreachable
+            if (!parent->children) parent->children = g_ptr_array_new();
+            g_ptr_array_add(parent->children, child);
+            // A listed parent links itself in its own turn
+            if (!made) break;
+            child = parent;
+        }
+    }
+}
+
+// Zip timestamps are in local time with two-second resolution.
+static gint64 zip_dos_time(guint16 time, guint16 date)
+{
+    GDateTime *t = g_date_time_new_local(1980 + (date >> 9), MAX((date >> 5) & 15, 1), MAX(date & 31, 1),
+                                         time >> 11, (time >> 5) & 63, MIN((time & 31) * 2, 59));
+    gint64 sec = t ? g_date_time_to_unix(t) : 0;
+    if (t) g_date_time_unref(t);
+    return sec;
+}
+
+// Reads exactly len bytes of the archive at off. The file may have been
+// cut short since it was opened, which is reported as damage.
+static gboolean zip_pread(Archive *a, void *buf, gsize len, guint64 off, GError **error)
+{
+    guint8 *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(a->fd, p, len, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return set_errno_error(error, "Read failed");
+        if (n == 0) return archive_corrupt(error, "truncated");
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+// Indexes the central directory of the zip open as a->fd.
+static gboolean zip_read_directory(Archive *a, GError **error)
+{
+    guint64 len = a->len;
+    // The end record is last but for a comment of up to 64 KiB, and a
+    // zip64 locator may sit right before it
+    gsize tail_len = MIN(len, (guint64)0xFFFF + 22 + 20);
+    guint64 base = len - tail_len;
+    guint8 *d = g_malloc(MAX(tail_len, 1));
+    if (!zip_pread(a, d, tail_len, base, error)) {
+        g_free(d);
+        return FALSE;
+    }
+    const guint8 *end_rec = NULL;
+    for (gsize i = tail_len >= 22 ? tail_len - 22 : 0; tail_len >= 22; --i) {
+        if (snap_get_le(d + i, 4) == ZIP_END_SIG && i + 22 + snap_get_le(d + i + 20, 2) <= tail_len) {
+            end_rec = d + i;
+            break;
+        }
+        if (i == 0 || tail_len - 22 - i >= 0xFFFF) break;
+    }
+    if (!end_rec) {
+        g_free(d);
+        return archive_corrupt(error, "no central directory");
+    }
+
+    guint64 count = snap_get_le(end_rec + 10, 2);
+    guint64 size = snap_get_le(end_rec + 12, 4);
+    guint64 offset = snap_get_le(end_rec + 16, 4);
+    if ((count == 0xFFFF || size == 0xFFFFFFFF || offset == 0xFFFFFFFF) && end_rec - d >= 20 &&
+        snap_get_le(end_rec - 20, 4) == ZIP64_LOCATOR_SIG) {
+        guint64 at = snap_get_le(end_rec - 20 + 8, 8);
+        guint8 z64[56];
+        if (len < 56 || at > len - 56 || !zip_pread(a, z64, sizeof z64, at, NULL) ||
+            snap_get_le(z64, 4) != ZIP64_END_SIG) {
+            g_free(d);
+            return archive_corrupt(error, "bad zip64 end record");
+        }
+        count = snap_get_le(z64 + 32, 8);
+        size = snap_get_le(z64 + 40, 8);
+        offset = snap_get_le(z64 + 48, 8);
+    }
+    g_free(d);
+    if (offset > len || size > len - offset) return archive_corrupt(error, "central directory out of bounds");
+
+    guint8 *dir = g_malloc(MAX(size, 1));
+    if (!zip_pread(a, dir, size, offset, error)) {
+        g_free(dir);
+        return FALSE;
+    }
+    const guint8 *p = dir, *end = p + size;
+    guint64 indexed = 0;
+    while (indexed < count) {
+        if (end - p < 46 || snap_get_le(p, 4) != ZIP_CENTRAL_SIG) break;
+        guint made_by = snap_get_le(p + 4, 2) >> 8;
+        guint64 csize = snap_get_le(p + 20, 4), usize = snap_get_le(p + 24, 4);
+        guint nlen = snap_get_le(p + 28, 2), elen = snap_get_le(p + 30, 2), clen = snap_get_le(p + 32, 2);
+        guint32 external = snap_get_le(p + 38, 4);
+        guint64 local = snap_get_le(p + 42, 4);
+        if ((gsize)(end - p - 46) < (gsize)nlen + elen + clen) break;
+
+        const guint8 *extra = p + 46 + nlen, *extra_end = extra + elen;
+        gint64 mtime = zip_dos_time(snap_get_le(p + 12, 2), snap_get_le(p + 14, 2));
+        for (const guint8 *x = extra; extra_end - x >= 4; x += 4 + snap_get_le(x + 2, 2)) {
+            guint id = snap_get_le(x, 2);
+            const guint8 *v = x + 4, *v_end = MIN(v + snap_get_le(x + 2, 2), extra_end);
+            if (id == 0x0001) {
+                // Zip64 sizes: only the fields that overflowed, in this order
+                if (usize == 0xFFFFFFFF && v_end - v >= 8) { usize = snap_get_le(v, 8); v += 8; }
+                if (csize == 0xFFFFFFFF && v_end - v >= 8) { csize = snap_get_le(v, 8); v += 8; }
+                if (local == 0xFFFFFFFF && v_end - v >= 8) local = snap_get_le(v, 8);
+            } else if (id == 0x5455 && v_end - v >= 5 && (v[0] & 1)) {
+                mtime = (gint32)snap_get_le(v + 1, 4); // Unix time, where the writer kept it
+            }
+        }
+
+        gchar *raw = g_strndup((const gchar *)p + 46, nlen);
+        // Only a Unix writer stores a mode
+        guint32 mode = made_by == 3 ? external >> 16 : 0;
+        gboolean dir = g_str_has_suffix(raw, "/") || S_ISDIR(mode);
+        gchar *path = archive_clean_path(raw);
+        if (path) {
+            ArchiveMember *m = archive_member_new(path, dir ? 'd' : S_ISLNK(mode) ? 'l' : 'f');
+            m->mode = mode & 07777 ? mode & 07777 : dir ? 0755 : 0644;
+            m->mtime = mtime;
+            m->size = usize;
+            m->csize = csize;
+            m->offset = local;
+            m->flags = snap_get_le(p + 8, 2);
+            m->method = snap_get_le(p + 10, 2);
+            m->crc = snap_get_le(p + 16, 4);
+            archive_add(a, m);
+        }
+        g_free(raw);
+        p += 46 + nlen + elen + clen;
+        ++indexed;
+    }
+    g_free(dir);
+    return indexed == count || archive_corrupt(error, "bad central directory");
+}
+
+// A numeric tar header field: octal, or base-256 for values octal cannot
+// hold.
+static guint64 tar_number(const guint8 *p, gsize len)
+{
+    guint64 v = 0;
+    if (p[0] & 0x80) {
+        v = p[0] & 0x3F;
+        for (gsize i = 1; i < len; ++i)
+            v = (v << 8) | p[i];
+        return v;
+    }
+    gsize i = 0;
+    while (i < len && p[i] == ' ')
+        ++i;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i)
+        v = v * 8 + (p[i] - '0');
+    return v;
+}
+
+static gboolean tar_header_valid(const guint8 *h)
+{
+    guint64 sum = 0;
+    for (guint i = 0; i < TAR_BLOCK; ++i)
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    return sum == tar_number(h + 148, 8);
+}
+
+// A header's string field, which is only NUL-terminated when it is
+// shorter than the field.
+static gchar* tar_string(const guint8 *field, gsize len)
+{
+    return g_strndup((const gchar *)field, strnlen((const gchar *)field, len));
+}
+
+// Reads the data of an extension header: a GNU long name or a pax record
+// set.
+static gchar* tar_read_text(Archive *a, guint64 offset, guint64 size, GError **error)
+{
+    if (size > ARCHIVE_TEXT_MAX) {
+        archive_corrupt(error, "oversized extension header");
+        return NULL;
+    }
+    gchar *text = g_malloc(size + 1);
+    gsize got = 0;
+    while (got < size) {
+        ssize_t n = pread(a->fd, text + got, size - got, offset + got);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            if (n < 0) set_errno_error(error, "Read failed");
+            else archive_corrupt(error, "truncated");
+            g_free(text);
+            return NULL;
+        }
+        got += n;
+    }
+    text[size] = '\0';
+    return text;
+}
+
+// Picks what the next member takes from a pax extended header, whose
+// records read "<length> <key>=<value>\n".
+static void tar_parse_pax(const gchar *text, gsize len, gchar **path, gchar **link, guint64 *size, gint64 *mtime)
+{
+    const gchar *p = text, *end = text + len;
+    while (p < end) {
+        gchar *sp;
+        guint64 record = g_ascii_strtoull(p, &sp, 10);
+        if (sp == p || *sp != ' ' || record < 4 || record > (guint64)(end - p)) break;
+        const gchar *key = sp + 1, *value_end = p + record - 1;
+        const gchar *eq = memchr(key, '=', value_end - key);
+        if (eq) {
+            gchar *value = g_strndup(eq + 1, value_end - eq - 1);
+            gsize klen = eq - key;
+            if (klen == 4 && memcmp(key, "path", 4) == 0) {
+                g_free(*path);
+                *path = value;
+                value = NULL;
+            } else if (klen == 8 && memcmp(key, "linkpath", 8) == 0) {
+                g_free(*link);
+                *link = value;
+                value = NULL;
+            } else if (klen == 4 && memcmp(key, "size", 4) == 0) {
+                *size = g_ascii_strtoull(value, NULL, 10);
+            } else if (klen == 5 && memcmp(key, "mtime", 5) == 0) {
+                *mtime = (gint64)g_ascii_strtod(value, NULL);
+            }
+            g_free(value);
+        }
+        p += record;
+    }
+}
+
+// What extension headers said about the member that follows them.
+typedef struct {
+    gchar *path;
+    gchar *link;
+    guint64 size;   // G_MAXUINT64 when not given
+    gint64 mtime;   // G_MININT64 when not given
+} TarPending;
+
+static void tar_pending_reset(TarPending *p)
+{
+    g_clear_pointer(&p->path, g_free);
+    g_clear_pointer(&p->link, g_free);
+    p->size = G_MAXUINT64;
+    p->mtime = G_MININT64;
+}
+
+static gboolean tar_block_is_zero(const guint8 *h)
+{
+    for (guint i = 0; i < TAR_BLOCK; ++i)
+        if (h[i]) return FALSE;
+    return TRUE;
+}
+
+// GNU long names and links, and pax records, carry what the next header
+// cannot hold.
+static gboolean tar_is_extension(gchar flag)
+{
+    return flag == 'L' || flag == 'K' || flag == 'x';
+}
+
+static guint64 tar_padded(guint64 size)
+{
+    return (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+}
+
+// Bytes of data after header h, before padding.
+static guint64 tar_data_size(const guint8 *h, const TarPending *p)
+{
+    if (!tar_is_extension(h[156]) && p->size != G_MAXUINT64) return p->size;
+    return tar_number(h + 124, 12);
+}
+
+// Takes in the data of extension header flag.
+static void tar_pending_take(TarPending *p, gchar flag, const gchar *text, gsize len)
+{
+    if (flag == 'L') {
+        g_free(p->path);
+        p->path = g_strndup(text, len);
+    } else if (flag == 'K') {
+        g_free(p->link);
+        p->link = g_strndup(text, len);
+    } else {
+        tar_parse_pax(text, len, &p->path, &p->link, &p->size, &p->mtime);
+    }
+}
+
+// The member header h describes, its data at offset, with what p holds
+// applied; p is reset for the next one. NULL when the path climbs out.
+static ArchiveMember* tar_header_member(const guint8 *h, TarPending *p, guint64 offset)
+{
+    gchar flag = h[156];
+    guint64 size = tar_data_size(h, p);
+    gchar *name = p->path;
+    p->path = NULL;
+    if (!name) {
+        gchar *base = tar_string(h, 100);
+        gchar *prefix = memcmp(h + 257, "ustar", 5) == 0 ? tar_string(h + 345, 155) : NULL;
+        name = prefix && *prefix ? g_strconcat(prefix, "/", base, NULL) : g_strdup(base);
+        g_free(prefix);
+        g_free(base);
+    }
+    gboolean file = flag == '0' || flag == '\0' || flag == '7' || flag == '1';
+    gchar type = flag == '5' || (flag == '\0' && g_str_has_suffix(name, "/")) ? 'd'
+               : flag == '2' ? 'l' : file ? 'f' : 'o';
+    gchar *path = archive_clean_path(name);
+    ArchiveMember *m = NULL;
+    if (path) {
+        m = archive_member_new(path, type);
+        m->mode = tar_number(h + 100, 8) & 07777;
+        m->mtime = p->mtime != G_MININT64 ? p->mtime : (gint64)tar_number(h + 136, 12);
+        m->size = type == 'f' && flag != '1' ? size : 0;
+        m->offset = offset;
+        if (flag == '1' || flag == '2') {
+            gchar *target = p->link ? g_strdup(p->link) : tar_string(h + 157, 100);
+            // A hard link names another member; a symlink is kept as written
+            m->link = flag == '1' ? archive_clean_path(target) : g_strdup(target);
+            g_free(target);
+            if (!m->link) m->type = 'o';
+        }
+    }
+    g_free(name);
+    tar_pending_reset(p);
+    return m;
+}
+
+// Walks the headers of an uncompressed tar, seeking over member data.
+static gboolean tar_build_index(Archive *a, GError **error)
+{
+    guint8 h[TAR_BLOCK];
+    guint64 off = 0;
+    TarPending pending = { NULL, NULL, G_MAXUINT64, G_MININT64 };
+    gboolean ok = TRUE;
+    for (;;) {
+        ssize_t n = pread(a->fd, h, TAR_BLOCK, off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            ok = set_errno_error(error, "Read failed");
+            break;
+        }
+        // Writers that leave out the closing zero blocks are common enough
+        if (n == 0) break;
+        if (n < TAR_BLOCK) {
+            ok = archive_corrupt(error, "truncated");
+            break;
+        }
+        if (tar_block_is_zero(h)) break;
+        if (!tar_header_valid(h)) {
+            ok = archive_corrupt(error, "bad header checksum");
+            break;
+        }
+
+        gchar flag = h[156];
+        guint64 size = tar_data_size(h, &pending);
+        guint64 data = off + TAR_BLOCK;
+        if (tar_is_extension(flag)) {
+            gchar *text = tar_read_text(a, data, size, error);
+            if (!text) {
+                ok = FALSE;
+                break;
+            }
+            tar_pending_take(&pending, flag, text, size);
+            g_free(text);
+        } else if (flag != 'g' && flag != 'V') {
+            // Global pax headers and volume labels describe no member
+            ArchiveMember *m = tar_header_member(h, &pending, data);
+            if (m) archive_add(a, m);
+        }
+        off = data + tar_padded(size);
+    }
+    tar_pending_reset(&pending);
+    return ok;
+}
+
+static gchar* tar_index_path(const struct stat *st)
+{
+    gchar *name = g_strdup_printf("%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x.idx",
+                                  (guint64)st->st_dev, (guint64)st->st_ino);
+    gchar *path = g_build_filename(g_get_user_cache_dir(), "owltech-fm", "archive-index", name, NULL);
+    g_free(name);
+    return path;
+}
+
+static gchar* tar_index_stamp(const struct stat *st)
+{
+    return g_strdup_printf(ARCHIVE_INDEX_MAGIC "\t%" G_GUINT64_FORMAT "\t%" G_GINT64_FORMAT ".%09ld",
+                           (guint64)st->st_size, (gint64)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec);
+}
+
+// Loads the cached index of the tar st describes, if it is still current.
+// Lines after the stamp are "<type> <mode> <mtime> <offset> <size> <path>
+// <link>", tab-separated, with escaped paths.
+static gboolean tar_load_index(Archive *a, const struct stat *st)
+{
+    gchar *path = tar_index_path(st), *contents = NULL;
+    gboolean ok = g_file_get_contents(path, &contents, NULL, NULL);
+    if (ok) utimensat(AT_FDCWD, path, NULL, 0); // Marks it used, for pruning
+    g_free(path);
+    if (!ok) return FALSE;
+    gchar **lines = g_strsplit(contents, "\n", -1);
+    g_free(contents);
+    gchar *stamp = tar_index_stamp(st);
+    ok = g_strcmp0(lines[0], stamp) == 0;
+    g_free(stamp);
+    for (guint i = 1; ok && lines[i] && *lines[i]; ++i) {
+        gchar **f = g_strsplit(lines[i], "\t", 7);
+        ok = g_strv_length(f) == 7 && strlen(f[0]) == 1;
+        if (ok) {
+            ArchiveMember *m = archive_member_new(g_strcompress(f[5]), f[0][0]);
+            m->mode = g_ascii_strtoull(f[1], NULL, 8);
+            m->mtime = g_ascii_strtoll(f[2], NULL, 10);
+            m->offset = g_ascii_strtoull(f[3], NULL, 10);
+            m->size = g_ascii_strtoull(f[4], NULL, 10);
+            m->link = *f[6] ? g_strcompress(f[6]) : NULL;
+            archive_add(a, m);
+        }
+        g_strfreev(f);
+    }
+    g_strfreev(lines);
+    if (!ok) {
+        // Start over from the headers
+        g_ptr_array_set_size(a->members, 0);
+        g_hash_table_remove_all(a->by_path);
+    }
+    return ok;
+}
+
+typedef struct {
+    gchar *path;
+    gint64 used;
+} TarIndexFile;
+
+static gint tar_index_compare_used(gconstpointer a, gconstpointer b)
+{
+    // Most recently used first
+    gint64 x = ((const TarIndexFile *)a)->used, y = ((const TarIndexFile *)b)->used;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Keeps the ARCHIVE_INDEX_KEEP most recently used indexes in dir.
+static void tar_prune_indexes(const gchar *dir)
+{
+    GArray *files = g_array_new(FALSE, FALSE, sizeof(TarIndexFile));
+    GDir *d = g_dir_open(dir, 0, NULL);
+    const gchar *name;
+    while (d && (name = g_dir_read_name(d)) != NULL) {
+        TarIndexFile f = { g_build_filename(dir, name, NULL), 0 };
+        struct stat st;
+        if (stat(f.path, &st) == 0) f.used = st.st_mtime;
+        g_array_append_val(files, f);
+    }
+    if (d) g_dir_close(d);
+    g_array_sort(files, tar_index_compare_used);
+    for (guint i = 0; i < files->len; ++i) {
+        TarIndexFile *f = &g_array_index(files, TarIndexFile, i);
+        if (i >= ARCHIVE_INDEX_KEEP) unlink(f->path);
+        g_free(f->path);
+    }
+    g_array_free(files, TRUE);
+}
+
+// Best effort: without a cache the headers are just walked again.
+static void tar_save_index(Archive *a, const struct stat *st)
+{
+    gchar *stamp = tar_index_stamp(st);
+    GString *out = g_string_new(stamp);
+    g_string_append_c(out, '\n');
+    g_free(stamp);
+    for (guint i = 0; i < a->members->len; ++i) {
+        ArchiveMember *m = g_ptr_array_index(a->members, i);
+        if (archive_lookup(a, m->path) != m) continue;
+        gchar *path = g_strescape(m->path, NULL);
+        gchar *link = m->link ? g_strescape(m->link, NULL) : g_strdup("");
+        g_string_append_printf(out, "%c\t%o\t%" G_GINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%" G_GUINT64_FORMAT "\t%s\t%s\n",
+                               m->type, m->mode, m->mtime, m->offset, m->size, path, link);
+        g_free(link);
+        g_free(path);
+    }
+    gchar *file = tar_index_path(st);
+    gchar *dir = g_path_get_dirname(file);
+    if (g_mkdir_with_parents(dir, 0700) == 0 && g_file_set_contents(file, out->str, out->len, NULL))
+        tar_prune_indexes(dir);
+    g_free(dir);
+    g_free(file);
+    g_string_free(out, TRUE);
+}
+
+static void archive_unref(Archive *a)
+{
+    if (!g_atomic_int_dec_and_test(&a->ref)) return;
+    g_hash_table_destroy(a->by_path);
+    g_ptr_array_free(a->members, TRUE);
+    close(a->fd);
+    g_free(a);
+}
+
+static Archive* archive_ref(Archive *a)
+{
+    g_atomic_int_inc(&a->ref);
+    return a;
+}
+
+// Opens name in dir_fd as an archive, recognised by its content. Fails
+// with G_IO_ERROR_NOT_SUPPORTED when it is not one.
+static Archive* archive_open_at(int dir_fd, const gchar *name, GError **error)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        set_errno_error(error, "Cannot open file");
+        if (fd >= 0) close(fd);
+        return NULL;
+    }
+    guint8 head[TAR_BLOCK];
+    ssize_t n = S_ISREG(st.st_mode) ? pread(fd, head, sizeof head, 0) : 0;
+    gboolean zip = n >= 4 && (memcmp(head, "PK\3\4", 4) == 0 || memcmp(head, "PK\5\6", 4) == 0);
+    if (!zip && !(n == TAR_BLOCK && tar_header_valid(head))) {
+        close(fd);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Not an archive");
+        return NULL;
+    }
+
+    Archive *a = g_new0(Archive, 1);
+    a->ref = 1;
+    a->format = zip ? ARCHIVE_ZIP : ARCHIVE_TAR;
+    a->fd = fd;
+    a->len = st.st_size;
+    a->members = g_ptr_array_new_with_free_func((GDestroyNotify)archive_member_free);
+    a->by_path = g_hash_table_new(g_str_hash, g_str_equal);
+    gboolean ok;
+    if (zip) {
+        ok = zip_read_directory(a, error);
+    } else {
+        ok = tar_load_index(a, &st);
+        if (!ok && (ok = tar_build_index(a, error))) tar_save_index(a, &st);
+    }
+    if (!ok) {
+        archive_unref(a);
+        return NULL;
+    }
+    archive_finish(a);
+    return a;
+}
+
+// Where a zip member's data starts: after its local header, whose extra
+// field need not match the central directory's.
+static gboolean zip_member_data(Archive *a, const ArchiveMember *m, guint64 *start, GError **error)
+{
+    guint8 h[30];
+    if (m->offset > a->len || a->len - m->offset < 30 || !zip_pread(a, h, sizeof h, m->offset, NULL) ||
+        snap_get_le(h, 4) != ZIP_LOCAL_SIG)
+        return archive_corrupt(error, "bad local header");
+    *start = m->offset + 30 + snap_get_le(h + 26, 2) + snap_get_le(h + 28, 2);
+    if (*start > a->len || a->len - *start < m->csize)
+        return archive_corrupt(error, "member data out of bounds");
+    return TRUE;
+}
+
+static gboolean zip_read_member(Archive *a, const ArchiveMember *m, guint64 limit, ArchiveWriteFunc write,
+                                gpointer user_data, GError **error)
+{
+    if (m->flags & ZIP_ENCRYPTED) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "%s is encrypted", m->path);
+        return FALSE;
+    }
+    if (m->method != ZIP_STORED && m->method != ZIP_DEFLATED) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "%s uses unsupported compression method %u",
+                    m->path, m->method);
+        return FALSE;
+    }
+    guint64 src;
+    if (!zip_member_data(a, m, &src, error)) return FALSE;
+
+    uLong crc = crc32(0, NULL, 0);
+    guint64 total = 0;
+    gboolean ok = TRUE, complete;
+    // Extraction asks for everything; the central directory still bounds it
+    if (m->method == ZIP_STORED && m->csize != m->size) return archive_corrupt(error, "member size mismatch");
+    guint8 *in = g_malloc(ARCHIVE_BUFFER_SIZE);
+    if (m->method == ZIP_STORED) {
+        guint64 want = MIN(m->csize, limit);
+        while (ok && total < want) {
+            gsize n = MIN(want - total, (guint64)ARCHIVE_BUFFER_SIZE);
+            ok = zip_pread(a, in, n, src + total, error) && write(in, n, user_data, error);
+            crc = crc32(crc, in, n);
+            total += n;
+        }
+        complete = want == m->csize;
+    } else {
+        z_stream z = { 0 };
+        guint8 *buf = g_malloc(ARCHIVE_BUFFER_SIZE);
+        guint64 in_left = m->csize;
+        int zr = inflateInit2(&z, -MAX_WBITS) == Z_OK ? Z_OK : Z_MEM_ERROR;
+        while (ok && zr == Z_OK && total < limit) {
+            if (z.avail_in == 0 && in_left > 0) {
+                z.avail_in = (uInt)MIN(in_left, (guint64)ARCHIVE_BUFFER_SIZE);
+                if (!(ok = zip_pread(a, in, z.avail_in, src, error))) break;
+                z.next_in = in;
+                src += z.avail_in;
+                in_left -= z.avail_in;
+            }
+            z.next_out = buf;
+            z.avail_out = ARCHIVE_BUFFER_SIZE;
+            zr = inflate(&z, Z_NO_FLUSH);
+            if (zr != Z_OK && zr != Z_STREAM_END) {
+                ok = archive_corrupt(error, "bad compressed data");
+                break;
+            }
+            gsize n = MIN((guint64)(ARCHIVE_BUFFER_SIZE - z.avail_out), limit - total);
+            if (n > m->size - total) {
+                ok = archive_corrupt(error, "member larger than recorded");
+                break;
+            }
+            crc = crc32(crc, buf, n);
+            ok = write(buf, n, user_data, error);
+            total += n;
+        }
+        complete = zr == Z_STREAM_END;
+        if (zr != Z_MEM_ERROR) inflateEnd(&z);
+        g_free(buf);
+    }
+    g_free(in);
+    if (ok && complete && (total != m->size || crc != m->crc))
+        ok = archive_corrupt(error, "checksum mismatch");
+    return ok;
+}
+
+static gboolean tar_read_member(Archive *a, const ArchiveMember *m, guint64 limit, ArchiveWriteFunc write,
+                                gpointer user_data, GError **error)
+{
+    guint8 *buf = g_malloc(ARCHIVE_BUFFER_SIZE);
+    guint64 off = m->offset, left = MIN(m->size, limit);
+    gboolean ok = TRUE;
+    while (ok && left > 0) {
+        ssize_t n = pread(a->fd, buf, MIN(left, (guint64)ARCHIVE_BUFFER_SIZE), off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) ok = set_errno_error(error, "Read failed");
+        else if (n == 0) ok = archive_corrupt(error, "truncated");
+        else ok = write(buf, n, user_data, error);
+        off += MAX(n, 0);
+        left -= MAX(n, 0);
+    }
+    g_free(buf);
+    return ok;
+}
+
+// Passes up to limit bytes of a member's content to write, reading only
+// that member; a symlink's content is its target. A whole zip member has
+// its CRC checked.
+static gboolean archive_read_member(Archive *a, const ArchiveMember *m, guint64 limit, ArchiveWriteFunc write,
+                                    gpointer user_data, GError **error)
+{
+    if (a->format == ARCHIVE_TAR && m->type == 'f' && m->link) {
+        const ArchiveMember *target = archive_lookup(a, m->link);
+        if (!target || target->type != 'f' || target->link) {
+            g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s links to missing %s", m->path, m->link);
+            return FALSE;
+        }
+        m = target;
+    }
+    if (m->type == 'd' || m->type == 'o') {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_REGULAR_FILE, "%s has no content to read", m->path);
+        return FALSE;
+    }
+    if (a->format == ARCHIVE_TAR && m->type == 'l')
+        return write((const guint8 *)m->link, MIN(strlen(m->link), limit), user_data, error);
+    return a->format == ARCHIVE_ZIP ? zip_read_member(a, m, limit, write, user_data, error)
+                                    : tar_read_member(a, m, limit, write, user_data, error);
+}
+
+static gboolean archive_collect(const guint8 *data, gsize len, gpointer user_data, GError **error)
+{
+    g_byte_array_append(user_data, data, len);
+    return TRUE;
+}
+
+typedef struct {
+    Archive *archive;     // NULL while a compressed tar is streamed
+    QosClass qos;
+    GCancellable *cancellable;
+    GMutex lock;
+    GCond cond;
+    guint outstanding;    // Files queued for the workers
+    guint64 bytes_done;
+    guint64 bytes_total;
+    GPtrArray *errors;    // Members that could not be extracted
+    GPtrArray *files;     // ArchiveTask, written by the workers
+    GPtrArray *dirs;      // ArchiveTask, in the order they were made
+} ArchiveExtract;
+
+// Where one member goes. Directories carry their metadata with them, as a
+// streamed member is gone by the time it is applied.
+typedef struct {
+    const ArchiveMember *member;
+    gchar *path;
+    guint32 mode;
+    gint64 mtime;
+} ArchiveTask;
+
+typedef struct {
+    ArchiveExtract *x;
+    int fd;
+} ArchiveSink;
+
+static ArchiveExtract* archive_extract_new(Archive *a, QosClass qos)
+{
+    ArchiveExtract *x = g_new0(ArchiveExtract, 1);
+    x->archive = a ? archive_ref(a) : NULL;
+    x->qos = qos;
+    x->cancellable = g_cancellable_new();
+    g_mutex_init(&x->lock);
+    g_cond_init(&x->cond);
+    x->errors = g_ptr_array_new_with_free_func(g_free);
+    return x;
+}
+
+static void archive_task_free(ArchiveTask *t)
+{
+    g_free(t->path);
+    g_free(t);
+}
+
+static void archive_extract_add_task(GPtrArray *tasks, const ArchiveMember *m, gchar *path_taken)
+{
+    ArchiveTask *t = g_new0(ArchiveTask, 1);
+    t->member = m;
+    t->path = path_taken;
+    t->mode = m->mode;
+    t->mtime = m->mtime;
+    g_ptr_array_add(tasks, t);
+}
+
+static void archive_extract_free(ArchiveExtract *x)
+{
+    if (x->archive) archive_unref(x->archive);
+    g_object_unref(x->cancellable);
+    g_mutex_clear(&x->lock);
+    g_cond_clear(&x->cond);
+    g_ptr_array_free(x->errors, TRUE);
+    if (x->files) g_ptr_array_free(x->files, TRUE);
+    if (x->dirs) g_ptr_array_free(x->dirs, TRUE);
+    g_free(x);
+}
+
+static gboolean archive_sink_write(const guint8 *data, gsize len, gpointer user_data, GError **error)
+{
+    ArchiveSink *sink = user_data;
+    if (g_cancellable_set_error_if_cancelled(sink->x->cancellable, error)) return FALSE;
+    if (!write_all(sink->fd, data, len, error)) return FALSE;
+    qos_throttle(sink->x->qos, len, sink->x->cancellable);
+    g_mutex_lock(&sink->x->lock);
+    sink->x->bytes_done += len;
+    g_mutex_unlock(&sink->x->lock);
+    return TRUE;
+}
+
+static guint64 archive_member_bytes(const ArchiveMember *m)
+{
+    guint64 bytes = m->type == 'f' ? m->size : 0;
+    for (guint i = 0; m->children && i < m->children->len; ++i)
+        bytes += archive_member_bytes(g_ptr_array_index(m->children, i));
+    return bytes;
+}
+
+// Workers report failures too, so this takes the lock.
+static void archive_extract_add_error(ArchiveExtract *x, const ArchiveMember *m, const gchar *message)
+{
+    g_mutex_lock(&x->lock);
+    g_ptr_array_add(x->errors, g_strdup_printf("%s: %s", m->path, message));
+    g_mutex_unlock(&x->lock);
+}
+
+// Set-id bits are not restored.
+static void archive_set_metadata(int fd, guint32 mode, gint64 mtime)
+{
+    fchmod(fd, mode & 0777);
+    struct timespec times[2] = { { 0, UTIME_OMIT }, { mtime, 0 } };
+    futimens(fd, times);
+}
+
+// Creates name in dir_fd, where nothing may exist by that name yet, with
+// size bytes allocated up front: the data lands in few extents and a full
+// disk fails before anything is written.
+static int archive_create_file(int dir_fd, const gchar *name, guint64 size, GError **error)
+{
+    int fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        set_errno_error(error, "Cannot create file");
+        return -1;
+    }
+    if (size > 0 && fallocate(fd, 0, 0, size) != 0 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        set_errno_error(error, "Cannot preallocate file");
+        close(fd);
+        unlinkat(dir_fd, name, 0);
+        return -1;
+    }
+    return fd;
+}
+
+// Creates the directories and links of m, and of everything beneath it, at
+// path, and queues its files for the workers. Members that cannot be
+// extracted are listed in x->errors; FALSE means the extraction was
+// cancelled.
+static gboolean archive_extract_plan(ArchiveExtract *x, const ArchiveMember *m, const gchar *path)
+{
+    if (g_cancellable_is_cancelled(x->cancellable)) return FALSE;
+    if (m->type == 'o') {
+        archive_extract_add_error(x, m, "Special files are not extracted");
+        return TRUE;
+    }
+    if (m->type == 'f') {
+        archive_extract_add_task(x->files, m, g_strdup(path));
+        return TRUE;
+    }
+    if (m->type == 'l') {
+        GError *err = NULL;
+        GByteArray *target = g_byte_array_new();
+        gboolean ok = archive_read_member(x->archive, m, PATH_MAX, archive_collect, target, &err);
+        g_byte_array_append(target, (const guint8 *)"", 1);
+        if (ok && symlink((const gchar *)target->data, path) != 0) set_errno_error(&err, "Cannot create link");
+        g_byte_array_free(target, TRUE);
+        if (err) archive_extract_add_error(x, m, err->message);
+        g_clear_error(&err);
+        return TRUE;
+    }
+
+    if (mkdir(path, 0700) != 0) {
+        archive_extract_add_error(x, m, g_strerror(errno));
+        return TRUE;
+    }
+    archive_extract_add_task(x->dirs, m, g_strdup(path));
+    gboolean ok = TRUE;
+    for (guint i = 0; ok && m->children && i < m->children->len; ++i) {
+        const ArchiveMember *child = g_ptr_array_index(m->children, i);
+        gchar *child_path = g_build_filename(path, archive_member_name(child), NULL);
+        ok = archive_extract_plan(x, child, child_path);
+        g_free(child_path);
+    }
+    return ok;
+}
+
+static void archive_extract_file(ArchiveExtract *x, const ArchiveTask *t)
+{
+    const ArchiveMember *m = t->member;
+    GError *err = NULL;
+    ArchiveSink sink = { x, archive_create_file(AT_FDCWD, t->path, m->size, &err) };
+    gboolean ok = sink.fd >= 0 && archive_read_member(x->archive, m, G_MAXUINT64, archive_sink_write, &sink, &err);
+    if (ok) archive_set_metadata(sink.fd, m->mode, m->mtime);
+    if (sink.fd >= 0 && close(sink.fd) != 0 && ok) ok = set_errno_error(&err, "Cannot finish file");
+    if (!ok && sink.fd >= 0) unlink(t->path);
+    if (err && !g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) archive_extract_add_error(x, m, err->message);
+    g_clear_error(&err);
+}
+
+static void archive_extract_worker(gpointer data, gpointer user_data)
+{
+    ArchiveExtract *x = user_data;
+    qos_apply_thread(x->qos);
+    if (!g_cancellable_is_cancelled(x->cancellable)) archive_extract_file(x, data);
+    g_mutex_lock(&x->lock);
+    if (--x->outstanding == 0) g_cond_signal(&x->cond);
+    g_mutex_unlock(&x->lock);
+}
+
+static gint archive_task_compare_offset(gconstpointer a, gconstpointer b)
+{
+    const ArchiveTask *x = *(ArchiveTask * const *)a, *y = *(ArchiveTask * const *)b;
+    return x->member->offset < y->member->offset ? -1 : x->member->offset > y->member->offset;
+}
+
+// Sets the metadata of the directories made, once everything is in them:
+// entries being created would move their mtime, and a read-only mode
+// would keep them out. Reversed, the order they were made in puts every
+// directory before its parent.
+static void archive_extract_finish_dirs(ArchiveExtract *x)
+{
+    for (guint i = x->dirs->len; i-- > 0;) {
+        const ArchiveTask *t = g_ptr_array_index(x->dirs, i);
+        int fd = open(t->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) continue;
+        archive_set_metadata(fd, t->mode, t->mtime);
+        close(fd);
+    }
+}
+
+// Extracts members of x's archive into dest_dir under names of their own,
+// as a copy would be named when the name is taken. The tree is laid out
+// first; then every member is independent, compressed or not, so the
+// files are written by as many workers as the archive's device and the
+// destination's both take, in archive order so a single worker reads it
+// front to back.
+static gboolean archive_extract_run(ArchiveExtract *x, GPtrArray *members, const gchar *dest_dir, GError **error)
+{
+    x->files = g_ptr_array_new_with_free_func((GDestroyNotify)archive_task_free);
+    x->dirs = g_ptr_array_new_with_free_func((GDestroyNotify)archive_task_free);
+    g_mutex_lock(&x->lock);
+    for (guint i = 0; i < members->len; ++i)
+        x->bytes_total += archive_member_bytes(g_ptr_array_index(members, i));
+    g_mutex_unlock(&x->lock);
+    gboolean ok = TRUE;
+    for (guint i = 0; ok && i < members->len; ++i) {
+        const ArchiveMember *m = g_ptr_array_index(members, i);
+        gchar *dst = copy_unique_dest(dest_dir, archive_member_name(m));
+        ok = archive_extract_plan(x, m, dst);
+        g_free(dst);
+    }
+
+    if (ok && x->files->len > 0) {
+        struct stat in_st, out_st;
+        guint in = fstat(x->archive->fd, &in_st) == 0 ? device_io_slots(device_probe(in_st.st_dev)) : 1;
+        guint out = stat(dest_dir, &out_st) == 0 ? device_io_slots(device_probe(out_st.st_dev)) : 1;
+        g_ptr_array_sort(x->files, archive_task_compare_offset);
+        GThreadPool *pool = g_thread_pool_new(archive_extract_worker, x, MIN(in, out), x->qos == QOS_BACKGROUND, NULL);
+        g_mutex_lock(&x->lock);
+        x->outstanding = x->files->len;
+        g_mutex_unlock(&x->lock);
+        for (guint i = 0; i < x->files->len; ++i)
+            g_thread_pool_push(pool, g_ptr_array_index(x->files, i), NULL);
+        g_mutex_lock(&x->lock);
+        while (x->outstanding > 0)
+            g_cond_wait(&x->cond, &x->lock);
+        g_mutex_unlock(&x->lock);
+        g_thread_pool_free(pool, FALSE, TRUE);
+    }
+    archive_extract_finish_dirs(x);
+    return !g_cancellable_set_error_if_cancelled(x->cancellable, error);
+}
+
+// A gzip-compressed tar, read once from start to end.
+typedef struct {
+    ArchiveExtract *x;
+    int fd;
+    int root_fd;          // The directory it is extracted into
+    GHashTable *made;     // Directories this extraction made, "" for the root
+    z_stream z;
+    guint8 *in;
+    gboolean in_eof;
+    gboolean between;     // At the end of a gzip member; another may follow
+    gboolean end;
+} TarStream;
+
+// Fills buf with up to len bytes of the tar; fewer only at its end.
+static gboolean tar_stream_read(TarStream *s, guint8 *buf, gsize len, gsize *got, GError **error)
+{
+    s->z.next_out = buf;
+    s->z.avail_out = len;
+    while (s->z.avail_out > 0 && !s->end) {
+        if (s->z.avail_in == 0 && !s->in_eof) {
+            if (g_cancellable_set_error_if_cancelled(s->x->cancellable, error)) return FALSE;
+            ssize_t n = read(s->fd, s->in, ARCHIVE_BUFFER_SIZE);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) return set_errno_error(error, "Read failed");
+            s->in_eof = n == 0;
+            s->z.next_in = s->in;
+            s->z.avail_in = n;
+            qos_throttle(s->x->qos, n, s->x->cancellable);
+            g_mutex_lock(&s->x->lock);
+            s->x->bytes_done += n;
+            g_mutex_unlock(&s->x->lock);
+            continue;
+        }
+        if (s->z.avail_in == 0) {
+            if (!s->between) return archive_corrupt(error, "truncated");
+            s->end = TRUE;
+            break;
+        }
+        int zr = inflate(&s->z, Z_NO_FLUSH);
+        if (zr == Z_STREAM_END) {
+            // Concatenated gzip members make up one stream
+            inflateReset(&s->z);
+            s->between = TRUE;
+        } else if (zr == Z_OK) {
+            s->between = FALSE;
+        } else if (s->between) {
+            s->end = TRUE; // Padding after the last member, as tape writers leave
+        } else {
+            return archive_corrupt(error, "bad compressed data");
+        }
+    }
+    *got = len - s->z.avail_out;
+    return TRUE;
+}
+
+static gboolean tar_stream_exact(TarStream *s, guint8 *buf, gsize len, GError **error)
+{
+    gsize got;
+    if (!tar_stream_read(s, buf, len, &got, error)) return FALSE;
+    return got == len || archive_corrupt(error, "truncated");
+}
+
+// Reads over what is left of a member's data and padding.
+static gboolean tar_stream_skip(TarStream *s, guint64 len, guint8 *buf, GError **error)
+{
+    while (len > 0) {
+        gsize n = MIN(len, (guint64)ARCHIVE_BUFFER_SIZE);
+        if (!tar_stream_exact(s, buf, n, error)) return FALSE;
+        len -= n;
+    }
+    return TRUE;
+}
+
+// Makes sure the directories above path are ones this extraction made,
+// making what is missing. Nothing else is ever gone through, so a link
+// that an earlier member planted cannot lead a later one outside.
+static gboolean tar_stream_parents(TarStream *s, const gchar *path, GError **error)
+{
+    for (const gchar *slash = strchr(path, '/'); slash; slash = strchr(slash + 1, '/')) {
+        gchar *dir = g_strndup(path, slash - path);
+        if (g_hash_table_contains(s->made, dir)) {
+            g_free(dir);
+        } else if (mkdirat(s->root_fd, dir, 0755) == 0) {
+            g_hash_table_add(s->made, dir);
+        } else {
+            if (errno == EEXIST) g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "%s is not a folder", dir);
+            else set_errno_error(error, "Cannot create folder");
+            g_free(dir);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// Clears the way for a non-directory member: a later copy of a path
+// replaces the earlier one, as tar(1) does.
+static gboolean tar_stream_replace(TarStream *s, const gchar *path, GError **error)
+{
+    if (!tar_stream_parents(s, path, error)) return FALSE;
+    if (g_hash_table_contains(s->made, path)) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_EXISTS, "A folder is in the way");
+        return FALSE;
+    }
+    if (unlinkat(s->root_fd, path, 0) != 0 && errno != ENOENT) return set_errno_error(error, "Cannot replace");
+    return TRUE;
+}
+
+// Extracts m, whose data of size bytes comes next in the stream; *used
+// says how much of it was read. Only a failure of the stream itself, or a
+// cancellation, returns FALSE; the member's own end up in x->errors.
+static gboolean tar_stream_member(TarStream *s, ArchiveMember *m, guint64 size, guint8 *buf, guint64 *used,
+                                  GError **error)
+{
+    ArchiveExtract *x = s->x;
+    GError *err = NULL;
+    *used = 0;
+    if (m->type == 'o') {
+        g_set_error(&err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "Special files are not extracted");
+    } else if (m->type == 'd') {
+        if (!tar_stream_parents(s, m->path, &err)) {
+        } else if (mkdirat(s->root_fd, m->path, 0700) == 0) {
+            g_hash_table_add(s->made, g_strdup(m->path));
+            archive_extract_add_task(x->dirs, m, g_strdup(m->path));
+        } else if (errno == EEXIST && g_hash_table_contains(s->made, m->path)) {
+            archive_extract_add_task(x->dirs, m, g_strdup(m->path)); // Made for an earlier member
+        } else {
+            set_errno_error(&err, "Cannot create folder");
+        }
+    } else if (!tar_stream_replace(s, m->path, &err)) {
+    } else if (m->type == 'l') {
+        if (symlinkat(m->link, s->root_fd, m->path) != 0) set_errno_error(&err, "Cannot create link");
+    } else if (m->link) {
+        // A hard link to an earlier member, through directories made here
+        if (!tar_stream_parents(s, m->link, &err)) {
+        } else if (linkat(s->root_fd, m->link, s->root_fd, m->path, 0) != 0) {
+            set_errno_error(&err, "Cannot create link");
+        }
+    } else {
+        int fd = archive_create_file(s->root_fd, m->path, size, &err);
+        while (*used < size) {
+            gsize n = MIN(size - *used, (guint64)ARCHIVE_BUFFER_SIZE);
+            if (!tar_stream_exact(s, buf, n, error)) {
+                if (fd >= 0) {
+                    close(fd);
+                    unlinkat(s->root_fd, m->path, 0);
+                }
+                g_clear_error(&err);
+                return FALSE;
+            }
+            *used += n;
+            // Past a write failure the data is only read over
+            if (fd >= 0 && !err) write_all(fd, buf, n, &err);
+        }
+        if (fd >= 0) {
+            if (!err) archive_set_metadata(fd, m->mode, m->mtime);
+            if (close(fd) != 0 && !err) set_errno_error(&err, "Cannot finish file");
+            if (err) unlinkat(s->root_fd, m->path, 0);
+        }
+    }
+    if (err) archive_extract_add_error(x, m, err->message);
+    g_clear_error(&err);
+    return TRUE;
+}
+
+// Extracts the gzip-compressed tar open as fd into the directory dest in
+// one pass, as its headers come. There is no index to plan from, so the
+// work cannot be spread out; progress counts the compressed bytes read.
+static gboolean tar_stream_extract(ArchiveExtract *x, int fd, const gchar *dest, GError **error)
+{
+    x->dirs = g_ptr_array_new_with_free_func((GDestroyNotify)archive_task_free);
+    TarStream s = { x, fd, open(dest, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) };
+    if (s.root_fd < 0) return set_errno_error(error, "Cannot open folder");
+    if (inflateInit2(&s.z, MAX_WBITS + 16) != Z_OK) {
+        close(s.root_fd);
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Cannot start decompressing");
+        return FALSE;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    s.in = g_malloc(ARCHIVE_BUFFER_SIZE);
+    s.made = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    g_hash_table_add(s.made, g_strdup(""));
+    guint8 *buf = g_malloc(ARCHIVE_BUFFER_SIZE);
+    TarPending pending = { NULL, NULL, G_MAXUINT64, G_MININT64 };
+    guint8 h[TAR_BLOCK];
+    gboolean ok = TRUE, first = TRUE;
+    for (;;) {
+        gsize got;
+        if (!(ok = tar_stream_read(&s, h, TAR_BLOCK, &got, error))) break;
+        // Writers that leave out the closing zero blocks are common enough
+        if (got == 0 || (got == TAR_BLOCK && tar_block_is_zero(h))) break;
+        if (got < TAR_BLOCK || !tar_header_valid(h)) {
+            if (first)
+                g_set_error(error, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED, "The compressed file is not a tar archive");
+            else archive_corrupt(error, got < TAR_BLOCK ? "truncated" : "bad header checksum");
+            ok = FALSE;
+            break;
+        }
+        first = FALSE;
+
+        gchar flag = h[156];
+        guint64 size = tar_data_size(h, &pending), used = 0;
+        if (tar_is_extension(flag)) {
+            if (size > ARCHIVE_TEXT_MAX) {
+                ok = archive_corrupt(error, "oversized extension header");
+                break;
+            }
+            gchar *text = g_malloc(tar_padded(size));
+            ok = tar_stream_exact(&s, (guint8 *)text, tar_padded(size), error);
+            if (ok) tar_pending_take(&pending, flag, text, size);
+            g_free(text);
+            if (!ok) break;
+            continue;
+        }
+        if (flag != 'g' && flag != 'V') {
+            ArchiveMember *m = tar_header_member(h, &pending, 0);
+            if (m) ok = tar_stream_member(&s, m, m->type == 'f' && !m->link ? size : 0, buf, &used, error);
+            if (m) archive_member_free(m);
+        }
+        if (!ok || !(ok = tar_stream_skip(&s, tar_padded(size) - used, buf, error))) break;
+    }
+    tar_pending_reset(&pending);
+
+    for (guint i = x->dirs->len; i-- > 0;) {
+        const ArchiveTask *t = g_ptr_array_index(x->dirs, i);
+        int dir_fd = openat(s.root_fd, t->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dir_fd < 0) continue;
+        archive_set_metadata(dir_fd, t->mode, t->mtime);
+        close(dir_fd);
+    }
+    g_free(buf);
+    g_hash_table_destroy(s.made);
+    g_free(s.in);
+    inflateEnd(&s.z);
+    close(s.root_fd);
+    return ok;
+}
+
+// The folder an archive is extracted into: its name without the extension.
+static gchar* archive_folder_name(const gchar *name)
+{
+    static const gchar *suffixes[] = { ".tar.gz", ".tgz", ".tar", ".zip" };
+    gchar *lower = g_ascii_strdown(name, -1);
+    gchar *folder = NULL;
+    for (guint i = 0; !folder && i < G_N_ELEMENTS(suffixes); ++i)
+        if (g_str_has_suffix(lower, suffixes[i]) && strlen(name) > strlen(suffixes[i]))
+            folder = g_strndup(name, strlen(name) - strlen(suffixes[i]));
+    g_free(lower);
+    const gchar *dot = strrchr(name, '.');
+    if (!folder && dot && dot != name) folder = g_strndup(name, dot - name);
+    return folder ? folder : g_strconcat(name, " contents", NULL);
+}
+
+// Extracts all of the archive name in dir_fd into a new folder in
+// dest_dir. A gzip-compressed tar is streamed; anything else is indexed as
+// for browsing and extracted from the index.
+static gboolean archive_extract_all(ArchiveExtract *x, int dir_fd, const gchar *name, const gchar *dest_dir,
+                                    GError **error)
+{
+    int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    guint8 magic[2];
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        set_errno_error(error, "Cannot open archive");
+        if (fd >= 0) close(fd);
+        return FALSE;
+    }
+    gboolean gzip = pread(fd, magic, 2, 0) == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+    if (!gzip) {
+        close(fd);
+        fd = -1;
+        if (!(x->archive = archive_open_at(dir_fd, name, error))) return FALSE;
+    }
+
+    gchar *folder = archive_folder_name(name);
+    gchar *dest = copy_unique_dest(dest_dir, folder);
+    gboolean ok = mkdir(dest, 0755) == 0 || set_errno_error(error, "Cannot create folder");
+    if (ok && gzip) {
+        g_mutex_lock(&x->lock);
+        x->bytes_total = st.st_size;
+        g_mutex_unlock(&x->lock);
+        ok = tar_stream_extract(x, fd, dest, error);
+    } else if (ok) {
+        GPtrArray *top = x->archive->root->children ? x->archive->root->children : g_ptr_array_new();
+        ok = archive_extract_run(x, top, dest, error);
+        if (top != x->archive->root->children) g_ptr_array_free(top, TRUE);
+    }
+    // Only goes if nothing was extracted
+    if (!ok) rmdir(dest);
+    g_free(dest);
+    g_free(folder);
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+// Creating an archive: the selection is walked first, which fixes every
+// member's size and lets hard links be told apart. A reader thread then
+// reads the files' data ahead, a few buffers at most, while the job's own
+// thread frames it and compresses it straight into the archive, so the
+// disk and the compressor work at the same time and nothing is copied
+// aside on the way.
+
+typedef struct {
+    gchar *path;          // Relative to the directory of the selection, as stored
+    struct stat st;
+    gchar *link;          // Symlink target; tar: the earlier path of a hard link
+} ArchiveSource;
+
+typedef struct {
+    guint index;          // Of the source it belongs to
+    guint8 *data;
+    gsize len;            // 0 ends the source's data
+    gchar *error;         // Why it ended before its size
+} ArchiveChunk;
+
+typedef struct {
+    ArchiveFormat format;
+    gboolean gzip;        // Tar only
+    int dir_fd;
+    GPtrArray *names;     // Selected entries of dir_fd
+    gchar *dest;
+    QosClass qos;
+    GCancellable *cancellable;
+    GMutex lock;
+    GCond cond;
+    guint64 bytes_done;
+    guint64 bytes_total;
+    GPtrArray *errors;    // Entries that could not be archived (completely)
+    GPtrArray *sources;   // ArchiveSource, in archive order
+    GQueue chunks;        // ArchiveChunk read ahead, guarded by lock
+    gboolean stop;        // The writer wants no more chunks
+    int out_fd;
+    GByteArray *out;      // Not yet compressed or written
+    guint64 written;      // Archive bytes so far, before any gzip
+    z_stream gz;
+    guint8 *zbuf;
+    GByteArray *central;  // Zip: the central directory, built as members go
+    guint64 entries;
+} ArchiveCreate;
+
+// Zip: one member's data on its way out.
+typedef struct {
+    z_stream z;
+    gboolean deflating;
+    uLong crc;
+    guint64 usize;
+    guint64 csize;
+} ZipMember;
+
+static void archive_source_free(ArchiveSource *src)
+{
+    g_free(src->path);
+    g_free(src->link);
+    g_free(src);
+}
+
+static void archive_chunk_free(ArchiveChunk *k)
+{
+    g_free(k->data);
+    g_free(k->error);
+    g_free(k);
+}
+
+// Takes names over; their paths in the archive are the same, so it unpacks
+// to what was selected.
+static ArchiveCreate* archive_create_new(int dir_fd, GPtrArray *names, const gchar *dest, ArchiveFormat format,
+                                         gboolean gzip, QosClass qos)
+{
+    ArchiveCreate *c = g_new0(ArchiveCreate, 1);
+    c->format = format;
+    c->gzip = gzip && format == ARCHIVE_TAR;
+    c->dir_fd = dir_fd;
+    c->names = names;
+    c->dest = g_strdup(dest);
+    c->qos = qos;
+    c->cancellable = g_cancellable_new();
+    g_mutex_init(&c->lock);
+    g_cond_init(&c->cond);
+    c->errors = g_ptr_array_new_with_free_func(g_free);
+    c->sources = g_ptr_array_new_with_free_func((GDestroyNotify)archive_source_free);
+    g_queue_init(&c->chunks);
+    c->out_fd = -1;
+    c->out = g_byte_array_sized_new(2 * ARCHIVE_BUFFER_SIZE);
+    c->zbuf = g_malloc(ARCHIVE_BUFFER_SIZE);
+    c->central = g_byte_array_new();
+    return c;
+}
+
+static void archive_create_free(ArchiveCreate *c)
+{
+    g_queue_clear_full(&c->chunks, (GDestroyNotify)archive_chunk_free);
+    if (c->dir_fd >= 0) close(c->dir_fd);
+    g_ptr_array_free(c->names, TRUE);
+    g_free(c->dest);
+    g_object_unref(c->cancellable);
+    g_mutex_clear(&c->lock);
+    g_cond_clear(&c->cond);
+    g_ptr_array_free(c->errors, TRUE);
+    g_ptr_array_free(c->sources, TRUE);
+    g_byte_array_free(c->out, TRUE);
+    g_free(c->zbuf);
+    g_byte_array_free(c->central, TRUE);
+    g_free(c);
+}
+
+// Lists name in parent_fd, stored as path, and for a directory everything
+// beneath it. Entries that cannot be read are listed in c->errors; FALSE
+// means the job was cancelled.
+static gboolean archive_create_scan(ArchiveCreate *c, int parent_fd, const gchar *name, const gchar *path,
+                                    GHashTable *inodes)
+{
+    if (g_cancellable_is_cancelled(c->cancellable)) return FALSE;
+    struct stat st;
+    if (fstatat(parent_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+        g_ptr_array_add(c->errors, g_strdup_printf("%s: %s", path, g_strerror(errno)));
+        return TRUE;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode) && !S_ISLNK(st.st_mode)) {
+        g_ptr_array_add(c->errors, g_strdup_printf("%s: Special files are not archived", path));
+        return TRUE;
+    }
+
+    ArchiveSource *src = g_new0(ArchiveSource, 1);
+    src->path = g_strdup(path);
+    src->st = st;
+    if (S_ISLNK(st.st_mode)) {
+        gchar target[PATH_MAX];
+        ssize_t n = readlinkat(parent_fd, name, target, sizeof target - 1);
+        if (n < 0) {
+            g_ptr_array_add(c->errors, g_strdup_printf("%s: %s", path, g_strerror(errno)));
+            archive_source_free(src);
+            return TRUE;
+        }
+        src->link = g_strndup(target, n);
+    } else if (S_ISREG(st.st_mode) && st.st_nlink > 1 && c->format == ARCHIVE_TAR) {
+        // Tar keeps hard links; zip has no way to, so it stores the data again
+        gchar *key = g_strdup_printf("%" G_GINT64_MODIFIER "x:%" G_GINT64_MODIFIER "x",
+                                     (guint64)st.st_dev, (guint64)st.st_ino);
+        const gchar *first = g_hash_table_lookup(inodes, key);
+        if (first) src->link = g_strdup(first);
+        else g_hash_table_insert(inodes, g_strdup(key), src->path);
+        g_free(key);
+    }
+    g_ptr_array_add(c->sources, src);
+    if (S_ISREG(st.st_mode) && !src->link) c->bytes_total += st.st_size;
+    if (!S_ISDIR(st.st_mode)) return TRUE;
+
+    int fd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    GPtrArray *names = fd >= 0 ? snapshot_read_names(fd) : NULL;
+    if (!names) g_ptr_array_add(c->errors, g_strdup_printf("%s: %s", path, g_strerror(errno)));
+    gboolean ok = TRUE;
+    for (guint i = 0; ok && names && i < names->len; ++i) {
+        const gchar *child = g_ptr_array_index(names, i);
+        gchar *child_path = g_strconcat(path, "/", child, NULL);
+        ok = archive_create_scan(c, fd, child, child_path, inodes);
+        g_free(child_path);
+    }
+    if (names) g_ptr_array_free(names, TRUE);
+    if (fd >= 0) close(fd);
+    return ok;
+}
+
+// Hands a chunk to the writer, waiting while it is ARCHIVE_READ_AHEAD
+// chunks behind. FALSE once the writer has stopped.
+static gboolean archive_reader_push(ArchiveCreate *c, ArchiveChunk *k)
+{
+    g_mutex_lock(&c->lock);
+    while (!c->stop && c->chunks.length >= ARCHIVE_READ_AHEAD)
+        g_cond_wait(&c->cond, &c->lock);
+    gboolean open = !c->stop;
+    if (open) {
+        g_queue_push_tail(&c->chunks, k);
+        g_cond_broadcast(&c->cond);
+    }
+    g_mutex_unlock(&c->lock);
+    if (!open) archive_chunk_free(k);
+    return open;
+}
+
+// Reads the data of every file stored with its data, in archive order,
+// ending each with an empty chunk. A file is read up to the size it was
+// listed with; one that shrank in the meantime ends early.
+static gpointer archive_reader_thread(gpointer data)
+{
+    ArchiveCreate *c = data;
+    qos_apply_thread(c->qos);
+    gboolean open = TRUE;
+    for (guint i = 0; open && i < c->sources->len; ++i) {
+        const ArchiveSource *src = g_ptr_array_index(c->sources, i);
+        if (!S_ISREG(src->st.st_mode) || src->link) continue;
+        int fd = openat(c->dir_fd, src->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        gchar *error = fd < 0 ? g_strdup(g_strerror(errno)) : NULL;
+        if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        guint64 left = src->st.st_size;
+        while (open && !error && left > 0) {
+            ArchiveChunk *k = g_new0(ArchiveChunk, 1);
+            k->index = i;
+            k->data = g_malloc(MIN(left, (guint64)ARCHIVE_BUFFER_SIZE));
+            ssize_t n;
+            do n = read(fd, k->data, MIN(left, (guint64)ARCHIVE_BUFFER_SIZE));
+            while (n < 0 && errno == EINTR);
+            if (n <= 0) {
+                error = g_strdup(n < 0 ? g_strerror(errno) : "The file shrank while it was archived");
+                archive_chunk_free(k);
+                break;
+            }
+            k->len = n;
+            left -= n;
+            qos_throttle(c->qos, n, c->cancellable);
+            open = archive_reader_push(c, k);
+        }
+        if (fd >= 0) close(fd);
+        ArchiveChunk *end = g_new0(ArchiveChunk, 1);
+        end->index = i;
+        end->error = error;
+        if (open) open = archive_reader_push(c, end);
+        else archive_chunk_free(end);
+    }
+    return NULL;
+}
+
+static ArchiveChunk* archive_writer_pop(ArchiveCreate *c)
+{
+    g_mutex_lock(&c->lock);
+    while (g_queue_is_empty(&c->chunks))
+        g_cond_wait(&c->cond, &c->lock);
+    ArchiveChunk *k = g_queue_pop_head(&c->chunks);
+    g_cond_broadcast(&c->cond);
+    g_mutex_unlock(&c->lock);
+    return k;
+}
+
+// Writes out what is buffered, through gzip for a compressed tar; finish
+// ends the gzip stream.
+static gboolean archive_out_flush(ArchiveCreate *c, gboolean finish, GError **error)
+{
+    gboolean ok = TRUE;
+    if (!c->gzip) {
+        ok = write_all(c->out_fd, c->out->data, c->out->len, error);
+    } else {
+        c->gz.next_in = c->out->data;
+        c->gz.avail_in = c->out->len;
+        int zr;
+        do {
+            c->gz.next_out = c->zbuf;
+            c->gz.avail_out = ARCHIVE_BUFFER_SIZE;
+            zr = deflate(&c->gz, finish ? Z_FINISH : Z_NO_FLUSH);
+            ok = write_all(c->out_fd, c->zbuf, ARCHIVE_BUFFER_SIZE - c->gz.avail_out, error);
+        } while (ok && (finish ? zr == Z_OK : c->gz.avail_out == 0));
+    }
+    g_byte_array_set_size(c->out, 0);
+    return ok;
+}
+
+static gboolean archive_out(ArchiveCreate *c, const void *data, gsize len, GError **error)
+{
+    g_byte_array_append(c->out, data, len);
+    c->written += len;
+    return c->out->len < ARCHIVE_BUFFER_SIZE || archive_out_flush(c, FALSE, error);
+}
+
+static gboolean zip_member_out(ArchiveCreate *c, ZipMember *zm, const guint8 *data, gsize len, gboolean finish,
+                               GError **error)
+{
+    if (len > 0) zm->crc = crc32(zm->crc, data, len);
+    zm->usize += len;
+    if (!zm->deflating) {
+        zm->csize += len;
+        return archive_out(c, data, len, error);
+    }
+    zm->z.next_in = (Bytef *)data;
+    zm->z.avail_in = len;
+    int zr;
+    do {
+        zm->z.next_out = c->zbuf;
+        zm->z.avail_out = ARCHIVE_BUFFER_SIZE;
+        zr = deflate(&zm->z, finish ? Z_FINISH : Z_NO_FLUSH);
+        gsize n = ARCHIVE_BUFFER_SIZE - zm->z.avail_out;
+        zm->csize += n;
+        if (!archive_out(c, c->zbuf, n, error)) return FALSE;
+    } while (finish ? zr == Z_OK : zm->z.avail_out == 0);
+    return TRUE;
+}
+
+// Moves the data of source index from the reader into the archive, through
+// zm for zip. A tar member that came up short is padded to the size its
+// header promised.
+static gboolean archive_copy_source(ArchiveCreate *c, guint index, ZipMember *zm, GError **error)
+{
+    static const guint8 zeros[TAR_BLOCK];
+    const ArchiveSource *src = g_ptr_array_index(c->sources, index);
+    guint64 got = 0;
+    for (;;) {
+        if (g_cancellable_set_error_if_cancelled(c->cancellable, error)) return FALSE;
+        ArchiveChunk *k = archive_writer_pop(c);
+        if (k->len == 0) {
+            if (k->error) g_ptr_array_add(c->errors, g_strdup_printf("%s: %s", src->path, k->error));
+            archive_chunk_free(k);
+            break;
+        }
+        gboolean ok = zm ? zip_member_out(c, zm, k->data, k->len, FALSE, error)
+                         : archive_out(c, k->data, k->len, error);
+        got += k->len;
+        g_mutex_lock(&c->lock);
+        c->bytes_done += k->len;
+        g_mutex_unlock(&c->lock);
+        archive_chunk_free(k);
+        if (!ok) return FALSE;
+    }
+    for (; !zm && got < (guint64)src->st.st_size; got += MIN(src->st.st_size - got, TAR_BLOCK))
+        if (!archive_out(c, zeros, MIN(src->st.st_size - got, TAR_BLOCK), error)) return FALSE;
+    return TRUE;
+}
+
+// A numeric header field: octal while it fits, base-256 beyond.
+static void tar_put_number(guint8 *field, gsize len, guint64 v)
+{
+    if (v < 1ULL << (3 * (len - 1))) {
+        g_snprintf((gchar *)field, len, "%0*" G_GINT64_MODIFIER "o", (int)len - 1, v);
+        return;
+    }
+    for (gsize i = len; i-- > 1; v >>= 8)
+        field[i] = v & 0xFF;
+    field[0] = 0x80;
+}
+
+// Puts path in the name field, or splits it at a slash across the prefix
+// and name fields; FALSE when it needs a pax record.
+static gboolean tar_put_path(guint8 *h, const gchar *path)
+{
+    gsize len = strlen(path);
+    if (len <= 100) {
+        memcpy(h, path, len);
+        return TRUE;
+    }
+    for (const gchar *slash = strchr(path, '/'); slash && slash - path <= 155; slash = strchr(slash + 1, '/')) {
+        gsize rest = len - (slash - path) - 1;
+        if (rest > 0 && rest <= 100) {
+            memcpy(h + 345, path, slash - path);
+            memcpy(h, slash + 1, rest);
+            return TRUE;
+        }
+    }
+    memcpy(h, path, 100);
+    return FALSE;
+}
+
+// A pax record, "<length> <key>=<value>\n", whose length counts itself.
+static void tar_pax_record(GString *pax, const gchar *key, const gchar *value)
+{
+    gsize body = strlen(key) + strlen(value) + 3, len = body;
+    for (;;) {
+        gsize with_digits = body + g_snprintf(NULL, 0, "%" G_GSIZE_FORMAT, len);
+        if (with_digits == len) break;
+        len = with_digits;
+    }
+    g_string_append_printf(pax, "%" G_GSIZE_FORMAT " %s=%s\n", len, key, value);
+}
+
+static void tar_seal_header(guint8 *h, const struct stat *st, guint32 mode, guint64 size, gchar flag)
+{
+    tar_put_number(h + 100, 8, mode & 07777);
+    tar_put_number(h + 108, 8, st->st_uid);
+    tar_put_number(h + 116, 8, st->st_gid);
+    tar_put_number(h + 124, 12, size);
+    tar_put_number(h + 136, 12, MAX(st->st_mtime, 0));
+    h[156] = flag;
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memset(h + 148, ' ', 8);
+    guint sum = 0;
+    for (guint i = 0; i < TAR_BLOCK; ++i)
+        sum += h[i];
+    g_snprintf((gchar *)h + 148, 8, "%06o", sum);
+}
+
+// Writes the header of a member, behind a pax header when its path or
+// link target is too long for the ustar fields.
+static gboolean tar_write_header(ArchiveCreate *c, const gchar *path, const struct stat *st, gchar flag,
+                                 const gchar *link, guint64 size, GError **error)
+{
+    static const guint8 zeros[TAR_BLOCK];
+    guint8 h[TAR_BLOCK] = { 0 };
+    GString *pax = g_string_new(NULL);
+    if (!tar_put_path(h, path)) tar_pax_record(pax, "path", path);
+    if (link && strlen(link) > 100) tar_pax_record(pax, "linkpath", link);
+    if (link) memcpy(h + 157, link, MIN(strlen(link), 100));
+    tar_seal_header(h, st, st->st_mode, size, flag);
+
+    gboolean ok = TRUE;
+    if (pax->len > 0) {
+        guint8 x[TAR_BLOCK] = { 0 };
+        gchar *name = g_path_get_basename(path);
+        gchar *x_path = g_strdup_printf("PaxHeaders/%.80s", name);
+        memcpy(x, x_path, strlen(x_path));
+        tar_seal_header(x, st, 0644, pax->len, 'x');
+        ok = archive_out(c, x, TAR_BLOCK, error) && archive_out(c, pax->str, pax->len, error) &&
+             archive_out(c, zeros, tar_padded(pax->len) - pax->len, error);
+        g_free(x_path);
+        g_free(name);
+    }
+    g_string_free(pax, TRUE);
+    return ok && archive_out(c, h, TAR_BLOCK, error);
+}
+
+static gboolean tar_write_source(ArchiveCreate *c, guint index, GError **error)
+{
+    static const guint8 zeros[TAR_BLOCK];
+    const ArchiveSource *src = g_ptr_array_index(c->sources, index);
+    const struct stat *st = &src->st;
+    gchar flag = S_ISDIR(st->st_mode) ? '5' : S_ISLNK(st->st_mode) ? '2' : src->link ? '1' : '0';
+    guint64 size = flag == '0' ? st->st_size : 0;
+    gchar *path = flag == '5' ? g_strconcat(src->path, "/", NULL) : g_strdup(src->path);
+    gboolean ok = tar_write_header(c, path, st, flag, src->link, size, error);
+    g_free(path);
+    if (ok && flag == '0') {
+        ok = archive_copy_source(c, index, NULL, error) &&
+             archive_out(c, zeros, tar_padded(size) - size, error);
+    }
+    return ok;
+}
+
+// Two zero blocks end the archive, which is padded to a whole record as
+// tar(1) writes it.
+static gboolean tar_write_end(ArchiveCreate *c, GError **error)
+{
+    static const guint8 zeros[TAR_BLOCK];
+    gboolean ok = archive_out(c, zeros, TAR_BLOCK, error) && archive_out(c, zeros, TAR_BLOCK, error);
+    while (ok && c->written % ARCHIVE_TAR_RECORD != 0)
+        ok = archive_out(c, zeros, TAR_BLOCK, error);
+    return ok;
+}
+
+// Zip timestamps are in local time, from 1980 on, with two-second
+// resolution.
+static void zip_dos_stamp(gint64 t, guint16 *time, guint16 *date)
+{
+    GDateTime *d = g_date_time_new_from_unix_local(t);
+    gint year = d ? g_date_time_get_year(d) : 0;
+    if (year < 1980 || year > 2107) {
+        *time = 0;
+        *date = year > 2107 ? (127 << 9) | (12 << 5) | 31 : (1 << 5) | 1;
+    } else {
+        *date = (year - 1980) << 9 | g_date_time_get_month(d) << 5 | g_date_time_get_day_of_month(d);
+        *time = g_date_time_get_hour(d) << 11 | g_date_time_get_minute(d) << 5 | g_date_time_get_second(d) / 2;
+    }
+    if (d) g_date_time_unref(d);
+}
+
+// Data in these formats is compressed already; deflating it again would
+// only cost time, and usually a little space.
+static gboolean zip_already_compressed(const gchar *path)
+{
+    static const gchar *extensions[] = {
+        ".gz", ".tgz", ".bz2", ".xz", ".zst", ".zip", ".7z", ".rar", ".jpg", ".jpeg", ".png", ".gif",
+        ".webp", ".mp3", ".ogg", ".flac", ".mp4", ".mkv", ".webm", ".mov", ".avi",
+    };
+    const gchar *dot = strrchr(path, '.');
+    for (guint i = 0; dot && i < G_N_ELEMENTS(extensions); ++i)
+        if (g_ascii_strcasecmp(dot, extensions[i]) == 0) return TRUE;
+    return FALSE;
+}
+
+// Writes a member with its sizes and CRC in a data descriptor after the
+// data, as they are only known then, and adds its central directory
+// record. A member that could grow past 4 GiB carries zip64 fields from
+// the start.
+static gboolean zip_write_source(ArchiveCreate *c, guint index, GError **error)
+{
+    const ArchiveSource *src = g_ptr_array_index(c->sources, index);
+    const struct stat *st = &src->st;
+    gboolean dir = S_ISDIR(st->st_mode), link = S_ISLNK(st->st_mode);
+    gchar *path = dir ? g_strconcat(src->path, "/", NULL) : g_strdup(src->path);
+    guint64 size = dir ? 0 : link ? strlen(src->link) : (guint64)st->st_size;
+    gboolean zip64 = size >= ZIP64_THRESHOLD;
+    guint16 flags = ZIP_SIZES_FOLLOW | (g_utf8_validate(path, -1, NULL) ? ZIP_UTF8 : 0);
+    guint16 method = S_ISREG(st->st_mode) && size > 0 && !zip_already_compressed(path) ? ZIP_DEFLATED : ZIP_STORED;
+    guint16 time, date;
+    zip_dos_stamp(st->st_mtime, &time, &date);
+    guint64 offset = c->written;
+    gsize nlen = strlen(path);
+
+    GByteArray *h = g_byte_array_new();
+    snap_put_le(h, ZIP_LOCAL_SIG, 4);
+    snap_put_le(h, zip64 ? 45 : 20, 2);
+    snap_put_le(h, flags, 2);
+    snap_put_le(h, method, 2);
+    snap_put_le(h, time, 2);
+    snap_put_le(h, date, 2);
+    snap_put_le(h, 0, 4);
+    snap_put_le(h, zip64 ? 0xFFFFFFFF : 0, 4);
+    snap_put_le(h, zip64 ? 0xFFFFFFFF : 0, 4);
+    snap_put_le(h, nlen, 2);
+    snap_put_le(h, (zip64 ? 20 : 0) + 9, 2);
+    g_byte_array_append(h, (const guint8 *)path, nlen);
+    if (zip64) {
+        snap_put_le(h, 0x0001, 2);
+        snap_put_le(h, 16, 2);
+        snap_put_le(h, 0, 8);
+        snap_put_le(h, 0, 8);
+    }
+    snap_put_le(h, 0x5455, 2);
+    snap_put_le(h, 5, 2);
+    snap_put_le(h, 1, 1);
+    snap_put_le(h, (guint32)st->st_mtime, 4);
+    gboolean ok = archive_out(c, h->data, h->len, error);
+    g_byte_array_free(h, TRUE);
+
+    ZipMember zm = { .deflating = method == ZIP_DEFLATED, .crc = crc32(0, NULL, 0) };
+    if (ok && zm.deflating && deflateInit2(&zm.z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+                                           Z_DEFAULT_STRATEGY) != Z_OK) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Cannot start compressing");
+        ok = FALSE;
+        zm.deflating = FALSE;
+    }
+    if (ok && link) ok = zip_member_out(c, &zm, (const guint8 *)src->link, size, FALSE, error);
+    else if (ok && S_ISREG(st->st_mode)) ok = archive_copy_source(c, index, &zm, error);
+    if (ok && zm.deflating) ok = zip_member_out(c, &zm, NULL, 0, TRUE, error);
+    if (zm.deflating) deflateEnd(&zm.z);
+    if (!ok) {
+        g_free(path);
+        return FALSE;
+    }
+
+    GByteArray *d = g_byte_array_new();
+    snap_put_le(d, ZIP_DESCRIPTOR_SIG, 4);
+    snap_put_le(d, zm.crc, 4);
+    snap_put_le(d, zm.csize, zip64 ? 8 : 4);
+    snap_put_le(d, zm.usize, zip64 ? 8 : 4);
+    ok = archive_out(c, d->data, d->len, error);
+    g_byte_array_free(d, TRUE);
+
+    // Only the fields that overflowed go in the zip64 extra, in this order
+    gboolean big_u = zm.usize >= 0xFFFFFFFF, big_c = zm.csize >= 0xFFFFFFFF, big_o = offset >= 0xFFFFFFFF;
+    guint zip64_len = 8 * (big_u + big_c + big_o);
+    GByteArray *r = c->central;
+    snap_put_le(r, ZIP_CENTRAL_SIG, 4);
+    snap_put_le(r, 3 << 8 | 45, 2); // Made on Unix, so the mode below counts
+    snap_put_le(r, zip64 || zip64_len ? 45 : 20, 2);
+    snap_put_le(r, flags, 2);
+    snap_put_le(r, method, 2);
+    snap_put_le(r, time, 2);
+    snap_put_le(r, date, 2);
+    snap_put_le(r, zm.crc, 4);
+    snap_put_le(r, big_c ? 0xFFFFFFFF : zm.csize, 4);
+    snap_put_le(r, big_u ? 0xFFFFFFFF : zm.usize, 4);
+    snap_put_le(r, nlen, 2);
+    snap_put_le(r, (zip64_len ? 4 + zip64_len : 0) + 9, 2);
+    snap_put_le(r, 0, 2);
+    snap_put_le(r, 0, 2);
+    snap_put_le(r, 0, 2);
+    snap_put_le(r, (guint32)st->st_mode << 16 | (dir ? 0x10 : 0), 4);
+    snap_put_le(r, big_o ? 0xFFFFFFFF : offset, 4);
+    g_byte_array_append(r, (const guint8 *)path, nlen);
+    if (zip64_len) {
+        snap_put_le(r, 0x0001, 2);
+        snap_put_le(r, zip64_len, 2);
+        if (big_u) snap_put_le(r, zm.usize, 8);
+        if (big_c) snap_put_le(r, zm.csize, 8);
+        if (big_o) snap_put_le(r, offset, 8);
+    }
+    snap_put_le(r, 0x5455, 2);
+    snap_put_le(r, 5, 2);
+    snap_put_le(r, 1, 1);
+    snap_put_le(r, (guint32)st->st_mtime, 4);
+    c->entries++;
+    g_free(path);
+    return ok;
+}
+
+// The central directory and its end record, with zip64 versions of the
+// counts and offsets where the plain ones overflow.
+static gboolean zip_write_end(ArchiveCreate *c, GError **error)
+{
+    guint64 cd_offset = c->written, cd_size = c->central->len;
+    if (!archive_out(c, c->central->data, c->central->len, error)) return FALSE;
+    gboolean zip64 = c->entries >= 0xFFFF || cd_offset >= 0xFFFFFFFF || cd_size >= 0xFFFFFFFF;
+    GByteArray *e = g_byte_array_new();
+    if (zip64) {
+        guint64 at = c->written;
+        snap_put_le(e, ZIP64_END_SIG, 4);
+        snap_put_le(e, 44, 8);
+        snap_put_le(e, 3 << 8 | 45, 2);
+        snap_put_le(e, 45, 2);
+        snap_put_le(e, 0, 4);
+        snap_put_le(e, 0, 4);
+        snap_put_le(e, c->entries, 8);
+        snap_put_le(e, c->entries, 8);
+        snap_put_le(e, cd_size, 8);
+        snap_put_le(e, cd_offset, 8);
+        snap_put_le(e, ZIP64_LOCATOR_SIG, 4);
+        snap_put_le(e, 0, 4);
+        snap_put_le(e, at, 8);
+        snap_put_le(e, 1, 4);
+    }
+    snap_put_le(e, ZIP_END_SIG, 4);
+    snap_put_le(e, 0, 2);
+    snap_put_le(e, 0, 2);
+    snap_put_le(e, MIN(c->entries, 0xFFFF), 2);
+    snap_put_le(e, MIN(c->entries, 0xFFFF), 2);
+    snap_put_le(e, MIN(cd_size, 0xFFFFFFFF), 4);
+    snap_put_le(e, MIN(cd_offset, 0xFFFFFFFF), 4);
+    snap_put_le(e, 0, 2);
+    gboolean ok = archive_out(c, e->data, e->len, error);
+    g_byte_array_free(e, TRUE);
+    return ok;
+}
+
+// Writes the archive. A failed or cancelled one is removed; entries that
+// could not be archived are listed in c->errors and left out, and a file
+// that could not be read to its end is kept only as far as it was read.
+static gboolean archive_create_run(ArchiveCreate *c, GError **error)
+{
+    GHashTable *inodes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    gboolean ok = TRUE;
+    for (guint i = 0; ok && i < c->names->len; ++i) {
+        const gchar *name = g_ptr_array_index(c->names, i);
+        ok = archive_create_scan(c, c->dir_fd, name, name, inodes);
+    }
+    g_hash_table_destroy(inodes);
+    if (!ok) return !g_cancellable_set_error_if_cancelled(c->cancellable, error);
+
+    c->out_fd = open(c->dest, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (c->out_fd < 0) return set_errno_error(error, "Cannot create archive");
+    if (c->gzip && deflateInit2(&c->gz, Z_DEFAULT_COMPRESSION, Z_DEFLATED, MAX_WBITS + 16, 8,
+                                Z_DEFAULT_STRATEGY) != Z_OK) {
+        g_set_error(error, G_IO_ERROR, G_IO_ERROR_FAILED, "Cannot start compressing");
+        c->gzip = FALSE;
+        ok = FALSE;
+    }
+
+    GThread *reader = ok ? g_thread_new("fm-archive-read", archive_reader_thread, c) : NULL;
+    for (guint i = 0; ok && i < c->sources->len; ++i) {
+        if (g_cancellable_set_error_if_cancelled(c->cancellable, error)) ok = FALSE;
+        else if (c->format == ARCHIVE_TAR) ok = tar_write_source(c, i, error);
+        else ok = zip_write_source(c, i, error);
+    }
+    // Lets the reader go; what it read ahead is dropped with the job
+    g_mutex_lock(&c->lock);
+    c->stop = TRUE;
+    g_cond_broadcast(&c->cond);
+    g_mutex_unlock(&c->lock);
+    if (reader) g_thread_join(reader);
+
+    if (ok) ok = c->format == ARCHIVE_TAR ? tar_write_end(c, error) : zip_write_end(c, error);
+    if (ok) ok = archive_out_flush(c, TRUE, error);
+    if (c->gzip) deflateEnd(&c->gz);
+    if (close(c->out_fd) != 0 && ok) ok = set_errno_error(error, "Cannot finish archive");
+    c->out_fd = -1;
+    if (!ok) unlink(c->dest);
+    return ok;
+}
+
+// --- Job Scheduler ---
+// Long operations are submitted as jobs. Every storage device has its own
+// queue, whose jobs start in QoS class order as soon as the device has a
+// free slot: a spinning disk takes one job at a time, since several
+// streams would only make it seek, while flash takes a few. A busy disk
+// never holds up work queued for another. Each job runs on a worker thread
+// with its class applied. The UI thread only polls progress for the jobs
+// panel and applies each job's result once it is finished.
+
+#define JOB_FLASH_LIMIT 4
+#define JOB_PANEL_INTERVAL_MS 250
+#define JOB_RATE_TAU_SECONDS 3.0 // Time constant of the throughput average
+
+typedef struct {
+    guint64 done;
+    guint64 total;  // 0 when not known (yet)
+    gboolean bytes; // done and total count bytes rather than items
+} JobProgress;
+
+// Runs on a worker thread
+typedef gboolean (*JobRunFunc)(gpointer data, GCancellable *cancellable, GError **error);
+// Run on the UI thread; progress must only read thread-safe state
+typedef void (*JobProgressFunc)(gpointer data, JobProgress *progress);
+typedef void (*JobDoneFunc)(gpointer data, const GError *error);
+
+typedef struct {
+    gchar *device;         // Block device name, or major:minor without one
+    guint limit;           // Jobs it runs at once
+    guint running;
+    GQueue pending;        // Job, by class then submission
+} JobQueue;
+
+typedef struct {
+    gchar *title;
+    QosClass qos;          // Also the job's priority in its queue
+    guint64 seq;           // Submission order within a class
+    JobQueue *queue;       // Of the device the job works on
+    GCancellable *cancellable;
+    JobRunFunc run;
+    JobProgressFunc progress;
+    JobDoneFunc done;
+    gpointer data;
+    GDestroyNotify free_data;
+    gboolean running;
+    gint64 sample_time;    // Throughput estimate: last sample
+    guint64 sample_done;
+    gdouble rate;          // Units per second, exponentially weighted
+    GtkWidget *row;
+    GtkWidget *bar;
+    GtkWidget *detail;
+} Job;
+
+typedef struct {
+    GtkWidget *panel;      // Holds one row per job; hidden while idle
+    GtkWidget *list;
+    GHashTable *queues;    // Device key -> JobQueue
+    guint queued;          // Jobs waiting in any queue
+    GList *running;        // Job
+    guint64 seq;
+    guint tick_id;
+} JobScheduler;
+
+static JobScheduler scheduler;
+
+static void job_free(Job *job)
+{
+    if (job->row) gtk_widget_destroy(job->row);
+    if (job->free_data) job->free_data(job->data);
+    g_object_unref(job->cancellable);
+    g_free(job->title);
+    g_free(job);
+}
+
+static void job_queue_free(JobQueue *q)
+{
+    g_free(q->device);
+    g_free(q);
+}
+
+static gint job_compare(gconstpointer a, gconstpointer b, gpointer user_data)
+{
+    const Job *x = a, *y = b;
+    if (x->qos != y->qos) return x->qos < y->qos ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// The queue of the device behind dev. Partitions of one disk share its
+// queue; filesystems without a block device (tmpfs, network) each get
+// their own.
+static JobQueue* job_queue_for(dev_t dev)
+{
+    const DeviceInfo *info = device_probe(dev);
+    gchar *key = info->known ? g_strdup(info->name) : g_strdup_printf("%u:%u", major(dev), minor(dev));
+    JobQueue *q = g_hash_table_lookup(scheduler.queues, key);
+    if (q) {
+        g_free(key);
+        return q;
+    }
+    q = g_new0(JobQueue, 1);
+    q->device = key;
+    q->limit = info->known && info->rotational ? 1 : JOB_FLASH_LIMIT;
+    g_queue_init(&q->pending);
+    g_hash_table_insert(scheduler.queues, q->device, q);
+    return q;
+}
+
+static gchar* job_format_duration(gdouble seconds)
+{
+    guint64 s = (guint64)(seconds + 0.5);
+    if (s >= 3600) return g_strdup_printf("%" G_GUINT64_FORMAT ":%02u:%02u", s / 3600, (guint)(s / 60 % 60), (guint)(s % 60));
+    return g_strdup_printf("%u:%02u", (guint)(s / 60), (guint)(s % 60));
+}
+
+// Samples the job's progress and folds the throughput since the last
+// sample into an exponentially weighted average, weighting by elapsed
+// time so the estimate does not depend on how often the panel ticks.
+static void job_update_row(Job *job)
+{
+    if (!job->running) {
+        gtk_label_set_text(GTK_LABEL(job->detail), "Queued");
+        return;
+    }
+    JobProgress p = { 0 };
+    if (job->progress) job->progress(job->data, &p);
+
+    gint64 now = g_get_monotonic_time();
+    if (job->sample_time) {
+        gdouble dt = (now - job->sample_time) / (gdouble)G_USEC_PER_SEC;
+        if (dt > 0) {
+            gdouble instant = (p.done - MIN(p.done, job->sample_done)) / dt;
+            gdouble alpha = job->rate > 0 ? 1.0 - exp(-dt / JOB_RATE_TAU_SECONDS) : 1.0;
+            job->rate += alpha * (instant - job->rate);
+        }
+    }
+    job->sample_time = now;
+    job->sample_done = p.done;
+
+    GString *text = g_string_new(NULL);
+    if (p.bytes) {
+        gchar *done = g_format_size(p.done);
+        g_string_append(text, done);
+        g_free(done);
+        if (p.total) {
+            gchar *total = g_format_size(p.total);
+            g_string_append_printf(text, " of %s", total);
+            g_free(total);
+        }
+        gchar *rate = g_format_size((guint64)job->rate);
+        g_string_append_printf(text, ", %s/s", rate);
+        g_free(rate);
+    } else {
+        g_string_append_printf(text, "%" G_GUINT64_FORMAT, p.done);
+        if (p.total) g_string_append_printf(text, " of %" G_GUINT64_FORMAT, p.total);
+        g_string_append_printf(text, " items, %.0f/s", job->rate);
+    }
+    if (p.total && p.done < p.total && job->rate > 0) {
+        gchar *eta = job_format_duration((p.total - p.done) / job->rate);
+        g_string_append_printf(text, ", %s left", eta);
+        g_free(eta);
+    }
+    gtk_label_set_text(GTK_LABEL(job->detail), text->str);
+    g_string_free(text, TRUE);
+
+    if (p.total)
+        gtk_progress_bar_set_fraction(GTK_PROGRESS_BAR(job->bar), MIN(1.0, (gdouble)p.done / p.total));
+    else
+        gtk_progress_bar_pulse(GTK_PROGRESS_BAR(job->bar));
+}
+
+static gboolean job_panel_tick(gpointer user_data)
+{
+    for (GList *l = scheduler.running; l; l = l->next)
+        job_update_row(l->data);
+    return G_SOURCE_CONTINUE;
+}
+
+static void job_panel_update_visibility(void)
+{
+    gboolean busy = scheduler.running || scheduler.queued > 0;
+    gtk_widget_set_visible(scheduler.panel, busy);
+    if (busy && !scheduler.tick_id)
+        scheduler.tick_id = g_timeout_add(JOB_PANEL_INTERVAL_MS, job_panel_tick, NULL);
+    else if (!busy && scheduler.tick_id) {
+        g_source_remove(scheduler.tick_id);
+        scheduler.tick_id = 0;
+    }
+}
+
+static void job_pump(void);
+
+static void job_thread(GTask *task, gpointer source, gpointer task_data, GCancellable *cancellable)
+{
+    Job *job = task_data;
+    GError *err = NULL;
+    qos_apply_thread(job->qos);
+    if (job->run(job->data, cancellable, &err))
+        g_task_return_boolean(task, TRUE);
+    else
+        g_task_return_error(task, err);
+}
+
+// Background jobs cannot borrow a GTask pool thread: their raised nice
+// value would stick to it. This thread is theirs alone and ends with them.
+static gpointer job_background_thread(gpointer data)
+{
+    GTask *task = data;
+    job_thread(task, NULL, g_task_get_task_data(task), g_task_get_cancellable(task));
+    g_object_unref(task);
+    return NULL;
+}
+
+static void job_finished(GObject *source, GAsyncResult *res, gpointer user_data)
+{
+    Job *job = user_data;
+    GError *err = NULL;
+    g_task_propagate_boolean(G_TASK(res), &err);
+
+    scheduler.running = g_list_remove(scheduler.running, job);
+    job->queue->running--;
+    gtk_widget_destroy(job->row);
+    job->row = NULL;
+    job_pump();
+
+    job->done(job->data, err);
+    if (err) g_error_free(err);
+    job_free(job);
+}
+
+// Fills the free slots of every device from the head of its queue.
+static void job_pump(void)
+{
+    GHashTableIter iter;
+    JobQueue *q;
+    g_hash_table_iter_init(&iter, scheduler.queues);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer *)&q)) {
+        while (q->running < q->limit && !g_queue_is_empty(&q->pending)) {
+            Job *job = g_queue_pop_head(&q->pending);
+            scheduler.queued--;
+            q->running++;
+            scheduler.running = g_list_append(scheduler.running, job);
+            job->running = TRUE;
+
+            GTask *task = g_task_new(NULL, job->cancellable, job_finished, job);
+            g_task_set_task_data(task, job, NULL);
+            if (job->qos == QOS_BACKGROUND)
+                g_thread_unref(g_thread_new("fm-background-job", job_background_thread, task));
+            else {
+                g_task_run_in_thread(task, job_thread);
+                g_object_unref(task);
+            }
+            job_update_row(job);
+        }
+    }
+    job_panel_update_visibility();
+}
+
+static void on_job_cancel_clicked(GtkButton *btn, gpointer user_data)
+{
+    Job *job = user_data;
+    g_cancellable_cancel(job->cancellable);
+    gtk_widget_set_sensitive(GTK_WIDGET(btn), FALSE);
+    if (job->running) return;
+
+    // Never started; finish it right here
+    g_queue_remove(&job->queue->pending, job);
+    scheduler.queued--;
+    GError *err = g_error_new_literal(G_IO_ERROR, G_IO_ERROR_CANCELLED, "Cancelled before it started");
+    job_panel_update_visibility();
+    job->done(job->data, err);
+    g_error_free(err);
+    job_free(job);
+}
+
+static void job_scheduler_init(GtkWidget *panel, GtkWidget *list)
+{
+    scheduler.panel = panel;
+    scheduler.list = list;
+    scheduler.queues = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)job_queue_free);
+}
+
+// Queues a job that works on device dev. run is called on a worker thread
+// with cancellable (taken over by the job; NULL makes a new one); done is
+// called on the UI thread with the outcome, after which free_data frees
+// data.
+static void job_submit(const gchar *title, QosClass qos, dev_t dev, GCancellable *cancellable,
+                       JobRunFunc run, JobProgressFunc progress, JobDoneFunc done,
+                       gpointer data, GDestroyNotify free_data)
+{
+    Job *job = g_new0(Job, 1);
+    job->title = g_strdup(title);
+    job->qos = qos;
+    job->seq = scheduler.seq++;
+    job->queue = job_queue_for(dev);
+    job->cancellable = cancellable ? g_object_ref(cancellable) : g_cancellable_new();
+    job->run = run;
+    job->progress = progress;
+    job->done = done;
+    job->data = data;
+    job->free_data = free_data;
+
+    GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+    GtkWidget *title_label = gtk_label_new(title);
+    gtk_label_set_ellipsize(GTK_LABEL(title_label), PANGO_ELLIPSIZE_MIDDLE);
+    gtk_label_set_xalign(GTK_LABEL(title_label), 0.0);
+    gtk_widget_set_size_request(title_label, 220, -1);
+    job->bar = gtk_progress_bar_new();
+    gtk_widget_set_hexpand(job->bar, TRUE);
+    gtk_widget_set_valign(job->bar, GTK_ALIGN_CENTER);
+    job->detail = gtk_label_new("Queued");
+    gtk_widget_set_size_request(job->detail, 280, -1);
+    gtk_label_set_xalign(GTK_LABEL(job->detail), 0.0);
+    GtkWidget *cancel = gtk_button_new_with_label("Cancel");
+    g_signal_connect(cancel, "clicked", G_CALLBACK(on_job_cancel_clicked), job);
+    gtk_box_pack_start(GTK_BOX(hbox), title_label, FALSE, FALSE, 6);
+    gtk_box_pack_start(GTK_BOX(hbox), job->bar, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), job->detail, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(hbox), cancel, FALSE, FALSE, 6);
+    job->row = gtk_list_box_row_new();
+    gtk_container_add(GTK_CONTAINER(job->row), hbox);
+    gtk_widget_show_all(job->row);
+    gtk_list_box_insert(GTK_LIST_BOX(scheduler.list), job->row, -1);
+
+    g_queue_insert_sorted(&job->queue->pending, job, job_compare, NULL);
+    scheduler.queued++;
+    job_pump();
+}
+
+// The device under dirfd, for job_submit.
+static dev_t job_device_of(int dirfd, const gchar *path)
+{
+    struct stat st;
+    return fstatat(dirfd, path, &st, 0) == 0 ? st.st_dev : 0;
+}
+
+// Measures how much background work slows down what the user waits on.
+// A load thread reads every file under a directory from the device (its
+// pages are dropped as it goes) while the foreground repeatedly lists
+// another directory the way refresh_file_list does and reads the start of
+// a file in it from a cold cache. The load runs in each QoS class in turn,
+// then as background work under a bandwidth cap.
+
+#define PROBE_PHASE_SECONDS 5
+#define PROBE_INTERVAL_MS 50
+#define PROBE_READ_SIZE (64 * 1024)
+
+typedef struct {
+    const gchar *root;
+    QosClass qos;
+    gint stop;
+    guint64 bytes; // Read by the load; only looked at once it has stopped
+} ProbeLoad;
+
+static void probe_load_tree(ProbeLoad *load, const gchar *path, guint8 *buf)
+{
+    struct stat st;
+    if (g_atomic_int_get(&load->stop) || lstat(path, &st) != 0) return;
+    if (S_ISREG(st.st_mode)) {
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return;
+        ssize_t n;
+        while (!g_atomic_int_get(&load->stop) && (n = read(fd, buf, COPY_BUFFER_SIZE)) > 0) {
+            load->bytes += n;
+            qos_throttle(load->qos, n, NULL);
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+        return;
+    }
+    if (!S_ISDIR(st.st_mode)) return;
+    DIR *dir = opendir(path);
+    if (!dir) return;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (g_strcmp0(de->d_name, ".") == 0 || g_strcmp0(de->d_name, "..") == 0) continue;
+        gchar *child = g_build_filename(path, de->d_name, NULL);
+        probe_load_tree(load, child, buf);
+        g_free(child);
+    }
+    closedir(dir);
+}
+
+// Runs on a thread of its own, since a background class sticks to it.
+static gpointer probe_load_thread(gpointer data)
+{
+    ProbeLoad *load = data;
+    qos_apply_thread(load->qos);
+    guint8 *buf = g_malloc(COPY_BUFFER_SIZE);
+    while (!g_atomic_int_get(&load->stop)) {
+        guint64 before = load->bytes;
+        probe_load_tree(load, load->root, buf);
+        if (load->bytes == before) g_usleep(10 * 1000); // Nothing to read
+    }
+    g_free(buf);
+    return NULL;
+}
+
+// Lists dir the way refresh_file_list does; returns milliseconds.
+static gdouble probe_list_once(const gchar *dir_path)
+{
+    gint64 start = g_get_monotonic_time();
+    DIR *dir = opendir(dir_path);
+    if (dir) {
+        struct dirent *de;
+        GPtrArray *entries = g_ptr_array_new_with_free_func(g_free);
+        while ((de = readdir(dir)) != NULL) {
+            struct stat st;
+            if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) fstatat(dirfd(dir), de->d_name, &st, 0);
+            g_ptr_array_add(entries, g_strdup(de->d_name));
+        }
+        g_ptr_array_sort(entries, compare_entry_names);
+        g_ptr_array_free(entries, TRUE);
+        closedir(dir);
+    }
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+// Opens path and reads its start from the device; returns milliseconds,
+// or a negative value when the file could not be read, which is no sample.
+static gdouble probe_open_once(const gchar *path, guint8 *buf)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+    gint64 start = g_get_monotonic_time();
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, PROBE_READ_SIZE);
+    close(fd);
+    if (n <= 0) return -1;
+    return (g_get_monotonic_time() - start) / 1000.0;
+}
+
+static gint probe_compare_ms(gconstpointer a, gconstpointer b)
+{
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+    return x < y ? -1 : x > y;
+}
+
+static gdouble probe_percentile(GArray *ms, gdouble p)
+{
+    if (ms->len == 0) return 0;
+    g_array_sort(ms, probe_compare_ms);
+    return g_array_index(ms, gdouble, MIN(ms->len - 1, (guint)(p * ms->len)));
+}
+
+static int run_latency_probe(const gchar *list_dir, const gchar *load_dir, guint cap_mib)
+{
+    GPtrArray *files = g_ptr_array_new_with_free_func(g_free);
+    DIR *dir = opendir(list_dir);
+    if (!dir) {
+        g_printerr("Cannot open %s: %s\n", list_dir, g_strerror(errno));
+        g_ptr_array_free(files, TRUE);
+        return 1;
+    }
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, 0) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+            g_ptr_array_add(files, g_build_filename(list_dir, de->d_name, NULL));
+    }
+    closedir(dir);
+
+    static const struct { const gchar *name; gboolean load; QosClass qos; gboolean capped; } phases[] = {
+        { "idle", FALSE, QOS_NORMAL, FALSE },
+        { "normal load", TRUE, QOS_NORMAL, FALSE },
+        { "background load", TRUE, QOS_BACKGROUND, FALSE },
+        { "capped background", TRUE, QOS_BACKGROUND, TRUE },
+    };
+    guint8 *buf = g_malloc(PROBE_READ_SIZE);
+    gdouble idle_list = 0, idle_open = 0;
+    g_print("%-18s %10s %10s %10s %10s %12s\n", "phase", "list p50", "list p99", "open p50", "open p99", "load MB/s");
+    for (guint i = 0; i < G_N_ELEMENTS(phases); ++i) {
+        qos_set_rate(QOS_BACKGROUND, phases[i].capped ? (guint64)cap_mib * 1024 * 1024 : 0);
+        ProbeLoad load = { load_dir, phases[i].qos };
+        GThread *thread = phases[i].load ? g_thread_new("fm-probe-load", probe_load_thread, &load) : NULL;
+
+        GArray *list_ms = g_array_new(FALSE, FALSE, sizeof(gdouble));
+        GArray *open_ms = g_array_new(FALSE, FALSE, sizeof(gdouble));
+        gint64 start = g_get_monotonic_time();
+        for (guint n = 0; g_get_monotonic_time() - start < PROBE_PHASE_SECONDS * G_USEC_PER_SEC; ++n) {
+            gdouble ms = probe_list_once(list_dir);
+            g_array_append_val(list_ms, ms);
+            if (files->len > 0) {
+                ms = probe_open_once(g_ptr_array_index(files, n % files->len), buf);
+                if (ms >= 0) g_array_append_val(open_ms, ms);
+            }
+            g_usleep(PROBE_INTERVAL_MS * 1000);
+        }
+        gdouble elapsed = (g_get_monotonic_time() - start) / (gdouble)G_USEC_PER_SEC;
+
+        if (thread) {
+            g_atomic_int_set(&load.stop, 1);
+            g_thread_join(thread);
+        }
+        gdouble list50 = probe_percentile(list_ms, 0.5), open50 = probe_percentile(open_ms, 0.5);
+        if (i == 0) {
+            idle_list = list50;
+            idle_open = open50;
+        }
+        g_print("%-18s %8.2fms %8.2fms %8.2fms %8.2fms %12.1f", phases[i].name, list50,
+                probe_percentile(list_ms, 0.99), open50, probe_percentile(open_ms, 0.99), load.bytes / 1e6 / elapsed);
+        if (i > 0 && idle_list > 0 && idle_open > 0)
+            g_print("   (list x%.1f, open x%.1f)", list50 / idle_list, open50 / idle_open);
+        g_print("\n");
+        g_array_free(list_ms, TRUE);
+        g_array_free(open_ms, TRUE);
+    }
+    qos_set_rate(QOS_BACKGROUND, 0);
+    g_free(buf);
+    g_ptr_array_free(files, TRUE);
+    return 0;
+}
+
+// --- File System Operations ---
+
+static void start_paste_job(AppWidgets *w, GPtrArray *sources, int dest_fd, const gchar *rename_to,
+                            gboolean move, CopyJournal *journal);
+
+static void append_list_row(AppWidgets *w, const gchar *entryName, gboolean is_dir)
+{
+    GtkWidget *row = gtk_list_box_row_new();
+    GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+
+    GtkWidget *image;
+    if (is_dir)
+        image = gtk_image_new_from_icon_name("folder", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    else
+        image = gtk_image_new_from_icon_name("text-x-generic", GTK_ICON_SIZE_SMALL_TOOLBAR);
+
+    GtkWidget *label = gtk_label_new(entryName);
+    gtk_widget_set_halign(label, GTK_ALIGN_START);
+
+    gtk_box_pack_start(GTK_BOX(hbox), image, FALSE, FALSE, 6);
+    gtk_box_pack_start(GTK_BOX(hbox), label, TRUE, TRUE, 6);
+    gtk_container_add(GTK_CONTAINER(row), hbox);
+    gtk_widget_show_all(row);
+
+    g_object_set_data_full(G_OBJECT(row), "entry-name", g_strdup(entryName), g_free);
+    gtk_list_box_insert(GTK_LIST_BOX(w->listbox), row, -1);
+}
+
+// Lists the member directory being browsed inside an archive.
+static void archive_fill_list(AppWidgets *w)
+{
+    gchar *shown = g_build_filename(w->current_dir, w->archive_name, w->archive_dir, NULL);
+    gtk_label_set_text(GTK_LABEL(w->pathLabel), shown);
+    g_free(shown);
+    ArchiveMember *dir = archive_lookup(w->archive, w->archive_dir);
+    for (guint i = 0; dir && dir->children && i < dir->children->len; ++i) {
+        const ArchiveMember *m = g_ptr_array_index(dir->children, i);
+        append_list_row(w, archive_member_name(m), m->type == 'd');
+    }
+}
+
+// Inside an archive only what reads from it makes sense: everything that
+// would act on a real directory is disabled, and Extract takes the place
+// of copying.
+static void archive_mode_changed(AppWidgets *w)
+{
+    for (guint i = 0; i < w->dir_actions->len; ++i)
+        gtk_widget_set_sensitive(g_ptr_array_index(w->dir_actions, i), w->archive == NULL);
+}
+
+static void leave_archive(AppWidgets *w)
+{
+    g_clear_pointer(&w->archive, archive_unref);
+    g_clear_pointer(&w->archive_name, g_free);
+    g_clear_pointer(&w->archive_dir, g_free);
+    archive_mode_changed(w);
+}
+
+// Browses name, in the current directory, as a directory if it is an
+// archive. FALSE when it is not one, so it is read as a file instead.
+static gboolean enter_archive(AppWidgets *w, const gchar *name)
+{
+    GError *err = NULL;
+    Archive *archive = archive_open_at(w->dir_fd, name, &err);
+    if (!archive) {
+        gboolean failed = !g_error_matches(err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED);
+        if (failed) show_error_dialog(GTK_WINDOW(w->window), "File Read Error", err->message);
+        g_error_free(err);
+        return failed;
+    }
+    w->archive = archive;
+    w->archive_name = g_strdup(name);
+    w->archive_dir = g_strdup("");
+    // Nothing in the editor may be saved over the archive
+    g_clear_pointer(&w->selected_file_path, g_free);
+    gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview)), "", -1);
+    archive_mode_changed(w);
+    refresh_file_list(w);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected (Archive View)");
+    return TRUE;
+}
+
+// Opens a member of the archive being browsed: a directory is listed, a
+// file previewed. Only the start of a large member is read.
+static void archive_activate(AppWidgets *w, const gchar *name)
+{
+    gchar *path = *w->archive_dir ? g_strconcat(w->archive_dir, "/", name, NULL) : g_strdup(name);
+    ArchiveMember *m = archive_lookup(w->archive, path);
+    if (m && m->type == 'd') {
+        g_free(w->archive_dir);
+        w->archive_dir = path;
+        refresh_file_list(w);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected (Archive View)");
+        return;
+    }
+
+    GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
+    GByteArray *bytes = g_byte_array_new();
+    GError *err = NULL;
+    if (!m) {
+        g_set_error(&err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND, "%s is not in the archive", path);
+    } else if (archive_read_member(w->archive, m, ARCHIVE_PREVIEW_MAX, archive_collect, bytes, &err)) {
+        // A preview cut short may end inside a character
+        const gchar *end;
+        gboolean cut = m->size > ARCHIVE_PREVIEW_MAX;
+        gboolean text = g_utf8_validate((const gchar *)bytes->data, bytes->len, &end) ||
+                        (cut && bytes->len - (end - (const gchar *)bytes->data) < 4);
+        if (text) gtk_text_buffer_set_text(buf, (const gchar *)bytes->data, end - (const gchar *)bytes->data);
+        else gtk_text_buffer_set_text(buf, "(Binary content. Use Extract to get this member out.)", -1);
+
+        GDateTime *mtime = g_date_time_new_from_unix_local(m->mtime);
+        gchar *time_str = mtime ? g_date_time_format_iso8601(mtime) : g_strdup("unknown");
+        gchar *status_text = g_strdup_printf("Archive Member: %s | Size: %" G_GUINT64_FORMAT " bytes | Modified: %s%s",
+                                             m->path, m->size, time_str, cut && text ? " | Showing the first 1 MiB" : "");
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), status_text);
+        g_free(status_text);
+        g_free(time_str);
+        if (mtime) g_date_time_unref(mtime);
+    }
+    if (err) {
+        show_error_dialog(GTK_WINDOW(w->window), "File Read Error", err->message);
+        g_error_free(err);
+        gtk_text_buffer_set_text(buf, "", -1);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: Read Failed");
+    }
+    g_byte_array_free(bytes, TRUE);
+    g_free(path);
+}
+
+static void refresh_file_list(AppWidgets *w)
+{
+    // Clear existing list
+    GList *children = gtk_container_get_children(GTK_CONTAINER(w->listbox));
+    for (GList *iter = children; iter != NULL; iter = iter->next) {
+        gtk_widget_destroy(GTK_WIDGET(iter->data));
+    }
+    g_list_free(children);
+    
+    // Clear editor and status on refresh
+    GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
+    gtk_text_buffer_set_text(buf, "", -1);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected");
+    
+    if (w->selected_file_path) {
+        g_free(w->selected_file_path);
+        w->selected_file_path = NULL;
+    }
+
+    // Update path label; the directory may have moved since it was opened
+    gchar *path = dir_handle_path(w->dir_fd);
+    if (path) {
+        g_free(w->current_dir);
+        w->current_dir = path;
+    }
+    gtk_label_set_text(GTK_LABEL(w->pathLabel), w->current_dir);
+    if (w->archive) {
+        archive_fill_list(w);
+        return;
+    }
+
+    int fd = openat(w->dir_fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *dir = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dir) {
+        if (fd >= 0) close(fd);
+        show_error_dialog(GTK_WINDOW(w->window), "Navigation Error", "Cannot open directory: Permission denied or not found.");
+        return;
+    }
+
+    // Directory entries carry their type, so only the rare entries whose
+    // type the filesystem does not record (and links) need a stat
+    struct dirent *de;
+    GPtrArray *entries = g_ptr_array_new_with_free_func(g_free);
+    GHashTable *dirs = g_hash_table_new(g_str_hash, g_str_equal);
+
+    while ((de = readdir(dir)) != NULL) {
+        if (g_strcmp0(de->d_name, ".") == 0 || g_strcmp0(de->d_name, "..") == 0) continue;
+        if (g_strcmp0(de->d_name, VERSIONS_DIR_NAME) == 0) continue;
+        if (g_str_has_prefix(de->d_name, STAGING_DIR_PREFIX)) continue;
+        gchar *entryName = g_strdup(de->d_name);
+        g_ptr_array_add(entries, entryName);
+
+        gboolean is_dir = de->d_type == DT_DIR;
+        struct stat st;
+        if ((de->d_type == DT_UNKNOWN || de->d_type == DT_LNK) && fstatat(fd, de->d_name, &st, 0) == 0)
+            is_dir = S_ISDIR(st.st_mode);
+        if (is_dir) g_hash_table_add(dirs, entryName);
+    }
+
+    g_ptr_array_sort(entries, compare_entry_names);
+
+    for (guint i = 0; i < entries->len; ++i) {
+        gchar *entryName = g_ptr_array_index(entries, i);
+        append_list_row(w, entryName, g_hash_table_contains(dirs, entryName));
+    }
+
+    closedir(dir);
+    g_hash_table_destroy(dirs);
+    g_ptr_array_free(entries, TRUE);
+}
+
+// Makes the directory name beneath the current one (".." for the parent)
+// the current directory.
+static gboolean navigate_to(AppWidgets *w, const gchar *name, GError **error)
+{
+    int fd = dir_handle_openat(w->dir_fd, name);
+    if (fd < 0) return set_errno_error(error, "Cannot open directory");
+
+    gchar *path = dir_handle_path(fd);
+    if (!path) path = g_canonicalize_filename(name, w->current_dir);
+    close(w->dir_fd);
+    w->dir_fd = fd;
+    g_free(w->current_dir);
+    w->current_dir = path;
+    return TRUE;
+}
+
+static void on_row_activated(GtkListBox *box, GtkListBoxRow *row, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    const gchar *entryName = g_object_get_data(G_OBJECT(row), "entry-name");
+    if (w->archive) {
+        archive_activate(w, entryName);
+        return;
+    }
+    
+    if (w->selected_file_path) {
+        g_free(w->selected_file_path);
+        w->selected_file_path = NULL;
+    }
+    w->selected_file_path = g_build_filename(w->current_dir, entryName, NULL);
+
+    struct stat entry_st;
+    if (fstatat(w->dir_fd, entryName, &entry_st, 0) == 0 && S_ISDIR(entry_st.st_mode)) {
+        // Navigate into directory
+        GError *err = NULL;
+        if (!navigate_to(w, entryName, &err)) {
+            show_error_dialog(GTK_WINDOW(w->window), "Navigation Error", err->message);
+            g_error_free(err);
+            return;
+        }
+        refresh_file_list(w);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected (Directory View)");
+        
+        GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
+        gtk_text_buffer_set_text(buf, "", -1);
+
+    } else if (enter_archive(w, entryName)) {
+        // Browsed like a directory, or reported as damaged
+    } else {
+        // Read file contents (READ) and display metadata (Optional Feature)
+        gchar *contents = NULL;
+        gsize len = 0;
+        GError *err = NULL;
+        struct stat file_stat;
+
+        if (read_file_at(w->dir_fd, entryName, &contents, &len, &file_stat, &err)) {
+            GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
+            gtk_text_buffer_set_text(buf, contents, len);
+            g_free(contents);
+            
+            // Display metadata (size and time) from the file just read
+            GDateTime *mtime = g_date_time_new_from_unix_local(file_stat.st_mtim.tv_sec);
+            gchar *time_str = mtime ? g_date_time_format_iso8601(mtime) : g_strdup("unknown");
+            gchar *status_text = g_strdup_printf("Current File: %s | Size: %lu bytes | Modified: %s", 
+                                                entryName, 
+                                                (gulong)file_stat.st_size, 
+                                                time_str);
+            gtk_label_set_text(GTK_LABEL(w->statusLabel), status_text);
+            g_free(time_str);
+            g_free(status_text);
+            if (mtime) g_date_time_unref(mtime);
+
+        } else {
+            show_error_dialog(GTK_WINDOW(w->window), "File Read Error", err->message);
+            g_error_free(err);
+            GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
+            gtk_text_buffer_set_text(buf, "", -1);
+            gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: Read Failed");
+        }
+    }
+    
+    // Clear selection path (it's re-set on activation)
+    if (w->selected_file_path) {
+        g_free(w->selected_file_path);
+        w->selected_file_path = NULL;
+    }
+}
+
+static void on_new_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    const gchar *name = gtk_entry_get_text(GTK_ENTRY(w->entryName));
+    if (!name || !*name) {
+        show_error_dialog(GTK_WINDOW(w->window), "Create Error", "Please enter a name.");
+        return;
+    }
+
+    GError *err = NULL;
+    gboolean is_dir = (g_str_has_suffix(name, "/") || g_str_has_suffix(name, "\\"));
+
+    // CREATE operation: exclusive, relative to the current directory
+    if (!create_path_at(w->dir_fd, name, &err)) {
+        show_error_dialog(GTK_WINDOW(w->window), is_dir ? "Create Directory Error" : "Create File Error", err->message);
+        g_error_free(err);
+        return;
+    }
+
+    refresh_file_list(w);
+    show_info_dialog(GTK_WINDOW(w->window), "Success", is_dir ? "Directory created." : "File created.");
+    gtk_entry_set_text(GTK_ENTRY(w->entryName), "");
+}
+
+// Creates every name listed in a dialog, one per line, in the current
+// directory. Lines ending in "/" become directories.
+static void on_batch_new_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GtkWidget *dialog = gtk_dialog_new_with_buttons("Create Many", GTK_WINDOW(w->window), GTK_DIALOG_MODAL,
+                                                    "Cancel", GTK_RESPONSE_CANCEL,
+                                                    "Create", GTK_RESPONSE_ACCEPT, NULL);
+    gtk_window_set_default_size(GTK_WINDOW(dialog), 400, 400);
+    GtkWidget *area = gtk_dialog_get_content_area(GTK_DIALOG(dialog));
+    GtkWidget *hint = gtk_label_new("One name per line; end a line with / to create a directory.");
+    gtk_box_pack_start(GTK_BOX(area), hint, FALSE, FALSE, 4);
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    GtkWidget *view = gtk_text_view_new();
+    gtk_container_add(GTK_CONTAINER(scrolled), view);
+    gtk_box_pack_start(GTK_BOX(area), scrolled, TRUE, TRUE, 0);
+    gtk_widget_show_all(dialog);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gchar *text = NULL;
+    if (response == GTK_RESPONSE_ACCEPT) {
+        GtkTextBuffer *buffer = gtk_text_view_get_buffer(GTK_TEXT_VIEW(view));
+        GtkTextIter start, end;
+        gtk_text_buffer_get_bounds(buffer, &start, &end);
+        text = gtk_text_buffer_get_text(buffer, &start, &end, FALSE);
+    }
+    gtk_widget_destroy(dialog);
+    if (!text) return;
+
+    gchar **names = g_strsplit(text, "\n", -1);
+    GPtrArray *errors = g_ptr_array_new_with_free_func(g_free);
+    guint created = create_batch_at(w->dir_fd, names, errors);
+    g_strfreev(names);
+    g_free(text);
+
+    refresh_file_list(w);
+    if (errors->len > 0) {
+        // Long lists are cut short; the first failures tell the story
+        guint shown = MIN(errors->len, 20);
+        GString *msg = g_string_new(NULL);
+        g_string_printf(msg, "Created %u item(s); %u failed:", created, errors->len);
+        for (guint i = 0; i < shown; ++i)
+            g_string_append_printf(msg, "\n%s", (const gchar *)g_ptr_array_index(errors, i));
+        if (errors->len > shown) g_string_append_printf(msg, "\n... and %u more", errors->len - shown);
+        show_error_dialog(GTK_WINDOW(w->window), "Create Error", msg->str);
+        g_string_free(msg, TRUE);
+    } else {
+        gchar *msg = g_strdup_printf("Created %u item(s).", created);
+        show_info_dialog(GTK_WINDOW(w->window), "Success", msg);
+        g_free(msg);
+    }
+    g_ptr_array_free(errors, TRUE);
+}
+
+static void on_save_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GtkListBoxRow *row = get_single_selected_row(w);
+    if (!row) {
+        show_error_dialog(GTK_WINDOW(w->window), "Save Error", "Please select a single file to save.");
+        return;
+    }
+
+    const gchar *name = g_object_get_data(G_OBJECT(row), "entry-name");
+    struct stat st;
+    if (fstatat(w->dir_fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+        show_error_dialog(GTK_WINDOW(w->window), "Save Error", "Cannot save content to a directory.");
+        return;
+    }
+
+    GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
+    GtkTextIter s, e;
+    gtk_text_buffer_get_start_iter(buf, &s);
+    gtk_text_buffer_get_end_iter(buf, &e);
+
+    gchar *text = gtk_text_buffer_get_text(buf, &s, &e, FALSE);
+    GError *err = NULL;
+
+    // Preserve the previous contents before they are replaced
+    if (!versions_snapshot(w->dir_fd, name, &err)) {
+        gchar *msg = g_strdup_printf("Previous version could not be preserved, file not saved: %s", err->message);
+        show_error_dialog(GTK_WINDOW(w->window), "Save Error", msg);
+        g_free(msg);
+        g_error_free(err);
+        g_free(text);
+        return;
+    }
+
+    // UPDATE operation
+    if (!write_file_at(w->dir_fd, name, text, strlen(text), &err)) {
+        show_error_dialog(GTK_WINDOW(w->window), "Save Error", err->message);
+        g_error_free(err);
+        g_free(text);
+        return;
+    }
+
+    int root_fd;
+    int vdir_fd = versions_open(w->dir_fd, name, FALSE, &root_fd, NULL);
+    if (vdir_fd >= 0) {
+        versions_prune(root_fd, vdir_fd);
+        close(vdir_fd);
+        close(root_fd);
+    }
+
+    g_free(text);
+    show_info_dialog(GTK_WINDOW(w->window), "Success", "File saved (updated).");
+    
+    // Trigger row activation to refresh metadata display
+    on_row_activated(GTK_LIST_BOX(w->listbox), row, w);
+}
+
+typedef struct {
+    AppWidgets *w;
+    int dir_fd;          // The directory the items were deleted from
+    gchar *origin_dir;
+    GPtrArray *names;
+    gboolean staged;     // Stage for undo instead of deleting for good
+    gint64 batch;        // Staged: undone together
+    GPtrArray *unstaged; // Staged: names that have to be deleted for good
+    gchar *unstaged_reason;
+    guint deleted;       // Names fully deleted or staged
+    DeleteJob *job;
+} DeleteOp;
+
+static void delete_op_free(DeleteOp *op)
+{
+    close(op->dir_fd);
+    g_free(op->origin_dir);
+    g_ptr_array_free(op->names, TRUE);
+    g_ptr_array_free(op->unstaged, TRUE);
+    g_free(op->unstaged_reason);
+    delete_job_free(op->job);
+    g_free(op);
+}
+
+static gboolean delete_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    DeleteOp *op = (DeleteOp *)data;
+    for (guint i = 0; i < op->names->len; ++i) {
+        const gchar *name = g_ptr_array_index(op->names, i);
+        GError *err = NULL;
+        if (op->staged) {
+            if (staging_stage(op->dir_fd, name, op->origin_dir, op->batch, &err)) {
+                delete_job_add_removed(op->job, 1);
+                op->deleted++;
+            } else {
+                g_ptr_array_add(op->unstaged, g_strdup(name));
+                if (!op->unstaged_reason) op->unstaged_reason = g_strdup(err->message);
+                g_error_free(err);
+            }
+        } else if (delete_tree_at(op->dir_fd, name, op->job, &err)) {
+            op->deleted++;
+        } else {
+            if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_propagate_error(error, err);
+                return FALSE;
+            }
+            g_mutex_lock(&op->job->lock);
+            g_ptr_array_add(op->job->errors, g_strdup_printf("%s: %s", name, err->message));
+            g_mutex_unlock(&op->job->lock);
+            g_error_free(err);
+        }
+    }
+    return TRUE;
+}
+
+static void delete_progress(gpointer data, JobProgress *progress)
+{
+    DeleteOp *op = (DeleteOp *)data;
+    progress->done = delete_job_removed(op->job);
+    progress->total = op->staged ? op->names->len : 0;
+}
+
+static void start_delete_job(AppWidgets *w, int dir_fd, const gchar *origin_dir, GPtrArray *names, gboolean staged);
+
+typedef struct {
+    AppWidgets *w;
+    int dir_fd;
+    gchar *origin_dir;
+    GPtrArray *names;
+} DeleteRetry;
+
+static void on_delete_retry_response(GtkDialog *dialog, gint response, gpointer user_data)
+{
+    DeleteRetry *retry = (DeleteRetry *)user_data;
+    gtk_widget_destroy(GTK_WIDGET(dialog));
+    if (response == GTK_RESPONSE_YES && retry->dir_fd >= 0)
+        start_delete_job(retry->w, retry->dir_fd, retry->origin_dir, retry->names, FALSE);
+    if (retry->dir_fd >= 0) close(retry->dir_fd);
+    g_free(retry->origin_dir);
+    g_ptr_array_free(retry->names, TRUE);
+    g_free(retry);
+}
+
+static void delete_done(gpointer data, const GError *error)
+{
+    DeleteOp *op = (DeleteOp *)data;
+    AppWidgets *w = op->w;
+
+    refresh_file_list(w);
+
+    // Only items that are gone entirely count as deleted; a tree that was
+    // partly removed is reported with the failures
+    guint failed = op->names->len - op->deleted;
+    gchar *done = failed == 0 ? g_strdup_printf("Deleted %u item(s)", op->deleted)
+                              : g_strdup_printf("Deleted %u of %u item(s), %u failed", op->deleted, op->names->len, failed);
+    gchar *status = op->staged
+        ? g_strdup_printf("%s (Undo Delete restores them until they are reclaimed)", done)
+        : g_strdup_printf("%s, %" G_GUINT64_FORMAT " entries removed", done, delete_job_removed(op->job));
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+    g_free(done);
+
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        gchar *text = g_strdup_printf("Delete cancelled after %u of %u item(s)", op->deleted, op->names->len);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), text);
+        g_free(text);
+    } else if (error) {
+        show_error_dialog(GTK_WINDOW(w->window), "Delete Error", error->message);
+    } else if (op->job->errors->len > 0) {
+        g_ptr_array_add(op->job->errors, NULL);
+        gchar *joined = g_strjoinv("\n", (gchar **)op->job->errors->pdata);
+        gchar *msg = g_strdup_printf("%u of %u item(s) could not be deleted:\n%s",
+                                     failed, op->names->len, joined);
+        show_error_dialog(GTK_WINDOW(w->window), "Delete Error", msg);
+        g_free(msg);
+        g_free(joined);
+    }
+
+    if (op->unstaged->len > 0) {
+        // Asked without blocking; the question outlives this job
+        DeleteRetry *retry = g_new0(DeleteRetry, 1);
+        retry->w = w;
+        retry->dir_fd = fcntl(op->dir_fd, F_DUPFD_CLOEXEC, 0);
+        retry->origin_dir = g_strdup(op->origin_dir);
+        retry->names = op->unstaged;
+        op->unstaged = g_ptr_array_new_with_free_func(g_free);
+        GtkWidget *c = gtk_message_dialog_new(GTK_WINDOW(w->window), GTK_DIALOG_MODAL, GTK_MESSAGE_WARNING,
+                                              GTK_BUTTONS_YES_NO,
+                                              "%u item(s) cannot be deleted with undo (%s). Delete them permanently?",
+                                              retry->names->len, op->unstaged_reason);
+        g_signal_connect(c, "response", G_CALLBACK(on_delete_retry_response), retry);
+        gtk_widget_show(c);
+    }
+}
+
+// Deletes names beneath dir_fd, whose path is origin_dir, as a job: staged
+// for undo, or for good with the parallel delete engine.
+static void start_delete_job(AppWidgets *w, int dir_fd, const gchar *origin_dir, GPtrArray *names, gboolean staged)
+{
+    DeleteOp *op = g_new0(DeleteOp, 1);
+    op->w = w;
+    op->dir_fd = fcntl(dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (op->dir_fd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Delete Error", g_strerror(errno));
+        g_free(op);
+        return;
+    }
+    op->origin_dir = g_strdup(origin_dir);
+    op->names = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < names->len; ++i)
+        g_ptr_array_add(op->names, g_strdup(g_ptr_array_index(names, i)));
+    op->staged = staged;
+    op->batch = g_get_real_time();
+    op->unstaged = g_ptr_array_new_with_free_func(g_free);
+    op->job = delete_job_new(NULL);
+
+    gchar *title = names->len == 1 ? g_strdup_printf("Delete \"%s\"", (gchar *)g_ptr_array_index(names, 0))
+                                   : g_strdup_printf("Delete %u items", names->len);
+    job_submit(title, staged ? QOS_INTERACTIVE : QOS_NORMAL, job_device_of(op->dir_fd, "."),
+               op->job->cancellable, delete_run, delete_progress, delete_done, op, (GDestroyNotify)delete_op_free);
+    g_free(title);
+}
+
+static void on_delete_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GPtrArray *names = get_selected_names_copy(w);
+    if (names->len == 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Delete Error", "Please select an item.");
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+    int dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (dir_fd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Delete Error", g_strerror(errno));
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+    gchar *dir = g_strdup(w->current_dir);
+
+    gboolean staged = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(w->stagedDeleteCheck));
+    gchar *what = names->len == 1 ? g_strdup_printf("\"%s\"", (gchar *)g_ptr_array_index(names, 0))
+                                  : g_strdup_printf("%u items", names->len);
+
+    GtkWidget *c = gtk_message_dialog_new(GTK_WINDOW(w->window),
+                                          GTK_DIALOG_MODAL,
+                                          GTK_MESSAGE_QUESTION,
+                                          GTK_BUTTONS_YES_NO,
+                                          staged ? "Confirm deletion of %s? It can be undone for a short while."
+                                                 : "Confirm deletion of %s? This cannot be undone.", what);
+    gint res = gtk_dialog_run(GTK_DIALOG(c));
+    gtk_widget_destroy(c);
+    g_free(what);
+
+    // DELETE operation: one job for the whole selection. Staged deletes
+    // are renames out of sight, reclaimed in the background; otherwise
+    // the trees are removed in parallel
+    if (res == GTK_RESPONSE_YES)
+        start_delete_job(w, dir_fd, dir, names, staged);
+    close(dir_fd);
+    g_free(dir);
+    g_ptr_array_free(names, TRUE);
+}
+
+static void on_undo_delete_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GError *err = NULL;
+
+    guint restored = staging_undo_last(&err);
+    if (restored > 0) refresh_file_list(w);
+    if (err) {
+        show_error_dialog(GTK_WINDOW(w->window), "Undo Error", err->message);
+        g_error_free(err);
+    }
+    if (restored > 0) {
+        gchar *msg = g_strdup_printf("Restored %u item(s)", restored);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), msg);
+        g_free(msg);
+    }
+}
+
+typedef struct {
+    AppWidgets *w;
+    int dir_fd;        // The directory the items were trashed from
+    gchar *origin_dir;
+    GPtrArray *names;
+    GCancellable *cancellable;
+    gint done;
+    GPtrArray *errors; // Written by the worker, read once it has finished
+} TrashOp;
+
+static void trash_op_free(TrashOp *op)
+{
+    close(op->dir_fd);
+    g_free(op->origin_dir);
+    g_ptr_array_free(op->names, TRUE);
+    g_object_unref(op->cancellable);
+    g_ptr_array_free(op->errors, TRUE);
+    g_free(op);
+}
+
+// Trashes every name in one pass; trash directories are looked up once
+// per filesystem.
+static gboolean trash_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    TrashOp *op = (TrashOp *)data;
+    GHashTable *trashes = g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, (GDestroyNotify)trash_dir_free);
+
+    for (guint i = 0; i < op->names->len && !g_cancellable_is_cancelled(op->cancellable); ++i) {
+        const gchar *name = g_ptr_array_index(op->names, i);
+        GError *err = NULL;
+        struct stat st;
+        if (fstatat(op->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            set_errno_error(&err, "Cannot stat");
+        } else {
+            gint64 key = st.st_dev;
+            TrashDir *t = g_hash_table_lookup(trashes, &key);
+            if (!t && (t = trash_dir_for(st.st_dev, op->origin_dir, &err)) != NULL)
+                g_hash_table_insert(trashes, g_memdup2(&key, sizeof key), t);
+            if (t) trash_put(t, op->dir_fd, name, op->origin_dir, &err);
+        }
+        if (err) {
+            g_ptr_array_add(op->errors, g_strdup_printf("%s: %s", name, err->message));
+            g_error_free(err);
+        }
+        g_atomic_int_inc(&op->done);
+    }
+    g_hash_table_destroy(trashes);
+    return TRUE;
+}
+
+static void trash_progress(gpointer data, JobProgress *progress)
+{
+    TrashOp *op = (TrashOp *)data;
+    progress->done = g_atomic_int_get(&op->done);
+    progress->total = op->names->len;
+}
+
+static void trash_done(gpointer data, const GError *error)
+{
+    TrashOp *op = (TrashOp *)data;
+    AppWidgets *w = op->w;
+
+    refresh_file_list(w);
+
+    guint trashed = g_atomic_int_get(&op->done) - op->errors->len;
+    gchar *status = g_strdup_printf("Moved %u item(s) to the trash", trashed);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+
+    if (op->errors->len > 0) {
+        g_ptr_array_add(op->errors, NULL);
+        gchar *joined = g_strjoinv("\n", (gchar **)op->errors->pdata);
+        gchar *msg = g_strdup_printf("%u item(s) could not be moved to the trash:\n%s", op->errors->len - 1, joined);
+        show_error_dialog(GTK_WINDOW(w->window), "Trash Error", msg);
+        g_free(msg);
+        g_free(joined);
+    }
+}
+
+// Trashes names from the current directory as a job.
+static void start_trash_job(AppWidgets *w, GPtrArray *names)
+{
+    TrashOp *op = g_new0(TrashOp, 1);
+    op->w = w;
+    op->dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (op->dir_fd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Trash Error", g_strerror(errno));
+        g_free(op);
+        return;
+    }
+    op->origin_dir = g_strdup(w->current_dir);
+    op->names = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < names->len; ++i)
+        g_ptr_array_add(op->names, g_strdup(g_ptr_array_index(names, i)));
+    op->cancellable = g_cancellable_new();
+    op->errors = g_ptr_array_new_with_free_func(g_free);
+
+    gchar *title = names->len == 1 ? g_strdup_printf("Trash \"%s\"", (gchar *)g_ptr_array_index(names, 0))
+                                   : g_strdup_printf("Trash %u items", names->len);
+    job_submit(title, QOS_INTERACTIVE, job_device_of(op->dir_fd, "."), op->cancellable,
+               trash_run, trash_progress, trash_done, op, (GDestroyNotify)trash_op_free);
+    g_free(title);
+}
+
+static void on_trash_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GPtrArray *names = get_selected_names(w);
+    if (names->len == 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Trash Error", "Please select an item.");
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+
+    // TRASH operation: reversible, so no confirmation
+    start_trash_job(w, names);
+    g_ptr_array_free(names, TRUE);
+}
+
+typedef struct {
+    AppWidgets *w;
+    TrashScan *scan;
+    GPtrArray *targets; // TrashEntry owned by scan
+    DeleteJob *job;
+} PurgeOp;
+
+static void purge_op_free(PurgeOp *op)
+{
+    g_ptr_array_free(op->targets, TRUE);
+    trash_scan_free(op->scan);
+    delete_job_free(op->job);
+    g_free(op);
+}
+
+static gboolean purge_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    PurgeOp *op = (PurgeOp *)data;
+    for (guint i = 0; i < op->targets->len; ++i) {
+        TrashEntry *e = g_ptr_array_index(op->targets, i);
+        GError *err = NULL;
+        if (!trash_purge(e, op->job, &err)) {
+            if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_propagate_error(error, err);
+                return FALSE;
+            }
+            g_mutex_lock(&op->job->lock);
+            g_ptr_array_add(op->job->errors, g_strdup_printf("%s: %s", e->origin, err->message));
+            g_mutex_unlock(&op->job->lock);
+            g_error_free(err);
+        }
+    }
+    return TRUE;
+}
+
+static void purge_progress(gpointer data, JobProgress *progress)
+{
+    PurgeOp *op = (PurgeOp *)data;
+    progress->done = delete_job_removed(op->job);
+}
+
+static void purge_done(gpointer data, const GError *error)
+{
+    PurgeOp *op = (PurgeOp *)data;
+    AppWidgets *w = op->w;
+
+    gchar *status = g_strdup_printf("Trash emptied: %" G_GUINT64_FORMAT " item(s) removed", delete_job_removed(op->job));
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+
+    if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), "Emptying the trash was cancelled");
+    } else if (error) {
+        show_error_dialog(GTK_WINDOW(w->window), "Trash Error", error->message);
+    } else if (op->job->errors->len > 0) {
+        g_ptr_array_add(op->job->errors, NULL);
+        gchar *joined = g_strjoinv("\n", (gchar **)op->job->errors->pdata);
+        show_error_dialog(GTK_WINDOW(w->window), "Trash Error", joined);
+        g_free(joined);
+    }
+}
+
+// Permanently deletes targets, which belong to scan; takes both.
+static void start_purge_job(AppWidgets *w, TrashScan *scan, GPtrArray *targets)
+{
+    PurgeOp *op = g_new0(PurgeOp, 1);
+    op->w = w;
+    op->scan = scan;
+    op->targets = targets;
+    op->job = delete_job_new(NULL);
+    op->job->qos = QOS_BACKGROUND;
+
+    // Nothing is waiting on a purge
+    gchar *title = g_strdup_printf("Delete %u item(s) from the trash", targets->len);
+    TrashEntry *first = g_ptr_array_index(targets, 0);
+    job_submit(title, QOS_BACKGROUND, job_device_of(first->dir->files_fd, "."), op->job->cancellable,
+               purge_run, purge_progress, purge_done, op, (GDestroyNotify)purge_op_free);
+    g_free(title);
+}
+
+enum {
+    TRASH_RESPONSE_RESTORE = 1,
+    TRASH_RESPONSE_DELETE,
+    TRASH_RESPONSE_PURGE_AGE,
+    TRASH_RESPONSE_PURGE_SIZE,
+    TRASH_RESPONSE_EMPTY,
+};
+
+// Shows what is in the trash and acts on it: restore or delete the
+// selection, purge by age, shrink to a size limit (oldest first) or empty
+// it. Takes ownership of scan.
+static void show_trash_dialog(AppWidgets *w, TrashScan *scan)
+{
+    GtkWidget *d = gtk_dialog_new_with_buttons("Trash", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Restore", TRASH_RESPONSE_RESTORE,
+                                               "Delete Selected", TRASH_RESPONSE_DELETE,
+                                               "Purge Older", TRASH_RESPONSE_PURGE_AGE,
+                                               "Shrink to Limit", TRASH_RESPONSE_PURGE_SIZE,
+                                               "Empty Trash", TRASH_RESPONSE_EMPTY,
+                                               "Close", GTK_RESPONSE_CLOSE,
+                                               NULL);
+    gtk_window_set_default_size(GTK_WINDOW(d), 700, 500);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+
+    guint64 total = 0;
+    for (guint i = 0; i < scan->entries->len; ++i)
+        total += ((TrashEntry *)g_ptr_array_index(scan->entries, i))->size;
+    gchar *total_text = g_format_size(total);
+    gchar *summary = g_strdup_printf("%u item(s), %s on disk", scan->entries->len, total_text);
+    GtkWidget *summary_label = gtk_label_new(summary);
+    gtk_label_set_xalign(GTK_LABEL(summary_label), 0.0);
+    gtk_box_pack_start(GTK_BOX(content), summary_label, FALSE, FALSE, 4);
+    g_free(summary);
+    g_free(total_text);
+
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    GtkWidget *list = gtk_list_box_new();
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(list), GTK_SELECTION_MULTIPLE);
+    gtk_container_add(GTK_CONTAINER(scrolled), list);
+    gtk_box_pack_start(GTK_BOX(content), scrolled, TRUE, TRUE, 0);
+
+    for (guint i = 0; i < scan->entries->len; ++i) {
+        TrashEntry *e = g_ptr_array_index(scan->entries, i);
+        GDateTime *dt = g_date_time_new_from_unix_local(e->deleted);
+        gchar *when = g_date_time_format(dt, "%Y-%m-%d %H:%M");
+        gchar *size = g_format_size(e->size);
+        gchar *text = g_strdup_printf("%s\t%s\t%s", e->origin, when, size);
+        GtkWidget *label = gtk_label_new(text);
+        gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+        GtkWidget *row = gtk_list_box_row_new();
+        gtk_container_add(GTK_CONTAINER(row), label);
+        g_object_set_data(G_OBJECT(row), "trash-entry", e);
+        gtk_list_box_insert(GTK_LIST_BOX(list), row, -1);
+        g_free(text);
+        g_free(size);
+        g_free(when);
+        g_date_time_unref(dt);
+    }
+
+    GtkWidget *limits = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    GtkWidget *days = gtk_spin_button_new_with_range(0, 3650, 1);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(days), 30);
+    GtkWidget *mib = gtk_spin_button_new_with_range(0, 1024 * 1024, 64);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(mib), 1024);
+    gtk_box_pack_start(GTK_BOX(limits), gtk_label_new("Purge items older than (days):"), FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(limits), days, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(limits), gtk_label_new("Size limit (MiB):"), FALSE, FALSE, 12);
+    gtk_box_pack_start(GTK_BOX(limits), mib, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(content), limits, FALSE, FALSE, 4);
+
+    gtk_widget_show_all(d);
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+
+    GPtrArray *targets = g_ptr_array_new();
+    if (response == TRASH_RESPONSE_RESTORE || response == TRASH_RESPONSE_DELETE) {
+        GList *rows = gtk_list_box_get_selected_rows(GTK_LIST_BOX(list));
+        for (GList *r = rows; r; r = r->next)
+            g_ptr_array_add(targets, g_object_get_data(G_OBJECT(r->data), "trash-entry"));
+        g_list_free(rows);
+    } else if (response == TRASH_RESPONSE_PURGE_AGE) {
+        gint64 cutoff = g_get_real_time() / G_USEC_PER_SEC - (gint64)gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(days)) * 86400;
+        for (guint i = 0; i < scan->entries->len; ++i) {
+            TrashEntry *e = g_ptr_array_index(scan->entries, i);
+            if (e->deleted < cutoff) g_ptr_array_add(targets, e);
+        }
+    } else if (response == TRASH_RESPONSE_PURGE_SIZE) {
+        guint64 limit = (guint64)gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(mib)) * 1024 * 1024;
+        for (guint i = scan->entries->len; i-- > 0 && total > limit; ) {
+            TrashEntry *e = g_ptr_array_index(scan->entries, i);
+            g_ptr_array_add(targets, e);
+            total -= e->size;
+        }
+    } else if (response == TRASH_RESPONSE_EMPTY) {
+        for (guint i = 0; i < scan->entries->len; ++i)
+            g_ptr_array_add(targets, g_ptr_array_index(scan->entries, i));
+    }
+    gtk_widget_destroy(d);
+
+    if (targets->len == 0) {
+        if (response != GTK_RESPONSE_CLOSE && response != GTK_RESPONSE_DELETE_EVENT)
+            gtk_label_set_text(GTK_LABEL(w->statusLabel), "Trash: nothing to do");
+        g_ptr_array_free(targets, TRUE);
+        trash_scan_free(scan);
+        return;
+    }
+
+    if (response == TRASH_RESPONSE_RESTORE) {
+        GString *errors = g_string_new(NULL);
+        for (guint i = 0; i < targets->len; ++i) {
+            TrashEntry *e = g_ptr_array_index(targets, i);
+            GError *err = NULL;
+            if (!trash_restore(e, &err)) {
+                g_string_append_printf(errors, "%s: %s\n", e->origin, err->message);
+                g_error_free(err);
+            }
+        }
+        refresh_file_list(w);
+        if (errors->len > 0) show_error_dialog(GTK_WINDOW(w->window), "Restore Error", errors->str);
+        g_string_free(errors, TRUE);
+        g_ptr_array_free(targets, TRUE);
+        trash_scan_free(scan);
+        return;
+    }
+
+    GtkWidget *c = gtk_message_dialog_new(GTK_WINDOW(w->window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION,
+                                          GTK_BUTTONS_YES_NO,
+                                          "Permanently delete %u item(s) from the trash? This cannot be undone.",
+                                          targets->len);
+    gint res = gtk_dialog_run(GTK_DIALOG(c));
+    gtk_widget_destroy(c);
+    if (res != GTK_RESPONSE_YES) {
+        g_ptr_array_free(targets, TRUE);
+        trash_scan_free(scan);
+        return;
+    }
+    start_purge_job(w, scan, targets);
+}
+
+typedef struct {
+    AppWidgets *w;
+    TrashScan *scan;
+} TrashScanOp;
+
+static void trash_scan_op_free(TrashScanOp *op)
+{
+    if (op->scan) trash_scan_free(op->scan);
+    g_free(op);
+}
+
+static gboolean trash_scan_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    TrashScanOp *op = (TrashScanOp *)data;
+    op->scan = trash_scan();
+    return TRUE;
+}
+
+static void trash_scan_done(gpointer data, const GError *error)
+{
+    TrashScanOp *op = (TrashScanOp *)data;
+    gtk_label_set_text(GTK_LABEL(op->w->statusLabel), "Current File: None Selected");
+    if (error) return;
+    TrashScan *scan = op->scan;
+    op->scan = NULL;
+    show_trash_dialog(op->w, scan);
+}
+
+static void on_view_trash_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    // Sizing trashed trees can take a while; do it off the UI thread, ahead
+    // of bulk work since the user is waiting on it
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Reading the trash...");
+    TrashScanOp *op = g_new0(TrashScanOp, 1);
+    op->w = w;
+    job_submit("Read the trash", QOS_INTERACTIVE, job_device_of(AT_FDCWD, g_get_home_dir()), NULL,
+               trash_scan_run, NULL, trash_scan_done, op, (GDestroyNotify)trash_scan_op_free);
+}
+
+enum {
+    SELECT_RESPONSE_ALL = 1,
+    SELECT_RESPONSE_NONE,
+};
+
+// Selects rows by a shell-style pattern such as "*.o", replacing the
+// selection or adding to it.
+static void on_select_pattern_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GtkWidget *d = gtk_dialog_new_with_buttons("Select", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Select All", SELECT_RESPONSE_ALL,
+                                               "Select None", SELECT_RESPONSE_NONE,
+                                               "Cancel", GTK_RESPONSE_CANCEL,
+                                               "Select", GTK_RESPONSE_ACCEPT,
+                                               NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(d), GTK_RESPONSE_ACCEPT);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+    GtkWidget *entry = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(entry), "Pattern, e.g. *.o or report-??.txt");
+    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    GtkWidget *add = gtk_check_button_new_with_label("Add to the current selection");
+    gtk_box_pack_start(GTK_BOX(content), entry, FALSE, FALSE, 6);
+    gtk_box_pack_start(GTK_BOX(content), add, FALSE, FALSE, 0);
+    gtk_widget_show_all(d);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    gchar *pattern = g_strdup(gtk_entry_get_text(GTK_ENTRY(entry)));
+    gboolean extend = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(add));
+    gtk_widget_destroy(d);
+
+    if (response == SELECT_RESPONSE_ALL) {
+        gtk_list_box_select_all(GTK_LIST_BOX(w->listbox));
+    } else if (response == SELECT_RESPONSE_NONE) {
+        gtk_list_box_unselect_all(GTK_LIST_BOX(w->listbox));
+    } else if (response == GTK_RESPONSE_ACCEPT && *pattern) {
+        if (!extend) gtk_list_box_unselect_all(GTK_LIST_BOX(w->listbox));
+        GList *rows = gtk_container_get_children(GTK_CONTAINER(w->listbox));
+        for (GList *r = rows; r; r = r->next) {
+            const gchar *name = g_object_get_data(G_OBJECT(r->data), "entry-name");
+            if (g_pattern_match_simple(pattern, name))
+                gtk_list_box_select_row(GTK_LIST_BOX(w->listbox), GTK_LIST_BOX_ROW(r->data));
+        }
+        g_list_free(rows);
+    }
+    g_free(pattern);
+
+    GPtrArray *names = get_selected_names(w);
+    gchar *status = g_strdup_printf("%u item(s) selected", names->len);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+    g_ptr_array_free(names, TRUE);
+}
+
+// Applies a chmod-style specification to mode: octal ("644") or symbolic
+// clauses such as "u+x,go-w" or "a=rX", where X grants execute only to
+// directories and to files someone can already execute.
+static gboolean apply_mode_spec(const gchar *spec, mode_t mode, gboolean is_dir, mode_t *out)
+{
+    gsize len = strlen(spec);
+    if (len > 0 && strspn(spec, "01234567") == len) {
+        if (len > 4) return FALSE;
+        *out = g_ascii_strtoull(spec, NULL, 8) & 07777;
+        return TRUE;
+    }
+
+    gchar **clauses = g_strsplit(spec, ",", -1);
+    gboolean ok = clauses[0] != NULL;
+    for (gchar **c = clauses; ok && *c; ++c) {
+        const gchar *p = *c;
+        mode_t who = 0;
+        for (; *p && strchr("ugoa", *p); ++p)
+            who |= *p == 'u' ? 04700 : *p == 'g' ? 02070 : *p == 'o' ? 01007 : 07777;
+        if (!who) who = 07777;
+        if (!*p) ok = FALSE;
+        while (ok && *p) {
+            gchar op = *p++;
+            if (!strchr("+-=", op)) {
+                ok = FALSE;
+                break;
+            }
+            mode_t perm = 0;
+            for (; *p && strchr("rwxXst", *p); ++p) {
+                switch (*p) {
+                case 'r': perm |= 0444; break;
+                case 'w': perm |= 0222; break;
+                case 'x': perm |= 0111; break;
+                case 'X': if (is_dir || (mode & 0111)) perm |= 0111; break;
+                case 's': perm |= 06000; break;
+                case 't': perm |= 01000; break;
+                }
+            }
+            perm &= who;
+            if (op == '+') mode |= perm;
+            else if (op == '-') mode &= ~perm;
+            else mode = (mode & ~who) | perm;
+        }
+    }
+    g_strfreev(clauses);
+    if (ok) *out = mode & 07777;
+    return ok;
+}
+
+typedef struct {
+    AppWidgets *w;
+    int dir_fd;
+    GPtrArray *names;
+    gchar *spec;
+    gint done;
+    GPtrArray *errors; // Written by the worker, read once it has finished
+} ChmodOp;
+
+static void chmod_op_free(ChmodOp *op)
+{
+    close(op->dir_fd);
+    g_ptr_array_free(op->names, TRUE);
+    g_free(op->spec);
+    g_ptr_array_free(op->errors, TRUE);
+    g_free(op);
+}
+
+static gboolean chmod_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    ChmodOp *op = (ChmodOp *)data;
+    for (guint i = 0; i < op->names->len && !g_cancellable_is_cancelled(cancellable); ++i) {
+        const gchar *name = g_ptr_array_index(op->names, i);
+        struct stat st;
+        mode_t mode;
+        // Symlinks have no permissions of their own
+        if (fstatat(op->dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0 ||
+            (!S_ISLNK(st.st_mode) && apply_mode_spec(op->spec, st.st_mode & 07777, S_ISDIR(st.st_mode), &mode) &&
+             mode != (st.st_mode & 07777) && fchmodat(op->dir_fd, name, mode, 0) != 0))
+            g_ptr_array_add(op->errors, g_strdup_printf("%s: %s", name, g_strerror(errno)));
+        g_atomic_int_inc(&op->done);
+    }
+    return TRUE;
+}
+
+static void chmod_progress(gpointer data, JobProgress *progress)
+{
+    ChmodOp *op = (ChmodOp *)data;
+    progress->done = g_atomic_int_get(&op->done);
+    progress->total = op->names->len;
+}
+
+static void chmod_done(gpointer data, const GError *error)
+{
+    ChmodOp *op = (ChmodOp *)data;
+    AppWidgets *w = op->w;
+
+    gchar *status = g_strdup_printf("Changed permissions of %u item(s)", g_atomic_int_get(&op->done) - op->errors->len);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+
+    if (op->errors->len > 0) {
+        g_ptr_array_add(op->errors, NULL);
+        gchar *joined = g_strjoinv("\n", (gchar **)op->errors->pdata);
+        gchar *msg = g_strdup_printf("%u item(s) could not be changed:\n%s", op->errors->len - 1, joined);
+        show_error_dialog(GTK_WINDOW(w->window), "Permissions Error", msg);
+        g_free(msg);
+        g_free(joined);
+    }
+}
+
+static void on_chmod_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GPtrArray *names = get_selected_names_copy(w);
+    if (names->len == 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Permissions Error", "Please select an item.");
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+    int dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (dir_fd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Permissions Error", g_strerror(errno));
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+
+    GtkWidget *d = gtk_dialog_new_with_buttons("Permissions", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Cancel", GTK_RESPONSE_CANCEL,
+                                               "Apply", GTK_RESPONSE_ACCEPT,
+                                               NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(d), GTK_RESPONSE_ACCEPT);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+    gchar *prompt = g_strdup_printf("New mode for %u item(s), octal (644) or symbolic (u+x,go-w, a=rX):", names->len);
+    gtk_box_pack_start(GTK_BOX(content), gtk_label_new(prompt), FALSE, FALSE, 6);
+    g_free(prompt);
+    GtkWidget *entry = gtk_entry_new();
+    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    struct stat st;
+    if (names->len == 1 && fstatat(dir_fd, g_ptr_array_index(names, 0), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+        gchar *current = g_strdup_printf("%04o", st.st_mode & 07777);
+        gtk_entry_set_text(GTK_ENTRY(entry), current);
+        g_free(current);
+    }
+    gtk_box_pack_start(GTK_BOX(content), entry, FALSE, FALSE, 6);
+    gtk_widget_show_all(d);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    gchar *spec = g_strstrip(g_strdup(gtk_entry_get_text(GTK_ENTRY(entry))));
+    gtk_widget_destroy(d);
+
+    mode_t check;
+    if (response != GTK_RESPONSE_ACCEPT) {
+        close(dir_fd);
+        g_free(spec);
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+    if (!apply_mode_spec(spec, 0, FALSE, &check)) {
+        show_error_dialog(GTK_WINDOW(w->window), "Permissions Error", "Not a valid mode.");
+        close(dir_fd);
+        g_free(spec);
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+
+    // CHMOD operation: one job for the whole selection
+    ChmodOp *op = g_new0(ChmodOp, 1);
+    op->w = w;
+    op->dir_fd = dir_fd;
+    op->names = names;
+    op->spec = spec;
+    op->errors = g_ptr_array_new_with_free_func(g_free);
+
+    job_submit("Change permissions", QOS_INTERACTIVE, job_device_of(op->dir_fd, "."), NULL,
+               chmod_run, chmod_progress, chmod_done, op, (GDestroyNotify)chmod_op_free);
+}
+
+static void on_rename_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    const gchar *newName = gtk_entry_get_text(GTK_ENTRY(w->entryName));
+    if (!newName || !*newName) {
+        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", "Please enter new name.");
+        return;
+    }
+
+    GtkListBoxRow *row = get_single_selected_row(w);
+    if (!row) {
+        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", "Please select a single item.");
+        return;
+    }
+
+    // The new name may also be a path, relative to the current directory,
+    // absolute or starting with "~"; a trailing "/" moves the item into that
+    // directory under its current name
+    const gchar *oldName = g_object_get_data(G_OBJECT(row), "entry-name");
+    gchar *oldpath = g_build_filename(w->current_dir, oldName, NULL);
+    gchar *expanded = newName[0] == '~' && (newName[1] == '/' || newName[1] == '\0')
+                      ? g_build_filename(g_get_home_dir(), newName + 1, NULL) : g_strdup(newName);
+    gchar *newpath = g_canonicalize_filename(expanded, w->current_dir);
+    g_free(expanded);
+    if (g_str_has_suffix(newName, "/")) {
+        gchar *inside = g_build_filename(newpath, oldName, NULL);
+        g_free(newpath);
+        newpath = inside;
+    }
+
+    // RENAME operation: O(1) within a filesystem, never replacing a target.
+    // Relative to the held directories; a plain new name stays in this one.
+    gchar *dest_dir = g_path_get_dirname(newpath);
+    gchar *new_leaf = g_path_get_basename(newpath);
+    gboolean same_dir = strchr(newName, '/') == NULL && newName[0] != '~';
+    int dst_dirfd = same_dir ? w->dir_fd : open(dest_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    int e = dst_dirfd < 0 ? ENOENT : move_renameat(w->dir_fd, oldName, dst_dirfd, new_leaf);
+    g_free(new_leaf);
+
+    if (dst_dirfd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", "The destination folder does not exist.");
+    } else if (e == EXDEV) {
+        // Another filesystem: copy and delete in the background. A
+        // filesystem mounted beneath the item is still inside it.
+        GPtrArray *names = g_ptr_array_new();
+        g_ptr_array_add(names, (gpointer)oldName);
+        GPtrArray *sources = g_ptr_array_new();
+        g_ptr_array_add(sources, oldpath);
+        GError *err = NULL;
+        if (!copy_check_sources(w->dir_fd, names, dst_dirfd, TRUE, &err)) {
+            show_error_dialog(GTK_WINDOW(w->window), "Rename Error", err->message);
+            g_error_free(err);
+        } else {
+            CopyJournal *journal = copy_journal_create("move", dest_dir, sources, &err);
+            if (!journal) {
+                g_warning("Move will not be resumable: %s", err->message);
+                g_error_free(err);
+            }
+            start_paste_job(w, sources, dst_dirfd, newpath, TRUE, journal);
+            gtk_entry_set_text(GTK_ENTRY(w->entryName), "");
+        }
+        g_ptr_array_free(sources, TRUE);
+        g_ptr_array_free(names, TRUE);
+    } else if (e != 0) {
+        gchar *err_msg = e == EEXIST ? g_strdup("Item with the new name already exists.")
+                                     : g_strdup_printf("Rename failed: %s", g_strerror(e));
+        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", err_msg);
+        g_free(err_msg);
+    } else {
+        refresh_file_list(w);
+        show_info_dialog(GTK_WINDOW(w->window), "Success", "Item renamed.");
+        gtk_entry_set_text(GTK_ENTRY(w->entryName), "");
+    }
+    if (dst_dirfd >= 0 && !same_dir) close(dst_dirfd);
+    g_free(dest_dir);
+    g_free(oldpath);
+    g_free(newpath);
+}
+
+typedef struct {
+    AppWidgets *w;
+    int dir_fd;
+    RenamePlan *plan;
+    gint done;
+} BulkRenameOp;
+
+static void bulk_rename_op_free(BulkRenameOp *op)
+{
+    close(op->dir_fd);
+    rename_plan_free(op->plan);
+    g_free(op);
+}
+
+static gboolean bulk_rename_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    BulkRenameOp *op = (BulkRenameOp *)data;
+    return rename_plan_execute(op->plan, op->dir_fd, cancellable, &op->done, error);
+}
+
+static void bulk_rename_progress(gpointer data, JobProgress *progress)
+{
+    BulkRenameOp *op = (BulkRenameOp *)data;
+    progress->done = g_atomic_int_get(&op->done);
+    progress->total = op->plan->steps->len;
+}
+
+// Renamed rows are updated in place and re-sorted, rather than listing the
+// directory again, as long as it is still the one shown.
+static void bulk_rename_done(gpointer data, const GError *error)
+{
+    BulkRenameOp *op = (BulkRenameOp *)data;
+    AppWidgets *w = op->w;
+    struct stat shown, renamed;
+    gboolean same_dir = fstat(w->dir_fd, &shown) == 0 && fstat(op->dir_fd, &renamed) == 0 &&
+                        shown.st_dev == renamed.st_dev && shown.st_ino == renamed.st_ino;
+
+    if (error) {
+        if (same_dir) refresh_file_list(w);
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            show_error_dialog(GTK_WINDOW(w->window), "Rename Error", error->message);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), "Nothing was renamed");
+        return;
+    }
+    if (same_dir) {
+        GList *rows = gtk_container_get_children(GTK_CONTAINER(w->listbox));
+        for (GList *r = rows; r; r = r->next) {
+            const gchar *to = g_hash_table_lookup(op->plan->renamed, g_object_get_data(G_OBJECT(r->data), "entry-name"));
+            if (to) set_row_name(GTK_LIST_BOX_ROW(r->data), to);
+        }
+        g_list_free(rows);
+        gtk_list_box_invalidate_sort(GTK_LIST_BOX(w->listbox));
+    }
+    gchar *status = g_strdup_printf("Renamed %u item(s)", g_hash_table_size(op->plan->renamed));
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+}
+
+#define RENAME_PREVIEW_ROWS 200
+
+typedef struct {
+    AppWidgets *w;
+    GPtrArray *names;     // The selection, in listing order
+    GHashTable *existing; // Everything in the directory
+    GtkWidget *dialog;
+    GtkWidget *find;
+    GtkWidget *replace;
+    GtkWidget *case_combo;
+    GtkWidget *preview;
+    GtkWidget *summary;
+    RenamePlan *plan;     // For the current inputs; NULL when they do not work
+} BulkRenameUi;
+
+// Recomputes the plan on every edit; the preview shows its first rows.
+static void bulk_rename_update(BulkRenameUi *ui)
+{
+    if (ui->plan) rename_plan_free(ui->plan);
+    ui->plan = NULL;
+    GList *old = gtk_container_get_children(GTK_CONTAINER(ui->preview));
+    for (GList *r = old; r; r = r->next) gtk_widget_destroy(GTK_WIDGET(r->data));
+    g_list_free(old);
+
+    GError *err = NULL;
+    GPtrArray *targets = g_ptr_array_new_with_free_func(g_free);
+    RenameSpec *spec = rename_spec_new(gtk_entry_get_text(GTK_ENTRY(ui->find)),
+                                       gtk_entry_get_text(GTK_ENTRY(ui->replace)),
+                                       gtk_combo_box_get_active(GTK_COMBO_BOX(ui->case_combo)), &err);
+    for (guint i = 0; spec && i < ui->names->len; ++i) {
+        gchar *to = rename_spec_apply(spec, ui->w->dir_fd, g_ptr_array_index(ui->names, i), i, &err);
+        if (!to) break;
+        g_ptr_array_add(targets, to);
+    }
+    if (spec) rename_spec_free(spec);
+    if (!err) ui->plan = rename_plan_new(ui->existing, ui->names, targets, &err);
+
+    for (guint i = 0; i < MIN(targets->len, RENAME_PREVIEW_ROWS); ++i) {
+        const gchar *from = g_ptr_array_index(ui->names, i), *to = g_ptr_array_index(targets, i);
+        gchar *text = g_strcmp0(from, to) == 0 ? g_strdup_printf("%s  (unchanged)", from)
+                                               : g_strdup_printf("%s  \u2192  %s", from, to);
+        GtkWidget *label = gtk_label_new(text);
+        gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+        gtk_label_set_ellipsize(GTK_LABEL(label), PANGO_ELLIPSIZE_MIDDLE);
+        gtk_widget_show(label);
+        gtk_list_box_insert(GTK_LIST_BOX(ui->preview), label, -1);
+        g_free(text);
+    }
+
+    guint count = ui->plan ? g_hash_table_size(ui->plan->renamed) : 0;
+    gchar *summary = err ? g_strdup(err->message)
+                   : count == 0 ? g_strdup("Nothing to rename.")
+                   : g_strdup_printf("%u of %u item(s) will be renamed%s.", count, ui->names->len,
+                                     ui->names->len > RENAME_PREVIEW_ROWS ? " (preview shows the first 200)" : "");
+    gtk_label_set_text(GTK_LABEL(ui->summary), summary);
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(ui->dialog), GTK_RESPONSE_ACCEPT, count > 0);
+    g_free(summary);
+    g_clear_error(&err);
+    g_ptr_array_free(targets, TRUE);
+}
+
+static void on_bulk_rename_changed(GtkWidget *widget, gpointer user_data)
+{
+    bulk_rename_update((BulkRenameUi *)user_data);
+}
+
+static void on_bulk_rename_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GPtrArray *selected = get_selected_names(w);
+    if (selected->len == 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", "Please select the items to rename.");
+        g_ptr_array_free(selected, TRUE);
+        return;
+    }
+
+    BulkRenameUi ui = { w };
+    ui.names = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < selected->len; ++i)
+        g_ptr_array_add(ui.names, g_strdup(g_ptr_array_index(selected, i)));
+    g_ptr_array_free(selected, TRUE);
+    ui.existing = rename_read_dir(w->dir_fd);
+
+    ui.dialog = gtk_dialog_new_with_buttons("Bulk Rename", GTK_WINDOW(w->window),
+                                            GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                            "Cancel", GTK_RESPONSE_CANCEL,
+                                            "Rename", GTK_RESPONSE_ACCEPT,
+                                            NULL);
+    gtk_window_set_default_size(GTK_WINDOW(ui.dialog), 640, 480);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(ui.dialog));
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 6);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 6);
+    ui.find = gtk_entry_new();
+    gtk_entry_set_placeholder_text(GTK_ENTRY(ui.find), "Regular expression; empty to use a template");
+    gtk_widget_set_hexpand(ui.find, TRUE);
+    ui.replace = gtk_entry_new();
+    gtk_entry_set_text(GTK_ENTRY(ui.replace), "{name}{ext}");
+    ui.case_combo = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(ui.case_combo), "Keep case");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(ui.case_combo), "lower case");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(ui.case_combo), "UPPER CASE");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(ui.case_combo), "Title Case");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(ui.case_combo), RENAME_CASE_KEEP);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Find:"), 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), ui.find, 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Replace with:"), 0, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), ui.replace, 1, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Case:"), 0, 2, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), ui.case_combo, 1, 2, 1, 1);
+    gtk_box_pack_start(GTK_BOX(content), grid, FALSE, FALSE, 6);
+
+    GtkWidget *help = gtk_label_new("With a regular expression, \\1 or \\g<name> insert groups. A template may use "
+                                    "{name}, {ext}, {n}, {n:3} (zero-padded), {n:3:0} (from 0), {date} and "
+                                    "{date:%Y%m%d}.");
+    gtk_label_set_line_wrap(GTK_LABEL(help), TRUE);
+    gtk_label_set_xalign(GTK_LABEL(help), 0.0);
+    gtk_box_pack_start(GTK_BOX(content), help, FALSE, FALSE, 0);
+
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    ui.preview = gtk_list_box_new();
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(ui.preview), GTK_SELECTION_NONE);
+    gtk_container_add(GTK_CONTAINER(scrolled), ui.preview);
+    gtk_box_pack_start(GTK_BOX(content), scrolled, TRUE, TRUE, 6);
+    ui.summary = gtk_label_new(NULL);
+    gtk_label_set_xalign(GTK_LABEL(ui.summary), 0.0);
+    gtk_box_pack_start(GTK_BOX(content), ui.summary, FALSE, FALSE, 0);
+
+    g_signal_connect(ui.find, "changed", G_CALLBACK(on_bulk_rename_changed), &ui);
+    g_signal_connect(ui.replace, "changed", G_CALLBACK(on_bulk_rename_changed), &ui);
+    g_signal_connect(ui.case_combo, "changed", G_CALLBACK(on_bulk_rename_changed), &ui);
+    bulk_rename_update(&ui);
+    gtk_widget_show_all(ui.dialog);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(ui.dialog));
+    gtk_widget_destroy(ui.dialog);
+    g_hash_table_destroy(ui.existing);
+    g_ptr_array_free(ui.names, TRUE);
+
+    int dir_fd = response == GTK_RESPONSE_ACCEPT && ui.plan ? fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0) : -1;
+    if (dir_fd < 0) {
+        if (ui.plan) rename_plan_free(ui.plan);
+        return;
+    }
+
+    // RENAME operation: the whole plan is one job
+    BulkRenameOp *op = g_new0(BulkRenameOp, 1);
+    op->w = w;
+    op->dir_fd = dir_fd;
+    op->plan = ui.plan;
+    gchar *title = g_strdup_printf("Rename %u items", g_hash_table_size(op->plan->renamed));
+    job_submit(title, QOS_INTERACTIVE, job_device_of(dir_fd, "."), NULL,
+               bulk_rename_run, bulk_rename_progress, bulk_rename_done, op, (GDestroyNotify)bulk_rename_op_free);
+    g_free(title);
+}
+
+typedef enum {
+    CHECKSUM_SHOW,
+    CHECKSUM_SAVE_MANIFEST,
+    CHECKSUM_VERIFY_MANIFEST,
+} ChecksumMode;
+
+enum {
+    CHECKSUM_RESPONSE_SHOW = 1,
+    CHECKSUM_RESPONSE_SAVE,
+    CHECKSUM_RESPONSE_VERIFY,
+};
+
+#define CHECKSUM_REPORT_LINES 50
+
+typedef struct {
+    AppWidgets *w;
+    ChecksumMode mode;
+    GPtrArray *names;   // Selection to hash; unused when verifying
+    gchar *manifest;    // Written or read in the job's directory
+    GString *lines;     // Show: the digests in manifest format
+    guint written;      // Save: lines in the manifest
+    ChecksumJob *job;
+} ChecksumOp;
+
+static void checksum_op_free(ChecksumOp *op)
+{
+    close(op->job->dir_fd);
+    checksum_job_free(op->job);
+    g_ptr_array_free(op->names, TRUE);
+    g_free(op->manifest);
+    if (op->lines) g_string_free(op->lines, TRUE);
+    g_free(op);
+}
+
+static gboolean checksum_op_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    ChecksumOp *op = (ChecksumOp *)data;
+    ChecksumJob *job = op->job;
+
+    if (op->mode == CHECKSUM_VERIFY_MANIFEST) {
+        gchar *contents;
+        gsize len;
+        struct stat st;
+        if (!read_file_at(job->dir_fd, op->manifest, &contents, &len, &st, error)) return FALSE;
+        gboolean ok = checksum_manifest_parse(job, contents, error);
+        g_free(contents);
+        if (!ok) return FALSE;
+    } else {
+        for (guint i = 0; i < op->names->len; ++i) {
+            const gchar *name = g_ptr_array_index(op->names, i);
+            checksum_walk(job, job->dir_fd, name, name);
+        }
+        // A manifest does not list itself
+        for (guint i = 0; op->manifest && i < job->files->len; ++i)
+            if (strcmp(((ChecksumFile *)g_ptr_array_index(job->files, i))->path, op->manifest) == 0)
+                g_ptr_array_remove_index(job->files, i--);
+    }
+    if (!checksum_job_run(job, error)) return FALSE;
+
+    if (op->mode == CHECKSUM_VERIFY_MANIFEST) return TRUE;
+    op->lines = g_string_new(NULL);
+    for (guint i = 0; i < job->files->len; ++i) {
+        ChecksumFile *f = g_ptr_array_index(job->files, i);
+        if (f->digest) {
+            checksum_manifest_append(op->lines, f->digest, f->path);
+            op->written++;
+        } else {
+            g_ptr_array_add(job->errors, g_strdup_printf("%s: %s", f->path, f->error));
+        }
+    }
+    if (op->mode == CHECKSUM_SAVE_MANIFEST)
+        return write_file_at(job->dir_fd, op->manifest, op->lines->str, op->lines->len, error);
+    return TRUE;
+}
+
+static void checksum_op_progress(gpointer data, JobProgress *progress)
+{
+    ChecksumOp *op = (ChecksumOp *)data;
+    g_mutex_lock(&op->job->lock);
+    progress->done = op->job->bytes_done;
+    progress->total = op->job->bytes_total;
+    g_mutex_unlock(&op->job->lock);
+    progress->bytes = TRUE;
+}
+
+// Joins up to CHECKSUM_REPORT_LINES of lines for a dialog.
+static gchar* checksum_report(GPtrArray *lines)
+{
+    GString *out = g_string_new(NULL);
+    for (guint i = 0; i < lines->len && i < CHECKSUM_REPORT_LINES; ++i)
+        g_string_append_printf(out, "%s%s", i ? "\n" : "", (gchar *)g_ptr_array_index(lines, i));
+    if (lines->len > CHECKSUM_REPORT_LINES)
+        g_string_append_printf(out, "\n... and %u more", lines->len - CHECKSUM_REPORT_LINES);
+    return g_string_free(out, FALSE);
+}
+
+static void checksum_show_digests(AppWidgets *w, ChecksumOp *op)
+{
+    gchar *title = g_strdup_printf("%s Checksums", checksum_info[op->job->algorithm].name);
+    GtkWidget *d = gtk_dialog_new_with_buttons(title, GTK_WINDOW(w->window), GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Close", GTK_RESPONSE_CLOSE, NULL);
+    g_free(title);
+    gtk_window_set_default_size(GTK_WINDOW(d), 720, 360);
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    GtkWidget *view = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(view), FALSE);
+    gtk_text_view_set_monospace(GTK_TEXT_VIEW(view), TRUE);
+    gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(view)), op->lines->str, op->lines->len);
+    gtk_container_add(GTK_CONTAINER(scrolled), view);
+    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(d))), scrolled, TRUE, TRUE, 0);
+    g_signal_connect(d, "response", G_CALLBACK(gtk_widget_destroy), NULL);
+    gtk_widget_show_all(d);
+}
+
+static void checksum_op_done(gpointer data, const GError *error)
+{
+    ChecksumOp *op = (ChecksumOp *)data;
+    AppWidgets *w = op->w;
+    ChecksumJob *job = op->job;
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected");
+
+    if (error) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            show_error_dialog(GTK_WINDOW(w->window), "Checksum Error", error->message);
+        return;
+    }
+
+    if (op->mode == CHECKSUM_VERIFY_MANIFEST) {
+        GPtrArray *failed = g_ptr_array_new_with_free_func(g_free);
+        guint ok = 0;
+        for (guint i = 0; i < job->files->len; ++i) {
+            ChecksumFile *f = g_ptr_array_index(job->files, i);
+            if (!f->digest) g_ptr_array_add(failed, g_strdup_printf("%s: %s", f->path, f->error));
+            else if (g_ascii_strcasecmp(f->digest, f->expected) != 0)
+                g_ptr_array_add(failed, g_strdup_printf("%s: FAILED", f->path));
+            else ok++;
+        }
+        gchar *status = g_strdup_printf("%s: %u OK, %u failed", op->manifest, ok, failed->len);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+        if (failed->len > 0) {
+            gchar *report = checksum_report(failed);
+            gchar *msg = g_strdup_printf("%s\n\n%s", status, report);
+            show_error_dialog(GTK_WINDOW(w->window), "Verification Failed", msg);
+            g_free(msg);
+            g_free(report);
+        } else {
+            show_info_dialog(GTK_WINDOW(w->window), "Verification", status);
+        }
+        g_free(status);
+        g_ptr_array_free(failed, TRUE);
+        return;
+    }
+
+    if (op->mode == CHECKSUM_SAVE_MANIFEST) {
+        refresh_file_list(w);
+        gchar *status = g_strdup_printf("Wrote %u checksum(s) to %s", op->written, op->manifest);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+        g_free(status);
+    } else {
+        checksum_show_digests(w, op);
+    }
+    if (job->errors->len > 0) {
+        gchar *report = checksum_report(job->errors);
+        gchar *msg = g_strdup_printf("%u item(s) could not be hashed:\n%s", job->errors->len, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Checksum Error", msg);
+        g_free(msg);
+        g_free(report);
+    }
+}
+
+typedef struct {
+    GtkWidget *algorithm;
+    GtkWidget *manifest;
+} ChecksumUi;
+
+// Follows the algorithm with its customary manifest name, unless another
+// name was entered.
+static void on_checksum_algorithm_changed(GtkComboBox *combo, gpointer user_data)
+{
+    ChecksumUi *ui = user_data;
+    const gchar *name = gtk_entry_get_text(GTK_ENTRY(ui->manifest));
+    for (ChecksumAlgorithm a = 0; a < CHECKSUM_ALGORITHMS; ++a) {
+        if (g_strcmp0(name, checksum_info[a].manifest) == 0) {
+            gtk_entry_set_text(GTK_ENTRY(ui->manifest), checksum_info[gtk_combo_box_get_active(combo)].manifest);
+            break;
+        }
+    }
+}
+
+// Hashes the selection, showing the digests or saving them as a manifest,
+// or verifies the files a manifest lists. Either way it is one job.
+static void on_checksums_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GPtrArray *names = get_selected_names_copy(w);
+    int dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (dir_fd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Checksum Error", g_strerror(errno));
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+    ChecksumAlgorithm algorithm = CHECKSUM_SHA256;
+    const gchar *manifest = NULL;
+    if (names->len == 1 && checksum_manifest_algorithm(g_ptr_array_index(names, 0), &algorithm))
+        manifest = g_ptr_array_index(names, 0);
+
+    GtkWidget *d = gtk_dialog_new_with_buttons("Checksums", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Cancel", GTK_RESPONSE_CANCEL,
+                                               "Verify Manifest", CHECKSUM_RESPONSE_VERIFY,
+                                               "Save Manifest", CHECKSUM_RESPONSE_SAVE,
+                                               "Show", CHECKSUM_RESPONSE_SHOW,
+                                               NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(d), manifest ? CHECKSUM_RESPONSE_VERIFY : CHECKSUM_RESPONSE_SHOW);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 6);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 6);
+    ChecksumUi ui;
+    ui.algorithm = gtk_combo_box_text_new();
+    for (ChecksumAlgorithm a = 0; a < CHECKSUM_ALGORITHMS; ++a)
+        gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(ui.algorithm), checksum_info[a].name);
+    gtk_combo_box_set_active(GTK_COMBO_BOX(ui.algorithm), algorithm);
+    ui.manifest = gtk_entry_new();
+    gtk_entry_set_text(GTK_ENTRY(ui.manifest), manifest ? manifest : checksum_info[algorithm].manifest);
+    gtk_entry_set_activates_default(GTK_ENTRY(ui.manifest), TRUE);
+    g_signal_connect(ui.algorithm, "changed", G_CALLBACK(on_checksum_algorithm_changed), &ui);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Algorithm:"), 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), ui.algorithm, 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Manifest:"), 0, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), ui.manifest, 1, 1, 1, 1);
+    gtk_box_pack_start(GTK_BOX(content), grid, FALSE, FALSE, 6);
+    gtk_widget_show_all(d);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    algorithm = gtk_combo_box_get_active(GTK_COMBO_BOX(ui.algorithm));
+    gchar *manifest_name = g_strstrip(g_strdup(gtk_entry_get_text(GTK_ENTRY(ui.manifest))));
+    gtk_widget_destroy(d);
+
+    const gchar *problem = NULL;
+    if (response != CHECKSUM_RESPONSE_SHOW && response != CHECKSUM_RESPONSE_SAVE &&
+        response != CHECKSUM_RESPONSE_VERIFY)
+        problem = "";
+    else if (response != CHECKSUM_RESPONSE_VERIFY && names->len == 0)
+        problem = "Please select the items to hash.";
+    else if (response != CHECKSUM_RESPONSE_SHOW && (!*manifest_name || strchr(manifest_name, '/')))
+        problem = "Please enter the name of a manifest in this folder.";
+    if (problem) {
+        if (*problem) show_error_dialog(GTK_WINDOW(w->window), "Checksum Error", problem);
+        close(dir_fd);
+        g_free(manifest_name);
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+
+    ChecksumOp *op = g_new0(ChecksumOp, 1);
+    op->w = w;
+    op->mode = response == CHECKSUM_RESPONSE_SHOW ? CHECKSUM_SHOW :
+               response == CHECKSUM_RESPONSE_SAVE ? CHECKSUM_SAVE_MANIFEST : CHECKSUM_VERIFY_MANIFEST;
+    op->names = names;
+    if (op->mode != CHECKSUM_SHOW) op->manifest = manifest_name;
+    else g_free(manifest_name);
+    op->job = checksum_job_new(dir_fd, algorithm, NULL);
+    // Verification is about what is on the disk now, not what was cached
+    op->job->use_cache = op->mode != CHECKSUM_VERIFY_MANIFEST;
+
+    gchar *title = op->mode == CHECKSUM_VERIFY_MANIFEST ? g_strdup_printf("Verify %s", op->manifest)
+                                                         : g_strdup_printf("%s checksums", checksum_info[algorithm].name);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Computing checksums...");
+    job_submit(title, QOS_NORMAL, job_device_of(dir_fd, "."), op->job->cancellable,
+               checksum_op_run, checksum_op_progress, checksum_op_done, op, (GDestroyNotify)checksum_op_free);
+    g_free(title);
+}
+
+typedef struct {
+    AppWidgets *w;
+    GPtrArray *names;
+    DupScan *scan;
+} DupScanOp;
+
+static void dup_scan_op_free(DupScanOp *op)
+{
+    g_ptr_array_free(op->names, TRUE);
+    if (op->scan) dup_scan_free(op->scan);
+    g_free(op);
+}
+
+static gboolean dup_scan_op_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    DupScanOp *op = (DupScanOp *)data;
+    return dup_scan_run(op->scan, op->names, error);
+}
+
+static void dup_scan_op_progress(gpointer data, JobProgress *progress)
+{
+    DupScan *scan = ((DupScanOp *)data)->scan;
+    g_mutex_lock(&scan->lock);
+    if (scan->stage == DUP_STAGE_HASH && scan->hash) {
+        g_mutex_lock(&scan->hash->lock);
+        progress->done = scan->hash->bytes_done;
+        progress->total = scan->hash->bytes_total;
+        g_mutex_unlock(&scan->hash->lock);
+        progress->bytes = TRUE;
+    } else {
+        // The walk does not know its total
+        progress->done = scan->done;
+        progress->total = scan->stage == DUP_STAGE_WALK ? 0 : scan->total;
+    }
+    g_mutex_unlock(&scan->lock);
+}
+
+typedef struct {
+    AppWidgets *w;
+    DupScan *scan;
+    GPtrArray *sets;    // DupSet of scan to collapse
+    DupMethod method;
+    gint done;          // Copies collapsed
+    guint total;
+    guint64 reclaimed;
+    GPtrArray *errors;
+} DupCollapseOp;
+
+static void dup_collapse_op_free(DupCollapseOp *op)
+{
+    g_ptr_array_free(op->sets, TRUE);
+    dup_scan_free(op->scan);
+    g_ptr_array_free(op->errors, TRUE);
+    g_free(op);
+}
+
+static gboolean dup_collapse_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    DupCollapseOp *op = (DupCollapseOp *)data;
+    for (guint i = 0; i < op->sets->len; ++i) {
+        DupSet *set = g_ptr_array_index(op->sets, i);
+        const DupFile *keep = g_ptr_array_index(set->files, 0);
+        for (guint j = 1; j < set->files->len; ++j) {
+            if (g_cancellable_set_error_if_cancelled(cancellable, error)) return FALSE;
+            const DupFile *copy = g_ptr_array_index(set->files, j);
+            GError *err = NULL;
+            gboolean ok = op->method == DUP_HARD_LINK ? dup_hard_link(op->scan->dir_fd, keep, copy, &err)
+                                                      : dup_share_extents(op->scan->dir_fd, keep, copy, &err);
+            if (ok) {
+                op->reclaimed += set->size;
+            } else if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_NOT_SUPPORTED)) {
+                // The same for every other file
+                g_propagate_error(error, err);
+                return FALSE;
+            } else {
+                g_ptr_array_add(op->errors, g_strdup_printf("%s: %s", copy->path, err->message));
+                g_error_free(err);
+            }
+            g_atomic_int_inc(&op->done);
+        }
+    }
+    return TRUE;
+}
+
+static void dup_collapse_progress(gpointer data, JobProgress *progress)
+{
+    DupCollapseOp *op = (DupCollapseOp *)data;
+    progress->done = g_atomic_int_get(&op->done);
+    progress->total = op->total;
+}
+
+static void dup_collapse_done(gpointer data, const GError *error)
+{
+    DupCollapseOp *op = (DupCollapseOp *)data;
+    AppWidgets *w = op->w;
+    gchar *size = g_format_size(op->reclaimed);
+    gchar *status = g_strdup_printf("Reclaimed %s from %u duplicate(s)", size,
+                                    g_atomic_int_get(&op->done) - op->errors->len);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+    g_free(size);
+
+    if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        show_error_dialog(GTK_WINDOW(w->window), "Duplicates Error", error->message);
+    } else if (op->errors->len > 0) {
+        gchar *report = checksum_report(op->errors);
+        gchar *msg = g_strdup_printf("%u duplicate(s) were left as they were:\n%s", op->errors->len, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Duplicates Error", msg);
+        g_free(msg);
+        g_free(report);
+    }
+}
+
+enum {
+    DUP_RESPONSE_SHARE = 1,
+    DUP_RESPONSE_LINK,
+};
+
+#define DUP_DIALOG_SETS 1000
+
+// Lists the duplicate sets, most space to reclaim first, and collapses the
+// selected ones. Takes ownership of scan.
+static void show_duplicates_dialog(AppWidgets *w, DupScan *scan)
+{
+    GtkWidget *d = gtk_dialog_new_with_buttons("Duplicates", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Share Blocks", DUP_RESPONSE_SHARE,
+                                               "Hard Link", DUP_RESPONSE_LINK,
+                                               "Close", GTK_RESPONSE_CLOSE,
+                                               NULL);
+    gtk_window_set_default_size(GTK_WINDOW(d), 700, 500);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+
+    guint64 total = 0;
+    for (guint i = 0; i < scan->sets->len; ++i)
+        total += dup_set_reclaimable(g_ptr_array_index(scan->sets, i));
+    gchar *total_text = g_format_size(total);
+    gchar *summary = g_strdup_printf("%u set(s) of duplicates, %s to reclaim. Of %u file(s), %u shared their size "
+                                     "with another and %u their first and last %u KiB as well.%s",
+                                     scan->sets->len, total_text, scan->files->len, scan->size_matches,
+                                     scan->edge_matches, DUP_EDGE_SIZE / 1024,
+                                     scan->sets->len > DUP_DIALOG_SETS ? " Only the largest sets are listed." : "");
+    GtkWidget *summary_label = gtk_label_new(summary);
+    gtk_label_set_xalign(GTK_LABEL(summary_label), 0.0);
+    gtk_label_set_line_wrap(GTK_LABEL(summary_label), TRUE);
+    gtk_box_pack_start(GTK_BOX(content), summary_label, FALSE, FALSE, 4);
+    g_free(summary);
+    g_free(total_text);
+
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    GtkWidget *list = gtk_list_box_new();
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(list), GTK_SELECTION_MULTIPLE);
+    gtk_container_add(GTK_CONTAINER(scrolled), list);
+    gtk_box_pack_start(GTK_BOX(content), scrolled, TRUE, TRUE, 0);
+
+    for (guint i = 0; i < scan->sets->len && i < DUP_DIALOG_SETS; ++i) {
+        DupSet *set = g_ptr_array_index(scan->sets, i);
+        gchar *size = g_format_size(set->size);
+        gchar *reclaim = g_format_size(dup_set_reclaimable(set));
+        GString *text = g_string_new(NULL);
+        g_string_append_printf(text, "%u copies of %s, %s to reclaim", set->files->len, size, reclaim);
+        for (guint j = 0; j < set->files->len; ++j)
+            g_string_append_printf(text, "\n    %s%s", ((DupFile *)g_ptr_array_index(set->files, j))->path,
+                                   j == 0 ? " (kept)" : "");
+        GtkWidget *label = gtk_label_new(text->str);
+        gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+        GtkWidget *row = gtk_list_box_row_new();
+        gtk_container_add(GTK_CONTAINER(row), label);
+        g_object_set_data(G_OBJECT(row), "dup-set", set);
+        gtk_list_box_insert(GTK_LIST_BOX(list), row, -1);
+        g_string_free(text, TRUE);
+        g_free(reclaim);
+        g_free(size);
+    }
+    gtk_list_box_select_all(GTK_LIST_BOX(list));
+
+    gtk_widget_show_all(d);
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    GPtrArray *sets = g_ptr_array_new();
+    guint copies = 0;
+    if (response == DUP_RESPONSE_SHARE || response == DUP_RESPONSE_LINK) {
+        GList *rows = gtk_list_box_get_selected_rows(GTK_LIST_BOX(list));
+        for (GList *r = rows; r; r = r->next) {
+            DupSet *set = g_object_get_data(G_OBJECT(r->data), "dup-set");
+            g_ptr_array_add(sets, set);
+            copies += set->files->len - 1;
+        }
+        g_list_free(rows);
+    }
+    gtk_widget_destroy(d);
+
+    if (sets->len > 0 && response == DUP_RESPONSE_LINK) {
+        GtkWidget *c = gtk_message_dialog_new(GTK_WINDOW(w->window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION,
+                                              GTK_BUTTONS_YES_NO,
+                                              "Replace %u file(s) with hard links to the kept copies? Linked files "
+                                              "share permissions, owner and times, and a change to one shows in all.",
+                                              copies);
+        if (gtk_dialog_run(GTK_DIALOG(c)) != GTK_RESPONSE_YES) g_ptr_array_set_size(sets, 0);
+        gtk_widget_destroy(c);
+    }
+    if (sets->len == 0) {
+        g_ptr_array_free(sets, TRUE);
+        dup_scan_free(scan);
+        return;
+    }
+
+    DupCollapseOp *op = g_new0(DupCollapseOp, 1);
+    op->w = w;
+    op->scan = scan;
+    op->sets = sets;
+    op->method = response == DUP_RESPONSE_LINK ? DUP_HARD_LINK : DUP_SHARE_EXTENTS;
+    op->total = copies;
+    op->errors = g_ptr_array_new_with_free_func(g_free);
+    job_submit(op->method == DUP_HARD_LINK ? "Hard link duplicates" : "Share blocks of duplicates", QOS_NORMAL,
+               job_device_of(scan->dir_fd, "."), NULL, dup_collapse_run, dup_collapse_progress, dup_collapse_done,
+               op, (GDestroyNotify)dup_collapse_op_free);
+}
+
+static void dup_scan_op_done(gpointer data, const GError *error)
+{
+    DupScanOp *op = (DupScanOp *)data;
+    AppWidgets *w = op->w;
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected");
+    if (error) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            show_error_dialog(GTK_WINDOW(w->window), "Duplicates Error", error->message);
+        return;
+    }
+    if (op->scan->errors->len > 0) {
+        gchar *report = checksum_report(op->scan->errors);
+        gchar *msg = g_strdup_printf("%u item(s) could not be read and were left out:\n%s",
+                                     op->scan->errors->len, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Duplicates Error", msg);
+        g_free(msg);
+        g_free(report);
+    }
+    if (op->scan->sets->len == 0) {
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), "No duplicates found");
+        return;
+    }
+    DupScan *scan = op->scan;
+    op->scan = NULL;
+    show_duplicates_dialog(w, scan);
+}
+
+// Looks for duplicates beneath the selected folders, or the whole folder
+// when nothing is selected.
+static void on_find_duplicates_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    int dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (dir_fd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Duplicates Error", g_strerror(errno));
+        return;
+    }
+    GPtrArray *selected = get_selected_names(w);
+    DupScanOp *op = g_new0(DupScanOp, 1);
+    op->w = w;
+    op->names = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < selected->len; ++i)
+        g_ptr_array_add(op->names, g_strdup(g_ptr_array_index(selected, i)));
+    if (selected->len == 0) g_ptr_array_add(op->names, g_strdup("."));
+    g_ptr_array_free(selected, TRUE);
+    op->scan = dup_scan_new(dir_fd, NULL);
+
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Looking for duplicates...");
+    job_submit("Find duplicates", QOS_NORMAL, job_device_of(dir_fd, "."), op->scan->cancellable,
+               dup_scan_op_run, dup_scan_op_progress, dup_scan_op_done, op, (GDestroyNotify)dup_scan_op_free);
+}
+
+typedef struct {
+    AppWidgets *w;
+    CmpScan *scan;
+} CompareOp;
+
+static void compare_op_free(CompareOp *op)
+{
+    if (op->scan) cmp_scan_free(op->scan);
+    g_free(op);
+}
+
+static gboolean compare_op_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    return cmp_scan_run(((CompareOp *)data)->scan, error);
+}
+
+static void compare_op_progress(gpointer data, JobProgress *progress)
+{
+    CmpScan *scan = ((CompareOp *)data)->scan;
+    g_mutex_lock(&scan->lock);
+    if (scan->hash[0]) {
+        progress->done = progress->total = 0;
+        for (guint i = 0; i < 2; ++i) {
+            g_mutex_lock(&scan->hash[i]->lock);
+            progress->done += scan->hash[i]->bytes_done;
+            progress->total += scan->hash[i]->bytes_total;
+            g_mutex_unlock(&scan->hash[i]->lock);
+        }
+        progress->bytes = TRUE;
+    } else {
+        // The walk does not know its total
+        progress->done = scan->scanned;
+        progress->total = 0;
+    }
+    g_mutex_unlock(&scan->lock);
+}
+
+typedef struct {
+    AppWidgets *w;
+    CmpScan *scan;
+    CmpSync sync;
+} SyncOp;
+
+static void sync_op_free(SyncOp *op)
+{
+    copy_job_free(op->sync.copy);
+    cmp_scan_free(op->scan);
+    g_free(op);
+}
+
+static gboolean sync_op_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    SyncOp *op = (SyncOp *)data;
+    return cmp_sync_run(op->scan, &op->sync, error);
+}
+
+static void sync_op_progress(gpointer data, JobProgress *progress)
+{
+    SyncOp *op = (SyncOp *)data;
+    progress->done = g_atomic_int_get(&op->sync.done);
+    progress->total = op->sync.total;
+}
+
+static void sync_op_done(gpointer data, const GError *error)
+{
+    SyncOp *op = (SyncOp *)data;
+    AppWidgets *w = op->w;
+    CmpSync *sync = &op->sync;
+    gchar *literal = g_format_size(sync->literal);
+    gchar *reused = g_format_size(sync->reused);
+    gchar *status = sync->literal + sync->reused > 0
+        ? g_strdup_printf("Synced: %u copied, %u updated (large files: %s written, %s reused)",
+                          sync->copied, sync->updated, literal, reused)
+        : g_strdup_printf("Synced: %u copied, %u updated", sync->copied, sync->updated);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+    g_free(reused);
+    g_free(literal);
+
+    if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+        show_error_dialog(GTK_WINDOW(w->window), "Sync Error", error->message);
+    } else if (sync->copy->errors->len > 0) {
+        gchar *report = checksum_report(sync->copy->errors);
+        gchar *msg = g_strdup_printf("%u item(s) could not be synced:\n%s", sync->copy->errors->len, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Sync Error", msg);
+        g_free(msg);
+        g_free(report);
+    }
+}
+
+#define COMPARE_DIALOG_ROWS 1000
+
+// Lists what differs between the two trees and offers to bring the target
+// up to date. Takes ownership of scan.
+static void show_compare_dialog(AppWidgets *w, CmpScan *scan)
+{
+    guint syncs = 0, listed = 0;
+    for (guint i = 0; i < scan->entries->len; ++i)
+        if (cmp_entry_syncs(g_ptr_array_index(scan->entries, i))) syncs++;
+
+    GtkWidget *d = gtk_dialog_new_with_buttons("Compare Folders", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Close", GTK_RESPONSE_CLOSE, NULL);
+    if (syncs > 0) gtk_dialog_add_button(GTK_DIALOG(d), "Sync to Target", GTK_RESPONSE_ACCEPT);
+    gtk_window_set_default_size(GTK_WINDOW(d), 700, 500);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+
+    GString *summary = g_string_new(NULL);
+    g_string_append_printf(summary, "Source: %s\nTarget: %s\n%u entries compared", scan->src_root, scan->dst_root,
+                           scan->scanned);
+    for (CmpState st = 0; st < CMP_STATES; ++st)
+        g_string_append_printf(summary, "%s %s %u", st == 0 ? ":" : ",", cmp_state_names[st], scan->counts[st]);
+    g_string_append_printf(summary, ". %u file(s) had to be hashed.", scan->hashed);
+    if (scan->errors->len > 0) g_string_append_printf(summary, " %u could not be read.", scan->errors->len);
+    GtkWidget *summary_label = gtk_label_new(summary->str);
+    gtk_label_set_xalign(GTK_LABEL(summary_label), 0.0);
+    gtk_label_set_line_wrap(GTK_LABEL(summary_label), TRUE);
+    gtk_box_pack_start(GTK_BOX(content), summary_label, FALSE, FALSE, 4);
+    g_string_free(summary, TRUE);
+
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    GtkWidget *list = gtk_list_box_new();
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(list), GTK_SELECTION_NONE);
+    gtk_container_add(GTK_CONTAINER(scrolled), list);
+    gtk_box_pack_start(GTK_BOX(content), scrolled, TRUE, TRUE, 0);
+    for (guint i = 0; i < scan->entries->len && listed < COMPARE_DIALOG_ROWS; ++i) {
+        CmpEntry *e = g_ptr_array_index(scan->entries, i);
+        if (e->state == CMP_SAME) continue;
+        gchar *text = g_strdup_printf("%s\t%s%s", cmp_state_names[e->state], e->path,
+                                      S_ISDIR(e->state == CMP_EXTRA ? e->dst_st.st_mode : e->src_st.st_mode) ? "/" : "");
+        GtkWidget *label = gtk_label_new(text);
+        gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+        gtk_list_box_insert(GTK_LIST_BOX(list), label, -1);
+        g_free(text);
+        listed++;
+    }
+
+    gtk_widget_show_all(d);
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    gtk_widget_destroy(d);
+
+    if (response == GTK_RESPONSE_ACCEPT) {
+        GtkWidget *c = gtk_message_dialog_new(GTK_WINDOW(w->window), GTK_DIALOG_MODAL, GTK_MESSAGE_QUESTION,
+                                              GTK_BUTTONS_YES_NO,
+                                              "Update %s from %s?\n%u missing item(s) will be copied and %u changed "
+                                              "one(s) replaced. %u item(s) newer in the target and %u only there "
+                                              "are left alone.",
+                                              scan->dst_root, scan->src_root, scan->counts[CMP_MISSING],
+                                              scan->counts[CMP_NEWER] + scan->counts[CMP_DIFFERENT],
+                                              scan->counts[CMP_OLDER], scan->counts[CMP_EXTRA]);
+        if (gtk_dialog_run(GTK_DIALOG(c)) != GTK_RESPONSE_YES) response = GTK_RESPONSE_CLOSE;
+        gtk_widget_destroy(c);
+    }
+    if (response != GTK_RESPONSE_ACCEPT) {
+        cmp_scan_free(scan);
+        return;
+    }
+
+    SyncOp *op = g_new0(SyncOp, 1);
+    op->w = w;
+    op->scan = scan;
+    op->sync.copy = copy_job_new(NULL);
+    op->sync.total = syncs;
+    // Queued on the target's device, which takes the writes
+    gchar *name = g_path_get_basename(scan->dst_root);
+    gchar *title = g_strdup_printf("Sync to \"%s\"", name);
+    job_submit(title, QOS_NORMAL, job_device_of(scan->dst_fd, "."), op->sync.copy->cancellable,
+               sync_op_run, sync_op_progress, sync_op_done, op, (GDestroyNotify)sync_op_free);
+    g_free(title);
+    g_free(name);
+}
+
+static void compare_op_done(gpointer data, const GError *error)
+{
+    CompareOp *op = (CompareOp *)data;
+    AppWidgets *w = op->w;
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected");
+    if (error) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            show_error_dialog(GTK_WINDOW(w->window), "Compare Error", error->message);
+        return;
+    }
+    if (op->scan->errors->len > 0) {
+        gchar *report = checksum_report(op->scan->errors);
+        gchar *msg = g_strdup_printf("%u item(s) could not be compared:\n%s", op->scan->errors->len, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Compare Error", msg);
+        g_free(msg);
+        g_free(report);
+    }
+    CmpScan *scan = op->scan;
+    op->scan = NULL;
+    show_compare_dialog(w, scan);
+}
+
+// Compares the current folder, as the source, with another one. A single
+// selected folder is offered as the target.
+static void on_compare_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GtkWidget *d = gtk_dialog_new_with_buttons("Compare Folders", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Cancel", GTK_RESPONSE_CANCEL,
+                                               "Compare", GTK_RESPONSE_ACCEPT,
+                                               NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(d), GTK_RESPONSE_ACCEPT);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 6);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 6);
+    GtkWidget *source = gtk_label_new(w->current_dir);
+    gtk_label_set_xalign(GTK_LABEL(source), 0.0);
+    GtkWidget *target = gtk_file_chooser_button_new("Target Folder", GTK_FILE_CHOOSER_ACTION_SELECT_FOLDER);
+    GtkListBoxRow *row = get_single_selected_row(w);
+    struct stat st;
+    gchar *suggested = row && fstatat(w->dir_fd, g_object_get_data(G_OBJECT(row), "entry-name"), &st, 0) == 0 &&
+                       S_ISDIR(st.st_mode)
+                       ? g_build_filename(w->current_dir, g_object_get_data(G_OBJECT(row), "entry-name"), NULL)
+                       : g_path_get_dirname(w->current_dir);
+    gtk_file_chooser_set_filename(GTK_FILE_CHOOSER(target), suggested);
+    g_free(suggested);
+    gtk_widget_set_hexpand(target, TRUE);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Source:"), 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), source, 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Target:"), 0, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), target, 1, 1, 1, 1);
+    gtk_box_pack_start(GTK_BOX(content), grid, FALSE, FALSE, 6);
+    gtk_widget_show_all(d);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    gchar *target_dir = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(target));
+    gtk_widget_destroy(d);
+    if (response != GTK_RESPONSE_ACCEPT || !target_dir) {
+        g_free(target_dir);
+        return;
+    }
+
+    GError *err = NULL;
+    CmpScan *scan = cmp_scan_new(w->current_dir, target_dir, &err);
+    if (!scan) {
+        show_error_dialog(GTK_WINDOW(w->window), "Compare Error", err->message);
+        g_error_free(err);
+        g_free(target_dir);
+        return;
+    }
+    CompareOp *op = g_new0(CompareOp, 1);
+    op->w = w;
+    op->scan = scan;
+    gchar *name = g_path_get_basename(target_dir);
+    gchar *title = g_strdup_printf("Compare with \"%s\"", name);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Comparing folders...");
+    job_submit(title, QOS_NORMAL, job_device_of(scan->src_fd, "."), scan->cancellable,
+               compare_op_run, compare_op_progress, compare_op_done, op, (GDestroyNotify)compare_op_free);
+    g_free(title);
+    g_free(name);
+    g_free(target_dir);
+}
+
+typedef struct {
+    AppWidgets *w;
+    gchar *root;
+    SnapshotScan *scan;   // When a snapshot is taken
+    gchar *file;          // The snapshot taken
+    Snapshot *from;       // Diffed against to, or against the snapshot taken
+    Snapshot *to;
+    GPtrArray *changes;
+    gboolean show;        // List the changes rather than count them
+    gchar *title;         // Of the list
+} SnapshotOp;
+
+static void snapshot_op_free(SnapshotOp *op)
+{
+    if (op->scan) snapshot_scan_free(op->scan);
+    if (op->from) snapshot_close(op->from);
+    if (op->to) snapshot_close(op->to);
+    if (op->changes) g_ptr_array_free(op->changes, TRUE);
+    g_free(op->file);
+    g_free(op->title);
+    g_free(op->root);
+    g_free(op);
+}
+
+static gboolean snapshot_op_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    SnapshotOp *op = (SnapshotOp *)data;
+    if (op->scan) {
+        if (!(op->file = snapshot_take(op->scan, op->root, error))) return FALSE;
+        if (!op->from) return TRUE;
+        if (!(op->to = snapshot_open(op->file, error))) return FALSE;
+    }
+    return (op->changes = snapshot_diff(op->from, op->to, error)) != NULL;
+}
+
+static void snapshot_op_progress(gpointer data, JobProgress *progress)
+{
+    SnapshotOp *op = (SnapshotOp *)data;
+    if (!op->scan) return;
+    // The last snapshot's size is the best guess there is
+    progress->done = g_atomic_int_get(&op->scan->entries);
+    progress->total = op->scan->base ? MAX(op->scan->base->entries, progress->done) : 0;
+}
+
+static void snapshot_show_changes(AppWidgets *w, const gchar *title, GPtrArray *changes)
+{
+    guint counts[3];
+    snapshot_count_changes(changes, counts);
+    GString *text = g_string_new(NULL);
+    g_string_append_printf(text, "%u added, %u removed, %u modified\n\n", counts[0], counts[1], counts[2]);
+    for (guint i = 0; i < changes->len; ++i) {
+        SnapshotChange *c = g_ptr_array_index(changes, i);
+        g_string_append_printf(text, "%-9s %s%s\n", snapshot_change_names[c->kind], c->path, c->dir ? "/" : "");
+    }
+    GtkWidget *d = gtk_dialog_new_with_buttons(title, GTK_WINDOW(w->window), GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Close", GTK_RESPONSE_CLOSE, NULL);
+    gtk_window_set_default_size(GTK_WINDOW(d), 720, 420);
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    GtkWidget *view = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(view), FALSE);
+    gtk_text_view_set_monospace(GTK_TEXT_VIEW(view), TRUE);
+    gtk_text_buffer_set_text(gtk_text_view_get_buffer(GTK_TEXT_VIEW(view)), text->str, text->len);
+    gtk_container_add(GTK_CONTAINER(scrolled), view);
+    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(d))), scrolled, TRUE, TRUE, 0);
+    g_signal_connect(d, "response", G_CALLBACK(gtk_widget_destroy), NULL);
+    gtk_widget_show_all(d);
+    g_string_free(text, TRUE);
+}
+
+static void snapshot_op_done(gpointer data, const GError *error)
+{
+    SnapshotOp *op = (SnapshotOp *)data;
+    AppWidgets *w = op->w;
+    if (error) {
+        if (!g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+            show_error_dialog(GTK_WINDOW(w->window), "Snapshot Error", error->message);
+        return;
+    }
+    if (op->scan && op->scan->errors->len > 0) {
+        gchar *report = checksum_report(op->scan->errors);
+        gchar *msg = g_strdup_printf("%u item(s) could not be recorded:\n%s", op->scan->errors->len, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Snapshot Error", msg);
+        g_free(msg);
+        g_free(report);
+    }
+    if (op->show) {
+        snapshot_show_changes(w, op->title, op->changes);
+        return;
+    }
+    gchar *status = op->changes ? g_strdup_printf("Snapshot taken: %d entries, %u change(s) since the last one",
+                                                  g_atomic_int_get(&op->scan->entries), op->changes->len)
+                                : g_strdup_printf("Snapshot taken: %d entries", g_atomic_int_get(&op->scan->entries));
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+}
+
+enum {
+    SNAPSHOT_RESPONSE_TAKE = 1,
+    SNAPSHOT_RESPONSE_CHANGES,
+    SNAPSHOT_RESPONSE_COMPARE,
+    SNAPSHOT_RESPONSE_DELETE,
+};
+
+static gchar* snapshot_describe(const Snapshot *snap)
+{
+    GDateTime *t = g_date_time_new_from_unix_local(snap->created / G_USEC_PER_SEC);
+    gchar *when = g_date_time_format(t, "%Y-%m-%d %H:%M:%S");
+    gchar *text = g_strdup_printf("%s  %" G_GUINT64_FORMAT " entries%s", when, snap->entries,
+                                  snap->flags & SNAPSHOT_HASHES ? ", with content hashes" : "");
+    g_free(when);
+    g_date_time_unref(t);
+    return text;
+}
+
+// Takes snapshots of the current folder and shows what changed since one
+// of them, or between two.
+static void on_snapshots_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    gchar *root = realpath(w->current_dir, NULL);
+    if (!root) {
+        show_error_dialog(GTK_WINDOW(w->window), "Snapshot Error", g_strerror(errno));
+        return;
+    }
+    GPtrArray *files = snapshot_list(root);
+
+    GtkWidget *d = gtk_dialog_new_with_buttons("Snapshots", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Delete", SNAPSHOT_RESPONSE_DELETE,
+                                               "Compare Two", SNAPSHOT_RESPONSE_COMPARE,
+                                               "Changes Since", SNAPSHOT_RESPONSE_CHANGES,
+                                               "Take Snapshot", SNAPSHOT_RESPONSE_TAKE,
+                                               "Close", GTK_RESPONSE_CLOSE,
+                                               NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(d), SNAPSHOT_RESPONSE_TAKE);
+    gtk_window_set_default_size(GTK_WINDOW(d), 560, 360);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+    GtkWidget *scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_vexpand(scrolled, TRUE);
+    GtkWidget *list = gtk_list_box_new();
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(list), GTK_SELECTION_MULTIPLE);
+    gtk_container_add(GTK_CONTAINER(scrolled), list);
+    gtk_box_pack_start(GTK_BOX(content), scrolled, TRUE, TRUE, 0);
+    for (guint i = 0; i < files->len; ++i) {
+        GError *err = NULL;
+        Snapshot *snap = snapshot_open(g_ptr_array_index(files, i), &err);
+        gchar *text = snap ? snapshot_describe(snap) : g_strdup(err->message);
+        GtkWidget *label = gtk_label_new(text);
+        gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+        GtkWidget *row = gtk_list_box_row_new();
+        gtk_container_add(GTK_CONTAINER(row), label);
+        g_object_set_data(G_OBJECT(row), "snapshot-file", g_ptr_array_index(files, i));
+        gtk_list_box_insert(GTK_LIST_BOX(list), row, -1);
+        g_free(text);
+        g_clear_error(&err);
+        if (snap) snapshot_close(snap);
+    }
+    GtkWidget *hashes = gtk_check_button_new_with_label("Hash file contents (slower, ignores mere touches)");
+    gtk_box_pack_start(GTK_BOX(content), hashes, FALSE, FALSE, 6);
+    gtk_widget_show_all(d);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    GPtrArray *chosen = g_ptr_array_new_with_free_func(g_free);
+    GList *rows = gtk_list_box_get_selected_rows(GTK_LIST_BOX(list));
+    for (GList *r = rows; r; r = r->next)
+        g_ptr_array_add(chosen, g_strdup(g_object_get_data(G_OBJECT(r->data), "snapshot-file")));
+    g_list_free(rows);
+    guint32 flags = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(hashes)) ? SNAPSHOT_HASHES : 0;
+    gtk_widget_destroy(d);
+
+    const gchar *problem = NULL;
+    if (response == SNAPSHOT_RESPONSE_CHANGES && chosen->len != 1)
+        problem = "Please select the snapshot to compare the folder with.";
+    else if (response == SNAPSHOT_RESPONSE_COMPARE && chosen->len != 2)
+        problem = "Please select two snapshots.";
+    else if (response == SNAPSHOT_RESPONSE_DELETE && chosen->len == 0)
+        problem = "Please select the snapshots to delete.";
+    if (problem) show_error_dialog(GTK_WINDOW(w->window), "Snapshot Error", problem);
+
+    SnapshotOp *op = NULL;
+    GError *err = NULL;
+    if (problem) {
+        // Nothing to do
+    } else if (response == SNAPSHOT_RESPONSE_DELETE) {
+        for (guint i = 0; i < chosen->len; ++i)
+            if (unlink(g_ptr_array_index(chosen, i)) != 0 && !err) set_errno_error(&err, "Cannot delete snapshot");
+    } else if (response == SNAPSHOT_RESPONSE_TAKE || response == SNAPSHOT_RESPONSE_CHANGES ||
+               response == SNAPSHOT_RESPONSE_COMPARE) {
+        op = g_new0(SnapshotOp, 1);
+        op->w = w;
+        op->root = g_strdup(root);
+        op->show = response != SNAPSHOT_RESPONSE_TAKE;
+        if (response == SNAPSHOT_RESPONSE_COMPARE) {
+            // Listed newest first
+            op->from = snapshot_open(g_ptr_array_index(chosen, 1), &err);
+            op->to = op->from ? snapshot_open(g_ptr_array_index(chosen, 0), &err) : NULL;
+        } else {
+            // The new snapshot is taken against the newest one, which
+            // shares the most with it
+            Snapshot *base = files->len > 0 ? snapshot_open(g_ptr_array_index(files, 0), NULL) : NULL;
+            op->scan = snapshot_scan_new(flags, base);
+            const gchar *from = response == SNAPSHOT_RESPONSE_CHANGES ? g_ptr_array_index(chosen, 0)
+                              : files->len > 0 ? g_ptr_array_index(files, 0) : NULL;
+            if (from) op->from = snapshot_open(from, &err);
+        }
+        if (op->from) {
+            gchar *since = snapshot_describe(op->from);
+            op->title = g_strdup_printf("Changes since %s", since);
+            g_free(since);
+        }
+    }
+    if (err) {
+        show_error_dialog(GTK_WINDOW(w->window), "Snapshot Error", err->message);
+        g_error_free(err);
+        if (op) snapshot_op_free(op);
+        op = NULL;
+    }
+    if (op) {
+        gchar *name = g_path_get_basename(root);
+        gchar *title = g_strdup_printf("%s \"%s\"", op->scan ? "Snapshot" : "Compare snapshots of", name);
+        job_submit(title, QOS_NORMAL, job_device_of(AT_FDCWD, root), op->scan ? op->scan->cancellable : NULL,
+                   snapshot_op_run, snapshot_op_progress, snapshot_op_done, op, (GDestroyNotify)snapshot_op_free);
+        g_free(title);
+        g_free(name);
+    }
+    g_ptr_array_free(chosen, TRUE);
+    g_ptr_array_free(files, TRUE);
+    free(root);
+}
+
+static GHashTable *scrubs_running; // Root -> its Scrub, while a job has it
+
+typedef struct {
+    AppWidgets *w;
+    Scrub *scrub;
+} ScrubOp;
+
+static void scrub_op_free(ScrubOp *op)
+{
+    scrub_free(op->scrub);
+    g_free(op);
+}
+
+static gboolean scrub_op_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    return scrub_run(((ScrubOp *)data)->scrub, error);
+}
+
+static void scrub_op_progress(gpointer data, JobProgress *progress)
+{
+    Scrub *s = ((ScrubOp *)data)->scrub;
+    g_mutex_lock(&s->lock);
+    progress->done = s->state->bytes + s->reading;
+    g_mutex_unlock(&s->lock);
+    // The last complete pass is the best guess there is
+    progress->total = MAX(s->state->last_bytes, progress->done);
+    progress->bytes = TRUE;
+}
+
+static void scrub_op_done(gpointer data, const GError *error)
+{
+    ScrubOp *op = (ScrubOp *)data;
+    Scrub *s = op->scrub;
+    AppWidgets *w = op->w;
+    g_hash_table_remove(scrubs_running, s->state->root);
+    if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        show_error_dialog(GTK_WINDOW(w->window), "Scrub Error", error->message);
+    if (s->found->len > 0) {
+        gchar *report = checksum_report(s->found);
+        gchar *msg = g_strdup_printf("%u damaged file(s) under %s:\n%s", s->found->len, s->state->root, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Corruption Found", msg);
+        g_free(msg);
+        g_free(report);
+    }
+    if (error) return;
+    gchar *status = g_strdup_printf("Scrubbed %s: %" G_GUINT64_FORMAT " file(s) checked, %" G_GUINT64_FORMAT
+                                    " newly sealed, %u bad, %u could not be read",
+                                    s->state->root, s->state->files, s->state->sealed, s->state->bad->len,
+                                    s->errors->len);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+    g_free(status);
+}
+
+// Starts a pass, or resumes one, over state's tree in the background. The
+// job takes state over; so does a failure.
+static gboolean scrub_start(AppWidgets *w, ScrubState *state, GError **error)
+{
+    Scrub *s = scrub_new(state, error);
+    if (!s) return FALSE;
+    ScrubOp *op = g_new0(ScrubOp, 1);
+    op->w = w;
+    op->scrub = s;
+    g_hash_table_insert(scrubs_running, g_strdup(state->root), s);
+    gchar *name = g_path_get_basename(state->root);
+    gchar *title = g_strdup_printf("Scrub \"%s\"", name);
+    job_submit(title, QOS_BACKGROUND, s->dev, s->cancellable,
+               scrub_op_run, scrub_op_progress, scrub_op_done, op, (GDestroyNotify)scrub_op_free);
+    g_free(title);
+    g_free(name);
+    return TRUE;
+}
+
+// Starts the scrubs that are due and not running yet. A tree that is gone,
+// such as an archive disk that is not plugged in, waits for the next look.
+static gboolean scrub_start_due(gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GPtrArray *states = scrub_state_list();
+    gint64 now = g_get_real_time();
+    for (guint i = 0; i < states->len; ++i) {
+        ScrubState *state = g_ptr_array_index(states, i);
+        if (g_hash_table_contains(scrubs_running, state->root) || !scrub_due(state, now)) {
+            scrub_state_free(state);
+            continue;
+        }
+        GError *err = NULL;
+        if (!scrub_start(w, state, &err)) {
+            if (!g_error_matches(err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND)) g_warning("Cannot scrub: %s", err->message);
+            g_error_free(err);
+        }
+    }
+    g_ptr_array_free(states, TRUE);
+    return G_SOURCE_CONTINUE;
+}
+
+static void scrub_scheduler_init(AppWidgets *w)
+{
+    scrubs_running = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    scrub_start_due(w);
+    g_timeout_add_seconds(SCRUB_CHECK_SECONDS, scrub_start_due, w);
+}
+
+static gchar* scrub_format_time(gint64 usec)
+{
+    GDateTime *t = g_date_time_new_from_unix_local(usec / G_USEC_PER_SEC);
+    gchar *text = g_date_time_format(t, "%Y-%m-%d %H:%M");
+    g_date_time_unref(t);
+    return text;
+}
+
+// What the state file says about a tree's scrubs.
+static gchar* scrub_describe(const ScrubState *state)
+{
+    if (!state)
+        return g_strdup_printf("This folder is not scrubbed. A scrub re-reads every file and checks it against "
+                               "its stored checksum; files without one get one for the next pass. Once started, "
+                               "the folder is scrubbed again every %d days.", SCRUB_INTERVAL_DAYS);
+    GString *text = g_string_new(NULL);
+    if (state->finished) {
+        gchar *when = scrub_format_time(state->finished);
+        gchar *size = g_format_size(state->last_bytes);
+        g_string_append_printf(text, "Last complete pass: %s, %s read.\n", when, size);
+        g_free(size);
+        g_free(when);
+    }
+    if (state->started) {
+        gchar *when = scrub_format_time(state->started);
+        g_string_append_printf(text, "A pass started %s has checked %" G_GUINT64_FORMAT " file(s)%s%s.\n", when,
+                               state->files, state->cursor ? ", up to " : "", state->cursor ? state->cursor : "");
+        g_free(when);
+    } else if (state->finished) {
+        gchar *due = scrub_format_time(state->finished + (gint64)SCRUB_INTERVAL_DAYS * 24 * 3600 * G_USEC_PER_SEC);
+        g_string_append_printf(text, "It checked %" G_GUINT64_FORMAT " file(s) and sealed %" G_GUINT64_FORMAT
+                               " new one(s). The next pass is due %s.\n", state->files, state->sealed, due);
+        g_free(due);
+    }
+    if (state->bad->len > 0) {
+        gchar *report = checksum_report(state->bad);
+        g_string_append_printf(text, "\n%u damaged file(s):\n%s", state->bad->len, report);
+        g_free(report);
+    } else {
+        g_string_append(text, "No damaged files found.");
+    }
+    return g_string_free(text, FALSE);
+}
+
+enum {
+    SCRUB_RESPONSE_START = 1,
+    SCRUB_RESPONSE_FORGET,
+};
+
+// Shows how the current folder's scrubs went, starts or resumes a pass,
+// sets the bandwidth cap (of a running pass too) or stops scrubbing it.
+static void on_scrub_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    gchar *root = realpath(w->current_dir, NULL);
+    if (!root) {
+        show_error_dialog(GTK_WINDOW(w->window), "Scrub Error", g_strerror(errno));
+        return;
+    }
+    // A running pass is described as of its last checkpoint
+    Scrub *running = g_hash_table_lookup(scrubs_running, root);
+    gchar *path = scrub_state_path(root);
+    ScrubState *state = scrub_state_load(path, NULL);
+    g_free(path);
+
+    GtkWidget *d = gtk_dialog_new_with_buttons("Scrub", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Stop Scrubbing", SCRUB_RESPONSE_FORGET,
+                                               state && state->started ? "Resume Pass" : "Scrub Now",
+                                               SCRUB_RESPONSE_START,
+                                               "Close", GTK_RESPONSE_CLOSE,
+                                               NULL);
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(d), SCRUB_RESPONSE_FORGET, state && !running);
+    gtk_dialog_set_response_sensitive(GTK_DIALOG(d), SCRUB_RESPONSE_START, !running);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+    gchar *text = scrub_describe(state);
+    gchar *full = running ? g_strconcat("A pass is running now.\n", text, NULL) : g_strdup(text);
+    GtkWidget *label = gtk_label_new(full);
+    gtk_label_set_line_wrap(GTK_LABEL(label), TRUE);
+    gtk_label_set_selectable(GTK_LABEL(label), TRUE);
+    gtk_label_set_xalign(GTK_LABEL(label), 0.0);
+    gtk_box_pack_start(GTK_BOX(content), label, TRUE, TRUE, 6);
+    g_free(full);
+    g_free(text);
+
+    GtkWidget *rate_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    gtk_box_pack_start(GTK_BOX(rate_hbox), gtk_label_new("Bandwidth cap (MiB/s, 0 for none):"), FALSE, FALSE, 0);
+    GtkWidget *spin = gtk_spin_button_new_with_range(0, 10000, 5);
+    gtk_spin_button_set_value(GTK_SPIN_BUTTON(spin), running ? g_atomic_int_get(&running->state->rate)
+                                                   : state ? state->rate : SCRUB_DEFAULT_RATE);
+    gtk_box_pack_start(GTK_BOX(rate_hbox), spin, FALSE, FALSE, 0);
+    gtk_box_pack_start(GTK_BOX(content), rate_hbox, FALSE, FALSE, 6);
+    gtk_widget_show_all(d);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    gint rate = gtk_spin_button_get_value_as_int(GTK_SPIN_BUTTON(spin));
+    gtk_widget_destroy(d);
+
+    // A pass may have finished, or the scheduler started one, while the
+    // dialog was open. A finished pass has saved newer state than ours.
+    Scrub *was_running = running;
+    running = g_hash_table_lookup(scrubs_running, root);
+    if (was_running && !running) {
+        if (state) scrub_state_free(state);
+        path = scrub_state_path(root);
+        state = scrub_state_load(path, NULL);
+        g_free(path);
+    }
+
+    GError *err = NULL;
+    if (running) {
+        scrub_set_rate(running, rate);
+    } else if (response == SCRUB_RESPONSE_FORGET && state) {
+        // The seals stay; they keep serving as the checksum cache
+        if (unlink(state->path) != 0) set_errno_error(&err, "Cannot remove scrub state");
+        else gtk_label_set_text(GTK_LABEL(w->statusLabel), "This folder is no longer scrubbed");
+    } else if (response == SCRUB_RESPONSE_START) {
+        if (!state) state = scrub_state_new(root);
+        state->rate = rate;
+        if (scrub_start(w, state, &err))
+            gtk_label_set_text(GTK_LABEL(w->statusLabel), "Scrubbing in the background...");
+        state = NULL;
+    } else if (state && state->rate != rate) {
+        state->rate = rate;
+        scrub_state_save(state, &err);
+    }
+    if (err) {
+        show_error_dialog(GTK_WINDOW(w->window), "Scrub Error", err->message);
+        g_error_free(err);
+    }
+    if (state) scrub_state_free(state);
+    free(root);
+}
+
+typedef struct {
+    AppWidgets *w;
+    ArchiveExtract *x;
+    GPtrArray *members;   // ArchiveMember, owned by x's archive; NULL for all of source
+    int dir_fd;           // Holds source
+    gchar *source;
+    gchar *dest_dir;
+} ExtractOp;
+
+static void extract_op_free(ExtractOp *op)
+{
+    archive_extract_free(op->x);
+    if (op->members) g_ptr_array_free(op->members, TRUE);
+    if (op->dir_fd >= 0) close(op->dir_fd);
+    g_free(op->source);
+    g_free(op->dest_dir);
+    g_free(op);
+}
+
+static gboolean extract_op_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    ExtractOp *op = (ExtractOp *)data;
+    if (op->members) return archive_extract_run(op->x, op->members, op->dest_dir, error);
+    return archive_extract_all(op->x, op->dir_fd, op->source, op->dest_dir, error);
+}
+
+static void extract_op_progress(gpointer data, JobProgress *progress)
+{
+    ArchiveExtract *x = ((ExtractOp *)data)->x;
+    g_mutex_lock(&x->lock);
+    progress->done = x->bytes_done;
+    progress->total = x->bytes_total;
+    g_mutex_unlock(&x->lock);
+    progress->bytes = TRUE;
+}
+
+static void extract_op_done(gpointer data, const GError *error)
+{
+    ExtractOp *op = (ExtractOp *)data;
+    AppWidgets *w = op->w;
+    if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        show_error_dialog(GTK_WINDOW(w->window), "Extract Error", error->message);
+    if (op->x->errors->len > 0) {
+        gchar *report = checksum_report(op->x->errors);
+        gchar *msg = g_strdup_printf("%u member(s) could not be extracted:\n%s", op->x->errors->len, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Extract Error", msg);
+        g_free(msg);
+        g_free(report);
+    }
+    if (!error) {
+        gchar *status = op->members
+            ? g_strdup_printf("Extracted %u item(s) to %s", op->members->len, op->dest_dir)
+            : g_strdup_printf("Extracted \"%s\"", op->source);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+        g_free(status);
+    }
+    // The listing shows the new items once the archive is left
+    if (!w->archive) refresh_file_list(w);
+}
+
+static void extract_submit(AppWidgets *w, ExtractOp *op, const gchar *title)
+{
+    job_submit(title, QOS_NORMAL, job_device_of(w->dir_fd, "."), op->x->cancellable,
+               extract_op_run, extract_op_progress, extract_op_done, op, (GDestroyNotify)extract_op_free);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Extracting in the background...");
+}
+
+// Extracts the selected members of the archive being browsed next to it,
+// in the directory that holds the archive. Outside an archive, each
+// selected archive is extracted whole into a folder of its own.
+static void on_extract_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GPtrArray *names = get_selected_names(w);
+    if (names->len == 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Extract Error",
+                          w->archive ? "Please select an item." : "Please select an archive.");
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+
+    if (!w->archive) {
+        for (guint i = 0; i < names->len; ++i) {
+            const gchar *name = g_ptr_array_index(names, i);
+            ExtractOp *op = g_new0(ExtractOp, 1);
+            op->w = w;
+            op->x = archive_extract_new(NULL, QOS_NORMAL);
+            op->dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+            op->source = g_strdup(name);
+            op->dest_dir = g_strdup(w->current_dir);
+            gchar *title = g_strdup_printf("Extract \"%s\"", name);
+            extract_submit(w, op, title);
+            g_free(title);
+        }
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+
+    ExtractOp *op = g_new0(ExtractOp, 1);
+    op->w = w;
+    op->x = archive_extract_new(w->archive, QOS_NORMAL);
+    op->members = g_ptr_array_new();
+    op->dir_fd = -1;
+    op->dest_dir = g_strdup(w->current_dir);
+    for (guint i = 0; i < names->len; ++i) {
+        const gchar *name = g_ptr_array_index(names, i);
+        gchar *path = *w->archive_dir ? g_strconcat(w->archive_dir, "/", name, NULL) : g_strdup(name);
+        ArchiveMember *m = archive_lookup(w->archive, path);
+        if (m) g_ptr_array_add(op->members, m);
+        g_free(path);
+    }
+
+    gchar *title = op->members->len == 1
+        ? g_strdup_printf("Extract \"%s\"", (gchar *)g_ptr_array_index(names, 0))
+        : g_strdup_printf("Extract %u items from \"%s\"", op->members->len, w->archive_name);
+    extract_submit(w, op, title);
+    g_free(title);
+    g_ptr_array_free(names, TRUE);
+}
+
+typedef struct {
+    AppWidgets *w;
+    ArchiveCreate *c;
+} CompressOp;
+
+static void compress_op_free(CompressOp *op)
+{
+    archive_create_free(op->c);
+    g_free(op);
 }
 
-static void show_info_dialog(GtkWindow *parent, const gchar *title, const gchar *message)
+static gboolean compress_op_run(gpointer data, GCancellable *cancellable, GError **error)
 {
-    GtkWidget *d = gtk_message_dialog_new(parent,
-        GTK_DIALOG_MODAL,
-        GTK_MESSAGE_INFO,
-        GTK_BUTTONS_OK,
-        "%s", message);
-    gtk_window_set_title(GTK_WINDOW(d), title);
-    gtk_dialog_run(GTK_DIALOG(d));
-    gtk_widget_destroy(d);
+    return archive_create_run(((CompressOp *)data)->c, error);
 }
 
-// --- File System Operations ---
+static void compress_op_progress(gpointer data, JobProgress *progress)
+{
+    ArchiveCreate *c = ((CompressOp *)data)->c;
+    g_mutex_lock(&c->lock);
+    progress->done = c->bytes_done;
+    progress->total = c->bytes_total;
+    g_mutex_unlock(&c->lock);
+    progress->bytes = TRUE;
+}
 
-static void refresh_file_list(AppWidgets *w)
+static void compress_op_done(gpointer data, const GError *error)
 {
-    // Clear existing list
-    GList *children = gtk_container_get_children(GTK_CONTAINER(w->listbox));
-    for (GList *iter = children; iter != NULL; iter = iter->next) {
-        gtk_widget_destroy(GTK_WIDGET(iter->data));
+    CompressOp *op = (CompressOp *)data;
+    AppWidgets *w = op->w;
+    if (error && !g_error_matches(error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        show_error_dialog(GTK_WINDOW(w->window), "Compress Error", error->message);
+    if (op->c->errors->len > 0) {
+        gchar *report = checksum_report(op->c->errors);
+        gchar *msg = g_strdup_printf("%u item(s) could not be archived in full:\n%s", op->c->errors->len, report);
+        show_error_dialog(GTK_WINDOW(w->window), "Compress Error", msg);
+        g_free(msg);
+        g_free(report);
     }
-    g_list_free(children);
-    
-    // Clear editor and status on refresh
-    GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
-    gtk_text_buffer_set_text(buf, "", -1);
-    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected");
-    
-    if (w->selected_file_path) {
-        g_free(w->selected_file_path);
-        w->selected_file_path = NULL;
+    if (!error) {
+        gchar *name = g_path_get_basename(op->c->dest);
+        gchar *status = g_strdup_printf("Created %s", name);
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), status);
+        g_free(status);
+        g_free(name);
     }
+    if (!w->archive) refresh_file_list(w);
+}
 
-    // Update path label
-    gtk_label_set_text(GTK_LABEL(w->pathLabel), w->current_dir);
-
-    GDir *dir = g_dir_open(w->current_dir, 0, NULL);
-    if (!dir) {
-        show_error_dialog(GTK_WINDOW(w->window), "Navigation Error", "Cannot open directory: Permission denied or not found.");
+// Packs the selection into a new tar, compressed tar or zip in this folder.
+static void on_compress_clicked(GtkButton *btn, gpointer user_data)
+{
+    static const gchar *extensions[] = { ".tar.gz", ".tar", ".zip" };
+    AppWidgets *w = (AppWidgets *)user_data;
+    GPtrArray *names = get_selected_names_copy(w);
+    if (names->len == 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Compress Error", "Please select the items to archive.");
+        g_ptr_array_free(names, TRUE);
+        return;
+    }
+    int dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (dir_fd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Compress Error", g_strerror(errno));
+        g_ptr_array_free(names, TRUE);
         return;
     }
+    gchar *dir = g_strdup(w->current_dir);
 
-    const gchar *name;
-    GPtrArray *entries = g_ptr_array_new_with_free_func(g_free);
+    GtkWidget *d = gtk_dialog_new_with_buttons("Compress", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Cancel", GTK_RESPONSE_CANCEL,
+                                               "Create", GTK_RESPONSE_OK,
+                                               NULL);
+    gtk_dialog_set_default_response(GTK_DIALOG(d), GTK_RESPONSE_OK);
+    GtkWidget *content = gtk_dialog_get_content_area(GTK_DIALOG(d));
+    GtkWidget *grid = gtk_grid_new();
+    gtk_grid_set_row_spacing(GTK_GRID(grid), 6);
+    gtk_grid_set_column_spacing(GTK_GRID(grid), 6);
+    GtkWidget *entry = gtk_entry_new();
+    gtk_entry_set_text(GTK_ENTRY(entry), names->len == 1 ? (gchar *)g_ptr_array_index(names, 0) : "Archive");
+    gtk_entry_set_activates_default(GTK_ENTRY(entry), TRUE);
+    GtkWidget *format = gtk_combo_box_text_new();
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(format), "tar.gz (compressed tar)");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(format), "tar");
+    gtk_combo_box_text_append_text(GTK_COMBO_BOX_TEXT(format), "zip");
+    gtk_combo_box_set_active(GTK_COMBO_BOX(format), 0);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Name:"), 0, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), entry, 1, 0, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), gtk_label_new("Format:"), 0, 1, 1, 1);
+    gtk_grid_attach(GTK_GRID(grid), format, 1, 1, 1, 1);
+    gtk_box_pack_start(GTK_BOX(content), grid, FALSE, FALSE, 6);
+    gtk_widget_show_all(d);
+
+    gint response = gtk_dialog_run(GTK_DIALOG(d));
+    gint choice = gtk_combo_box_get_active(GTK_COMBO_BOX(format));
+    gchar *stem = g_strstrip(g_strdup(gtk_entry_get_text(GTK_ENTRY(entry))));
+    gtk_widget_destroy(d);
 
-    while ((name = g_dir_read_name(dir)) != NULL) {
-        if (g_strcmp0(name, ".") == 0 || g_strcmp0(name, "..") == 0) continue;
-        g_ptr_array_add(entries, g_strdup(name));
+    const gchar *problem = NULL;
+    if (response != GTK_RESPONSE_OK || choice < 0)
+        problem = "";
+    else if (!*stem || strchr(stem, '/'))
+        problem = "Please enter a name for the archive.";
+    if (problem) {
+        if (*problem) show_error_dialog(GTK_WINDOW(w->window), "Compress Error", problem);
+        close(dir_fd);
+        g_free(dir);
+        g_free(stem);
+        g_ptr_array_free(names, TRUE);
+        return;
     }
-    g_dir_close(dir);
 
-    g_ptr_array_sort(entries, (GCompareFunc)g_ascii_strcasecmp);
+    gchar *file = g_str_has_suffix(stem, extensions[choice]) ? g_strdup(stem)
+                                                             : g_strconcat(stem, extensions[choice], NULL);
+    gchar *dest = copy_unique_dest(dir, file);
+    CompressOp *op = g_new0(CompressOp, 1);
+    op->w = w;
+    op->c = archive_create_new(dir_fd, names, dest, choice == 2 ? ARCHIVE_ZIP : ARCHIVE_TAR, choice == 0, QOS_NORMAL);
 
-    for (guint i = 0; i < entries->len; ++i) {
-        gchar *entryName = g_ptr_array_index(entries, i);
-        gchar *fullpath = g_build_filename(w->current_dir, entryName, NULL);
+    gchar *dest_name = g_path_get_basename(dest);
+    gchar *title = g_strdup_printf("Create \"%s\"", dest_name);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), "Compressing in the background...");
+    job_submit(title, QOS_NORMAL, job_device_of(dir_fd, "."), op->c->cancellable,
+               compress_op_run, compress_op_progress, compress_op_done, op, (GDestroyNotify)compress_op_free);
+    g_free(title);
+    g_free(dest_name);
+    g_free(dest);
+    g_free(file);
+    g_free(stem);
+    g_free(dir);
+}
 
-        GtkWidget *row = gtk_list_box_row_new();
-        GtkWidget *hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 8);
+static void on_history_clicked(GtkButton *btn, gpointer user_data)
+{
+    AppWidgets *w = (AppWidgets *)user_data;
+    GtkListBoxRow *row = get_single_selected_row(w);
+    if (!row) {
+        show_error_dialog(GTK_WINDOW(w->window), "History Error", "Please select a single file.");
+        return;
+    }
+
+    // The list may be rebuilt while the dialog runs; keep the name and the
+    // directory, not the row
+    struct stat st;
+    if (fstatat(w->dir_fd, g_object_get_data(G_OBJECT(row), "entry-name"), &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+        show_error_dialog(GTK_WINDOW(w->window), "History Error", "Directories have no version history.");
+        return;
+    }
+    int dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+    if (dir_fd < 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "History Error", g_strerror(errno));
+        return;
+    }
+    gchar *name = g_strdup(g_object_get_data(G_OBJECT(row), "entry-name"));
+    gchar *dir = g_strdup(w->current_dir);
+    row = NULL;
 
-        GtkWidget *image;
-        if (g_file_test(fullpath, G_FILE_TEST_IS_DIR))
-            image = gtk_image_new_from_icon_name("folder", GTK_ICON_SIZE_SMALL_TOOLBAR);
+    GError *open_err = NULL;
+    int root_fd = -1;
+    int vdir_fd = versions_open(dir_fd, name, FALSE, &root_fd, &open_err);
+    GPtrArray *versions = vdir_fd >= 0 ? versions_list(vdir_fd) : g_ptr_array_new();
+    if (versions->len == 0) {
+        if (open_err && !g_error_matches(open_err, G_IO_ERROR, G_IO_ERROR_NOT_FOUND))
+            show_error_dialog(GTK_WINDOW(w->window), "History Error", open_err->message);
         else
-            image = gtk_image_new_from_icon_name("text-x-generic", GTK_ICON_SIZE_SMALL_TOOLBAR);
+            show_info_dialog(GTK_WINDOW(w->window), "History", "No previous versions of this file.");
+        g_clear_error(&open_err);
+        g_ptr_array_free(versions, TRUE);
+        if (vdir_fd >= 0) {
+            close(vdir_fd);
+            close(root_fd);
+        }
+        close(dir_fd);
+        g_free(name);
+        g_free(dir);
+        return;
+    }
 
-        GtkWidget *label = gtk_label_new(entryName);
-        gtk_widget_set_halign(label, GTK_ALIGN_START);
+    // diff(1) needs a path; take it from the held directory
+    gchar *dir_path = dir_handle_path(dir_fd);
+    gchar *fullpath = g_build_filename(dir_path ? dir_path : dir, name, NULL);
+    g_free(dir_path);
 
-        gtk_box_pack_start(GTK_BOX(hbox), image, FALSE, FALSE, 6);
-        gtk_box_pack_start(GTK_BOX(hbox), label, TRUE, TRUE, 6);
-        gtk_container_add(GTK_CONTAINER(row), hbox);
-        gtk_widget_show_all(row);
+    GtkWidget *d = gtk_dialog_new_with_buttons("Version History", GTK_WINDOW(w->window),
+                                               GTK_DIALOG_MODAL | GTK_DIALOG_DESTROY_WITH_PARENT,
+                                               "Restore to Editor", GTK_RESPONSE_APPLY,
+                                               "Restore File", GTK_RESPONSE_ACCEPT,
+                                               "Close", GTK_RESPONSE_CLOSE,
+                                               NULL);
+    gtk_window_set_default_size(GTK_WINDOW(d), 800, 500);
 
-        g_object_set_data_full(G_OBJECT(row), "entry-name", g_strdup(entryName), g_free);
-        gtk_list_box_insert(GTK_LIST_BOX(w->listbox), row, -1);
+    GtkWidget *hpaned = gtk_paned_new(GTK_ORIENTATION_HORIZONTAL);
+    gtk_widget_set_vexpand(hpaned, TRUE);
+    gtk_box_pack_start(GTK_BOX(gtk_dialog_get_content_area(GTK_DIALOG(d))), hpaned, TRUE, TRUE, 0);
 
-        g_free(fullpath);
-    }
+    GtkWidget *list_scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_widget_set_size_request(list_scrolled, 240, -1);
+    GtkWidget *vlist = gtk_list_box_new();
+    gtk_container_add(GTK_CONTAINER(list_scrolled), vlist);
+    gtk_paned_pack1(GTK_PANED(hpaned), list_scrolled, FALSE, TRUE);
 
-    g_ptr_array_free(entries, TRUE);
-}
+    GtkWidget *diff_scrolled = gtk_scrolled_window_new(NULL, NULL);
+    GtkWidget *diffview = gtk_text_view_new();
+    gtk_text_view_set_editable(GTK_TEXT_VIEW(diffview), FALSE);
+    gtk_text_view_set_monospace(GTK_TEXT_VIEW(diffview), TRUE);
+    gtk_container_add(GTK_CONTAINER(diff_scrolled), diffview);
+    gtk_paned_pack2(GTK_PANED(hpaned), diff_scrolled, TRUE, TRUE);
 
-static void on_row_activated(GtkListBox *box, GtkListBoxRow *row, gpointer user_data)
-{
-    AppWidgets *w = (AppWidgets *)user_data;
-    const gchar *entryName = g_object_get_data(G_OBJECT(row), "entry-name");
-    
-    if (w->selected_file_path) {
-        g_free(w->selected_file_path);
-        w->selected_file_path = NULL;
+    for (guint i = 0; i < versions->len; ++i) {
+        const gchar *version = g_ptr_array_index(versions, i);
+        gchar *label = versions_describe(vdir_fd, version);
+        GtkWidget *vrow = gtk_list_box_row_new();
+        GtkWidget *l = gtk_label_new(label);
+        gtk_widget_set_halign(l, GTK_ALIGN_START);
+        gtk_container_add(GTK_CONTAINER(vrow), l);
+        g_object_set_data_full(G_OBJECT(vrow), "version-name", g_strdup(version), g_free);
+        g_object_set_data_full(G_OBJECT(vrow), "version-label", label, g_free);
+        gtk_list_box_insert(GTK_LIST_BOX(vlist), vrow, -1);
     }
-    w->selected_file_path = g_build_filename(w->current_dir, entryName, NULL);
 
-    if (g_file_test(w->selected_file_path, G_FILE_TEST_IS_DIR)) {
-        // Navigate into directory
-        g_free(w->current_dir);
-        w->current_dir = g_strdup(w->selected_file_path);
-        refresh_file_list(w);
-        gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: None Selected (Directory View)");
-        
-        GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
-        gtk_text_buffer_set_text(buf, "", -1);
+    HistoryView hv = { fullpath, diffview, root_fd, vdir_fd };
+    g_signal_connect(vlist, "row-selected", G_CALLBACK(on_version_selected), &hv);
+    gtk_list_box_select_row(GTK_LIST_BOX(vlist), gtk_list_box_get_row_at_index(GTK_LIST_BOX(vlist), 0));
 
-    } else {
-        // Read file contents (READ) and display metadata (Optional Feature)
+    gtk_widget_show_all(d);
+    gint res = gtk_dialog_run(GTK_DIALOG(d));
+
+    GtkListBoxRow *vrow = gtk_list_box_get_selected_row(GTK_LIST_BOX(vlist));
+    gboolean reload = FALSE;
+    if (res == GTK_RESPONSE_APPLY && vrow) {
+        const gchar *version = g_object_get_data(G_OBJECT(vrow), "version-name");
         gchar *contents = NULL;
         gsize len = 0;
+        gboolean is_temp = FALSE;
         GError *err = NULL;
-
-        if (g_file_get_contents(w->selected_file_path, &contents, &len, &err)) {
+        gchar *vfile = versions_materialize(root_fd, vdir_fd, version, &is_temp, &err);
+        if (vfile && g_file_get_contents(vfile, &contents, &len, &err)) {
             GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
             gtk_text_buffer_set_text(buf, contents, len);
+            gchar *status_text = g_strdup_printf("Current File: %s | Restored version from %s (unsaved)",
+                                                 name, (const gchar *)g_object_get_data(G_OBJECT(vrow), "version-label"));
+            gtk_label_set_text(GTK_LABEL(w->statusLabel), status_text);
+            g_free(status_text);
             g_free(contents);
-            
-            // Display metadata (size and time)
-            struct stat file_stat;
-            if (stat(w->selected_file_path, &file_stat) == 0) {
-                gchar *time_str = g_time_val_to_iso8601(&file_stat.st_mtim, NULL);
-                gchar *status_text = g_strdup_printf("Current File: %s | Size: %lu bytes | Modified: %s", 
-                                                    entryName, 
-                                                    (gulong)file_stat.st_size, 
-                                                    time_str);
-                gtk_label_set_text(GTK_LABEL(w->statusLabel), status_text);
-                g_free(time_str);
-                g_free(status_text);
-            } else {
-                gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: Metadata unavailable");
-            }
-
         } else {
-            show_error_dialog(GTK_WINDOW(w->window), "File Read Error", err->message);
+            show_error_dialog(GTK_WINDOW(w->window), "History Error", err->message);
+            g_error_free(err);
+        }
+        if (vfile && is_temp) unlink(vfile);
+        g_free(vfile);
+    } else if (res == GTK_RESPONSE_ACCEPT && vrow) {
+        GError *err = NULL;
+        if (versions_restore_file(root_fd, vdir_fd, g_object_get_data(G_OBJECT(vrow), "version-name"),
+                                  dir_fd, name, &err)) {
+            versions_prune(root_fd, vdir_fd);
+            reload = TRUE;
+        } else {
+            show_error_dialog(GTK_WINDOW(w->window), "History Error", err->message);
             g_error_free(err);
-            GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
-            gtk_text_buffer_set_text(buf, "", -1);
-            gtk_label_set_text(GTK_LABEL(w->statusLabel), "Current File: Read Failed");
         }
     }
-    
-    // Clear selection path (it's re-set on activation)
-    if (w->selected_file_path) {
-        g_free(w->selected_file_path);
-        w->selected_file_path = NULL;
+    g_signal_handlers_disconnect_by_data(vlist, &hv);
+    gtk_widget_destroy(d);
+
+    g_ptr_array_free(versions, TRUE);
+    close(vdir_fd);
+    close(root_fd);
+    g_free(fullpath);
+
+    if (reload) {
+        show_info_dialog(GTK_WINDOW(w->window), "Success", "Version restored.");
+        // Reopen the file only while its directory is still the one listed
+        struct stat held, shown;
+        if (fstat(dir_fd, &held) == 0 && fstat(w->dir_fd, &shown) == 0 &&
+            held.st_dev == shown.st_dev && held.st_ino == shown.st_ino && !w->archive &&
+            (row = find_row_by_name(w, name)) != NULL)
+            on_row_activated(GTK_LIST_BOX(w->listbox), row, w);
     }
+    close(dir_fd);
+    g_free(name);
+    g_free(dir);
 }
 
-static void on_new_clicked(GtkButton *btn, gpointer user_data)
+static void set_clipboard(AppWidgets *w, gboolean cut)
 {
-    AppWidgets *w = (AppWidgets *)user_data;
-    const gchar *name = gtk_entry_get_text(GTK_ENTRY(w->entryName));
-    if (!name || !*name) {
-        show_error_dialog(GTK_WINDOW(w->window), "Create Error", "Please enter a name.");
+    GPtrArray *names = get_selected_names(w);
+    if (names->len == 0) {
+        show_error_dialog(GTK_WINDOW(w->window), cut ? "Cut Error" : "Copy Error", "Please select an item.");
+        g_ptr_array_free(names, TRUE);
         return;
     }
 
-    gchar *fullpath = g_build_filename(w->current_dir, name, NULL);
-    GError *err = NULL;
-    gboolean is_dir = (g_str_has_suffix(name, "/") || g_str_has_suffix(name, "\\"));
-    
-    if (g_file_test(fullpath, G_FILE_TEST_EXISTS)) {
-        show_error_dialog(GTK_WINDOW(w->window), "Create Error", "File or directory already exists.");
-        g_free(fullpath);
-        return;
-    }
+    // The whole selection is pasted by one job. The directory is held
+    // rather than its path, so it is found again even if it is renamed.
+    g_ptr_array_set_size(w->clipboard, 0);
+    for (guint i = 0; i < names->len; ++i)
+        g_ptr_array_add(w->clipboard, g_strdup(g_ptr_array_index(names, i)));
+    if (w->clipboard_dir_fd >= 0) close(w->clipboard_dir_fd);
+    w->clipboard_dir_fd = fcntl(w->dir_fd, F_DUPFD_CLOEXEC, 0);
+    w->clipboard_cut = cut;
 
-    if (is_dir) {
-        // CREATE Directory
-        if (g_mkdir_with_parents(fullpath, 0755) != 0) {
-            show_error_dialog(GTK_WINDOW(w->window), "Create Directory Error", g_strerror(errno));
-            g_free(fullpath);
-            return;
+    gchar *status_text = names->len == 1
+        ? g_strdup_printf("%s \"%s\" to clipboard", cut ? "Cut" : "Copied", (gchar *)g_ptr_array_index(names, 0))
+        : g_strdup_printf("%s %u items to clipboard", cut ? "Cut" : "Copied", names->len);
+    gtk_label_set_text(GTK_LABEL(w->statusLabel), status_text);
+    g_free(status_text);
+    g_ptr_array_free(names, TRUE);
+}
+
+static void on_copy_clicked(GtkButton *btn, gpointer user_data)
+{
+    set_clipboard((AppWidgets *)user_data, FALSE);
+}
+
+static void on_cut_clicked(GtkButton *btn, gpointer user_data)
+{
+    set_clipboard((AppWidgets *)user_data, TRUE);
+}
+
+typedef struct {
+    AppWidgets *w;
+    GPtrArray *sources;
+    gchar *dest_dir;
+    gchar *rename_to;  // Explicit target for a single source, or NULL
+    gboolean move;
+    CopyJob *job;
+    CopyJournal *journal;
+} PasteOp;
+
+static void paste_op_free(PasteOp *op)
+{
+    g_ptr_array_free(op->sources, TRUE);
+    g_free(op->dest_dir);
+    g_free(op->rename_to);
+    copy_job_free(op->job);
+    if (op->journal) copy_journal_close(op->journal, FALSE);
+    g_free(op);
+}
+
+// Asks what to do with an unfinished job: resume it now, keep its journal
+// for a later launch, or discard it along with its partial files.
+static void prompt_resume_job(AppWidgets *w, CopyJournal *journal, const gchar *message)
+{
+    GtkWidget *dialog = gtk_message_dialog_new(GTK_WINDOW(w->window), GTK_DIALOG_MODAL,
+                                               GTK_MESSAGE_QUESTION, GTK_BUTTONS_NONE, "%s", message);
+    gtk_window_set_title(GTK_WINDOW(dialog), "Unfinished Copy");
+    gtk_dialog_add_buttons(GTK_DIALOG(dialog), "Discard", GTK_RESPONSE_REJECT,
+                           "Later", GTK_RESPONSE_CLOSE, "Resume", GTK_RESPONSE_ACCEPT, NULL);
+    gint response = gtk_dialog_run(GTK_DIALOG(dialog));
+    gtk_widget_destroy(dialog);
+
+    gboolean move = g_strcmp0(journal->mode, "move") == 0;
+    int dest_fd = response == GTK_RESPONSE_ACCEPT ? open(journal->dest_dir, O_PATH | O_DIRECTORY | O_CLOEXEC) : -1;
+    if (response == GTK_RESPONSE_ACCEPT && dest_fd < 0) {
+        gchar *msg = g_strdup_printf("Cannot resume into %s: %s", journal->dest_dir, g_strerror(errno));
+        show_error_dialog(GTK_WINDOW(w->window), "Unfinished Copy", msg);
+        g_free(msg);
+        copy_journal_close(journal, FALSE);
+    } else if (response == GTK_RESPONSE_ACCEPT) {
+        journal->resuming = TRUE;
+        start_paste_job(w, journal->sources, dest_fd, NULL, move, journal);
+        close(dest_fd);
+    } else if (response == GTK_RESPONSE_REJECT) {
+        // An unfinished move leaves its sources in place; only the hidden
+        // partial copies go
+        GHashTableIter iter;
+        gpointer src, target;
+        g_hash_table_iter_init(&iter, journal->targets);
+        while (move && g_hash_table_iter_next(&iter, &src, &target)) {
+            if (copy_journal_is_moved(journal, src)) continue;
+            gchar *partial = move_partial_path(target);
+            remove_tree(partial, NULL);
+            g_free(partial);
         }
+        copy_journal_discard(journal);
     } else {
-        // CREATE File
-        if (!g_file_set_contents(fullpath, "", 0, &err)) {
-            show_error_dialog(GTK_WINDOW(w->window), "Create File Error", err->message);
-            g_error_free(err);
-            g_free(fullpath);
-            return;
-        }
+        copy_journal_close(journal, FALSE);
     }
+}
 
-    refresh_file_list(w);
-    show_info_dialog(GTK_WINDOW(w->window), "Success", is_dir ? "Directory created." : "File created.");
-    gtk_entry_set_text(GTK_ENTRY(w->entryName), "");
-    g_free(fullpath);
+typedef struct {
+    AppWidgets *w;
+    CopyJournal *journal;
+    gchar *message;
+} ResumePrompt;
+
+static gboolean prompt_resume_job_idle(gpointer data)
+{
+    ResumePrompt *p = data;
+    prompt_resume_job(p->w, p->journal, p->message);
+    g_free(p->message);
+    g_free(p);
+    return G_SOURCE_REMOVE;
 }
 
-static void on_save_clicked(GtkButton *btn, gpointer user_data)
+// Asks from an idle callback, for callers such as a job's done handler
+// that must not run a nested main loop.
+static void prompt_resume_job_later(AppWidgets *w, CopyJournal *journal, const gchar *message)
 {
-    AppWidgets *w = (AppWidgets *)user_data;
-    GtkListBoxRow *row = gtk_list_box_get_selected_row(GTK_LIST_BOX(w->listbox));
-    if (!row) {
-        show_error_dialog(GTK_WINDOW(w->window), "Save Error", "Please select a file to save.");
-        return;
-    }
+    ResumePrompt *p = g_new0(ResumePrompt, 1);
+    p->w = w;
+    p->journal = journal;
+    p->message = g_strdup(message);
+    g_idle_add(prompt_resume_job_idle, p);
+}
 
-    const gchar *name = g_object_get_data(G_OBJECT(row), "entry-name");
-    gchar *fullpath = g_build_filename(w->current_dir, name, NULL);
-    
-    if (g_file_test(fullpath, G_FILE_TEST_IS_DIR)) {
-        show_error_dialog(GTK_WINDOW(w->window), "Save Error", "Cannot save content to a directory.");
-        g_free(fullpath);
-        return;
+// Offers to resume copies that were interrupted by a crash or logout.
+static void resume_pending_jobs(AppWidgets *w)
+{
+    GPtrArray *pending = copy_journal_find_pending();
+    for (guint i = 0; i < pending->len; ++i) {
+        GError *err = NULL;
+        CopyJournal *journal = copy_journal_load(g_ptr_array_index(pending, i), &err);
+        if (!journal) {
+            g_warning("Skipping copy journal %s: %s", (gchar *)g_ptr_array_index(pending, i), err->message);
+            g_error_free(err);
+            continue;
+        }
+        gchar *msg = g_strdup_printf("A %s of %u item(s) into %s was interrupted.\n"
+                                     "%u file(s) had already been copied.",
+                                     journal->mode, journal->sources->len, journal->dest_dir,
+                                     g_hash_table_size(journal->completed));
+        prompt_resume_job(w, journal, msg);
+        g_free(msg);
     }
+    g_ptr_array_free(pending, TRUE);
+}
 
-    GtkTextBuffer *buf = gtk_text_view_get_buffer(GTK_TEXT_VIEW(w->textview));
-    GtkTextIter s, e;
-    gtk_text_buffer_get_start_iter(buf, &s);
-    gtk_text_buffer_get_end_iter(buf, &e);
+static gboolean paste_run(gpointer data, GCancellable *cancellable, GError **error)
+{
+    PasteOp *op = (PasteOp *)data;
 
-    gchar *text = gtk_text_buffer_get_text(buf, &s, &e, FALSE);
-    GError *err = NULL;
+    for (guint i = 0; i < op->sources->len; ++i) {
+        const gchar *src = g_ptr_array_index(op->sources, i);
+        gchar *dst = copy_journal_lookup_target(op->journal, src);
+        if (!dst && op->rename_to) {
+            dst = g_strdup(op->rename_to);
+            copy_journal_set_target(op->journal, src, dst);
+        } else if (!dst) {
+            // Copies get a fresh name; moves never replace what is there
+            gchar *name = g_path_get_basename(src);
+            dst = op->move ? g_build_filename(op->dest_dir, name, NULL) : copy_unique_dest(op->dest_dir, name);
+            copy_journal_set_target(op->journal, src, dst);
+            g_free(name);
+        }
+        GError *err = NULL;
 
-    // UPDATE operation
-    if (!g_file_set_contents(fullpath, text, -1, &err)) {
-        show_error_dialog(GTK_WINDOW(w->window), "Save Error", err->message);
-        g_error_free(err);
-        g_free(text);
-        g_free(fullpath);
-        return;
+        gboolean ok = op->move ? move_path(src, dst, op->job, &err) : copy_engine_copy(src, dst, op->job, &err);
+        if (!ok) {
+            if (g_error_matches(err, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+                g_propagate_error(error, err);
+                g_free(dst);
+                return FALSE;
+            }
+            copy_job_add_error(op->job, src, err);
+            g_error_free(err);
+        }
+        g_free(dst);
     }
+    return TRUE;
+}
 
-    g_free(text);
-    show_info_dialog(GTK_WINDOW(w->window), "Success", "File saved (updated).");
-    
-    // Trigger row activation to refresh metadata display
-    on_row_activated(GTK_LIST_BOX(w->listbox), row, w);
-    g_free(fullpath);
+static void paste_progress(gpointer data, JobProgress *progress)
+{
+    PasteOp *op = (PasteOp *)data;
+    g_mutex_lock(&op->job->lock);
+    progress->done = op->job->bytes_done;
+    progress->total = op->job->bytes_total;
+    g_mutex_unlock(&op->job->lock);
+    progress->bytes = TRUE;
 }
 
-static void on_delete_clicked(GtkButton *btn, gpointer user_data)
+static void paste_done(gpointer data, const GError *error)
 {
-    AppWidgets *w = (AppWidgets *)user_data;
-    GtkListBoxRow *row = gtk_list_box_get_selected_row(GTK_LIST_BOX(w->listbox));
-    if (!row) {
-        show_error_dialog(GTK_WINDOW(w->window), "Delete Error", "Please select an item.");
-        return;
-    }
+    PasteOp *op = (PasteOp *)data;
+    AppWidgets *w = op->w;
 
-    const gchar *name = g_object_get_data(G_OBJECT(row), "entry-name");
-    gchar *fullpath = g_build_filename(w->current_dir, name, NULL);
+    refresh_file_list(w);
 
-    GtkWidget *c = gtk_message_dialog_new(GTK_WINDOW(w->window),
-                                          GTK_DIALOG_MODAL,
-                                          GTK_MESSAGE_QUESTION,
-                                          GTK_BUTTONS_YES_NO,
-                                          "Confirm deletion of \"%s\"? This cannot be undone.", name);
-    gint res = gtk_dialog_run(GTK_DIALOG(c));
-    gtk_widget_destroy(c);
+    // The job keeps its journal only while something is left to do
+    CopyJournal *journal = op->journal;
+    op->journal = op->job->journal = NULL;
+    gchar *msg = NULL;
+    gchar *report = op->job->verify ? copy_job_verify_report(op->job) : NULL;
 
-    if (res != GTK_RESPONSE_YES) {
-        g_free(fullpath);
-        return;
+    if (error) {
+        msg = g_strdup(error->message);
+    } else if (op->job->errors->len > 0) {
+        g_ptr_array_add(op->job->errors, NULL);
+        gchar *joined = g_strjoinv("\n", (gchar **)op->job->errors->pdata);
+        msg = g_strdup_printf("%u item(s) could not be %s:\n%s%s%s", op->job->errors->len - 1,
+                              op->move ? "moved" : "copied", joined,
+                              report ? "\n\n" : "", report ? report : "");
+        g_free(joined);
     }
 
-    GFile *file_to_delete = g_file_new_for_path(fullpath);
-    GError *err = NULL;
-    
-    // DELETE operation: Use GFile for recursive deletion (non-empty directories)
-    if (!g_file_delete(file_to_delete, G_FILE_COPY_RECURSIVE, NULL, &err)) {
-        show_error_dialog(GTK_WINDOW(w->window), "Delete Error", err->message);
-        g_error_free(err);
-        g_object_unref(file_to_delete);
-        g_free(fullpath);
+    if (msg && journal) {
+        gchar *question = g_strdup_printf("%s\n\nFinished files are kept and will be skipped when the %s is resumed.",
+                                          msg, op->move ? "move" : "copy");
+        prompt_resume_job_later(w, journal, question);
+        g_free(question);
+    } else if (msg) {
+        show_error_dialog(GTK_WINDOW(w->window), "Paste Error", msg);
+    } else {
+        if (journal) copy_journal_close(journal, TRUE);
+        gchar *text = copy_job_describe(op->job, op->move ? "Moved" : "Copied");
+        gtk_label_set_text(GTK_LABEL(w->statusLabel), text);
+        g_free(text);
+        if (report) show_info_dialog(GTK_WINDOW(w->window), "Verification", report);
+    }
+    g_free(report);
+    g_free(msg);
+}
+
+// Queues a copy or move of sources into the directory dest_fd as a job;
+// the UI only polls progress. rename_to names the target of a single
+// source instead. The copy engine walks trees by path, so the destination
+// path is taken from the descriptor here, as it is when the job starts.
+// Takes ownership of journal, which may be NULL.
+static void start_paste_job(AppWidgets *w, GPtrArray *sources, int dest_fd, const gchar *rename_to,
+                            gboolean move, CopyJournal *journal)
+{
+    gchar *dest_dir = dir_handle_path(dest_fd);
+    if (!dest_dir) {
+        show_error_dialog(GTK_WINDOW(w->window), "Paste Error", "The destination folder no longer exists.");
+        if (journal) copy_journal_close(journal, FALSE);
         return;
     }
 
-    g_object_unref(file_to_delete);
-    refresh_file_list(w);
-    show_info_dialog(GTK_WINDOW(w->window), "Success", "Item deleted.");
-    g_free(fullpath);
+    PasteOp *op = g_new0(PasteOp, 1);
+    op->w = w;
+    op->sources = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < sources->len; ++i)
+        g_ptr_array_add(op->sources, g_strdup(g_ptr_array_index(sources, i)));
+    op->dest_dir = dest_dir;
+    op->rename_to = g_strdup(rename_to);
+    op->move = move;
+    op->journal = journal;
+    op->job = copy_job_new(NULL);
+    op->job->direct_io = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(w->directIoCheck));
+    op->job->verify = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(w->verifyCheck));
+    op->job->journal = journal;
+
+    // Queued on the destination's device, which takes the writes
+    gchar *name = g_path_get_basename(g_ptr_array_index(sources, 0));
+    gchar *title = sources->len == 1 ? g_strdup_printf("%s \"%s\"", move ? "Move" : "Copy", name)
+                                     : g_strdup_printf("%s %u items", move ? "Move" : "Copy", sources->len);
+    job_submit(title, QOS_NORMAL, job_device_of(dest_fd, "."), op->job->cancellable,
+               paste_run, paste_progress, paste_done, op, (GDestroyNotify)paste_op_free);
+    g_free(title);
+    g_free(name);
 }
 
-static void on_rename_clicked(GtkButton *btn, gpointer user_data)
+static void on_paste_clicked(GtkButton *btn, gpointer user_data)
 {
     AppWidgets *w = (AppWidgets *)user_data;
-    const gchar *newName = gtk_entry_get_text(GTK_ENTRY(w->entryName));
-    if (!newName || !*newName) {
-        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", "Please enter new name.");
+    if (w->clipboard->len == 0) {
+        show_error_dialog(GTK_WINDOW(w->window), "Paste Error", "The clipboard is empty.");
         return;
     }
 
-    GtkListBoxRow *row = gtk_list_box_get_selected_row(GTK_LIST_BOX(w->listbox));
-    if (!row) {
-        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", "Please select an item.");
+    GError *err = NULL;
+    if (!copy_check_sources(w->clipboard_dir_fd, w->clipboard, w->dir_fd, w->clipboard_cut, &err)) {
+        show_error_dialog(GTK_WINDOW(w->window), "Paste Error", err->message);
+        g_error_free(err);
         return;
     }
 
-    const gchar *oldName = g_object_get_data(G_OBJECT(row), "entry-name");
-    gchar *oldpath = g_build_filename(w->current_dir, oldName, NULL);
-    gchar *newpath = g_build_filename(w->current_dir, newName, NULL);
-
-    if (g_file_test(newpath, G_FILE_TEST_EXISTS)) {
-        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", "Item with the new name already exists.");
-        g_free(oldpath);
-        g_free(newpath);
+    // Both ends come from held descriptors, so a rename of either
+    // directory or an ancestor since Copy/Cut is followed
+    gchar *src_dir = dir_handle_path(w->clipboard_dir_fd);
+    gchar *dest_dir = dir_handle_path(w->dir_fd);
+    if (!src_dir || !dest_dir) {
+        show_error_dialog(GTK_WINDOW(w->window), "Paste Error",
+                          !src_dir ? "The folder the items were taken from no longer exists."
+                                   : "The destination folder no longer exists.");
+        g_free(src_dir);
+        g_free(dest_dir);
         return;
     }
+    GPtrArray *sources = g_ptr_array_new_with_free_func(g_free);
+    for (guint i = 0; i < w->clipboard->len; ++i)
+        g_ptr_array_add(sources, g_build_filename(src_dir, g_ptr_array_index(w->clipboard, i), NULL));
 
-    // RENAME operation
-    if (rename(oldpath, newpath) != 0) {
-        gchar *err_msg = g_strdup_printf("Rename failed: %s", g_strerror(errno));
-        show_error_dialog(GTK_WINDOW(w->window), "Rename Error", err_msg);
-        g_free(err_msg);
-        g_free(oldpath);
-        g_free(newpath);
-        return;
+    // COPY or MOVE operation: journaled so an interrupted job can be
+    // resumed. Without a journal the job still runs, it just starts over if
+    // interrupted. Moves within a filesystem are plain renames.
+    const gchar *mode = w->clipboard_cut ? "move" : "copy";
+    CopyJournal *journal = copy_journal_create(mode, dest_dir, sources, &err);
+    if (!journal) {
+        g_warning("Paste will not be resumable: %s", err->message);
+        g_error_free(err);
     }
+    start_paste_job(w, sources, w->dir_fd, NULL, w->clipboard_cut, journal);
+    if (w->clipboard_cut) g_ptr_array_set_size(w->clipboard, 0);
+    g_ptr_array_free(sources, TRUE);
+    g_free(dest_dir);
+    g_free(src_dir);
+}
 
-    refresh_file_list(w);
-    show_info_dialog(GTK_WINDOW(w->window), "Success", "Item renamed.");
-    gtk_entry_set_text(GTK_ENTRY(w->entryName), "");
-    g_free(oldpath);
-    g_free(newpath);
+// The class to cap rides on the spin button; 0 MiB/s lifts the cap.
+static void on_rate_limit_changed(GtkSpinButton *spin, gpointer user_data)
+{
+    QosClass c = GPOINTER_TO_INT(g_object_get_data(G_OBJECT(spin), "qos-class"));
+    qos_set_rate(c, (guint64)gtk_spin_button_get_value_as_int(spin) * 1024 * 1024);
 }
 
 static void on_up_clicked(GtkButton *btn, gpointer user_data)
 {
     AppWidgets *w = (AppWidgets *)user_data;
-    gchar *parent = g_path_get_dirname(w->current_dir);
-
-    // Stop if we are at the root (parent == current_dir)
-    if (g_strcmp0(parent, w->current_dir) == 0) {
-        g_free(parent);
+    if (w->archive) {
+        // Up through the archive's directories, then out of it
+        if (*w->archive_dir) {
+            gchar *parent = g_path_get_dirname(w->archive_dir);
+            g_free(w->archive_dir);
+            w->archive_dir = strcmp(parent, ".") == 0 ? g_strdup("") : g_strdup(parent);
+            g_free(parent);
+        } else {
+            leave_archive(w);
+        }
+        refresh_file_list(w);
         return;
     }
-
-    g_free(w->current_dir);
-    w->current_dir = g_strdup(parent);
-    g_free(parent);
+    // Stop if we are at the root
+    if (g_strcmp0(w->current_dir, "/") == 0)
+        return;
 
     // NAVIGATE operation (up)
+    GError *err = NULL;
+    if (!navigate_to(w, "..", &err)) {
+        show_error_dialog(GTK_WINDOW(w->window), "Navigation Error", err->message);
+        g_error_free(err);
+        return;
+    }
     refresh_file_list(w);
 }
 
@@ -396,12 +14047,40 @@ static void on_up_clicked(GtkButton *btn, gpointer user_data)
 
 int main(int argc, char *argv[])
 {
+    if (argc == 4 && g_strcmp0(argv[1], "--bench-copy") == 0)
+        return run_copy_benchmark(argv[2], argv[3], FALSE, FALSE);
+    if (argc == 4 && g_strcmp0(argv[1], "--bench-copy-direct") == 0)
+        return run_copy_benchmark(argv[2], argv[3], TRUE, FALSE);
+    if (argc == 4 && g_strcmp0(argv[1], "--bench-copy-verify") == 0)
+        return run_copy_benchmark(argv[2], argv[3], FALSE, TRUE);
+    if (argc == 4 && g_strcmp0(argv[1], "--bench-copy-order") == 0)
+        return run_copy_order_benchmark(argv[2], argv[3]);
+    if ((argc == 4 || argc == 5) && g_strcmp0(argv[1], "--probe-latency") == 0)
+        return run_latency_probe(argv[2], argv[3], argc == 5 ? (guint)g_ascii_strtoull(argv[4], NULL, 10) : 16);
+    if ((argc == 3 || argc == 4) && g_strcmp0(argv[1], "--bench-checksum") == 0)
+        return run_checksum_benchmark(argv[2], argc == 4 ? argv[3] : "SHA-256");
+    if (argc == 4 && g_strcmp0(argv[1], "--bench-compare") == 0)
+        return run_compare_benchmark(argv[2], argv[3], FALSE);
+    if (argc == 4 && g_strcmp0(argv[1], "--bench-sync") == 0)
+        return run_compare_benchmark(argv[2], argv[3], TRUE);
+    if ((argc == 3 || argc == 4) && g_strcmp0(argv[1], "--snapshot") == 0)
+        return run_snapshot_benchmark(argv[2], argc == 4 && g_strcmp0(argv[3], "hash") == 0);
+    if ((argc == 3 || argc == 4) && g_strcmp0(argv[1], "--scrub") == 0)
+        return run_scrub(argv[2], argc == 4 ? (gint)g_ascii_strtoll(argv[3], NULL, 10) : -1);
+
     gtk_init(&argc, &argv);
     AppWidgets *w = g_new0(AppWidgets, 1);
+    w->clipboard = g_ptr_array_new_with_free_func(g_free);
+    w->clipboard_dir_fd = -1;
 
     gchar *cwd = g_get_current_dir();
     w->current_dir = g_strdup(cwd);
     g_free(cwd);
+    w->dir_fd = open(w->current_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (w->dir_fd < 0) {
+        g_printerr("Cannot open %s: %s\n", w->current_dir, g_strerror(errno));
+        return 1;
+    }
 
     w->window = gtk_window_new(GTK_WINDOW_TOPLEVEL);
     gtk_window_set_title(GTK_WINDOW(w->window), "CS 3502 File Manager - OwlTech FS Division");
@@ -417,8 +14096,11 @@ int main(int argc, char *argv[])
     gtk_label_set_xalign(GTK_LABEL(w->pathLabel), 0.0);
     gtk_label_set_ellipsize(GTK_LABEL(w->pathLabel), PANGO_ELLIPSIZE_START);
     GtkWidget *up_button = gtk_button_new_with_label("Go Up");
+    // Selected archives here, or selected members inside one
+    GtkWidget *extract_button = gtk_button_new_with_label("Extract");
     gtk_box_pack_start(GTK_BOX(path_hbox), w->pathLabel, TRUE, TRUE, 6);
     gtk_box_pack_end(GTK_BOX(path_hbox), up_button, FALSE, FALSE, 6);
+    gtk_box_pack_end(GTK_BOX(path_hbox), extract_button, FALSE, FALSE, 0);
     gtk_box_pack_start(GTK_BOX(vbox), path_hbox, FALSE, FALSE, 6);
     
     // Main Paned Window (Listbox | Editor)
@@ -437,7 +14119,9 @@ int main(int argc, char *argv[])
     gtk_box_pack_start(GTK_BOX(left_vbox), scrolled_list, TRUE, TRUE, 0);
 
     w->listbox = gtk_list_box_new();
-    gtk_list_box_set_selection_mode(GTK_LIST_BOX(w->listbox), GTK_SELECTION_SINGLE);
+    // Ctrl toggles rows, Shift extends a range; Select... picks by pattern
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(w->listbox), GTK_SELECTION_MULTIPLE);
+    gtk_list_box_set_sort_func(GTK_LIST_BOX(w->listbox), compare_rows, NULL, NULL);
     gtk_container_add(GTK_CONTAINER(scrolled_list), w->listbox);
 
     // Entry field for New/Rename operations
@@ -448,13 +14132,78 @@ int main(int argc, char *argv[])
     // Action Buttons
     GtkWidget *btns_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
     GtkWidget *new_button = gtk_button_new_with_label("New"); // CREATE
+    GtkWidget *batch_new_button = gtk_button_new_with_label("New Many...");
     GtkWidget *rename_button = gtk_button_new_with_label("Rename"); // RENAME
     GtkWidget *delete_button = gtk_button_new_with_label("Delete"); // DELETE
+    GtkWidget *undo_delete_button = gtk_button_new_with_label("Undo Delete");
     gtk_box_pack_start(GTK_BOX(btns_hbox), new_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(btns_hbox), batch_new_button, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(btns_hbox), rename_button, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(btns_hbox), delete_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(btns_hbox), undo_delete_button, TRUE, TRUE, 0);
     gtk_box_pack_start(GTK_BOX(left_vbox), btns_hbox, FALSE, FALSE, 6);
 
+    GtkWidget *trash_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    GtkWidget *trash_button = gtk_button_new_with_label("Move to Trash"); // TRASH
+    GtkWidget *view_trash_button = gtk_button_new_with_label("Trash...");
+    gtk_box_pack_start(GTK_BOX(trash_hbox), trash_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(trash_hbox), view_trash_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(left_vbox), trash_hbox, FALSE, FALSE, 0);
+
+    GtkWidget *select_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    GtkWidget *select_button = gtk_button_new_with_label("Select...");
+    GtkWidget *chmod_button = gtk_button_new_with_label("Permissions..."); // CHMOD
+    GtkWidget *bulk_rename_button = gtk_button_new_with_label("Bulk Rename...");
+    gtk_box_pack_start(GTK_BOX(select_hbox), select_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(select_hbox), chmod_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(select_hbox), bulk_rename_button, TRUE, TRUE, 0);
+    GtkWidget *checksums_button = gtk_button_new_with_label("Checksums...");
+    gtk_box_pack_start(GTK_BOX(select_hbox), checksums_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(left_vbox), select_hbox, FALSE, FALSE, 6);
+
+    GtkWidget *tools_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    GtkWidget *duplicates_button = gtk_button_new_with_label("Find Duplicates...");
+    gtk_box_pack_start(GTK_BOX(tools_hbox), duplicates_button, TRUE, TRUE, 0);
+    GtkWidget *compare_button = gtk_button_new_with_label("Compare...");
+    gtk_box_pack_start(GTK_BOX(tools_hbox), compare_button, TRUE, TRUE, 0);
+    GtkWidget *snapshots_button = gtk_button_new_with_label("Snapshots...");
+    gtk_box_pack_start(GTK_BOX(tools_hbox), snapshots_button, TRUE, TRUE, 0);
+    GtkWidget *scrub_button = gtk_button_new_with_label("Scrub...");
+    gtk_box_pack_start(GTK_BOX(tools_hbox), scrub_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(left_vbox), tools_hbox, FALSE, FALSE, 0);
+
+    GtkWidget *clip_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    GtkWidget *copy_button = gtk_button_new_with_label("Copy"); // COPY
+    GtkWidget *cut_button = gtk_button_new_with_label("Cut"); // MOVE
+    GtkWidget *paste_button = gtk_button_new_with_label("Paste");
+    gtk_box_pack_start(GTK_BOX(clip_hbox), copy_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(clip_hbox), cut_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(clip_hbox), paste_button, TRUE, TRUE, 0);
+    GtkWidget *compress_button = gtk_button_new_with_label("Compress...");
+    gtk_box_pack_start(GTK_BOX(clip_hbox), compress_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(left_vbox), clip_hbox, FALSE, FALSE, 0);
+
+    w->directIoCheck = gtk_check_button_new_with_label("Direct I/O for large files (keep page cache)");
+    gtk_box_pack_start(GTK_BOX(left_vbox), w->directIoCheck, FALSE, FALSE, 0);
+    w->verifyCheck = gtk_check_button_new_with_label("Verify copies against the source");
+    gtk_box_pack_start(GTK_BOX(left_vbox), w->verifyCheck, FALSE, FALSE, 0);
+    w->stagedDeleteCheck = gtk_check_button_new_with_label("Instant delete with undo (reclaim space in the background)");
+    gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(w->stagedDeleteCheck), TRUE);
+    gtk_box_pack_start(GTK_BOX(left_vbox), w->stagedDeleteCheck, FALSE, FALSE, 0);
+
+    // Bandwidth caps per QoS class, MiB/s; 0 means none
+    GtkWidget *rate_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
+    gtk_box_pack_start(GTK_BOX(rate_hbox), gtk_label_new("I/O cap (MiB/s):"), FALSE, FALSE, 0);
+    for (QosClass c = QOS_NORMAL; c <= QOS_BACKGROUND; ++c) {
+        GtkWidget *spin = gtk_spin_button_new_with_range(0, 10000, 10);
+        g_object_set_data(G_OBJECT(spin), "qos-class", GINT_TO_POINTER(c));
+        gtk_widget_set_tooltip_text(spin, c == QOS_NORMAL ? "Copies and moves" : "Emptying the trash and other background work");
+        g_signal_connect(spin, "value-changed", G_CALLBACK(on_rate_limit_changed), NULL);
+        gtk_box_pack_start(GTK_BOX(rate_hbox), gtk_label_new(qos_class_name(c)), FALSE, FALSE, 0);
+        gtk_box_pack_start(GTK_BOX(rate_hbox), spin, FALSE, FALSE, 0);
+    }
+    gtk_box_pack_start(GTK_BOX(left_vbox), rate_hbox, FALSE, FALSE, 0);
+
 
     // --- Right Pane (File Content Area) ---
     GtkWidget *right_vbox = gtk_box_new(GTK_ORIENTATION_VERTICAL, 6);
@@ -469,28 +14218,87 @@ int main(int argc, char *argv[])
     gtk_text_view_set_wrap_mode(GTK_TEXT_VIEW(w->textview), GTK_WRAP_WORD_CHAR);
     gtk_container_add(GTK_CONTAINER(editor_scrolled), w->textview);
     
-    // Save button
+    // Save / History buttons
+    GtkWidget *save_hbox = gtk_box_new(GTK_ORIENTATION_HORIZONTAL, 6);
     GtkWidget *save_button = gtk_button_new_with_label("Save Changes");
-    gtk_box_pack_end(GTK_BOX(right_vbox), save_button, FALSE, FALSE, 6);
+    GtkWidget *history_button = gtk_button_new_with_label("History");
+    gtk_box_pack_start(GTK_BOX(save_hbox), save_button, TRUE, TRUE, 0);
+    gtk_box_pack_start(GTK_BOX(save_hbox), history_button, FALSE, FALSE, 0);
+    gtk_box_pack_end(GTK_BOX(right_vbox), save_hbox, FALSE, FALSE, 6);
     
     // Status/Feedback Area
     w->statusLabel = gtk_label_new("Current File: None Selected");
     gtk_label_set_xalign(GTK_LABEL(w->statusLabel), 0.0);
     gtk_box_pack_start(GTK_BOX(right_vbox), w->statusLabel, FALSE, FALSE, 4);
 
+    // Background jobs: shown only while something is queued or running
+    GtkWidget *jobs_frame = gtk_frame_new("Jobs");
+    GtkWidget *jobs_scrolled = gtk_scrolled_window_new(NULL, NULL);
+    gtk_scrolled_window_set_policy(GTK_SCROLLED_WINDOW(jobs_scrolled), GTK_POLICY_NEVER, GTK_POLICY_AUTOMATIC);
+    gtk_scrolled_window_set_max_content_height(GTK_SCROLLED_WINDOW(jobs_scrolled), 160);
+    gtk_scrolled_window_set_propagate_natural_height(GTK_SCROLLED_WINDOW(jobs_scrolled), TRUE);
+    GtkWidget *jobs_list = gtk_list_box_new();
+    gtk_list_box_set_selection_mode(GTK_LIST_BOX(jobs_list), GTK_SELECTION_NONE);
+    gtk_container_add(GTK_CONTAINER(jobs_scrolled), jobs_list);
+    gtk_container_add(GTK_CONTAINER(jobs_frame), jobs_scrolled);
+    gtk_widget_show_all(jobs_frame);
+    gtk_widget_set_no_show_all(jobs_frame, TRUE);
+    gtk_widget_hide(jobs_frame);
+    gtk_box_pack_end(GTK_BOX(vbox), jobs_frame, FALSE, FALSE, 0);
+    job_scheduler_init(jobs_frame, jobs_list);
+
     // --- Connect Signals ---
     g_signal_connect(w->listbox, "row-activated", G_CALLBACK(on_row_activated), w);
     g_signal_connect(new_button, "clicked", G_CALLBACK(on_new_clicked), w);
+    g_signal_connect(batch_new_button, "clicked", G_CALLBACK(on_batch_new_clicked), w);
     g_signal_connect(save_button, "clicked", G_CALLBACK(on_save_clicked), w);
     g_signal_connect(delete_button, "clicked", G_CALLBACK(on_delete_clicked), w);
+    g_signal_connect(undo_delete_button, "clicked", G_CALLBACK(on_undo_delete_clicked), w);
+    g_signal_connect(trash_button, "clicked", G_CALLBACK(on_trash_clicked), w);
+    g_signal_connect(view_trash_button, "clicked", G_CALLBACK(on_view_trash_clicked), w);
+    g_signal_connect(select_button, "clicked", G_CALLBACK(on_select_pattern_clicked), w);
+    g_signal_connect(chmod_button, "clicked", G_CALLBACK(on_chmod_clicked), w);
+    g_signal_connect(bulk_rename_button, "clicked", G_CALLBACK(on_bulk_rename_clicked), w);
+    g_signal_connect(checksums_button, "clicked", G_CALLBACK(on_checksums_clicked), w);
+    g_signal_connect(duplicates_button, "clicked", G_CALLBACK(on_find_duplicates_clicked), w);
+    g_signal_connect(compare_button, "clicked", G_CALLBACK(on_compare_clicked), w);
+    g_signal_connect(snapshots_button, "clicked", G_CALLBACK(on_snapshots_clicked), w);
+    g_signal_connect(scrub_button, "clicked", G_CALLBACK(on_scrub_clicked), w);
     g_signal_connect(rename_button, "clicked", G_CALLBACK(on_rename_clicked), w);
     g_signal_connect(up_button, "clicked", G_CALLBACK(on_up_clicked), w);
+    g_signal_connect(history_button, "clicked", G_CALLBACK(on_history_clicked), w);
+    g_signal_connect(copy_button, "clicked", G_CALLBACK(on_copy_clicked), w);
+    g_signal_connect(cut_button, "clicked", G_CALLBACK(on_cut_clicked), w);
+    g_signal_connect(paste_button, "clicked", G_CALLBACK(on_paste_clicked), w);
+    g_signal_connect(extract_button, "clicked", G_CALLBACK(on_extract_clicked), w);
+    g_signal_connect(compress_button, "clicked", G_CALLBACK(on_compress_clicked), w);
+
+    // Everything that acts on the current directory or the open file
+    GtkWidget *dir_actions[] = {
+        new_button, batch_new_button, rename_button, delete_button, undo_delete_button, trash_button,
+        select_button, chmod_button, bulk_rename_button, checksums_button, duplicates_button,
+        compare_button, snapshots_button, scrub_button, copy_button, cut_button, paste_button,
+        compress_button, save_button, history_button,
+    };
+    w->dir_actions = g_ptr_array_new();
+    for (guint i = 0; i < G_N_ELEMENTS(dir_actions); ++i)
+        g_ptr_array_add(w->dir_actions, dir_actions[i]);
 
     refresh_file_list(w);
     gtk_widget_show_all(w->window);
+    resume_pending_jobs(w);
+    staging_restore_pending();
+    scrub_scheduler_init(w);
     gtk_main();
 
+    if (w->archive) archive_unref(w->archive);
+    g_free(w->archive_name);
+    g_free(w->archive_dir);
+    g_ptr_array_free(w->dir_actions, TRUE);
+    close(w->dir_fd);
     g_free(w->current_dir);
+    g_ptr_array_free(w->clipboard, TRUE);
+    if (w->clipboard_dir_fd >= 0) close(w->clipboard_dir_fd);
     g_free(w);
     return 0;
 }